@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <mutex>
+#include <tuple>
+
+#include "abort_profiler.h"
+#include "lockguard.h"
+#include "txn.h"
+#include "util.h"
+
+using namespace std;
+using namespace util;
+
+static_assert(transaction_base::ABORT_REASON_READ_ABSENCE_INTEREFERENCE <
+              abort_profiler::MaxReasons, "too many abort reasons");
+
+const size_t abort_profiler::MaxReasons;
+const size_t abort_profiler::TopK;
+const size_t abort_profiler::KeyPrefixLen;
+
+percore<abort_profiler::percore_ctx> abort_profiler::g_cores;
+uint64_t abort_profiler::g_sample_mask = 0x3;
+
+static mutex g_tables_mutex;
+static map<const void *, string> g_tables;
+
+void
+abort_profiler::percore_ctx::offer(
+    unsigned reason, const void *table, uint64_t key_hash,
+    const char *key, size_t keylen, bool is_address)
+{
+  ::lock_guard<spinlock> l(&lock_);
+  size_t min_idx = 0;
+  for (size_t i = 0; i < nhot_; i++) {
+    hot_key &h = hot_[i];
+    if (h.key_hash_ == key_hash && h.table_ == table &&
+        h.is_address_ == is_address) {
+      h.count_++;
+      h.reason_ = reason; // the latest one
+      return;
+    }
+    if (h.count_ < hot_[min_idx].count_)
+      min_idx = i;
+  }
+  hot_key *h;
+  uint64_t error = 0;
+  if (nhot_ < TopK) {
+    h = &hot_[nhot_++];
+  } else {
+    // evict the least counted key, whose count the new one inherits
+    h = &hot_[min_idx];
+    error = h->count_;
+  }
+  h->table_ = table;
+  h->key_hash_ = key_hash;
+  h->reason_ = reason;
+  h->is_address_ = is_address;
+  h->prefix_len_ = min(keylen, KeyPrefixLen);
+  NDB_MEMCPY(&h->prefix_[0], key, h->prefix_len_);
+  h->count_ = error + 1;
+  h->error_ = error;
+}
+
+void
+abort_profiler::SetSampleShift(unsigned shift)
+{
+  ALWAYS_ASSERT(shift < 64);
+  g_sample_mask = (uint64_t(1) << shift) - 1;
+}
+
+void
+abort_profiler::RegisterTable(const void *table, const string &name)
+{
+  std::lock_guard<mutex> l(g_tables_mutex);
+  g_tables[table] = name;
+}
+
+void
+abort_profiler::UnregisterTable(const void *table)
+{
+  std::lock_guard<mutex> l(g_tables_mutex);
+  g_tables.erase(table);
+}
+
+string
+abort_profiler::TableName(const void *table)
+{
+  std::lock_guard<mutex> l(g_tables_mutex);
+  auto it = g_tables.find(table);
+  return it == g_tables.end() ? string("<unknown>") : it->second;
+}
+
+void
+abort_profiler::Snapshot(profile &p, size_t n)
+{
+  p.sample_shift_ = __builtin_popcountll(g_sample_mask);
+  p.counts_.assign(MaxReasons, 0);
+  p.lock_hold_cycles_.assign(MaxReasons, 0);
+  p.nlock_holds_.assign(MaxReasons, 0);
+  p.commit_lock_hold_cycles_ = 0;
+  p.ncommit_lock_holds_ = 0;
+  p.hot_keys_.clear();
+  // keys are merged by <table, hash, is address>
+  map<tuple<const void *, uint64_t, bool>, hot_key> merged;
+  for (size_t i = 0; i < g_cores.size(); i++) {
+    percore_ctx &ctx = g_cores[i];
+    for (size_t r = 0; r < MaxReasons; r++) {
+      p.counts_[r] += ctx.counts_[r];
+      p.lock_hold_cycles_[r] += ctx.lock_hold_cycles_[r];
+      p.nlock_holds_[r] += ctx.nlock_holds_[r];
+    }
+    p.commit_lock_hold_cycles_ += ctx.commit_lock_hold_cycles_;
+    p.ncommit_lock_holds_ += ctx.ncommit_lock_holds_;
+    ::lock_guard<spinlock> l(&ctx.lock_);
+    for (size_t j = 0; j < ctx.nhot_; j++) {
+      const hot_key &h = ctx.hot_[j];
+      auto ret = merged.emplace(
+          make_tuple(h.table_, h.key_hash_, h.is_address_), h);
+      if (!ret.second) {
+        ret.first->second.count_ += h.count_;
+        ret.first->second.error_ += h.error_;
+      }
+    }
+  }
+  for (auto &e : merged)
+    p.hot_keys_.push_back(e.second);
+  sort(p.hot_keys_.begin(), p.hot_keys_.end(),
+       [](const hot_key &a, const hot_key &b) {
+         return a.count_ > b.count_;
+       });
+  if (p.hot_keys_.size() > n)
+    p.hot_keys_.resize(n);
+}
+
+void
+abort_profiler::Reset()
+{
+  for (size_t i = 0; i < g_cores.size(); i++) {
+    percore_ctx &ctx = g_cores[i];
+    ::lock_guard<spinlock> l(&ctx.lock_);
+    NDB_MEMSET(&ctx.counts_[0], 0, sizeof(ctx.counts_));
+    NDB_MEMSET(&ctx.lock_hold_cycles_[0], 0, sizeof(ctx.lock_hold_cycles_));
+    NDB_MEMSET(&ctx.nlock_holds_[0], 0, sizeof(ctx.nlock_holds_));
+    ctx.commit_lock_hold_cycles_ = 0;
+    ctx.ncommit_lock_holds_ = 0;
+    ctx.nlock_hold_samples_ = 0;
+    ctx.nattributed_ = 0;
+    ctx.nhot_ = 0;
+  }
+}
+
+void
+abort_profiler::Report(ostream &o, size_t n)
+{
+  profile p;
+  Snapshot(p, n);
+  for (size_t r = 0; r < MaxReasons; r++)
+    if (p.counts_[r])
+      o << "reason "
+        << transaction_base::AbortReasonStr(
+            static_cast<transaction_base::abort_reason>(r))
+        << " " << p.counts_[r] << endl;
+  // the lock hold counts are scaled up like the hot keys'
+  if (p.ncommit_lock_holds_)
+    o << "lock_hold COMMITTED " << (p.ncommit_lock_holds_ << p.sample_shift_) << " "
+      << (p.commit_lock_hold_cycles_ / p.ncommit_lock_holds_) << endl;
+  for (size_t r = 0; r < MaxReasons; r++)
+    if (p.nlock_holds_[r])
+      o << "lock_hold "
+        << transaction_base::AbortReasonStr(
+            static_cast<transaction_base::abort_reason>(r))
+        << " " << (p.nlock_holds_[r] << p.sample_shift_) << " "
+        << (p.lock_hold_cycles_[r] / p.nlock_holds_[r]) << endl;
+  // a sample stands for 2^sample_shift aborts
+  for (auto &h : p.hot_keys_) {
+    o << "hot " << TableName(h.table_) << " ";
+    if (h.is_address_)
+      o << "@" << hexify(h.key_hash_);
+    else
+      o << hexify(h.prefix()) << (h.prefix_len_ == KeyPrefixLen ? "..." : "");
+    o << " "
+      << transaction_base::AbortReasonStr(
+          static_cast<transaction_base::abort_reason>(h.reason_))
+      << " " << (h.count_ << p.sample_shift_)
+      << " " << (h.error_ << p.sample_shift_) << endl;
+  }
+}
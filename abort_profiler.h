@@ -0,0 +1,192 @@
+#ifndef _NDB_ABORT_PROFILER_H_
+#define _NDB_ABORT_PROFILER_H_
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "macros.h"
+#include "core.h"
+#include "spinlock.h"
+
+/**
+ * Always-on profile of txn aborts, for finding the rows behind contention
+ * w/o an ENABLE_EVENT_COUNTERS build.
+ *
+ * Every abort bumps a per-core count for its reason. Aborts which know the
+ * conflicting record (see transaction::abort_trap()) are also sampled, one
+ * in 2^SetSampleShift() per core, into a per-core top-K sketch (the
+ * "space saving" algorithm) of <table, key> pairs. The key is kept as a
+ * hash plus a short prefix, and the table is the concurrent_btree, named
+ * by RegisterTable() (base_txn_btree does so). A record whose key is not
+ * known (eg a read of a tuple) is identified by its address instead.
+ *
+ * Commits which lock a write set are sampled the same way (see
+ * SampleLockHold()), recording the cycles they held the locks for by
+ * outcome (committed, or the abort reason), so lock hold times are
+ * available w/o ENABLE_EVENT_COUNTERS too.
+ *
+ * The profile is served by stats_server (see stats_command), and can be
+ * dumped w/ Report()
+ */
+class abort_profiler {
+public:
+
+  static const size_t MaxReasons = 16; // >= # of ABORT_REASONS
+  static const size_t TopK = 32;        // sketch entries per core
+  static const size_t KeyPrefixLen = 24;
+
+  struct hot_key {
+    const void *table_;
+    uint64_t key_hash_;
+    uint8_t reason_;
+    uint8_t prefix_len_;
+    bool is_address_; // prefix_ holds nothing, key_hash_ is the address
+    char prefix_[KeyPrefixLen];
+    uint64_t count_;  // over-estimates the # of samples ...
+    uint64_t error_;  // ... by at most this much
+
+    inline std::string
+    prefix() const
+    {
+      return std::string(prefix_, prefix_len_);
+    }
+  };
+
+  struct profile {
+    uint64_t sample_shift_;
+    std::vector<uint64_t> counts_; // by reason
+    std::vector<hot_key> hot_keys_; // by count, descending
+    // sampled write set lock holds, by abort reason and for commits
+    std::vector<uint64_t> lock_hold_cycles_;
+    std::vector<uint64_t> nlock_holds_;
+    uint64_t commit_lock_hold_cycles_;
+    uint64_t ncommit_lock_holds_;
+  };
+
+  // counts an abort
+  static inline ALWAYS_INLINE void
+  Record(unsigned reason)
+  {
+    INVARIANT(reason < MaxReasons);
+    g_cores.my().counts_[reason]++;
+  }
+
+  // counts an abort over key of table, sampling it into the sketch
+  static inline void
+  Record(unsigned reason, const void *table, const char *key, size_t keylen)
+  {
+    INVARIANT(reason < MaxReasons);
+    percore_ctx &ctx = g_cores.my();
+    ctx.counts_[reason]++;
+    if (likely(ctx.nattributed_++ & g_sample_mask))
+      return;
+    ctx.offer(reason, table, HashKey(key, keylen), key, keylen, false);
+  }
+
+  // like Record() w/ a key, for a record known only by its address
+  static inline void
+  Record(unsigned reason, const void *table, const void *record)
+  {
+    INVARIANT(reason < MaxReasons);
+    percore_ctx &ctx = g_cores.my();
+    ctx.counts_[reason]++;
+    if (likely(ctx.nattributed_++ & g_sample_mask))
+      return;
+    ctx.offer(reason, table, (uintptr_t) record, nullptr, 0, true);
+  }
+
+  // whether a commit about to lock its write set is one of the one in
+  // 2^SetSampleShift() per core to time
+  static inline ALWAYS_INLINE bool
+  SampleLockHold()
+  {
+    return !(g_cores.my().nlock_hold_samples_++ & g_sample_mask);
+  }
+
+  // counts cycles of write set lock hold by a sampled commit which then
+  // aborted for reason
+  static inline ALWAYS_INLINE void
+  RecordLockHold(unsigned reason, uint64_t cycles)
+  {
+    INVARIANT(reason < MaxReasons);
+    percore_ctx &ctx = g_cores.my();
+    ctx.lock_hold_cycles_[reason] += cycles;
+    ctx.nlock_holds_[reason]++;
+  }
+
+  // like RecordLockHold(), for a sampled commit which went through
+  static inline ALWAYS_INLINE void
+  RecordCommitLockHold(uint64_t cycles)
+  {
+    percore_ctx &ctx = g_cores.my();
+    ctx.commit_lock_hold_cycles_ += cycles;
+    ctx.ncommit_lock_holds_++;
+  }
+
+  // samples one in 2^shift of the aborts which know their record, and of
+  // the commits' lock holds
+  static void SetSampleShift(unsigned shift);
+
+  static void RegisterTable(const void *table, const std::string &name);
+  static void UnregisterTable(const void *table);
+  static std::string TableName(const void *table);
+
+  // merges the per-core profiles, keeping the top n hot keys. not a
+  // consistent snapshot: counts move while it runs
+  static void Snapshot(profile &p, size_t n = TopK);
+
+  // zeroes the profile
+  static void Reset();
+
+  // human readable Snapshot(), one line per reason w/ aborts, per lock hold
+  // outcome (w/ the avg cycles held) and per hot key
+  static void Report(std::ostream &o, size_t n = TopK);
+
+  static inline uint64_t
+  HashKey(const char *key, size_t keylen)
+  {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < keylen; i++) {
+      h ^= (uint8_t) key[i];
+      h *= 0x100000001b3ULL;
+    }
+    return h;
+  }
+
+private:
+
+  struct percore_ctx {
+    percore_ctx()
+      : commit_lock_hold_cycles_(0), ncommit_lock_holds_(0),
+        nlock_hold_samples_(0), nattributed_(0), nhot_(0)
+    {
+      NDB_MEMSET(&counts_[0], 0, sizeof(counts_));
+      NDB_MEMSET(&lock_hold_cycles_[0], 0, sizeof(lock_hold_cycles_));
+      NDB_MEMSET(&nlock_holds_[0], 0, sizeof(nlock_holds_));
+    }
+
+    uint64_t counts_[MaxReasons];
+    uint64_t lock_hold_cycles_[MaxReasons];
+    uint64_t nlock_holds_[MaxReasons];
+    uint64_t commit_lock_hold_cycles_;
+    uint64_t ncommit_lock_holds_;
+    uint64_t nlock_hold_samples_;
+    uint64_t nattributed_;
+    // the sketch is only written by its core, but read by Snapshot()
+    spinlock lock_;
+    size_t nhot_;
+    hot_key hot_[TopK];
+
+    void offer(unsigned reason, const void *table, uint64_t key_hash,
+               const char *key, size_t keylen, bool is_address);
+  };
+
+  static percore<percore_ctx> g_cores;
+  static uint64_t g_sample_mask;
+};
+
+#endif /* _NDB_ABORT_PROFILER_H_ */
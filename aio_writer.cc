@@ -0,0 +1,174 @@
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "aio_writer.h"
+
+using namespace std;
+
+// glibc has no wrappers for these
+static inline long
+sys_io_setup(unsigned nr_events, aio_context_t *ctx)
+{
+  return syscall(SYS_io_setup, nr_events, ctx);
+}
+
+static inline long
+sys_io_destroy(aio_context_t ctx)
+{
+  return syscall(SYS_io_destroy, ctx);
+}
+
+static inline long
+sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+  return syscall(SYS_io_submit, ctx, nr, iocbpp);
+}
+
+static inline long
+sys_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                 struct io_event *events, struct timespec *ts)
+{
+  return syscall(SYS_io_getevents, ctx, min_nr, nr, events, ts);
+}
+
+aio_writer::aio_writer(size_t depth, size_t buffer_size, bool dsync)
+  : buffer_size_(buffer_size), dsync_(dsync), ctx_(0), slots_(depth),
+    events_(depth), fd_(-1), offset_(0), nsubmitted_(0), nreaped_(0)
+{
+  ALWAYS_ASSERT(depth > 0);
+  ALWAYS_ASSERT(buffer_size > 0 && !(buffer_size % Alignment));
+  if (sys_io_setup(depth, &ctx_) == -1) {
+    perror("io_setup");
+    ALWAYS_ASSERT(false);
+  }
+  for (auto &s : slots_) {
+    void *p;
+    if (posix_memalign(&p, Alignment, buffer_size_)) {
+      perror("posix_memalign");
+      ALWAYS_ASSERT(false);
+    }
+    s.buf_ = (uint8_t *) p;
+    s.cookie_ = 0;
+    s.done_ = false;
+  }
+}
+
+aio_writer::~aio_writer()
+{
+  vector<uint64_t> ignored;
+  drain(ignored);
+  sys_io_destroy(ctx_);
+  for (auto &s : slots_)
+    free(s.buf_);
+}
+
+void
+aio_writer::set_file(int fd, uint64_t offset)
+{
+  INVARIANT(!ninflight());
+  INVARIANT(!(offset % Alignment));
+  fd_ = fd;
+  offset_ = offset;
+}
+
+uint8_t *
+aio_writer::next_buffer()
+{
+  INVARIANT(ninflight() < depth());
+  return slots_[nsubmitted_ % depth()].buf_;
+}
+
+void
+aio_writer::submit(size_t nbytes, uint64_t cookie)
+{
+  INVARIANT(fd_ != -1);
+  INVARIANT(ninflight() < depth());
+  INVARIANT(nbytes && nbytes <= buffer_size_ && !(nbytes % Alignment));
+  const size_t idx = nsubmitted_ % depth();
+  slot &s = slots_[idx];
+  s.cookie_ = cookie;
+  s.done_ = false;
+  NDB_MEMSET(&s.cb_, 0, sizeof(s.cb_));
+  s.cb_.aio_data = idx;
+  s.cb_.aio_lio_opcode = IOCB_CMD_PWRITE;
+  s.cb_.aio_fildes = fd_;
+  s.cb_.aio_buf = (uintptr_t) s.buf_;
+  s.cb_.aio_nbytes = nbytes;
+  s.cb_.aio_offset = offset_;
+  if (dsync_)
+    s.cb_.aio_rw_flags = RWF_DSYNC;
+  struct iocb *cbs[1] = {&s.cb_};
+  long ret;
+  while ((ret = sys_io_submit(ctx_, 1, cbs)) == -1 && errno == EAGAIN)
+    get_events(1, nullptr);
+  if (ret != 1) {
+    perror("io_submit");
+    ALWAYS_ASSERT(false);
+  }
+  offset_ += nbytes;
+  nsubmitted_++;
+}
+
+long
+aio_writer::get_events(long min_nr, struct timespec *ts)
+{
+  long n;
+  while ((n = sys_io_getevents(
+            ctx_, min_nr, events_.size(), &events_[0], ts)) == -1 &&
+         errno == EINTR)
+    ;
+  if (n == -1) {
+    perror("io_getevents");
+    ALWAYS_ASSERT(false);
+  }
+  for (long i = 0; i < n; i++) {
+    slot &s = slots_[events_[i].data];
+    if (events_[i].res != (int64_t) s.cb_.aio_nbytes) {
+      errno = events_[i].res < 0 ? -events_[i].res : EIO;
+      perror("aio write");
+      ALWAYS_ASSERT(false);
+    }
+    s.done_ = true;
+  }
+  return n;
+}
+
+size_t
+aio_writer::reap(vector<uint64_t> &cookies, int64_t timeout_us)
+{
+  if (!ninflight())
+    return 0;
+  struct timespec zero = {0, 0};
+  get_events(0, &zero);
+  if (timeout_us < 0) {
+    while (!slots_[nreaped_ % depth()].done_)
+      get_events(1, nullptr);
+  } else if (timeout_us > 0 && !slots_[nreaped_ % depth()].done_) {
+    // io_getevents() does not say how long it waited, so just give it the
+    // whole timeout once: an earlier completion of a later write ends it
+    struct timespec ts;
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    get_events(1, &ts);
+  }
+  size_t n = 0;
+  while (ninflight() && slots_[nreaped_ % depth()].done_) {
+    slot &s = slots_[nreaped_ % depth()];
+    s.done_ = false;
+    cookies.push_back(s.cookie_);
+    nreaped_++;
+    n++;
+  }
+  return n;
+}
+
+void
+aio_writer::drain(vector<uint64_t> &cookies)
+{
+  while (ninflight())
+    reap(cookies, -1);
+}
@@ -0,0 +1,100 @@
+#ifndef _NDB_AIO_WRITER_H_
+#define _NDB_AIO_WRITER_H_
+
+#include <cstdint>
+#include <vector>
+#include <time.h>
+#include <linux/aio_abi.h>
+
+#include "macros.h"
+
+/**
+ * Appends to a file w/ O_DIRECT writes submitted through the kernel's
+ * async IO interface (io_submit(2)), keeping up to depth() of them in
+ * flight. Each write is staged in one of depth() aligned buffers, so the
+ * memory it was copied from can be reused as soon as it is submitted.
+ *
+ * If dsync, a write is durable once it completes (RWF_DSYNC), so no
+ * fsync() is needed. Writes may complete in any order, but reap() reports
+ * them in the order they were submitted.
+ *
+ * NOT THREAD SAFE
+ */
+class aio_writer {
+public:
+
+  // O_DIRECT needs offsets, lengths, and memory aligned to this
+  static const size_t Alignment = 4096;
+
+  aio_writer(size_t depth, size_t buffer_size, bool dsync);
+  ~aio_writer();
+
+  aio_writer(const aio_writer &) = delete;
+  aio_writer &operator=(const aio_writer &) = delete;
+
+  inline size_t
+  depth() const
+  {
+    return slots_.size();
+  }
+
+  // the size of each staging buffer
+  inline size_t
+  buffer_size() const
+  {
+    return buffer_size_;
+  }
+
+  inline size_t
+  ninflight() const
+  {
+    return nsubmitted_ - nreaped_;
+  }
+
+  // the next write goes to fd (which must be opened w/ O_DIRECT) at offset
+  // (aligned). no writes may be in flight
+  void set_file(int fd, uint64_t offset);
+
+  // the staging buffer for the next write. ninflight() must be < depth()
+  uint8_t *next_buffer();
+
+  // writes out the first nbytes (a multiple of Alignment) of next_buffer()
+  // at the current offset, and moves the offset past them. cookie is what
+  // reap() reports the write as
+  void submit(size_t nbytes, uint64_t cookie);
+
+  // appends the cookies of the writes which completed since the last call
+  // to cookies, in submission order, stopping at the first one still in
+  // flight. if timeout_us is not 0, first waits (up to timeout_us, or for
+  // as long as it takes if it is < 0) for the oldest write in flight to
+  // complete. returns the number of cookies appended
+  size_t reap(std::vector<uint64_t> &cookies, int64_t timeout_us = 0);
+
+  // waits for all the writes in flight, and reaps them
+  void drain(std::vector<uint64_t> &cookies);
+
+private:
+
+  struct slot {
+    uint8_t *buf_;
+    uint64_t cookie_;
+    bool done_;
+    struct iocb cb_;
+  };
+
+  // collects at least min_nr completions, unless ts (if not null) runs out
+  // first. returns the number collected
+  long get_events(long min_nr, struct timespec *ts);
+
+  const size_t buffer_size_;
+  const bool dsync_;
+  aio_context_t ctx_;
+  std::vector<slot> slots_; // the i-th write goes to slot i % depth()
+  std::vector<struct io_event> events_;
+  int fd_;
+  uint64_t offset_;
+  uint64_t nsubmitted_;
+  uint64_t nreaped_;
+};
+
+#endif /* _NDB_AIO_WRITER_H_ */
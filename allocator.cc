@@ -1,8 +1,12 @@
 #include <sys/mman.h>
 #include <unistd.h>
+#include <algorithm>
+#include <limits>
 #include <map>
 #include <iostream>
 #include <cstring>
+#include <tuple>
+#include <unordered_map>
 #include <numa.h>
 
 #include "allocator.h"
@@ -15,6 +19,12 @@ using namespace util;
 
 static event_counter evt_allocator_total_region_usage(
     "allocator_total_region_usage_bytes");
+static event_counter evt_allocator_borrowed_hugepgs(
+    "allocator_borrowed_hugepages");
+static event_counter evt_allocator_returned_hugepgs(
+    "allocator_returned_hugepages");
+static event_counter evt_allocator_reused_hugepgs(
+    "allocator_reused_hugepages");
 
 // page+alloc routines taken from masstree
 
@@ -27,13 +37,13 @@ allocator::PointerToPgMetadata(const void *p)
     return nullptr;
   const size_t cpu = PointerToCpu(p);
   const regionctx &pc = g_regions[cpu];
-  if (p >= pc.region_begin)
+  if (p >= pc.region_begin && p < pc.region_end)
     return nullptr;
   // round pg down to page
   p = (const void *) ((uintptr_t)p & ~(hugepgsize-1));
   const pgmetadata *pmd = (const pgmetadata *) p;
   ALWAYS_ASSERT((pmd->unit_ % AllocAlignment) == 0);
-  ALWAYS_ASSERT((MAX_ARENAS * AllocAlignment) >= pmd->unit_);
+  ALWAYS_ASSERT(MaxAllocSize >= pmd->unit_);
   return pmd;
 }
 #endif
@@ -123,6 +133,10 @@ allocator::Initialize(size_t ncpus, size_t maxpercore)
       (reinterpret_cast<uintptr_t>(x) + (g_ncpus * g_maxpercore + hugepgsize)));
 
   for (size_t i = 0; i < g_ncpus; i++) {
+    g_regions[i].numa_node = numa_available() < 0 ?
+      0 : std::max(numa_node_of_cpu(i % numa_num_configured_cpus()), 0);
+    // a region's returned hugepages are its own, so this never grows
+    g_regions[i].returned.reserve(g_maxpercore / hugepgsize);
     g_regions[i].region_begin =
       reinterpret_cast<char *>(g_memstart) + (i * g_maxpercore);
     g_regions[i].region_end   =
@@ -143,31 +157,69 @@ allocator::DumpStats()
   std::cerr << "[allocator] ncpus=" << g_ncpus << std::endl;
   for (size_t i = 0; i < g_ncpus; i++) {
     const bool f = g_regions[i].region_faulted;
-    const size_t remaining =
-      intptr_t(g_regions[i].region_end) -
-      intptr_t(g_regions[i].region_begin);
+    const region_stats s = GetRegionStats(i);
     std::cerr << "[allocator] cpu=" << i << " fully_faulted?=" << f
-              << " remaining=" << remaining << " bytes" << std::endl;
+              << " remaining=" << s.remaining_bytes_ << " bytes"
+              << " free=" << s.free_bytes_ << " bytes"
+              << " faulted=" << s.faulted_bytes_ << " bytes"
+              << " returned=" << s.returned_bytes_ << " bytes"
+              << " borrowed=" << s.borrowed_bytes_ << " bytes"
+              << " lent=" << s.lent_bytes_ << " bytes" << std::endl;
   }
 }
 
+void
+allocator::SetReturnWatermark(size_t bytes)
+{
+  g_return_watermark = bytes;
+}
+
+allocator::region_stats
+allocator::GetRegionStats(size_t cpu)
+{
+  static const size_t hugepgsize = GetHugepageSize();
+  ALWAYS_ASSERT(cpu < g_ncpus);
+  regionctx &pc = g_regions[cpu];
+  lock_guard<spinlock> l(pc.lock);
+  region_stats s;
+  s.remaining_bytes_ =
+    intptr_t(pc.region_end) - intptr_t(pc.region_begin);
+  s.free_bytes_ = pc.free_bytes;
+  s.faulted_bytes_ = pc.faulted_bytes;
+  s.returned_bytes_ = pc.returned.size() * hugepgsize;
+  s.borrowed_bytes_ = pc.borrowed_bytes;
+  s.lent_bytes_ = pc.lent_bytes;
+  for (size_t arena = 0; arena < MAX_ARENAS; arena++) {
+    s.arenas_[arena].nhugepgs_ = pc.arenas_nhugepgs[arena];
+    s.arenas_[arena].nobjs_ =
+      pc.arenas_nhugepgs[arena] * ObjectsPerHugepage(arena);
+    s.arenas_[arena].nfree_ = pc.arenas_nfree[arena];
+  }
+  return s;
+}
+
 static void *
 initialize_page(void *page, const size_t pagesize, const size_t unit)
 {
   INVARIANT(((uintptr_t)page % pagesize) == 0);
+  const uintptr_t base = (uintptr_t)page;
+  uintptr_t hdr = 0;
 
 #ifdef MEMCHECK_MAGIC
   ::allocator::pgmetadata *pmd = (::allocator::pgmetadata *) page;
   pmd->unit_ = unit;
-  page = (void *) ((uintptr_t)page + sizeof(*pmd));
+  hdr = sizeof(*pmd);
 #endif
 
-  void *first = (void *)util::iceil((uintptr_t)page, (uintptr_t)unit);
-  INVARIANT((uintptr_t)first + unit <= (uintptr_t)page + pagesize);
+  // objects are placed relative to the page (unit need not divide the
+  // page's alignment), so all the pages of a size class hold the same number
+  // of them (see ObjectsPerHugepage())
+  void *first = (void *)(base + util::iceil(hdr, (uintptr_t)unit));
+  INVARIANT((uintptr_t)first + unit <= base + pagesize);
   void **p = (void **)first;
   void *next = (void *)((uintptr_t)p + unit);
-  while ((uintptr_t)next + unit <= (uintptr_t)page + pagesize) {
-    INVARIANT(((uintptr_t)p % unit) == 0);
+  while ((uintptr_t)next + unit <= base + pagesize) {
+    INVARIANT((((uintptr_t)p - base) % unit) == 0);
     *p = next;
 #ifdef MEMCHECK_MAGIC
     NDB_MEMSET(
@@ -177,7 +229,7 @@ initialize_page(void *page, const size_t pagesize, const size_t unit)
     p = (void **)next;
     next = (void *)((uintptr_t)next + unit);
   }
-  INVARIANT(((uintptr_t)p % unit) == 0);
+  INVARIANT((((uintptr_t)p - base) % unit) == 0);
   *p = NULL;
 #ifdef MEMCHECK_MAGIC
   NDB_MEMSET(
@@ -187,8 +239,23 @@ initialize_page(void *page, const size_t pagesize, const size_t unit)
   return first;
 }
 
+size_t
+allocator::ObjectsPerHugepage(size_t arena)
+{
+  // as laid out by initialize_page()
+  static const size_t hugepgsize = GetHugepageSize();
+  INVARIANT(arena < MAX_ARENAS);
+  const size_t unit = ArenaUnit(arena);
+  uintptr_t first = 0;
+#ifdef MEMCHECK_MAGIC
+  first += sizeof(pgmetadata);
+#endif
+  first = util::iceil(first, (uintptr_t)unit);
+  return (hugepgsize - first) / unit;
+}
+
 void *
-allocator::AllocateArenas(size_t cpu, size_t arena)
+allocator::AllocateArenas(size_t cpu, size_t arena, size_t *nobjs)
 {
   INVARIANT(cpu < g_ncpus);
   INVARIANT(arena < MAX_ARENAS);
@@ -202,12 +269,24 @@ allocator::AllocateArenas(size_t cpu, size_t arena)
     // claim
     void *ret = pc.arenas[arena];
     pc.arenas[arena] = nullptr;
+    pc.free_bytes -= pc.arenas_nfree[arena] * ArenaUnit(arena);
+    if (nobjs)
+      *nobjs = pc.arenas_nfree[arena];
+    pc.arenas_nfree[arena] = 0;
     pc.lock.unlock();
     return ret;
   }
 
-  void * const mypx = AllocateUnmanagedWithLock(pc, 1); // releases lock
-  return initialize_page(mypx, hugepgsize, (arena + 1) * AllocAlignment);
+  void * const mypx = AllocateUnmanagedWithLock(cpu, 1); // releases lock
+  {
+    // maybe borrowed, so not from pc
+    regionctx &opc = g_regions[PointerToCpu(mypx)];
+    lock_guard<spinlock> l(opc.lock);
+    opc.arenas_nhugepgs[arena]++;
+  }
+  if (nobjs)
+    *nobjs = ObjectsPerHugepage(arena);
+  return initialize_page(mypx, hugepgsize, ArenaUnit(arena));
 }
 
 void *
@@ -215,13 +294,25 @@ allocator::AllocateUnmanaged(size_t cpu, size_t nhugepgs)
 {
   regionctx &pc = g_regions[cpu];
   pc.lock.lock();
-  return AllocateUnmanagedWithLock(pc, nhugepgs); // releases lock
+  return AllocateUnmanagedWithLock(cpu, nhugepgs); // releases lock
 }
 
 void *
-allocator::AllocateUnmanagedWithLock(regionctx &pc, size_t nhugepgs)
+allocator::AllocateUnmanagedWithLock(size_t cpu, size_t nhugepgs)
 {
   static const size_t hugepgsize = GetHugepageSize();
+  regionctx &pc = g_regions[cpu];
+
+  if (nhugepgs == 1 && !pc.returned.empty()) {
+    // still mapped, and faults back in on first touch
+    void * const px = pc.returned.back();
+    pc.returned.pop_back();
+    pc.faulted_bytes += hugepgsize; // once touched
+    pc.lock.unlock();
+    evt_allocator_total_region_usage.inc(hugepgsize);
+    ++evt_allocator_reused_hugepgs;
+    return px;
+  }
 
   void * const mypx = pc.region_begin;
 
@@ -233,34 +324,119 @@ allocator::AllocateUnmanagedWithLock(regionctx &pc, size_t nhugepgs)
     reinterpret_cast<char *>(mypx) + nhugepgs * hugepgsize;
 
   if (unlikely(mynewpx > pc.region_end)) {
-    std::cerr << "allocator::AllocateUnmanagedWithLock():" << std::endl
-              << "  region ending at " << pc.region_end << " OOM" << std::endl;
-    ALWAYS_ASSERT(false); // out of memory otherwise
+    pc.lock.unlock();
+    return BorrowHugepages(cpu, nhugepgs);
   }
 
   const bool needs_mmap = !pc.region_faulted;
   pc.region_begin = mynewpx;
+  if (needs_mmap)
+    pc.faulted_bytes += nhugepgs * hugepgsize;
   pc.lock.unlock();
 
   evt_allocator_total_region_usage.inc(nhugepgs * hugepgsize);
 
-  if (needs_mmap) {
-    void * const x = mmap(mypx, hugepgsize, PROT_READ | PROT_WRITE,
-        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-    if (unlikely(x == MAP_FAILED)) {
-      perror("mmap");
-      ALWAYS_ASSERT(false);
+  if (needs_mmap)
+    MapHugepages(mypx, nhugepgs);
+
+  return mypx;
+}
+
+void *
+allocator::BorrowHugepages(size_t cpu, size_t nhugepgs)
+{
+  static const size_t hugepgsize = GetHugepageSize();
+  regionctx &mypc = g_regions[cpu];
+
+  // lenders on our node go first, the ones w/ the most room first. the room
+  // is snapshotted under each lender's lock, and can shrink before we
+  // borrow, so it is re-checked then
+  std::vector<std::tuple<bool, size_t, size_t>> lenders; // (remote, room, cpu)
+  for (size_t i = 0; i < g_ncpus; i++) {
+    if (i == cpu)
+      continue;
+    regionctx &pc = g_regions[i];
+    size_t room;
+    {
+      lock_guard<spinlock> l(pc.lock);
+      room = (intptr_t(pc.region_end) - intptr_t(pc.region_begin)) / hugepgsize;
+      if (nhugepgs == 1)
+        room += pc.returned.size();
     }
-    INVARIANT(x == mypx);
-    const int advice =
-      UseMAdvWillNeed() ? MADV_HUGEPAGE | MADV_WILLNEED : MADV_HUGEPAGE;
-    if (madvise(x, hugepgsize, advice)) {
-      perror("madvise");
-      ALWAYS_ASSERT(false);
+    if (room < nhugepgs)
+      continue;
+    lenders.emplace_back(pc.numa_node != mypc.numa_node, room, i);
+  }
+  std::sort(lenders.begin(), lenders.end(),
+      [](const std::tuple<bool, size_t, size_t> &a,
+         const std::tuple<bool, size_t, size_t> &b) {
+        if (std::get<0>(a) != std::get<0>(b))
+          return !std::get<0>(a);
+        return std::get<1>(a) > std::get<1>(b);
+      });
+
+  for (auto &lender : lenders) {
+    regionctx &pc = g_regions[std::get<2>(lender)];
+    pc.lock.lock();
+    void *px = nullptr;
+    bool needs_mmap = false;
+    if (nhugepgs == 1 && !pc.returned.empty()) {
+      px = pc.returned.back();
+      pc.returned.pop_back();
+      pc.faulted_bytes += hugepgsize;
+    } else if (reinterpret_cast<char *>(pc.region_end) -
+               reinterpret_cast<char *>(pc.region_begin) >=
+               ssize_t(nhugepgs * hugepgsize)) {
+      // from the end, so the lender's own allocations are undisturbed
+      pc.region_end =
+        reinterpret_cast<char *>(pc.region_end) - nhugepgs * hugepgsize;
+      px = pc.region_end;
+      needs_mmap = !pc.region_faulted;
+      if (needs_mmap)
+        pc.faulted_bytes += nhugepgs * hugepgsize;
+    }
+    if (px)
+      pc.lent_bytes += nhugepgs * hugepgsize;
+    pc.lock.unlock();
+    if (!px)
+      continue;
+
+    {
+      lock_guard<spinlock> l(mypc.lock);
+      mypc.borrowed_bytes += nhugepgs * hugepgsize;
     }
+    evt_allocator_total_region_usage.inc(nhugepgs * hugepgsize);
+    evt_allocator_borrowed_hugepgs.inc(nhugepgs);
+    if (needs_mmap)
+      MapHugepages(px, nhugepgs);
+    return px;
   }
 
-  return mypx;
+  std::cerr << "allocator::BorrowHugepages():" << std::endl
+            << "  cpu" << cpu << " needs " << nhugepgs
+            << " hugepgs, no region has them: OOM" << std::endl;
+  ALWAYS_ASSERT(false); // out of memory otherwise
+  return nullptr;
+}
+
+void
+allocator::MapHugepages(void *px, size_t nhugepgs)
+{
+  static const size_t hugepgsize = GetHugepageSize();
+  const size_t sz = nhugepgs * hugepgsize;
+  void * const x = mmap(px, sz, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (unlikely(x == MAP_FAILED)) {
+    perror("mmap");
+    ALWAYS_ASSERT(false);
+  }
+  INVARIANT(x == px);
+  const int advice =
+    UseMAdvWillNeed() ? MADV_HUGEPAGE | MADV_WILLNEED : MADV_HUGEPAGE;
+  if (madvise(x, sz, advice)) {
+    perror("madvise");
+    ALWAYS_ASSERT(false);
+  }
 }
 
 void
@@ -269,6 +445,7 @@ allocator::ReleaseArenas(void **arenas)
   // cpu -> [(head, tail)]
   // XXX: use a small_map here?
   std::map<size_t, static_vector<std::pair<void *, void *>, MAX_ARENAS>> m;
+  std::map<size_t, static_vector<size_t, MAX_ARENAS>> counts; // cpu -> [n]
   for (size_t arena = 0; arena < MAX_ARENAS; arena++) {
     void *p = arenas[arena];
     while (p) {
@@ -278,6 +455,7 @@ allocator::ReleaseArenas(void **arenas)
       if (it == m.end()) {
         auto &v = m[cpu];
         v.resize(MAX_ARENAS);
+        counts[cpu].resize(MAX_ARENAS);
         *reinterpret_cast<void **>(p) = nullptr;
         v[arena].first = v[arena].second = p;
       } else {
@@ -290,21 +468,130 @@ allocator::ReleaseArenas(void **arenas)
           v[arena].first = p;
         }
       }
+      counts[cpu][arena]++;
       p = pnext;
     }
   }
   for (auto &p : m) {
     INVARIANT(!p.second.empty());
     regionctx &pc = g_regions[p.first];
+    const auto &n = counts[p.first];
+    bool do_return = false;
+    {
+      lock_guard<spinlock> l(pc.lock);
+      for (size_t arena = 0; arena < MAX_ARENAS; arena++) {
+        INVARIANT(bool(p.second[arena].first) == bool(p.second[arena].second));
+        if (!p.second[arena].first)
+          continue;
+        *reinterpret_cast<void **>(p.second[arena].second) = pc.arenas[arena];
+        pc.arenas[arena] = p.second[arena].first;
+        pc.arenas_nfree[arena] += n[arena];
+        pc.free_bytes += n[arena] * ArenaUnit(arena);
+      }
+      if (unlikely(pc.free_bytes > g_return_watermark && !pc.returning)) {
+        pc.returning = true;
+        do_return = true;
+      }
+    }
+    if (do_return)
+      ReturnHugepages(p.first);
+  }
+}
+
+void
+allocator::ReturnHugepages(size_t cpu)
+{
+  static const size_t hugepgsize = GetHugepageSize();
+  regionctx &pc = g_regions[cpu];
+
+  // take the free arenas, so the core is not held up while they are sorted
+  // out (it allocates new hugepages meanwhile)
+  void *lists[MAX_ARENAS];
+  size_t nfree[MAX_ARENAS];
+  size_t free_bytes;
+  {
     lock_guard<spinlock> l(pc.lock);
-    for (size_t arena = 0; arena < MAX_ARENAS; arena++) {
-      INVARIANT(bool(p.second[arena].first) == bool(p.second[arena].second));
-      if (!p.second[arena].first)
+    INVARIANT(pc.returning);
+    NDB_MEMCPY(&lists[0], &pc.arenas[0], sizeof(lists));
+    NDB_MEMCPY(&nfree[0], &pc.arenas_nfree[0], sizeof(nfree));
+    free_bytes = pc.free_bytes;
+    NDB_MEMSET(&pc.arenas[0], 0, sizeof(pc.arenas));
+    NDB_MEMSET(&pc.arenas_nfree[0], 0, sizeof(pc.arenas_nfree));
+    pc.free_bytes = 0;
+  }
+
+  // a hugepage holds objects of a single arena, so it has no live objects
+  // iff all of its objects are on that arena's free list
+  std::vector<void *> returned;
+  size_t nreturned_by_arena[MAX_ARENAS];
+  NDB_MEMSET(&nreturned_by_arena[0], 0, sizeof(nreturned_by_arena));
+  for (size_t arena = 0;
+       arena < MAX_ARENAS && free_bytes > g_return_watermark;
+       arena++) {
+    if (!lists[arena])
+      continue;
+    const size_t unit = ArenaUnit(arena);
+    const size_t nperpage = ObjectsPerHugepage(arena);
+    std::unordered_map<uintptr_t, size_t> pgfree; // hugepage -> # free
+    for (void *p = lists[arena]; p; p = *reinterpret_cast<void **>(p))
+      pgfree[uintptr_t(p) & ~(hugepgsize - 1)]++;
+    size_t nreturned = 0;
+    for (auto it = pgfree.begin(); it != pgfree.end(); ) {
+      INVARIANT(it->second <= nperpage);
+      if (it->second != nperpage || free_bytes <= g_return_watermark) {
+        it = pgfree.erase(it);
         continue;
-      *reinterpret_cast<void **>(p.second[arena].second) = pc.arenas[arena];
-      pc.arenas[arena] = p.second[arena].first;
+      }
+      returned.push_back(reinterpret_cast<void *>(it->first));
+      free_bytes -= nperpage * unit;
+      nreturned++;
+      ++it;
+    }
+    if (!nreturned)
+      continue;
+    // pgfree now holds the returned hugepages: unlink their objects
+    void **pp = &lists[arena];
+    while (*pp) {
+      if (pgfree.count(uintptr_t(*pp) & ~(hugepgsize - 1)))
+        *pp = *reinterpret_cast<void **>(*pp);
+      else
+        pp = reinterpret_cast<void **>(*pp);
     }
+    nfree[arena] -= nreturned * nperpage;
+    nreturned_by_arena[arena] = nreturned;
+  }
+
+  for (auto px : returned)
+    if (madvise(px, hugepgsize, MADV_DONTNEED)) {
+      perror("madvise");
+      ALWAYS_ASSERT(false);
+    }
+  evt_allocator_returned_hugepgs.inc(returned.size());
+  evt_allocator_total_region_usage.dec(returned.size() * hugepgsize);
+
+  void *tails[MAX_ARENAS];
+  for (size_t arena = 0; arena < MAX_ARENAS; arena++) {
+    tails[arena] = lists[arena];
+    if (tails[arena])
+      while (*reinterpret_cast<void **>(tails[arena]))
+        tails[arena] = *reinterpret_cast<void **>(tails[arena]);
+  }
+
+  lock_guard<spinlock> l(pc.lock);
+  for (size_t arena = 0; arena < MAX_ARENAS; arena++) {
+    INVARIANT(pc.arenas_nhugepgs[arena] >= nreturned_by_arena[arena]);
+    pc.arenas_nhugepgs[arena] -= nreturned_by_arena[arena];
+    if (!lists[arena])
+      continue;
+    *reinterpret_cast<void **>(tails[arena]) = pc.arenas[arena];
+    pc.arenas[arena] = lists[arena];
+    pc.arenas_nfree[arena] += nfree[arena];
+    pc.free_bytes += nfree[arena] * ArenaUnit(arena);
   }
+  pc.returned.insert(pc.returned.end(), returned.begin(), returned.end());
+  pc.faulted_bytes -= returned.size() * hugepgsize;
+  INVARIANT(pc.returned.size() <= pc.returned.capacity());
+  pc.returning = false;
 }
 
 static void
@@ -366,6 +653,7 @@ allocator::FaultRegion(size_t cpu)
     *px = 0xDE;
   std::cerr << "cpu" << cpu << " finished faulting region in "
             << t.lap_ms() << " ms" << std::endl;
+  pc.faulted_bytes += sz;
   pc.region_faulted = true;
 }
 
@@ -373,4 +661,5 @@ void *allocator::g_memstart = nullptr;
 void *allocator::g_memend = nullptr;
 size_t allocator::g_ncpus = 0;
 size_t allocator::g_maxpercore = 0;
+size_t allocator::g_return_watermark = std::numeric_limits<size_t>::max();
 percore<allocator::regionctx> allocator::g_regions;
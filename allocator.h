@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <iterator>
 #include <mutex>
+#include <vector>
 
 #include "util.h"
 #include "core.h"
@@ -13,7 +14,21 @@
 class allocator {
 public:
 
-  // our allocator doesn't let allocations exceed maxpercore over a single core
+  static const size_t LgAllocAlignment = 4; // all allocations aligned to 2^4 = 16
+  static const size_t AllocAlignment = 1 << LgAllocAlignment;
+
+  // an arena is a size class. the small ones are AllocAlignment apart, up to
+  // 512 bytes, and the large ones split each power of 2 in four, up to 64KB
+  // (so they waste at most 25%)
+  static const size_t NSmallArenas = 32;
+  static const size_t NLargeArenas = 28;
+  static const size_t MAX_ARENAS = NSmallArenas + NLargeArenas;
+  static const size_t MaxSmallAllocSize = NSmallArenas * AllocAlignment;
+  static const size_t MaxAllocSize = MaxSmallAllocSize << (NLargeArenas / 4);
+
+  // each core gets a region of maxpercore bytes. a core which runs out of its
+  // region borrows hugepages from the other cores' regions (those on its NUMA
+  // node first), so allocations only fail once all the regions are used up
   //
   // Initialize can be called many times- but only the first call has effect.
   //
@@ -22,9 +37,9 @@ public:
 
   static void DumpStats();
 
-  // returns an arena linked-list
+  // returns an arena linked-list, of *nobjs objects if nobjs is given
   static void *
-  AllocateArenas(size_t cpu, size_t sz);
+  AllocateArenas(size_t cpu, size_t sz, size_t *nobjs = nullptr);
 
   // allocates nhugepgs * hugepagesize contiguous bytes from CPU's region and
   // returns the raw, unmanaged pointer.
@@ -35,19 +50,80 @@ public:
   static void *
   AllocateUnmanaged(size_t cpu, size_t nhugepgs);
 
+  // once the free arenas of a core's region hold more than the return
+  // watermark (see SetReturnWatermark()), releasing arenas hands the
+  // hugepages w/ no live objects back to the OS (MADV_DONTNEED), until the
+  // free arenas are back under the watermark. the region reuses these
+  // hugepages before any others
   static void
   ReleaseArenas(void **arenas);
 
-  static const size_t LgAllocAlignment = 4; // all allocations aligned to 2^4 = 16
-  static const size_t AllocAlignment = 1 << LgAllocAlignment;
-  static const size_t MAX_ARENAS = 32;
+  // in bytes per region. the default never gives memory back
+  static void SetReturnWatermark(size_t bytes);
+
+  // of the hugepages in a region which hold objects of one size class
+  struct arena_stats {
+    size_t nhugepgs_;
+    size_t nobjs_;  // # of objects on them
+    size_t nfree_;  // ... which are on the region's free list. the others
+                    // are live, or on a thread's free list (see rcu::sync)
+  };
+
+  struct region_stats {
+    size_t remaining_bytes_; // not handed out yet (nor lent)
+    size_t free_bytes_;      // in the region's free arenas
+    size_t faulted_bytes_;   // mapped, less the returned hugepages
+    size_t returned_bytes_;  // given back to the OS, and not reused yet
+    size_t borrowed_bytes_;  // ever taken from other regions by this core
+    size_t lent_bytes_;      // ever taken from this region by other cores
+    arena_stats arenas_[MAX_ARENAS];
+  };
+
+  // cheap: a copy of the region's counters, under its lock
+  static region_stats GetRegionStats(size_t cpu);
+
+  static inline size_t
+  GetNumRegions()
+  {
+    return g_ncpus;
+  }
 
+  // the # of objects of size class arena on a hugepage
+  static size_t ObjectsPerHugepage(size_t arena);
+
+  // returns (size of the class, class) for an allocation of sz bytes. the
+  // class is >= MAX_ARENAS if sz is over MaxAllocSize
   static inline std::pair<size_t, size_t>
   ArenaSize(size_t sz)
   {
-    const size_t allocsz = util::round_up<size_t, LgAllocAlignment>(sz);
-    const size_t arena = allocsz / AllocAlignment - 1;
-    return std::make_pair(allocsz, arena);
+    if (likely(sz <= MaxSmallAllocSize)) {
+      const size_t allocsz = util::round_up<size_t, LgAllocAlignment>(sz);
+      const size_t arena = allocsz / AllocAlignment - 1;
+      return std::make_pair(allocsz, arena);
+    }
+    if (unlikely(sz > MaxAllocSize))
+      return std::make_pair(sz, size_t(MAX_ARENAS));
+    // sz is in (base, 2 * base], for base = MaxSmallAllocSize << lg
+    const size_t lg =
+      63 - __builtin_clzll((sz - 1) / MaxSmallAllocSize);
+    const size_t step = (MaxSmallAllocSize << lg) / 4;
+    const size_t quarter = (sz - (MaxSmallAllocSize << lg) - 1) / step;
+    return std::make_pair(
+        (MaxSmallAllocSize << lg) + (quarter + 1) * step,
+        NSmallArenas + lg * 4 + quarter);
+  }
+
+  // the size of the objects of a class
+  static inline size_t
+  ArenaUnit(size_t arena)
+  {
+    INVARIANT(arena < MAX_ARENAS);
+    if (likely(arena < NSmallArenas))
+      return (arena + 1) * AllocAlignment;
+    const size_t lg = (arena - NSmallArenas) / 4;
+    const size_t quarter = (arena - NSmallArenas) % 4;
+    return (MaxSmallAllocSize << lg) +
+      (quarter + 1) * ((MaxSmallAllocSize << lg) / 4);
   }
 
   // slow, but only needs to be called on initialization
@@ -109,35 +185,68 @@ private:
     regionctx()
       : region_begin(nullptr),
         region_end(nullptr),
-        region_faulted(false)
+        region_faulted(false),
+        numa_node(0),
+        free_bytes(0),
+        faulted_bytes(0),
+        returning(false),
+        borrowed_bytes(0),
+        lent_bytes(0)
     {
       NDB_MEMSET(arenas, 0, sizeof(arenas));
+      NDB_MEMSET(arenas_nfree, 0, sizeof(arenas_nfree));
+      NDB_MEMSET(arenas_nhugepgs, 0, sizeof(arenas_nhugepgs));
     }
     regionctx(const regionctx &) = delete;
     regionctx(regionctx &&) = delete;
     regionctx &operator=(const regionctx &) = delete;
 
-    // set by Initialize()
+    // set by Initialize(). other cores borrow hugepages from the end
     void *region_begin;
     void *region_end;
 
     bool region_faulted;
+    int numa_node;
 
     spinlock lock;
     std::mutex fault_lock; // XXX: hacky
     void *arenas[MAX_ARENAS];
+    size_t arenas_nfree[MAX_ARENAS]; // # of objects in arenas[i]
+    size_t arenas_nhugepgs[MAX_ARENAS]; // hugepages of the region in arena i
+    size_t free_bytes;
+    size_t faulted_bytes;
+
+    // hugepages of the region given back to the OS, still mapped
+    std::vector<void *> returned;
+    bool returning; // is ReturnHugepages() running?
+
+    size_t borrowed_bytes;
+    size_t lent_bytes;
   };
 
-  // assumes caller has the regionctx lock held, and
+  // assumes caller has the regionctx lock of cpu held, and
   // will release the lock.
   static void *
-  AllocateUnmanagedWithLock(regionctx &pc, size_t nhugepgs);
+  AllocateUnmanagedWithLock(size_t cpu, size_t nhugepgs);
+
+  // takes nhugepgs contiguous hugepages from another core's region
+  static void *
+  BorrowHugepages(size_t cpu, size_t nhugepgs);
+
+  // gives the hugepages of cpu's free arenas which hold no live objects back
+  // to the OS, until the free arenas are under the return watermark
+  static void
+  ReturnHugepages(size_t cpu);
+
+  static void
+  MapHugepages(void *px, size_t nhugepgs);
 
   // [g_memstart, g_memstart + ncpus * maxpercore) is the region of memory mmap()-ed
   static void *g_memstart;
   static void *g_memend; // g_memstart + ncpus * maxpercore
   static size_t g_ncpus;
   static size_t g_maxpercore;
+  static size_t g_return_watermark;
 
   static percore<regionctx> g_regions CACHE_ALIGNED;
 };
@@ -18,6 +18,22 @@ template <template <typename> class Transaction>
 struct base_txn_btree_handler {
   static inline void on_construct() {} // called when initializing
   static const bool has_background_task = false;
+  // whether records may be installed w/o going through a transaction
+  static inline bool can_bulk_load() { return true; }
+  // whether two live tables may not share a name (and so a table id)
+  static inline bool unique_table_names() { return false; }
+};
+
+// the ids (see base_txn_btree::TableId()) of the live tables, so that two
+// tables which the log could not tell apart are caught when the second one
+// is constructed, instead of at recovery
+class table_id_registry {
+public:
+  // asserts that no live table w/ a different name has id (a hash
+  // collision). if unique, also asserts that name is not the default one
+  // and that no live table has it already
+  static void Register(uint32_t id, const std::string &name, bool unique);
+  static void Unregister(uint32_t id);
 };
 
 template <template <typename> class Transaction, typename P>
@@ -37,20 +53,92 @@ public:
       been_destructed(false)
   {
     base_txn_btree_handler<Transaction>::on_construct();
+    abort_profiler::RegisterTable(&underlying_btree, name);
+    table_id_registry::Register(
+        TableId(name), name,
+        base_txn_btree_handler<Transaction>::unique_table_names());
+    underlying_btree.set_table_id(TableId(name));
   }
 
   ~base_txn_btree()
   {
+    table_id_registry::Unregister(table_id());
+    abort_profiler::UnregisterTable(&underlying_btree);
     if (!been_destructed)
       unsafe_purge(false);
   }
 
+  /**
+   * The id the log tags the writes to a table named name w/, which recovery
+   * routes them by (see txn_log_recovery::load()). A hash of the name, so
+   * it stays the same across restarts as long as the name does. Tables
+   * whose names hash alike are refused at construction (see
+   * table_id_registry)
+   */
+  static inline uint32_t
+  TableId(const std::string &name)
+  {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (char c : name)
+      h = (h ^ uint8_t(c)) * 16777619u;
+    return h;
+  }
+
+  inline uint32_t
+  table_id() const
+  {
+    return underlying_btree.table_id();
+  }
+
   inline size_t
   size_estimate() const
   {
-    return underlying_btree.size();
+    return underlying_btree.size_estimate();
+  }
+
+  /**
+   * Estimated number of keys in [lower, *upper) (no upper bound if upper is
+   * NULL), see concurrent_btree::estimate_range_count(). Not transactional,
+   * and keys which are deleted but not yet garbage collected still count
+   */
+  inline size_t
+  estimate_range_count(const string_type &lower,
+                       const string_type *upper) const
+  {
+    varkey uppervk;
+    if (upper)
+      uppervk = varkey(*upper);
+    return underlying_btree.estimate_range_count(
+        varkey(lower), upper ? &uppervk : nullptr);
   }
 
+  /**
+   * Runs one compaction pass over the underlying tree, see
+   * concurrent_btree::compact(). Safe to call while transactions are
+   * running (they may abort on the nodes it touches). The pass enters its
+   * own RCU region, so the caller need not be in one. Returns the number
+   * of tree nodes reclaimed
+   */
+  inline size_t
+  compact()
+  {
+    return underlying_btree.compact();
+  }
+
+  /**
+   * Reads the records of up to n keys >= pos (in their raw, on-disk form)
+   * as of TID t, invoking f(key, value, value_len) on each one which exists
+   * at t, in ascending key order. pos is then advanced past the last key
+   * looked at, and false is returned once there are no more keys.
+   *
+   * Not transactional: must be called from within an RCU region, and the
+   * caller must keep the record versions at t from being reclaimed while
+   * the scan is in progress (see transaction_proto2_static::PinSnapshot())
+   */
+  template <typename F>
+  bool snapshot_scan(tid_t t, std::string &pos, size_t n, F &f) const;
+
   inline size_type
   get_value_size_hint() const
   {
@@ -103,7 +191,7 @@ private:
           it != purge_stats_nkeys_node.end(); ++it)
         v += *it;
       const double avg_nkeys_node = double(v)/double(purge_stats_nkeys_node.size());
-      const double avg_fill_factor = avg_nkeys_node/double(concurrent_btree::NKeysPerNode);
+      const double avg_fill_factor = avg_nkeys_node/double(concurrent_btree::NKeysPerLeafNode);
       std::cerr << "btree node stats" << std::endl;
       std::cerr << "    avg_nkeys_node: " << avg_nkeys_node << std::endl;
       std::cerr << "    avg_fill_factor: " << avg_fill_factor << std::endl;
@@ -140,6 +228,17 @@ protected:
   // readers are placed here so they can be shared amongst
   // derived implementations
 
+  struct snapshot_value_reader {
+    std::string v_;
+    template <typename StringAllocator>
+    inline bool
+    operator()(const uint8_t *data, size_t sz, StringAllocator &sa)
+    {
+      v_.assign((const char *) data, sz);
+      return true;
+    }
+  };
+
   template <typename Traits, typename Callback,
             typename KeyReader, typename ValueReader>
   struct txn_search_range_callback : public concurrent_btree::low_level_search_range_callback {
@@ -147,9 +246,11 @@ protected:
           Transaction<Traits> *t,
           Callback *caller_callback,
           KeyReader *key_reader,
-          ValueReader *value_reader)
+          ValueReader *value_reader,
+          const concurrent_btree *btr)
       : t(t), caller_callback(caller_callback),
-        key_reader(key_reader), value_reader(value_reader) {}
+        key_reader(key_reader), value_reader(value_reader),
+        btr(btr) {}
 
     virtual void on_resp_node(const typename concurrent_btree::node_opaque_t *n, uint64_t version);
     virtual bool invoke(const typename concurrent_btree::string_type &k, typename concurrent_btree::value_type v,
@@ -160,6 +261,7 @@ protected:
     Callback *const caller_callback;
     KeyReader *const key_reader;
     ValueReader *const value_reader;
+    const concurrent_btree *const btr;
   };
 
   template <typename Traits, typename ValueReader>
@@ -168,6 +270,30 @@ protected:
             const typename P::Key &k,
             ValueReader &value_reader);
 
+  // batched do_search(): value_readers[i] reads keys[i], and found[i] is set
+  // to whether or not keys[i] exists. the underlying btree descents are done
+  // MultiGetBatchSize keys at a time (see btree::multi_search())
+  static const size_t MultiGetBatchSize = 16;
+
+  template <typename Traits, typename ValueReader>
+  inline size_t
+  do_multi_search(Transaction<Traits> &t,
+                  size_t n,
+                  const typename P::Key *keys,
+                  ValueReader *value_readers,
+                  bool *found);
+
+  // loads [begin, end), <std::string, P::Value> pairs sorted in ascending key
+  // order w/o duplicates, into an empty tree. each record is written w/
+  // writer into a tuple which looks like it was committed at MIN_TID, and
+  // the tuples are bulk loaded into the underlying btree. returns false
+  // (and loads nothing) if the tree is not empty, or if the Transaction
+  // cannot take records which bypassed it
+  template <typename ForwardIterator>
+  bool
+  do_bulk_load(ForwardIterator begin, ForwardIterator end,
+               dbtuple::tuple_writer_t writer, double fill_factor);
+
   template <typename Traits, typename Callback,
             typename KeyReader, typename ValueReader>
   inline void
@@ -231,14 +357,127 @@ base_txn_btree<Transaction, P>::do_search(
   const bool found = this->underlying_btree.search(varkey(*key_str), underlying_v, &search_info);
   if (found) {
     const dbtuple * const tuple = reinterpret_cast<const dbtuple *>(underlying_v);
-    return t.do_tuple_read(tuple, value_reader);
+    return t.do_tuple_read(tuple, value_reader, &this->underlying_btree);
   } else {
     // not found, add to absent_set
-    t.do_node_read(search_info.first, search_info.second);
+    t.do_node_read(search_info.first, search_info.second,
+                   &this->underlying_btree);
     return false;
   }
 }
 
+template <template <typename> class Transaction, typename P>
+template <typename Traits, typename ValueReader>
+size_t
+base_txn_btree<Transaction, P>::do_multi_search(
+    Transaction<Traits> &t,
+    size_t n,
+    const typename P::Key *keys,
+    ValueReader *value_readers,
+    bool *found)
+{
+  t.ensure_active();
+
+  size_t nfound = 0;
+  varkey batch_keys[MultiGetBatchSize];
+  typename concurrent_btree::value_type batch_values[MultiGetBatchSize];
+  bool batch_found[MultiGetBatchSize];
+  concurrent_btree::versioned_node_t batch_search_infos[MultiGetBatchSize];
+  for (size_t base = 0; base < n; base += MultiGetBatchSize) {
+    const size_t nbatch = std::min(n - base, size_t(MultiGetBatchSize));
+    for (size_t i = 0; i < nbatch; i++) {
+      typename P::KeyWriter key_writer(&keys[base + i]);
+      const std::string * const key_str =
+        key_writer.fully_materialize(true, t.string_allocator());
+      batch_keys[i] = varkey(*key_str);
+    }
+
+    // search the underlying btree to map k=>(btree_node|tuple)
+    this->underlying_btree.multi_search(
+        nbatch, batch_keys, batch_values, batch_found, batch_search_infos);
+
+    for (size_t i = 0; i < nbatch; i++) {
+      bool &f = found[base + i];
+      if (batch_found[i]) {
+        const dbtuple * const tuple =
+          reinterpret_cast<const dbtuple *>(batch_values[i]);
+        f = t.do_tuple_read(tuple, value_readers[base + i],
+                            &this->underlying_btree);
+      } else {
+        // not found, add to absent_set
+        t.do_node_read(batch_search_infos[i].first, batch_search_infos[i].second,
+                       &this->underlying_btree);
+        f = false;
+      }
+      if (f)
+        nfound++;
+    }
+  }
+  return nfound;
+}
+
+template <template <typename> class Transaction, typename P>
+template <typename ForwardIterator>
+bool
+base_txn_btree<Transaction, P>::do_bulk_load(
+    ForwardIterator begin, ForwardIterator end,
+    dbtuple::tuple_writer_t writer, double fill_factor)
+{
+  if (!base_txn_btree_handler<Transaction>::can_bulk_load() ||
+      !underlying_btree.empty())
+    return false;
+  scoped_rcu_region guard;
+  std::vector<std::pair<varkey, typename concurrent_btree::value_type>> records;
+  for (; begin != end; ++begin) {
+    const size_t sz =
+      writer(dbtuple::TUPLE_WRITER_COMPUTE_NEEDED, &begin->second, nullptr, 0);
+    INVARIANT(sz);
+    dbtuple * const tuple = dbtuple::alloc_first(sz, false);
+    writer(dbtuple::TUPLE_WRITER_DO_WRITE,
+        &begin->second, tuple->get_value_start(), 0);
+    // older than any snapshot
+    tuple->version = dbtuple::MIN_TID;
+#ifdef TUPLE_CHECK_KEY
+    tuple->key.assign(begin->first.data(), begin->first.size());
+    tuple->tree = (void *) &underlying_btree;
+#endif
+    records.emplace_back(
+        varkey(begin->first), (typename concurrent_btree::value_type) tuple);
+  }
+  ALWAYS_ASSERT(
+      underlying_btree.bulk_load(records.begin(), records.end(), fill_factor));
+  return true;
+}
+
+template <template <typename> class Transaction, typename P>
+template <typename F>
+bool
+base_txn_btree<Transaction, P>::snapshot_scan(
+    tid_t t, std::string &pos, size_t n, F &f) const
+{
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  INVARIANT(n > 0);
+  struct unused_allocator {};
+  snapshot_value_reader r;
+  unused_allocator sa;
+  size_t nseen = 0;
+  auto cb = [&](const typename concurrent_btree::string_type &k,
+                typename concurrent_btree::value_type v) -> bool {
+    const dbtuple * const tuple = reinterpret_cast<const dbtuple *>(v);
+    tid_t start_t = 0;
+    if (tuple->stable_read(t, start_t, r, sa, true) == dbtuple::READ_RECORD)
+      f(k, (const uint8_t *) r.v_.data(), r.v_.size());
+    if (++nseen < n)
+      return true;
+    // the smallest key after k
+    pos.assign(k);
+    pos.push_back('\0');
+    return false;
+  };
+  underlying_btree.search_range(varkey(pos), nullptr, cb);
+  return nseen == n;
+}
+
 template <template <typename> class Transaction, typename P>
 std::map<std::string, uint64_t>
 base_txn_btree<Transaction, P>::unsafe_purge(bool dump_stats)
@@ -388,7 +627,7 @@ base_txn_btree<Transaction, P>
   VERBOSE(std::cerr << "on_resp_node(): <node=0x" << util::hexify(intptr_t(n))
                << ", version=" << version << ">" << std::endl);
   VERBOSE(std::cerr << "  " << concurrent_btree::NodeStringify(n) << std::endl);
-  t->do_node_read(n, version);
+  t->do_node_read(n, version, btr);
 }
 
 template <template <typename> class Transaction, typename P>
@@ -406,7 +645,7 @@ base_txn_btree<Transaction, P>
                     << ", version=" << version << ">" << std::endl
                     << "  " << *((dbtuple *) v) << std::endl);
   const dbtuple * const tuple = reinterpret_cast<const dbtuple *>(v);
-  if (t->do_tuple_read(tuple, *value_reader))
+  if (t->do_tuple_read(tuple, *value_reader, btr))
     return caller_callback->invoke(
         (*key_reader)(k), value_reader->results());
   return true;
@@ -446,7 +685,8 @@ base_txn_btree<Transaction, P>::do_search_range_call(
     return;
 
   txn_search_range_callback<Traits, Callback, KeyReader, ValueReader> c(
-			&t, &callback, &key_reader, &value_reader);
+			&t, &callback, &key_reader, &value_reader,
+			&this->underlying_btree);
 
   varkey uppervk;
   if (upper_str)
@@ -482,7 +722,8 @@ base_txn_btree<Transaction, P>::do_rsearch_range_call(
     return;
 
   txn_search_range_callback<Traits, Callback, KeyReader, ValueReader> c(
-			&t, &callback, &key_reader, &value_reader);
+			&t, &callback, &key_reader, &value_reader,
+			&this->underlying_btree);
 
   varkey lowervk;
   if (lower_str)
@@ -5,6 +5,7 @@
 #include <string>
 #include <utility>
 #include <map>
+#include <vector>
 
 #include "../macros.h"
 #include "../str_arena.h"
@@ -119,6 +120,22 @@ public:
                        static_cast<const std::string &>(value));
   }
 
+  /**
+   * Load kvs, which must be sorted in ascending key order with no duplicate
+   * keys, into an empty index without going through a transaction. No other
+   * thread may access the index during the call (ie only use this in the
+   * loading phase, from the loader which owns the whole index).
+   *
+   * Returns false if the index cannot be bulk loaded (ie it is not empty),
+   * in which case nothing was loaded and the pairs should be insert()-ed
+   * instead. Default implementation always returns false
+   */
+  virtual bool
+  bulk_insert(const std::vector<std::pair<std::string, std::string>> &kvs)
+  {
+    return false;
+  }
+
   /**
    * Default implementation calls put() with NULL (zero-length) value
    */
@@ -141,6 +158,47 @@ public:
    */
   virtual size_t size() const = 0;
 
+  /**
+   * Estimated number of keys in [start_key, *end_key), or in
+   * [start_key, +infinity) if end_key is null. Only an estimate, not
+   * transactional!
+   *
+   * Default implementation counts the keys with a scan() under txn, so it
+   * is exact but takes time linear in the size of the range
+   */
+  virtual size_t
+  estimate_range_count(
+      void *txn,
+      const std::string &start_key,
+      const std::string *end_key)
+  {
+    struct counter : public scan_callback {
+      size_t n = 0;
+      virtual bool
+      invoke(const char *keyp, size_t keylen, const std::string &value)
+      {
+        n++;
+        return true;
+      }
+    } c;
+    scan(txn, start_key, end_key, c);
+    return c.n;
+  }
+
+  /**
+   * Reclaims index space left behind by removes (eg empty tree nodes).
+   * Unlike clear(), this is safe to call while transactions are running,
+   * and does not change the contents of the index.
+   *
+   * Returns the number of units (ie tree nodes) reclaimed. Default
+   * implementation does nothing
+   */
+  virtual size_t
+  compact()
+  {
+    return 0;
+  }
+
   /**
    * Not thread safe for now
    */
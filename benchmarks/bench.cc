@@ -4,6 +4,8 @@
 #include <vector>
 #include <utility>
 #include <string>
+#include <thread>
+#include <atomic>
 
 #include <stdlib.h>
 #include <sched.h>
@@ -15,6 +17,7 @@
 #include "../counter.h"
 #include "../scopedperf.hh"
 #include "../allocator.h"
+#include "../rcu.h"
 
 #ifdef USE_JEMALLOC
 //cannot include this header b/c conflicts with malloc.h
@@ -43,6 +46,7 @@ int slow_exit = 0;
 int retry_aborted_transaction = 0;
 int no_reset_counters = 0;
 int backoff_aborted_transaction = 0;
+uint64_t compact_interval_ms = 0;
 
 template <typename T>
 static void
@@ -102,6 +106,61 @@ write_cb(void *p, const char *s)
   ofs.close();
 }
 
+void
+bench_loader::load_sorted(
+    abstract_ordered_index *tbl,
+    const vector<pair<string, string>> &kvs)
+{
+  if (tbl->bulk_insert(kvs))
+    return;
+  const size_t batchsize = (db->txn_max_batch_size() == -1) ?
+    10000 : db->txn_max_batch_size();
+  ALWAYS_ASSERT(batchsize > 0);
+  for (size_t i = 0; i < kvs.size();) {
+    scoped_str_arena s_arena(arena);
+    void * const txn = db->new_txn(txn_flags, arena, txn_buf());
+    try {
+      const size_t iend = min(i + batchsize, kvs.size());
+      for (size_t j = i; j < iend; j++)
+        tbl->insert(txn, kvs[j].first, kvs[j].second);
+      if (db->commit_txn(txn))
+        i = iend;
+      else
+        db->abort_txn(txn);
+    } catch (abstract_db::abstract_abort_exception &ex) {
+      db->abort_txn(txn);
+    }
+  }
+}
+
+void
+bench_loader::flush_rows()
+{
+  typedef pair<string, string> kv;
+  for (auto &p : buffered_rows) {
+    vector<kv> &kvs = p.second;
+    const auto not_before = [](const kv &a, const kv &b) { return a.first >= b.first; };
+    if (adjacent_find(kvs.begin(), kvs.end(), not_before) != kvs.end()) {
+      stable_sort(kvs.begin(), kvs.end(),
+          [](const kv &a, const kv &b) { return a.first < b.first; });
+      // keep the last row of each key
+      auto out = kvs.begin();
+      for (auto it = kvs.begin(); it != kvs.end(); ++it) {
+        if (out != kvs.begin() && (out - 1)->first == it->first) {
+          *(out - 1) = move(*it);
+        } else {
+          if (out != it)
+            *out = move(*it);
+          ++out;
+        }
+      }
+      kvs.erase(out, kvs.end());
+    }
+    load_sorted(p.first, kvs);
+  }
+  buffered_rows.clear();
+}
+
 static event_avg_counter evt_avg_abort_spins("avg_abort_spins");
 
 void
@@ -235,6 +294,28 @@ bench_runner::run()
   barrier_a.wait_for(); // wait for all threads to start up
   timer t, t_nosync;
   barrier_b.count_down(); // bombs away!
+
+  // compact the tables in the background while the workers run, to give
+  // back the tree nodes left behind by removes
+  atomic<bool> compact_keep_going(true);
+  size_t n_compact_reclaimed = 0;
+  thread compactor;
+  if (compact_interval_ms)
+    compactor = thread([&]() {
+      while (compact_keep_going.load(memory_order_acquire)) {
+        for (map<string, abstract_ordered_index *>::iterator it = open_tables.begin();
+             it != open_tables.end(); ++it) {
+          scoped_rcu_region guard;
+          n_compact_reclaimed += it->second->compact();
+        }
+        for (uint64_t ms = 0;
+             ms < compact_interval_ms &&
+             compact_keep_going.load(memory_order_acquire);
+             ms++)
+          usleep(1000);
+      }
+    });
+
   if (run_mode == RUNMODE_TIME) {
     sleep(runtime);
     running = false;
@@ -242,6 +323,10 @@ bench_runner::run()
   __sync_synchronize();
   for (size_t i = 0; i < nthreads; i++)
     workers[i]->join();
+  if (compactor.joinable()) {
+    compact_keep_going.store(false, memory_order_release);
+    compactor.join();
+  }
   const unsigned long elapsed_nosync = t_nosync.lap();
   db->do_txn_finish(); // waits for all worker txns to persist
   size_t n_commits = 0;
@@ -330,6 +415,8 @@ bench_runner::run()
     cerr << "memory delta rate: " << (delta_mb / elapsed_sec)  << " MB/sec" << endl;
     cerr << "logical memory delta: " << size_delta_mb << " MB" << endl;
     cerr << "logical memory delta rate: " << (size_delta_mb / elapsed_sec) << " MB/sec" << endl;
+    if (compact_interval_ms)
+      cerr << "compaction reclaimed: " << n_compact_reclaimed << " nodes" << endl;
     cerr << "agg_nosync_throughput: " << agg_nosync_throughput << " ops/sec" << endl;
     cerr << "avg_nosync_per_core_throughput: " << avg_nosync_per_core_throughput << " ops/sec/core" << endl;
     cerr << "agg_throughput: " << agg_throughput << " ops/sec" << endl;
@@ -349,6 +436,7 @@ bench_runner::run()
     PERF_EXPR(scopedperf::perfsum_base::printall());
     cerr << "--- allocator stats ---" << endl;
     ::allocator::DumpStats();
+    rcu::s_instance.dump_alloc_stats(cerr);
     cerr << "---------------------------------------" << endl;
 
 #ifdef USE_JEMALLOC
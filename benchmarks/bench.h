@@ -41,6 +41,7 @@ extern int slow_exit;
 extern int retry_aborted_transaction;
 extern int no_reset_counters;
 extern int backoff_aborted_transaction;
+extern uint64_t compact_interval_ms;
 
 class scoped_db_thread_ctx {
 public:
@@ -93,12 +94,44 @@ protected:
 
   virtual void load() = 0;
 
+  // loads kvs (sorted by key, w/o duplicates) into tbl, which must not be
+  // touched by anybody else until this returns. tbl is bulk loaded if it
+  // can be, otherwise the pairs are inserted in batches of transactions
+  void load_sorted(
+      abstract_ordered_index *tbl,
+      const std::vector<std::pair<std::string, std::string>> &kvs);
+
+  // buffers a row of tbl, to be loaded by flush_rows()
+  inline void
+  buffer_row(abstract_ordered_index *tbl,
+             const std::string &key, const std::string &value)
+  {
+    buffered_rows[tbl].emplace_back(key, value);
+  }
+
+  // inserts a row w/ txn, or buffers it if txn is null
+  inline void
+  load_row(void *txn, abstract_ordered_index *tbl,
+           const std::string &key, const std::string &value)
+  {
+    if (txn)
+      tbl->insert(txn, key, value);
+    else
+      buffer_row(tbl, key, value);
+  }
+
+  // load_sorted()s the buffered rows of each table, after sorting them by
+  // key (the last row of a key wins, like w/ insert())
+  void flush_rows();
+
   util::fast_random r;
   abstract_db *const db;
   std::map<std::string, abstract_ordered_index *> open_tables;
   spin_barrier *b;
   std::string txn_obj_buf;
   str_arena arena;
+  std::map<abstract_ordered_index *,
+           std::vector<std::pair<std::string, std::string>>> buffered_rows;
 };
 
 class bench_worker : public ndb_thread {
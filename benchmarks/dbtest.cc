@@ -11,7 +11,9 @@
 #include <unistd.h>
 #include <sys/sysinfo.h>
 
+#include "../abort_profiler.h"
 #include "../allocator.h"
+#include "../rcu.h"
 #include "../stats_server.h"
 #include "bench.h"
 #include "bdb_wrapper.h"
@@ -66,16 +68,26 @@ main(int argc, char **argv)
   string basedir = curdir;
   string bench_opts;
   size_t numa_memory = 0;
+  size_t numa_memory_return_watermark = 0; // 0 means never return memory
+  size_t rcu_pending_watermark = 0; // 0 means no backpressure
   free(curdir);
   int saw_run_spec = 0;
   int nofsync = 0;
   int do_compress = 0;
   int fake_writes = 0;
+  int direct_io = 0;
+  int numa_aware_logging = 0;
+  int op_logging = 0;
   int disable_gc = 0;
+  int gc_threads = 0;
   int disable_snapshots = 0;
+  size_t log_segment_size = 0;
+  uint64_t log_flush_deadline_us = 0;
+  vector<log_codec *> log_codecs;
   vector<string> logfiles;
   vector<vector<unsigned>> assignments;
   string stats_server_sockfile;
+  unsigned abort_profile_sample_shift = 2; // abort_profiler's default
   while (1) {
     static struct option long_options[] =
     {
@@ -95,19 +107,30 @@ main(int argc, char **argv)
       {"ops-per-worker"             , required_argument , 0                          , 'n'} ,
       {"bench-opts"                 , required_argument , 0                          , 'o'} ,
       {"numa-memory"                , required_argument , 0                          , 'm'} , // implies --pin-cpus
+      {"numa-memory-return-watermark", required_argument, 0                          , 'w'} ,
+      {"rcu-pending-watermark"      , required_argument , 0                          , 'k'} ,
       {"logfile"                    , required_argument , 0                          , 'l'} ,
       {"assignment"                 , required_argument , 0                          , 'a'} ,
       {"log-nofsync"                , no_argument       , &nofsync                   , 1}   ,
       {"log-compress"               , no_argument       , &do_compress               , 1}   ,
+      {"log-codec"                  , required_argument , 0                          , 'z'} , // implies --log-compress
       {"log-fake-writes"            , no_argument       , &fake_writes               , 1}   ,
+      {"log-direct-io"              , no_argument       , &direct_io                 , 1}   ,
+      {"log-numa-aware"             , no_argument       , &numa_aware_logging        , 1}   ,
+      {"log-op-logging"             , no_argument       , &op_logging                , 1}   ,
+      {"log-segment-size"           , required_argument , 0                          , 'g'} ,
+      {"log-flush-deadline-us"      , required_argument , 0                          , 'u'} ,
       {"disable-gc"                 , no_argument       , &disable_gc                , 1}   ,
+      {"gc-threads"                 , no_argument       , &gc_threads                , 1}   ,
       {"disable-snapshots"          , no_argument       , &disable_snapshots         , 1}   ,
       {"stats-server-sockfile"      , required_argument , 0                          , 'x'} ,
+      {"abort-profile-sample-shift" , required_argument , 0                          , 'p'} ,
       {"no-reset-counters"          , no_argument       , &no_reset_counters         , 1}   ,
+      {"compact-interval-ms"        , required_argument , 0                          , 'c'} ,
       {0, 0, 0, 0}
     };
     int option_index = 0;
-    int c = getopt_long(argc, argv, "b:s:t:d:B:f:r:n:o:m:l:a:x:", long_options, &option_index);
+    int c = getopt_long(argc, argv, "b:s:t:d:B:f:r:n:o:m:w:k:l:a:x:p:c:g:u:z:", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -172,6 +195,16 @@ main(int argc, char **argv)
       }
       break;
 
+    case 'w':
+      numa_memory_return_watermark = parse_memory_spec(optarg);
+      ALWAYS_ASSERT(numa_memory_return_watermark > 0);
+      break;
+
+    case 'k':
+      rcu_pending_watermark = parse_memory_spec(optarg);
+      ALWAYS_ASSERT(rcu_pending_watermark > 0);
+      break;
+
     case 'l':
       logfiles.emplace_back(optarg);
       break;
@@ -185,6 +218,43 @@ main(int argc, char **argv)
       stats_server_sockfile = optarg;
       break;
 
+    case 'p':
+      abort_profile_sample_shift = strtoul(optarg, NULL, 10);
+      ALWAYS_ASSERT(abort_profile_sample_shift < 64);
+      abort_profiler::SetSampleShift(abort_profile_sample_shift);
+      break;
+
+    case 'c':
+      compact_interval_ms = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'g':
+      log_segment_size = parse_memory_spec(optarg);
+      ALWAYS_ASSERT(log_segment_size > 0);
+      break;
+
+    case 'u':
+      log_flush_deadline_us = strtoul(optarg, NULL, 10);
+      ALWAYS_ASSERT(log_flush_deadline_us > 0);
+      break;
+
+    case 'z':
+      {
+        // one codec for all the loggers, or one per --logfile
+        istringstream iss(optarg);
+        string name;
+        while (getline(iss, name, ',')) {
+          log_codec * const codec = log_codec::Find(name);
+          if (!codec) {
+            cerr << "[ERROR] unknown log codec: " << name << endl;
+            return 1;
+          }
+          log_codecs.push_back(codec);
+        }
+        do_compress = 1;
+      }
+      break;
+
     case '?':
       /* getopt_long already printed an error message. */
       exit(1);
@@ -212,6 +282,11 @@ main(int argc, char **argv)
     return 1;
   }
 
+  if (log_codecs.size() > 1 && log_codecs.size() != logfiles.size()) {
+    cerr << "[ERROR] --log-codec needs one codec, or one per logfile" << endl;
+    return 1;
+  }
+
   if (fake_writes && logfiles.empty()) {
     cerr << "[ERROR] --log-fake-writes specified without logging enabled" << endl;
     return 1;
@@ -222,13 +297,42 @@ main(int argc, char **argv)
     return 1;
   }
 
+  if (log_segment_size && logfiles.empty()) {
+    cerr << "[ERROR] --log-segment-size specified without logging enabled" << endl;
+    return 1;
+  }
+
+  if (log_flush_deadline_us && logfiles.empty()) {
+    cerr << "[ERROR] --log-flush-deadline-us specified without logging enabled" << endl;
+    return 1;
+  }
+
+  if (direct_io && logfiles.empty()) {
+    cerr << "[ERROR] --log-direct-io specified without logging enabled" << endl;
+    return 1;
+  }
+
+  if (numa_aware_logging && logfiles.empty()) {
+    cerr << "[ERROR] --log-numa-aware specified without logging enabled" << endl;
+    return 1;
+  }
+
+  if (op_logging && logfiles.empty()) {
+    cerr << "[ERROR] --log-op-logging specified without logging enabled" << endl;
+    return 1;
+  }
+
+  if (fake_writes && direct_io) {
+    cerr << "[WARNING] --log-direct-io has no effect with --log-fake-writes enabled" << endl;
+  }
+
   if (fake_writes && nofsync) {
     cerr << "[WARNING] --log-nofsync has no effect with --log-fake-writes enabled" << endl;
   }
 
 #ifndef ENABLE_EVENT_COUNTERS
   if (!stats_server_sockfile.empty()) {
-    cerr << "[WARNING] --stats-server-sockfile with no event counters enabled is useless" << endl;
+    cerr << "[WARNING] --stats-server-sockfile with no event counters enabled only serves the abort profile and allocator stats" << endl;
   }
 #endif
 
@@ -238,7 +342,13 @@ main(int argc, char **argv)
         numa_memory / nthreads, ::allocator::GetHugepageSize());
     numa_memory = maxpercpu * nthreads;
     ::allocator::Initialize(nthreads, maxpercpu);
+    if (numa_memory_return_watermark)
+      ::allocator::SetReturnWatermark(numa_memory_return_watermark);
+  } else if (numa_memory_return_watermark) {
+    cerr << "[WARNING] --numa-memory-return-watermark has no effect w/o --numa-memory" << endl;
   }
+  if (rcu_pending_watermark)
+    rcu::SetPendingWatermark(rcu_pending_watermark);
 
   const set<string> can_persist({"ndb-proto2"});
   if (!logfiles.empty() && !can_persist.count(db_type)) {
@@ -261,6 +371,11 @@ main(int argc, char **argv)
   }
 #endif
 
+  if (gc_threads && (disable_gc || db_type != "ndb-proto2")) {
+    cerr << "[ERROR] --gc-threads needs the gc of ndb-proto2" << endl;
+    return 1;
+  }
+
 #ifdef PROTO2_CAN_DISABLE_SNAPSHOTS
   const set<string> has_snapshots({"ndb-proto2"});
   if (disable_snapshots && !has_snapshots.count(db_type)) {
@@ -283,7 +398,9 @@ main(int argc, char **argv)
   } else if (db_type == "ndb-proto1") {
     // XXX: hacky simulation of proto1
     db = new ndb_wrapper<transaction_proto2>(
-        logfiles, assignments, !nofsync, do_compress, fake_writes);
+        logfiles, assignments, !nofsync, do_compress, fake_writes,
+        log_segment_size, log_flush_deadline_us, direct_io, log_codecs,
+        numa_aware_logging, op_logging);
     transaction_proto2_static::set_hack_status(true);
     ALWAYS_ASSERT(transaction_proto2_static::get_hack_status());
 #ifdef PROTO2_CAN_DISABLE_GC
@@ -292,12 +409,16 @@ main(int argc, char **argv)
 #endif
   } else if (db_type == "ndb-proto2") {
     db = new ndb_wrapper<transaction_proto2>(
-        logfiles, assignments, !nofsync, do_compress, fake_writes);
+        logfiles, assignments, !nofsync, do_compress, fake_writes,
+        log_segment_size, log_flush_deadline_us, direct_io, log_codecs,
+        numa_aware_logging, op_logging);
     ALWAYS_ASSERT(!transaction_proto2_static::get_hack_status());
 #ifdef PROTO2_CAN_DISABLE_GC
     if (!disable_gc)
       transaction_proto2_static::InitGC();
 #endif
+    if (gc_threads)
+      transaction_proto2_static::StartGCThreads();
 #ifdef PROTO2_CAN_DISABLE_SNAPSHOTS
     if (disable_snapshots)
       transaction_proto2_static::DisableSnapshots();
@@ -363,18 +484,34 @@ main(int argc, char **argv)
 #endif
     if (numa_memory > 0) {
       cerr << "  numa-memory : " << numa_memory             << endl;
+      cerr << "  numa-memory-return-watermark : " << numa_memory_return_watermark << endl;
     } else {
       cerr << "  numa-memory : disabled"                    << endl;
     }
+    cerr << "  rcu-pending-watermark : " << rcu_pending_watermark << endl;
     cerr << "  logfiles : " << logfiles                     << endl;
     cerr << "  assignments : " << assignments               << endl;
+    cerr << "  log-segment-size : " << log_segment_size     << endl;
+    cerr << "  log-flush-deadline-us : " << log_flush_deadline_us << endl;
+    cerr << "  log-direct-io : " << direct_io               << endl;
+    cerr << "  log-numa-aware : " << numa_aware_logging     << endl;
+    cerr << "  log-op-logging : " << op_logging             << endl;
+    cerr << "  log-codecs :";
+    for (auto c : log_codecs)
+      cerr << " " << c->name();
+    cerr << endl;
     cerr << "  disable-gc : " << disable_gc                 << endl;
+    cerr << "  gc-threads : " << gc_threads                 << endl;
     cerr << "  disable-snapshots : " << disable_snapshots   << endl;
     cerr << "  stats-server-sockfile: " << stats_server_sockfile << endl;
+    cerr << "  abort-profile-sample-shift: " << abort_profile_sample_shift << endl;
+    cerr << "  compact-interval-ms : " << compact_interval_ms << endl;
 
     cerr << "system properties:" << endl;
     cerr << "  btree_internal_node_size: " << concurrent_btree::InternalNodeSize() << endl;
     cerr << "  btree_leaf_node_size    : " << concurrent_btree::LeafNodeSize() << endl;
+    cerr << "  btree_internal_node_keys: " << concurrent_btree::NKeysPerInternalNode << endl;
+    cerr << "  btree_leaf_node_keys    : " << concurrent_btree::NKeysPerLeafNode << endl;
 
 #ifdef TUPLE_PREFETCH
     cerr << "  tuple_prefetch          : yes" << endl;
@@ -388,6 +525,12 @@ main(int argc, char **argv)
     cerr << "  btree_node_prefetch     : no" << endl;
 #endif
 
+#ifdef BTREE_SIMD_KEY_SEARCH
+    cerr << "  btree_node_key_search   : " << BTREE_SIMD_KEY_SEARCH << endl;
+#else
+    cerr << "  btree_node_key_search   : scalar" << endl;
+#endif
+
   }
 
   if (!stats_server_sockfile.empty()) {
@@ -402,6 +545,12 @@ main(int argc, char **argv)
   for (size_t i = 1; i <= bench_toks.size(); i++)
     argv[i] = (char *) bench_toks[i - 1].c_str();
   test_fn(db, argc, argv);
+  if (verbose && gc_threads) {
+    vector<transaction_proto2_static::gc_stats> stats;
+    transaction_proto2_static::GetGCStats(stats);
+    for (auto &s : stats)
+      cerr << s << endl;
+  }
   delete db;
   return 0;
 }
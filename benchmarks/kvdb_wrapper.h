@@ -66,6 +66,8 @@ public:
   insert(void *txn,
          const std::string &key,
          const std::string &value);
+  virtual bool
+  bulk_insert(const std::vector<std::pair<std::string, std::string>> &kvs);
   virtual void scan(
       void *txn,
       const std::string &start_key,
@@ -82,6 +84,11 @@ public:
       void *txn,
       const std::string &key);
   virtual size_t size() const;
+  virtual size_t estimate_range_count(
+      void *txn,
+      const std::string &start_key,
+      const std::string *end_key);
+  virtual size_t compact();
   virtual std::map<std::string, uint64_t> clear();
 private:
   std::string name;
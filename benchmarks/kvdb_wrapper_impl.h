@@ -379,6 +379,25 @@ kvdb_ordered_index<UseConcurrencyControl>::insert(void *txn,
   return 0;
 }
 
+template <bool UseConcurrencyControl>
+bool
+kvdb_ordered_index<UseConcurrencyControl>::bulk_insert(
+    const std::vector<std::pair<std::string, std::string>> &kvs)
+{
+  typedef basic_kvdb_record<UseConcurrencyControl> kvdb_record;
+  if (!btr.empty())
+    return false;
+  scoped_rcu_region guard;
+  std::vector<std::pair<varkey, typename my_btree::value_type>> records;
+  records.reserve(kvs.size());
+  for (auto &kv : kvs)
+    records.emplace_back(
+        varkey(kv.first),
+        (typename my_btree::value_type) kvdb_record::alloc(kv.second));
+  ALWAYS_ASSERT(btr.bulk_load(records.begin(), records.end()));
+  return true;
+}
+
 template <typename Btree, bool UseConcurrencyControl>
 class kvdb_wrapper_search_range_callback : public Btree::search_range_callback {
 public:
@@ -451,7 +470,27 @@ template <bool UseConcurrencyControl>
 size_t
 kvdb_ordered_index<UseConcurrencyControl>::size() const
 {
-  return btr.size();
+  return btr.size_estimate();
+}
+
+template <bool UseConcurrencyControl>
+size_t
+kvdb_ordered_index<UseConcurrencyControl>::estimate_range_count(
+    void *txn,
+    const std::string &start_key,
+    const std::string *end_key)
+{
+  varkey end;
+  if (end_key)
+    end = varkey(*end_key);
+  return btr.estimate_range_count(varkey(start_key), end_key ? &end : nullptr);
+}
+
+template <bool UseConcurrencyControl>
+size_t
+kvdb_ordered_index<UseConcurrencyControl>::compact()
+{
+  return btr.compact();
 }
 
 template <typename Btree, bool UseConcurrencyControl>
@@ -476,7 +515,7 @@ struct purge_tree_walker : public Btree::tree_walk_callback {
         it != purge_stats_nkeys_node.end(); ++it)
       v += *it;
     const double avg_nkeys_node = double(v)/double(purge_stats_nkeys_node.size());
-    const double avg_fill_factor = avg_nkeys_node/double(Btree::NKeysPerNode);
+    const double avg_fill_factor = avg_nkeys_node/double(Btree::NKeysPerLeafNode);
     std::cerr << "btree node stats" << std::endl;
     std::cerr << "    avg_nkeys_node: " << avg_nkeys_node << std::endl;
     std::cerr << "    avg_fill_factor: " << avg_fill_factor << std::endl;
@@ -3,6 +3,7 @@
 
 #include "abstract_db.h"
 #include "../txn_btree.h"
+#include "../log_codec.h"
 
 namespace private_ {
   struct ndbtxn {
@@ -44,7 +45,13 @@ public:
       const std::vector<std::vector<unsigned>> &assignments_given,
       bool call_fsync,
       bool use_compression,
-      bool fake_writes);
+      bool fake_writes,
+      size_t log_segment_size = 0,
+      uint64_t log_flush_deadline_us = 0,
+      bool log_direct_io = false,
+      const std::vector<log_codec *> &log_codecs = {},
+      bool log_numa_aware = false,
+      bool log_op_logging = false);
 
   virtual ssize_t txn_max_batch_size() const OVERRIDE { return 100; }
 
@@ -136,6 +143,8 @@ public:
   insert(void *txn,
          std::string &&key,
          std::string &&value);
+  virtual bool
+  bulk_insert(const std::vector<std::pair<std::string, std::string>> &kvs);
   virtual void scan(
       void *txn,
       const std::string &start_key,
@@ -155,6 +164,11 @@ public:
       void *txn,
       std::string &&key);
   virtual size_t size() const;
+  virtual size_t estimate_range_count(
+      void *txn,
+      const std::string &start_key,
+      const std::string *end_key);
+  virtual size_t compact();
   virtual std::map<std::string, uint64_t> clear();
 private:
   std::string name;
@@ -127,7 +127,13 @@ ndb_wrapper<Transaction>::ndb_wrapper(
     const std::vector<std::vector<unsigned>> &assignments_given,
     bool call_fsync,
     bool use_compression,
-    bool fake_writes)
+    bool fake_writes,
+    size_t log_segment_size,
+    uint64_t log_flush_deadline_us,
+    bool log_direct_io,
+    const std::vector<log_codec *> &log_codecs,
+    bool log_numa_aware,
+    bool log_op_logging)
 {
   if (logfiles.empty())
     return;
@@ -136,13 +142,32 @@ ndb_wrapper<Transaction>::ndb_wrapper(
       nthreads, logfiles, assignments_given, &assignments_used,
       call_fsync,
       use_compression,
-      fake_writes);
+      fake_writes,
+      log_segment_size,
+      log_flush_deadline_us,
+      log_direct_io,
+      log_codecs,
+      log_numa_aware,
+      log_op_logging);
   if (verbose) {
     std::cerr << "[logging subsystem]" << std::endl;
     std::cerr << "  assignments: " << assignments_used << std::endl;
     std::cerr << "  call fsync : " << call_fsync       << std::endl;
     std::cerr << "  compression: " << use_compression  << std::endl;
     std::cerr << "  fake_writes: " << fake_writes      << std::endl;
+    std::cerr << "  segment size: " << log_segment_size << std::endl;
+    std::cerr << "  flush deadline us: " << log_flush_deadline_us << std::endl;
+    std::cerr << "  direct io: " << log_direct_io << std::endl;
+    std::cerr << "  numa aware: " << log_numa_aware << std::endl;
+    std::cerr << "  op logging: " << log_op_logging << std::endl;
+    if (use_compression) {
+      std::cerr << "  codecs:";
+      if (log_codecs.empty())
+        std::cerr << " " << log_codec::Get(log_codec::CODEC_LZ4)->name();
+      for (auto c : log_codecs)
+        std::cerr << " " << c->name();
+      std::cerr << std::endl;
+    }
   }
 }
 
@@ -451,6 +476,14 @@ ndb_ordered_index<Transaction>::insert(
   return 0;
 }
 
+template <template <typename> class Transaction>
+bool
+ndb_ordered_index<Transaction>::bulk_insert(
+    const std::vector<std::pair<std::string, std::string>> &kvs)
+{
+  return btr.bulk_load(kvs.begin(), kvs.end());
+}
+
 template <template <typename> class Transaction>
 class ndb_wrapper_search_range_callback : public txn_btree<Transaction>::search_range_callback {
 public:
@@ -587,6 +620,23 @@ ndb_ordered_index<Transaction>::size() const
   return btr.size_estimate();
 }
 
+template <template <typename> class Transaction>
+size_t
+ndb_ordered_index<Transaction>::estimate_range_count(
+    void *txn,
+    const std::string &start_key,
+    const std::string *end_key)
+{
+  return btr.estimate_range_count(start_key, end_key);
+}
+
+template <template <typename> class Transaction>
+size_t
+ndb_ordered_index<Transaction>::compact()
+{
+  return btr.compact();
+}
+
 template <template <typename> class Transaction>
 std::map<std::string, uint64_t>
 ndb_ordered_index<Transaction>::clear()
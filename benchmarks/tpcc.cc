@@ -322,6 +322,28 @@ protected: \
     rcu::s_instance.fault_region();
   }
 
+  // true if every warehouse has its own tree for each (non read-only) table,
+  // in which case the loader for a warehouse is the only one touching them
+  // and can bulk load them
+  static inline bool
+  HasPerWarehouseTables()
+  {
+    return g_enable_separate_tree_per_partition && NumWarehouses() <= nthreads;
+  }
+
+  // true if the loader of warehouse_id (-1 for the loader of all of them)
+  // can buffer its rows and bulk load them (see bench_loader::flush_rows()):
+  // it must be the only one writing its trees, and when it pins itself to
+  // each warehouse in turn, the rows of a tree must all come from one
+  // warehouse so they get allocated while pinned to it (see
+  // PinToWarehouseId()). w/ shared trees, the loader buffers the whole
+  // table before loading it
+  static inline bool
+  CanBulkLoad(ssize_t warehouse_id)
+  {
+    return HasPerWarehouseTables() || (warehouse_id == -1 && !pin_cpus);
+  }
+
 public:
 
   static inline uint32_t
@@ -647,41 +669,41 @@ protected:
   load()
   {
     string obj_buf;
-    void *txn = db->new_txn(txn_flags, arena, txn_buf());
     uint64_t warehouse_total_sz = 0, n_warehouses = 0;
-    try {
-      vector<warehouse::value> warehouses;
-      for (uint i = 1; i <= NumWarehouses(); i++) {
-        const warehouse::key k(i);
+    // the only loader of the warehouse trees, so it can bulk load them
+    vector<warehouse::value> warehouses;
+    for (uint i = 1; i <= NumWarehouses(); i++) {
+      const warehouse::key k(i);
+
+      const string w_name = RandomStr(r, RandomNumber(r, 6, 10));
+      const string w_street_1 = RandomStr(r, RandomNumber(r, 10, 20));
+      const string w_street_2 = RandomStr(r, RandomNumber(r, 10, 20));
+      const string w_city = RandomStr(r, RandomNumber(r, 10, 20));
+      const string w_state = RandomStr(r, 3);
+      const string w_zip = "123456789";
+
+      warehouse::value v;
+      v.w_ytd = 300000;
+      v.w_tax = (float) RandomNumber(r, 0, 2000) / 10000.0;
+      v.w_name.assign(w_name);
+      v.w_street_1.assign(w_street_1);
+      v.w_street_2.assign(w_street_2);
+      v.w_city.assign(w_city);
+      v.w_state.assign(w_state);
+      v.w_zip.assign(w_zip);
+
+      checker::SanityCheckWarehouse(&k, &v);
+      const size_t sz = Size(v);
+      warehouse_total_sz += sz;
+      n_warehouses++;
+      buffer_row(tbl_warehouse(i), Encode(k), Encode(obj_buf, v));
+
+      warehouses.push_back(v);
+    }
+    flush_rows();
 
-        const string w_name = RandomStr(r, RandomNumber(r, 6, 10));
-        const string w_street_1 = RandomStr(r, RandomNumber(r, 10, 20));
-        const string w_street_2 = RandomStr(r, RandomNumber(r, 10, 20));
-        const string w_city = RandomStr(r, RandomNumber(r, 10, 20));
-        const string w_state = RandomStr(r, 3);
-        const string w_zip = "123456789";
-
-        warehouse::value v;
-        v.w_ytd = 300000;
-        v.w_tax = (float) RandomNumber(r, 0, 2000) / 10000.0;
-        v.w_name.assign(w_name);
-        v.w_street_1.assign(w_street_1);
-        v.w_street_2.assign(w_street_2);
-        v.w_city.assign(w_city);
-        v.w_state.assign(w_state);
-        v.w_zip.assign(w_zip);
-
-        checker::SanityCheckWarehouse(&k, &v);
-        const size_t sz = Size(v);
-        warehouse_total_sz += sz;
-        n_warehouses++;
-        tbl_warehouse(i)->insert(txn, Encode(k), Encode(obj_buf, v));
-
-        warehouses.push_back(v);
-      }
-      ALWAYS_ASSERT(db->commit_txn(txn));
-      arena.reset();
-      txn = db->new_txn(txn_flags, arena, txn_buf());
+    void * const txn = db->new_txn(txn_flags, arena, txn_buf());
+    try {
       for (uint i = 1; i <= NumWarehouses(); i++) {
         const warehouse::key k(i);
         string warehouse_v;
@@ -720,45 +742,33 @@ protected:
   load()
   {
     string obj_buf;
-    const ssize_t bsize = db->txn_max_batch_size();
-    void *txn = db->new_txn(txn_flags, arena, txn_buf());
     uint64_t total_sz = 0;
-    try {
-      for (uint i = 1; i <= NumItems(); i++) {
-        // items don't "belong" to a certain warehouse, so no pinning
-        const item::key k(i);
-
-        item::value v;
-        const string i_name = RandomStr(r, RandomNumber(r, 14, 24));
-        v.i_name.assign(i_name);
-        v.i_price = (float) RandomNumber(r, 100, 10000) / 100.0;
-        const int len = RandomNumber(r, 26, 50);
-        if (RandomNumber(r, 1, 100) > 10) {
-          const string i_data = RandomStr(r, len);
-          v.i_data.assign(i_data);
-        } else {
-          const int startOriginal = RandomNumber(r, 2, (len - 8));
-          const string i_data = RandomStr(r, startOriginal + 1) + "ORIGINAL" + RandomStr(r, len - startOriginal - 7);
-          v.i_data.assign(i_data);
-        }
-        v.i_im_id = RandomNumber(r, 1, 10000);
-
-        checker::SanityCheckItem(&k, &v);
-        const size_t sz = Size(v);
-        total_sz += sz;
-        tbl_item(1)->insert(txn, Encode(k), Encode(obj_buf, v)); // this table is shared, so any partition is OK
-
-        if (bsize != -1 && !(i % bsize)) {
-          ALWAYS_ASSERT(db->commit_txn(txn));
-          txn = db->new_txn(txn_flags, arena, txn_buf());
-          arena.reset();
-        }
+    // the only loader of the item tree, so it can bulk load it
+    for (uint i = 1; i <= NumItems(); i++) {
+      // items don't "belong" to a certain warehouse, so no pinning
+      const item::key k(i);
+
+      item::value v;
+      const string i_name = RandomStr(r, RandomNumber(r, 14, 24));
+      v.i_name.assign(i_name);
+      v.i_price = (float) RandomNumber(r, 100, 10000) / 100.0;
+      const int len = RandomNumber(r, 26, 50);
+      if (RandomNumber(r, 1, 100) > 10) {
+        const string i_data = RandomStr(r, len);
+        v.i_data.assign(i_data);
+      } else {
+        const int startOriginal = RandomNumber(r, 2, (len - 8));
+        const string i_data = RandomStr(r, startOriginal + 1) + "ORIGINAL" + RandomStr(r, len - startOriginal - 7);
+        v.i_data.assign(i_data);
       }
-      ALWAYS_ASSERT(db->commit_txn(txn));
-    } catch (abstract_db::abstract_abort_exception &ex) {
-      // shouldn't abort on loading!
-      ALWAYS_ASSERT(false);
+      v.i_im_id = RandomNumber(r, 1, 10000);
+
+      checker::SanityCheckItem(&k, &v);
+      const size_t sz = Size(v);
+      total_sz += sz;
+      buffer_row(tbl_item(1), Encode(k), Encode(obj_buf, v)); // this table is shared, so any partition is OK
     }
+    flush_rows();
     if (verbose) {
       cerr << "[INFO] finished loading item" << endl;
       cerr << "[INFO]   * average item record length: "
@@ -803,6 +813,24 @@ protected:
       if (pin_cpus)
         PinToWarehouseId(w);
 
+      if (CanBulkLoad(warehouse_id)) {
+        for (uint i = 1; i <= NumItems(); i++) {
+          const stock::key k(w, i);
+          const stock_data::key k_data(w, i);
+          stock::value v;
+          stock_data::value v_data;
+          make_stock(v, v_data);
+          checker::SanityCheckStock(&k, &v);
+          stock_total_sz += Size(v);
+          n_stocks++;
+          buffer_row(tbl_stock(w), Encode(k), Encode(obj_buf, v));
+          buffer_row(tbl_stock_data(w), Encode(k_data), Encode(obj_buf1, v_data));
+        }
+        if (HasPerWarehouseTables())
+          flush_rows();
+        continue;
+      }
+
       for (uint b = 0; b < nbatches;) {
         scoped_str_arena s_arena(arena);
         void * const txn = db->new_txn(txn_flags, arena, txn_buf());
@@ -813,31 +841,8 @@ protected:
             const stock_data::key k_data(w, i);
 
             stock::value v;
-            v.s_quantity = RandomNumber(r, 10, 100);
-            v.s_ytd = 0;
-            v.s_order_cnt = 0;
-            v.s_remote_cnt = 0;
-
             stock_data::value v_data;
-            const int len = RandomNumber(r, 26, 50);
-            if (RandomNumber(r, 1, 100) > 10) {
-              const string s_data = RandomStr(r, len);
-              v_data.s_data.assign(s_data);
-            } else {
-              const int startOriginal = RandomNumber(r, 2, (len - 8));
-              const string s_data = RandomStr(r, startOriginal + 1) + "ORIGINAL" + RandomStr(r, len - startOriginal - 7);
-              v_data.s_data.assign(s_data);
-            }
-            v_data.s_dist_01.assign(RandomStr(r, 24));
-            v_data.s_dist_02.assign(RandomStr(r, 24));
-            v_data.s_dist_03.assign(RandomStr(r, 24));
-            v_data.s_dist_04.assign(RandomStr(r, 24));
-            v_data.s_dist_05.assign(RandomStr(r, 24));
-            v_data.s_dist_06.assign(RandomStr(r, 24));
-            v_data.s_dist_07.assign(RandomStr(r, 24));
-            v_data.s_dist_08.assign(RandomStr(r, 24));
-            v_data.s_dist_09.assign(RandomStr(r, 24));
-            v_data.s_dist_10.assign(RandomStr(r, 24));
+            make_stock(v, v_data);
 
             checker::SanityCheckStock(&k, &v);
             const size_t sz = Size(v);
@@ -861,6 +866,7 @@ protected:
         }
       }
     }
+    flush_rows();
 
     if (verbose) {
       if (warehouse_id == -1) {
@@ -874,6 +880,35 @@ protected:
   }
 
 private:
+  void
+  make_stock(stock::value &v, stock_data::value &v_data)
+  {
+    v.s_quantity = RandomNumber(r, 10, 100);
+    v.s_ytd = 0;
+    v.s_order_cnt = 0;
+    v.s_remote_cnt = 0;
+
+    const int len = RandomNumber(r, 26, 50);
+    if (RandomNumber(r, 1, 100) > 10) {
+      const string s_data = RandomStr(r, len);
+      v_data.s_data.assign(s_data);
+    } else {
+      const int startOriginal = RandomNumber(r, 2, (len - 8));
+      const string s_data = RandomStr(r, startOriginal + 1) + "ORIGINAL" + RandomStr(r, len - startOriginal - 7);
+      v_data.s_data.assign(s_data);
+    }
+    v_data.s_dist_01.assign(RandomStr(r, 24));
+    v_data.s_dist_02.assign(RandomStr(r, 24));
+    v_data.s_dist_03.assign(RandomStr(r, 24));
+    v_data.s_dist_04.assign(RandomStr(r, 24));
+    v_data.s_dist_05.assign(RandomStr(r, 24));
+    v_data.s_dist_06.assign(RandomStr(r, 24));
+    v_data.s_dist_07.assign(RandomStr(r, 24));
+    v_data.s_dist_08.assign(RandomStr(r, 24));
+    v_data.s_dist_09.assign(RandomStr(r, 24));
+    v_data.s_dist_10.assign(RandomStr(r, 24));
+  }
+
   ssize_t warehouse_id;
 };
 
@@ -893,15 +928,16 @@ protected:
   {
     string obj_buf;
 
-    const ssize_t bsize = db->txn_max_batch_size();
-    void *txn = db->new_txn(txn_flags, arena, txn_buf());
     uint64_t district_total_sz = 0, n_districts = 0;
-    try {
-      uint cnt = 0;
-      for (uint w = 1; w <= NumWarehouses(); w++) {
-        if (pin_cpus)
-          PinToWarehouseId(w);
-        for (uint d = 1; d <= NumDistrictsPerWarehouse(); d++, cnt++) {
+    // the only loader of the district trees
+    for (uint w = 1; w <= NumWarehouses(); w++) {
+      if (pin_cpus)
+        PinToWarehouseId(w);
+      scoped_str_arena s_arena(arena);
+      void * const txn = CanBulkLoad(-1) ?
+        nullptr : db->new_txn(txn_flags, arena, txn_buf());
+      try {
+        for (uint d = 1; d <= NumDistrictsPerWarehouse(); d++) {
           const district::key k(w, d);
 
           district::value v;
@@ -919,20 +955,18 @@ protected:
           const size_t sz = Size(v);
           district_total_sz += sz;
           n_districts++;
-          tbl_district(w)->insert(txn, Encode(k), Encode(obj_buf, v));
-
-          if (bsize != -1 && !((cnt + 1) % bsize)) {
-            ALWAYS_ASSERT(db->commit_txn(txn));
-            txn = db->new_txn(txn_flags, arena, txn_buf());
-            arena.reset();
-          }
+          load_row(txn, tbl_district(w), Encode(k), Encode(obj_buf, v));
         }
+        if (txn)
+          ALWAYS_ASSERT(db->commit_txn(txn));
+      } catch (abstract_db::abstract_abort_exception &ex) {
+        // shouldn't abort on loading!
+        ALWAYS_ASSERT(false);
       }
-      ALWAYS_ASSERT(db->commit_txn(txn));
-    } catch (abstract_db::abstract_abort_exception &ex) {
-      // shouldn't abort on loading!
-      ALWAYS_ASSERT(false);
+      if (HasPerWarehouseTables())
+        flush_rows();
     }
+    flush_rows();
     if (verbose) {
       cerr << "[INFO] finished loading district" << endl;
       cerr << "[INFO]   * average district record length: "
@@ -974,6 +1008,7 @@ protected:
       (batchsize > NumCustomersPerDistrict()) ?
         1 : (NumCustomersPerDistrict() / batchsize);
     cerr << "num batches: " << nbatches << endl;
+    const bool bulk = CanBulkLoad(warehouse_id);
 
     uint64_t total_sz = 0;
 
@@ -983,7 +1018,8 @@ protected:
       for (uint d = 1; d <= NumDistrictsPerWarehouse(); d++) {
         for (uint batch = 0; batch < nbatches;) {
           scoped_str_arena s_arena(arena);
-          void * const txn = db->new_txn(txn_flags, arena, txn_buf());
+          void * const txn = bulk ?
+            nullptr : db->new_txn(txn_flags, arena, txn_buf());
           const size_t cstart = batch * batchsize;
           const size_t cend = std::min((batch + 1) * batchsize, NumCustomersPerDistrict());
           try {
@@ -1024,7 +1060,7 @@ protected:
               checker::SanityCheckCustomer(&k, &v);
               const size_t sz = Size(v);
               total_sz += sz;
-              tbl_customer(w)->insert(txn, Encode(k), Encode(obj_buf, v));
+              load_row(txn, tbl_customer(w), Encode(k), Encode(obj_buf, v));
 
               // customer name index
               const customer_name_idx::key k_idx(k.c_w_id, k.c_d_id, v.c_last.str(true), v.c_first.str(true));
@@ -1033,7 +1069,7 @@ protected:
               // index structure is:
               // (c_w_id, c_d_id, c_last, c_first) -> (c_id)
 
-              tbl_customer_name_idx(w)->insert(txn, Encode(k_idx), Encode(obj_buf, v_idx));
+              load_row(txn, tbl_customer_name_idx(w), Encode(k_idx), Encode(obj_buf, v_idx));
 
               history::key k_hist;
               k_hist.h_c_id = c;
@@ -1047,9 +1083,9 @@ protected:
               v_hist.h_amount = 10;
               v_hist.h_data.assign(RandomStr(r, RandomNumber(r, 10, 24)));
 
-              tbl_history(w)->insert(txn, Encode(k_hist), Encode(obj_buf, v_hist));
+              load_row(txn, tbl_history(w), Encode(k_hist), Encode(obj_buf, v_hist));
             }
-            if (db->commit_txn(txn)) {
+            if (!txn || db->commit_txn(txn)) {
               batch++;
             } else {
               db->abort_txn(txn);
@@ -1063,7 +1099,10 @@ protected:
           }
         }
       }
+      if (bulk && HasPerWarehouseTables())
+        flush_rows();
     }
+    flush_rows();
 
     if (verbose) {
       if (warehouse_id == -1) {
@@ -1111,6 +1150,7 @@ protected:
       1 : static_cast<uint>(warehouse_id);
     const uint w_end   = (warehouse_id == -1) ?
       NumWarehouses() : static_cast<uint>(warehouse_id);
+    const bool bulk = CanBulkLoad(warehouse_id);
 
     for (uint w = w_start; w <= w_end; w++) {
       if (pin_cpus)
@@ -1127,7 +1167,8 @@ protected:
         }
         for (uint c = 1; c <= NumCustomersPerDistrict();) {
           scoped_str_arena s_arena(arena);
-          void * const txn = db->new_txn(txn_flags, arena, txn_buf());
+          void * const txn = bulk ?
+            nullptr : db->new_txn(txn_flags, arena, txn_buf());
           try {
             const oorder::key k_oo(w, d, c);
 
@@ -1145,12 +1186,12 @@ protected:
             const size_t sz = Size(v_oo);
             oorder_total_sz += sz;
             n_oorders++;
-            tbl_oorder(w)->insert(txn, Encode(k_oo), Encode(obj_buf, v_oo));
+            load_row(txn, tbl_oorder(w), Encode(k_oo), Encode(obj_buf, v_oo));
 
             const oorder_c_id_idx::key k_oo_idx(k_oo.o_w_id, k_oo.o_d_id, v_oo.o_c_id, k_oo.o_id);
             const oorder_c_id_idx::value v_oo_idx(0);
 
-            tbl_oorder_c_id_idx(w)->insert(txn, Encode(k_oo_idx), Encode(obj_buf, v_oo_idx));
+            load_row(txn, tbl_oorder_c_id_idx(w), Encode(k_oo_idx), Encode(obj_buf, v_oo_idx));
 
             if (c >= 2101) {
               const new_order::key k_no(w, d, c);
@@ -1160,7 +1201,7 @@ protected:
               const size_t sz = Size(v_no);
               new_order_total_sz += sz;
               n_new_orders++;
-              tbl_new_order(w)->insert(txn, Encode(k_no), Encode(obj_buf, v_no));
+              load_row(txn, tbl_new_order(w), Encode(k_no), Encode(obj_buf, v_no));
             }
 
             for (uint l = 1; l <= uint(v_oo.o_ol_cnt); l++) {
@@ -1186,9 +1227,9 @@ protected:
               const size_t sz = Size(v_ol);
               order_line_total_sz += sz;
               n_order_lines++;
-              tbl_order_line(w)->insert(txn, Encode(k_ol), Encode(obj_buf, v_ol));
+              load_row(txn, tbl_order_line(w), Encode(k_ol), Encode(obj_buf, v_ol));
             }
-            if (db->commit_txn(txn)) {
+            if (!txn || db->commit_txn(txn)) {
               c++;
             } else {
               db->abort_txn(txn);
@@ -1204,7 +1245,10 @@ protected:
           }
         }
       }
+      if (bulk && HasPerWarehouseTables())
+        flush_rows();
     }
+    flush_rows();
 
     if (verbose) {
       if (warehouse_id == -1) {
@@ -279,6 +279,20 @@ protected:
   {
     abstract_ordered_index *tbl = open_tables.at("USERTABLE");
     const size_t nkeysperthd = nkeys / nthreads;
+    if (!pin_cpus) {
+      // no per-cpu memory regions to spread the records over, so load the
+      // whole table at once (u64_varkey()s sort in key id order). the same
+      // keys as the per-thread ranges below, which leave out the remainder
+      const size_t nloaded = nkeysperthd * nthreads;
+      vector<pair<string, string>> kvs;
+      kvs.reserve(nloaded);
+      for (size_t i = 0; i < nloaded; i++)
+        kvs.emplace_back(u64_varkey(i).str(), string(YCSBRecordSize, 'a'));
+      load_sorted(tbl, kvs);
+      if (verbose)
+        cerr << "[INFO] finished loading USERTABLE - nkeys: " << nloaded << endl;
+      return;
+    }
     for (size_t i = 0; i < nthreads; i++) {
       const size_t keystart = i * nkeysperthd;
       const size_t keyend = min((i + 1) * nkeysperthd, nkeys);
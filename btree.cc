@@ -23,7 +23,6 @@ struct testing_concurrent_btree_traits : public masstree_params {
   static const bool RcuRespCaller = false;
 };
 typedef mbtree<testing_concurrent_btree_traits> testing_concurrent_btree;
-#define HAVE_REVERSE_RANGE_SCANS
 #else
 struct testing_concurrent_btree_traits : public concurrent_btree_traits {
   static const bool RcuRespCaller = false;
@@ -31,28 +30,11 @@ struct testing_concurrent_btree_traits : public concurrent_btree_traits {
 typedef btree<testing_concurrent_btree_traits> testing_concurrent_btree;
 #endif
 
+#define HAVE_REVERSE_RANGE_SCANS
+
 using namespace std;
 using namespace util;
 
-class scoped_rate_timer {
-private:
-  util::timer t;
-  string region;
-  size_t n;
-
-public:
-  scoped_rate_timer(const string &region, size_t n) : region(region), n(n)
-  {}
-
-  ~scoped_rate_timer()
-  {
-    double x = t.lap() / 1000.0; // ms
-    double rate = double(n) / (x / 1000.0);
-    cerr << "timed region `" << region << "' took " << x
-              << " ms (" << rate << " events/sec)" << endl;
-  }
-};
-
 class btree_worker : public ndb_thread {
 public:
   btree_worker(testing_concurrent_btree *btr) : btr(btr)  {}
@@ -68,7 +50,7 @@ test1()
   btr.invariant_checker();
 
   // fill up root leaf node
-  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerNode; i++) {
+  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerLeafNode; i++) {
     btr.insert(u64_varkey(i), (typename testing_concurrent_btree::value_type) i);
     btr.invariant_checker();
 
@@ -76,23 +58,23 @@ test1()
     ALWAYS_ASSERT(btr.search(u64_varkey(i), v));
     ALWAYS_ASSERT(v == (typename testing_concurrent_btree::value_type) i);
   }
-  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerNode);
+  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerLeafNode);
 
   // induce a split
-  btr.insert(u64_varkey(testing_concurrent_btree::NKeysPerNode), (typename testing_concurrent_btree::value_type) (testing_concurrent_btree::NKeysPerNode));
+  btr.insert(u64_varkey(testing_concurrent_btree::NKeysPerLeafNode), (typename testing_concurrent_btree::value_type) (testing_concurrent_btree::NKeysPerLeafNode));
   btr.invariant_checker();
-  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerNode + 1);
+  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerLeafNode + 1);
 
   // now make sure we can find everything post split
-  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerNode + 1; i++) {
+  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerLeafNode + 1; i++) {
     typename testing_concurrent_btree::value_type v = 0;
     ALWAYS_ASSERT(btr.search(u64_varkey(i), v));
     ALWAYS_ASSERT(v == (typename testing_concurrent_btree::value_type) i);
   }
 
   // now fill up the new root node
-  const size_t n = (testing_concurrent_btree::NKeysPerNode + testing_concurrent_btree::NKeysPerNode * (testing_concurrent_btree::NMinKeysPerNode));
-  for (size_t i = testing_concurrent_btree::NKeysPerNode + 1; i < n; i++) {
+  const size_t n = (testing_concurrent_btree::NKeysPerLeafNode + testing_concurrent_btree::NKeysPerLeafNode * (testing_concurrent_btree::NMinKeysPerLeafNode));
+  for (size_t i = testing_concurrent_btree::NKeysPerLeafNode + 1; i < n; i++) {
     btr.insert(u64_varkey(i), (typename testing_concurrent_btree::value_type) i);
     btr.invariant_checker();
 
@@ -146,7 +128,7 @@ test3()
 {
   testing_concurrent_btree btr;
 
-  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerNode * 2; i++) {
+  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerLeafNode * 2; i++) {
     btr.insert(u64_varkey(i), (typename testing_concurrent_btree::value_type) i);
     btr.invariant_checker();
 
@@ -154,9 +136,9 @@ test3()
     ALWAYS_ASSERT(btr.search(u64_varkey(i), v));
     ALWAYS_ASSERT(v == (typename testing_concurrent_btree::value_type) i);
   }
-  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerNode * 2);
+  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerLeafNode * 2);
 
-  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerNode * 2; i++) {
+  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerLeafNode * 2; i++) {
     btr.remove(u64_varkey(i));
     btr.invariant_checker();
 
@@ -165,7 +147,7 @@ test3()
   }
   ALWAYS_ASSERT(btr.size() == 0);
 
-  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerNode * 2; i++) {
+  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerLeafNode * 2; i++) {
     btr.insert(u64_varkey(i), (typename testing_concurrent_btree::value_type) i);
     btr.invariant_checker();
 
@@ -173,9 +155,9 @@ test3()
     ALWAYS_ASSERT(btr.search(u64_varkey(i), v));
     ALWAYS_ASSERT(v == (typename testing_concurrent_btree::value_type) i);
   }
-  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerNode * 2);
+  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerLeafNode * 2);
 
-  for (ssize_t i = testing_concurrent_btree::NKeysPerNode * 2 - 1; i >= 0; i--) {
+  for (ssize_t i = testing_concurrent_btree::NKeysPerLeafNode * 2 - 1; i >= 0; i--) {
     btr.remove(u64_varkey(i));
     btr.invariant_checker();
 
@@ -184,7 +166,7 @@ test3()
   }
   ALWAYS_ASSERT(btr.size() == 0);
 
-  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerNode * 2; i++) {
+  for (size_t i = 0; i < testing_concurrent_btree::NKeysPerLeafNode * 2; i++) {
     btr.insert(u64_varkey(i), (typename testing_concurrent_btree::value_type) i);
     btr.invariant_checker();
 
@@ -192,9 +174,9 @@ test3()
     ALWAYS_ASSERT(btr.search(u64_varkey(i), v));
     ALWAYS_ASSERT(v == (typename testing_concurrent_btree::value_type) i);
   }
-  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerNode * 2);
+  ALWAYS_ASSERT(btr.size() == testing_concurrent_btree::NKeysPerLeafNode * 2);
 
-  for (ssize_t i = testing_concurrent_btree::NKeysPerNode; i >= 0; i--) {
+  for (ssize_t i = testing_concurrent_btree::NKeysPerLeafNode; i >= 0; i--) {
     btr.remove(u64_varkey(i));
     btr.invariant_checker();
 
@@ -202,7 +184,7 @@ test3()
     ALWAYS_ASSERT(!btr.search(u64_varkey(i), v));
   }
 
-  for (size_t i = testing_concurrent_btree::NKeysPerNode + 1; i < testing_concurrent_btree::NKeysPerNode * 2; i++) {
+  for (size_t i = testing_concurrent_btree::NKeysPerLeafNode + 1; i < testing_concurrent_btree::NKeysPerLeafNode * 2; i++) {
     btr.remove(u64_varkey(i));
     btr.invariant_checker();
 
@@ -455,6 +437,55 @@ test_varlen_multi_layer()
   ALWAYS_ASSERT(btr.size() == 0);
 }
 
+static void
+test_long_key_suffixes()
+{
+  typedef typename testing_concurrent_btree::value_type value_type;
+
+  // every slice holds at most one key, so all the keys live in one layer
+  // with their suffixes in the leaves. the suffixes keep getting replaced
+  // by ones of other lengths, and move between leaves on splits and merges
+  testing_concurrent_btree btr;
+  map<string, value_type> m;
+  fast_random r(2837463);
+  const size_t nslices = 64;
+  for (size_t round = 0; round < 200; round++) {
+    for (size_t i = 0; i < nslices; i++) {
+      const string slice = u64_varkey(i).str();
+      auto it = m.lower_bound(slice);
+      if (it != m.end() && it->first.compare(0, 8, slice) == 0) {
+        ALWAYS_ASSERT(btr.remove(varkey(it->first)));
+        m.erase(it);
+      }
+      if (!(r.next() % 4))
+        continue;
+      const string k = slice + string(1 + r.next() % 100, 'a' + (round % 26));
+      const value_type v = (value_type) (round * nslices + i + 1);
+      ALWAYS_ASSERT(btr.insert(varkey(k), v));
+      m[k] = v;
+    }
+    btr.invariant_checker();
+    ALWAYS_ASSERT(btr.size() == m.size());
+  }
+
+  for (auto &p : m) {
+    value_type v = 0;
+    ALWAYS_ASSERT(btr.search(varkey(p.first), v));
+    ALWAYS_ASSERT(v == p.second);
+    ALWAYS_ASSERT(!btr.search(varkey(p.first + "a"), v));
+    ALWAYS_ASSERT(!btr.search(varkey(p.first.substr(0, p.first.size() - 1)), v));
+  }
+  test6_ns::scan_callback::kv_vec data;
+  test6_ns::scan_callback cb(&data);
+  btr.search_range(varkey(""), NULL, cb);
+  ALWAYS_ASSERT(data.size() == m.size());
+  size_t i = 0;
+  for (auto &p : m) {
+    ALWAYS_ASSERT(data[i].first == p.first);
+    ALWAYS_ASSERT(data[i++].second == p.second);
+  }
+}
+
 static void
 test_two_layer()
 {
@@ -759,6 +790,39 @@ test_null_keys_2()
   ALWAYS_ASSERT(btr.size() == 0);
 }
 
+// checks the node key slice search primitives against the scalar versions
+static void
+test_key_slice_search()
+{
+#ifdef BTREE_SIMD_KEY_SEARCH
+  fast_random r(2390491283);
+  const size_t nslots = concurrent_btree::NKeysPerNode;
+  uint64_t keys[nslots];
+  for (size_t i = 0; i < 10000; i++) {
+    const size_t n = r.next() % (nslots + 1);
+    // mix small slices (lots of duplicates) with ones that have the high
+    // bit set, to exercise the unsigned compares
+    for (size_t j = 0; j < n; j++)
+      keys[j] = (i % 2) ? r.next() % 8 : r.next();
+    sort(&keys[0], &keys[n]);
+    for (size_t j = 0; j < 32; j++) {
+      uint64_t k;
+      switch (j % 4) {
+      case 0: k = n ? keys[r.next() % n] : 0; break;
+      case 1: k = n ? keys[r.next() % n] + 1 : 1; break;
+      case 2: k = n ? keys[r.next() % n] - 1 : numeric_limits<uint64_t>::max(); break;
+      default: k = (i % 2) ? r.next() % 8 : r.next(); break;
+      }
+      ALWAYS_ASSERT(private_::simd_count_slices_lt(keys, n, k) ==
+                    private_::scalar_count_slices_lt(keys, n, k));
+      ALWAYS_ASSERT(private_::simd_count_slices_le(keys, n, k) ==
+                    private_::scalar_count_slices_le(keys, n, k));
+    }
+  }
+  cout << "test_key_slice_search (" << BTREE_SIMD_KEY_SEARCH << ") passed" << endl;
+#endif
+}
+
 static inline string
 maxkey(unsigned size)
 {
@@ -804,6 +868,23 @@ test_random_keys()
   const string mkey = maxkey(maxkeylen);
   test_range_scan_helper tester_rev(btr, varkey(mkey), NULL, true, ex);
   tester_rev.test();
+
+  // bounded reverse scans (lower, upper], where the bounds are either
+  // existing keys or random strings
+  for (size_t i = 0; i < 1000; i++) {
+    const string upper = (i % 2) ?
+      keys[r.next() % nkeys] : r.next_readable_string(r.next() % (maxkeylen + 1));
+    const string lower = (i % 3) ?
+      keys[r.next() % nkeys] : r.next_readable_string(r.next() % (maxkeylen + 1));
+    if (upper <= lower)
+      continue;
+    const set<string> range_keys(
+        keyset.upper_bound(lower), keyset.upper_bound(upper));
+    const varkey lowervk(lower);
+    test_range_scan_helper::expect range_ex(range_keys);
+    test_range_scan_helper tester_range(btr, varkey(upper), &lowervk, true, range_ex);
+    tester_range.test();
+  }
 #endif
 
   for (size_t i = 0; i < nkeys; i++) {
@@ -855,6 +936,684 @@ test_insert_remove_mix()
   ALWAYS_ASSERT(btr.size() == insert_keys.size());
 }
 
+static void
+test_multi_search()
+{
+  testing_concurrent_btree btr;
+  fast_random r(83205914);
+
+  // a mix of 8-byte keys and longer ones, so some of the descents
+  // go through multiple layers
+  const size_t nkeys = 10000;
+  map<string, typename testing_concurrent_btree::value_type> m;
+  vector<string> probes;
+  for (size_t i = 0; i < nkeys; i++) {
+    const string k = (i % 3) ?
+      u64_varkey(r.next() % (nkeys * 2)).str() :
+      r.next_readable_string(r.next() % 40);
+    const typename testing_concurrent_btree::value_type v =
+      (typename testing_concurrent_btree::value_type) (i + 1);
+    btr.insert(varkey(k), v);
+    m[k] = v;
+    probes.push_back(k);
+    // probably absent
+    probes.push_back((i % 2) ?
+        u64_varkey(r.next() % (nkeys * 2)).str() :
+        r.next_readable_string(r.next() % 40));
+  }
+
+  vector<varkey> keys;
+  for (auto &p : probes)
+    keys.emplace_back(p);
+  vector<typename testing_concurrent_btree::value_type> values(keys.size());
+  unique_ptr<bool[]> found(new bool[keys.size()]);
+  vector<typename testing_concurrent_btree::versioned_node_t> infos(keys.size());
+  const size_t nfound =
+    btr.multi_search(keys.size(), &keys[0], &values[0], found.get(), &infos[0]);
+
+  size_t nexpected = 0;
+  for (size_t i = 0; i < probes.size(); i++) {
+    auto it = m.find(probes[i]);
+    ALWAYS_ASSERT(found[i] == (it != m.end()));
+    if (found[i]) {
+      ALWAYS_ASSERT(values[i] == it->second);
+      nexpected++;
+    }
+    typename testing_concurrent_btree::value_type v = 0;
+    typename testing_concurrent_btree::versioned_node_t info;
+    ALWAYS_ASSERT(btr.search(keys[i], v, &info) == found[i]);
+    ALWAYS_ASSERT(info == infos[i]);
+  }
+  ALWAYS_ASSERT(nfound == nexpected);
+}
+
+static void
+test_bulk_load()
+{
+  typedef typename testing_concurrent_btree::value_type value_type;
+
+  // 8-byte keys, plus groups of keys which share slices at every length,
+  // some of which need suffixes and some of which need new layers
+  map<string, value_type> m;
+  fast_random r(5902341);
+  for (size_t i = 0; i < 20000; i++)
+    m[u64_varkey(r.next() % 100000).str()] = (value_type) (m.size() + 1);
+  for (size_t i = 0; i < 200; i++) {
+    const string base = r.next_string(8);
+    for (size_t len = 0; len <= 8; len++)
+      m[base.substr(0, len)] = (value_type) (m.size() + 1);
+    if (i % 2)
+      m[base + r.next_readable_string(1 + r.next() % 20)] =
+        (value_type) (m.size() + 1);
+    else
+      for (size_t j = 0; j < 1 + (i % 40); j++)
+        m[base + r.next_readable_string(r.next() % 30)] =
+          (value_type) (m.size() + 1);
+  }
+
+  const double fill_factors[] = {1.0, 0.75, 0.5, 0.1};
+  for (auto fill_factor : fill_factors) {
+    testing_concurrent_btree btr;
+    ALWAYS_ASSERT(btr.bulk_load(m.begin(), m.end(), fill_factor));
+    btr.invariant_checker();
+    ALWAYS_ASSERT(btr.size() == m.size());
+    ALWAYS_ASSERT(!btr.bulk_load(m.begin(), m.end(), fill_factor));
+
+    for (auto &p : m) {
+      value_type v = 0;
+      ALWAYS_ASSERT(btr.search(varkey(p.first), v));
+      ALWAYS_ASSERT(v == p.second);
+    }
+
+    test6_ns::scan_callback::kv_vec data;
+    test6_ns::scan_callback cb(&data);
+    btr.search_range(varkey(""), NULL, cb);
+    ALWAYS_ASSERT(data.size() == m.size());
+    size_t i = 0;
+    for (auto &p : m) {
+      ALWAYS_ASSERT(data[i].first == p.first);
+      ALWAYS_ASSERT(data[i++].second == p.second);
+    }
+
+#ifdef HAVE_REVERSE_RANGE_SCANS
+    data.clear();
+    test6_ns::scan_callback cb_rev(&data, true);
+    btr.rsearch_range(varkey(string(64, '\xff')), NULL, cb_rev);
+    ALWAYS_ASSERT(data.size() == m.size());
+    i = data.size();
+    for (auto &p : m) {
+      ALWAYS_ASSERT(data[--i].first == p.first);
+      ALWAYS_ASSERT(data[i].second == p.second);
+    }
+#endif
+
+    // the loaded tree must behave like any other afterwards
+    i = 0;
+    for (auto it = m.begin(); it != m.end(); ++i) {
+      if (i % 2) {
+        ++it;
+        continue;
+      }
+      ALWAYS_ASSERT(btr.remove(varkey(it->first)));
+      ++it;
+    }
+    for (size_t i = 0; i < 1000; i++)
+      btr.insert(u64_varkey(r.next()), (value_type) (i + 1));
+    btr.invariant_checker();
+  }
+
+  testing_concurrent_btree btr;
+  ALWAYS_ASSERT(btr.bulk_load(m.end(), m.end()));
+  ALWAYS_ASSERT(btr.empty());
+  btr.insert(varkey("a"), (value_type) 1);
+  ALWAYS_ASSERT(!btr.empty());
+  ALWAYS_ASSERT(!btr.bulk_load(m.begin(), m.end()));
+  ALWAYS_ASSERT(btr.size() == 1);
+}
+
+static void
+test_compact()
+{
+#ifndef NDB_MASSTREE
+  typedef typename testing_concurrent_btree::value_type value_type;
+  typedef typename testing_concurrent_btree::compact_stats compact_stats;
+
+  // queue-like keys: each group shares its first 8 bytes, so each group gets
+  // its own layer. groups are then drained so that:
+  //   g % 3 == 0: the layer is empty
+  //   g % 3 == 1: the layer has one key left
+  //   g % 3 == 2: the layer has one key left, which is itself a layer with
+  //               one key left
+  const size_t ngroups = 1200;
+  testing_concurrent_btree btr;
+  map<string, value_type> m;
+  set<string> removed;
+  for (size_t g = 0; g < ngroups; g++) {
+    const string prefix = u64_varkey(g).str();
+    vector<string> keys;
+    if (g % 3 != 2) {
+      for (size_t j = 0; j < 4; j++)
+        keys.push_back(prefix + u64_varkey(j).str());
+    } else {
+      keys.push_back(prefix + u64_varkey(1).str());
+      for (size_t j = 0; j < 4; j++)
+        keys.push_back(prefix + u64_varkey(0).str() + u64_varkey(j).str() + "x");
+    }
+    for (auto &k : keys)
+      ALWAYS_ASSERT(btr.insert(varkey(k), (value_type) (m.size() + removed.size() + 1)));
+    for (size_t j = 0; j < keys.size(); j++) {
+      if (g % 3 != 0 && j == keys.size() - 1) {
+        value_type v = 0;
+        ALWAYS_ASSERT(btr.search(varkey(keys[j]), v));
+        m[keys[j]] = v;
+        continue;
+      }
+      ALWAYS_ASSERT(btr.remove(varkey(keys[j])));
+      removed.insert(keys[j]);
+    }
+  }
+  btr.invariant_checker();
+  ALWAYS_ASSERT(btr.size() == m.size());
+
+  compact_stats stats;
+  const size_t nreclaimed = btr.compact(&stats);
+  btr.invariant_checker();
+  ALWAYS_ASSERT(nreclaimed == stats.nodes_reclaimed());
+  ALWAYS_ASSERT(stats.layers_removed_ == ngroups / 3);
+  ALWAYS_ASSERT(stats.layers_collapsed_ == ngroups / 3 + 2 * (ngroups / 3));
+  ALWAYS_ASSERT(btr.size() == m.size());
+  // nothing is left to do
+  ALWAYS_ASSERT(!btr.compact());
+
+  for (auto &p : m) {
+    value_type v = 0;
+    ALWAYS_ASSERT(btr.search(varkey(p.first), v));
+    ALWAYS_ASSERT(v == p.second);
+  }
+  for (auto &k : removed) {
+    value_type v = 0;
+    ALWAYS_ASSERT(!btr.search(varkey(k), v));
+  }
+  {
+    test6_ns::scan_callback::kv_vec data;
+    test6_ns::scan_callback cb(&data);
+    btr.search_range(varkey(""), NULL, cb);
+    ALWAYS_ASSERT(data.size() == m.size());
+    size_t i = 0;
+    for (auto &p : m) {
+      ALWAYS_ASSERT(data[i].first == p.first);
+      ALWAYS_ASSERT(data[i++].second == p.second);
+    }
+  }
+
+  // refilling the drained groups must re-create the layers
+  for (auto &k : removed) {
+    const value_type v = (value_type) (m.size() + 1);
+    ALWAYS_ASSERT(btr.insert(varkey(k), v));
+    m[k] = v;
+  }
+  btr.invariant_checker();
+  ALWAYS_ASSERT(btr.size() == m.size());
+  for (auto &p : m) {
+    value_type v = 0;
+    ALWAYS_ASSERT(btr.search(varkey(p.first), v));
+    ALWAYS_ASSERT(v == p.second);
+  }
+
+  // underfull leaves: a sparsely loaded tree has leaves of a key or two,
+  // under minimally full internal nodes
+  {
+    map<string, value_type> m;
+    for (size_t i = 0; i < 10000; i++)
+      m[u64_varkey(i).str()] = (value_type) (i + 1);
+    testing_concurrent_btree btr;
+    ALWAYS_ASSERT(btr.bulk_load(m.begin(), m.end(), 0.1));
+    compact_stats stats;
+    btr.compact(&stats);
+    btr.invariant_checker();
+    ALWAYS_ASSERT(stats.leaves_merged_ > 0);
+    ALWAYS_ASSERT(stats.internals_merged_ > 0);
+    ALWAYS_ASSERT(!stats.layers_removed_ && !stats.layers_collapsed_);
+    ALWAYS_ASSERT(btr.size() == m.size());
+    test6_ns::scan_callback::kv_vec data;
+    test6_ns::scan_callback cb(&data);
+    btr.search_range(varkey(""), NULL, cb);
+    ALWAYS_ASSERT(data.size() == m.size());
+    size_t i = 0;
+    for (auto &p : m) {
+      ALWAYS_ASSERT(data[i].first == p.first);
+      ALWAYS_ASSERT(data[i++].second == p.second);
+    }
+    for (auto &p : m)
+      ALWAYS_ASSERT(btr.remove(varkey(p.first)));
+    btr.invariant_checker();
+    ALWAYS_ASSERT(btr.empty());
+  }
+
+  // an empty layer hanging off the root leaf, which is its only key
+  {
+    testing_concurrent_btree btr;
+    const string k0 = "abcdefgh0", k1 = "abcdefgh1";
+    ALWAYS_ASSERT(btr.insert(varkey(k0), (value_type) 1));
+    ALWAYS_ASSERT(btr.insert(varkey(k1), (value_type) 2));
+    ALWAYS_ASSERT(btr.remove(varkey(k0)));
+    ALWAYS_ASSERT(btr.remove(varkey(k1)));
+    ALWAYS_ASSERT(!btr.empty());
+    compact_stats stats;
+    ALWAYS_ASSERT(btr.compact(&stats) == 1);
+    ALWAYS_ASSERT(stats.layers_removed_ == 1);
+    btr.invariant_checker();
+    ALWAYS_ASSERT(btr.empty());
+  }
+  cout << "test_compact passed" << endl;
+#endif
+}
+
+static void
+test_lazy_leaf_removes()
+{
+#ifndef NDB_MASSTREE
+  typedef typename testing_concurrent_btree::value_type value_type;
+  typedef typename testing_concurrent_btree::compact_stats compact_stats;
+
+  // removes only rebalance a leaf once it goes empty, so thinning out every
+  // leaf down to a single key leaves the structure alone, for compact() to
+  // merge back together later
+  {
+    const size_t nkeys = 20000;
+    testing_concurrent_btree btr;
+    for (size_t i = 0; i < nkeys; i++)
+      ALWAYS_ASSERT(btr.insert(u64_varkey(i), (value_type) (i + 1)));
+    for (size_t i = 0; i < nkeys; i++)
+      if (i % 8)
+        ALWAYS_ASSERT(btr.remove(u64_varkey(i)));
+    btr.invariant_checker();
+    ALWAYS_ASSERT(btr.size() == nkeys / 8);
+    for (size_t i = 0; i < nkeys; i++) {
+      value_type v = 0;
+      ALWAYS_ASSERT(btr.search(u64_varkey(i), v) == !(i % 8));
+      ALWAYS_ASSERT(i % 8 || v == (value_type) (i + 1));
+    }
+
+    compact_stats stats;
+    btr.compact(&stats);
+    btr.invariant_checker();
+    ALWAYS_ASSERT(stats.leaves_merged_ > 0);
+    ALWAYS_ASSERT(btr.size() == nkeys / 8);
+  }
+
+  // queue: insert at the tail, remove from the head, so leaves are drained
+  // from the front and then steal from or merge with their right sibling
+  {
+    const size_t window = 1000;
+    const size_t nops = 50000;
+    testing_concurrent_btree btr;
+    uint64_t head = 0, tail = 0;
+    for (; tail < window; tail++)
+      ALWAYS_ASSERT(btr.insert(u64_varkey(tail), (value_type) (tail + 1)));
+    for (size_t i = 0; i < nops; i++, head++, tail++) {
+      ALWAYS_ASSERT(btr.remove(u64_varkey(head)));
+      ALWAYS_ASSERT(btr.insert(u64_varkey(tail), (value_type) (tail + 1)));
+      if (!(i % 1000))
+        btr.invariant_checker();
+    }
+    btr.invariant_checker();
+    ALWAYS_ASSERT(btr.size() == window);
+
+    test6_ns::scan_callback::kv_vec data;
+    test6_ns::scan_callback cb(&data);
+    btr.search_range(varkey(""), NULL, cb);
+    ALWAYS_ASSERT(data.size() == window);
+    for (size_t i = 0; i < window; i++) {
+      ALWAYS_ASSERT(data[i].first == u64_varkey(head + i).str());
+      ALWAYS_ASSERT(data[i].second == (value_type) (head + i + 1));
+    }
+
+    for (; head < tail; head++)
+      ALWAYS_ASSERT(btr.remove(u64_varkey(head)));
+    btr.invariant_checker();
+    ALWAYS_ASSERT(btr.empty());
+  }
+
+  // emptying leaves in random order, from both ends of their parents, with
+  // key slices shared by several keys (which a steal must not split up)
+  {
+    map<string, value_type> m;
+    testing_concurrent_btree btr;
+    fast_random r(3029184);
+    for (size_t i = 0; i < 2000; i++) {
+      const string base = u64_varkey(i).str();
+      for (size_t j = 0; j < (i % 4) + 1; j++) {
+        const string k = j ? base + string(j, 'a' + (i % 26)) : base;
+        m[k] = (value_type) (m.size() + 1);
+        ALWAYS_ASSERT(btr.insert(varkey(k), m[k]));
+      }
+    }
+    vector<string> keys;
+    for (auto &p : m)
+      keys.push_back(p.first);
+    for (size_t i = keys.size(); i > 1; i--)
+      swap(keys[i - 1], keys[r.next() % i]);
+    for (size_t i = 0; i < keys.size(); i++) {
+      ALWAYS_ASSERT(btr.remove(varkey(keys[i])));
+      m.erase(keys[i]);
+      if (!(i % 500)) {
+        btr.invariant_checker();
+        ALWAYS_ASSERT(btr.size() == m.size());
+        for (auto &p : m) {
+          value_type v = 0;
+          ALWAYS_ASSERT(btr.search(varkey(p.first), v));
+          ALWAYS_ASSERT(v == p.second);
+        }
+      }
+    }
+    btr.invariant_checker();
+    ALWAYS_ASSERT(btr.size() == 0);
+  }
+  cout << "test_lazy_leaf_removes passed" << endl;
+#endif
+}
+
+static void
+test_subtree_counts()
+{
+#ifndef NDB_MASSTREE
+  typedef typename testing_concurrent_btree::value_type value_type;
+
+  // the same mix of keys as test_bulk_load(), so all kinds of layers show up
+  map<string, value_type> m;
+  fast_random r(9823177);
+  for (size_t i = 0; i < 20000; i++)
+    m[u64_varkey(r.next() % 100000).str()] = (value_type) (m.size() + 1);
+  for (size_t i = 0; i < 200; i++) {
+    const string base = r.next_string(8);
+    for (size_t len = 0; len <= 8; len++)
+      m[base.substr(0, len)] = (value_type) (m.size() + 1);
+    for (size_t j = 0; j < 1 + (i % 40); j++)
+      m[base + r.next_readable_string(r.next() % 30)] =
+        (value_type) (m.size() + 1);
+  }
+  vector<string> keys;
+  for (auto &p : m)
+    keys.push_back(p.first);
+  const size_t n = keys.size();
+
+  // nothing is left pending after a bulk load, so every answer is exact
+  {
+    testing_concurrent_btree btr;
+    ALWAYS_ASSERT(btr.bulk_load(m.begin(), m.end()));
+    btr.invariant_checker();
+    btr.count_invariant_checker();
+    ALWAYS_ASSERT(btr.size_estimate() == n);
+    for (size_t i = 0; i < n; i += 7) {
+      ALWAYS_ASSERT(btr.rank(varkey(keys[i])) == i);
+      string k;
+      ALWAYS_ASSERT(btr.select(i, k));
+      ALWAYS_ASSERT(k == keys[i]);
+    }
+    const string upper = keys[n / 2];
+    const varkey upper_key(upper);
+    ALWAYS_ASSERT(btr.estimate_range_count(varkey(keys[n / 4]), &upper_key) ==
+                  n / 2 - n / 4);
+    ALWAYS_ASSERT(btr.estimate_range_count(varkey(""), NULL) == n);
+    string k;
+    ALWAYS_ASSERT(btr.select(n + 100, k));
+    ALWAYS_ASSERT(k == keys[n - 1]);
+  }
+
+  // built up one key at a time (in random order), the counts lag behind a
+  // bit, but by no more than a few percent. the invariant checker makes
+  // sure nothing gets lost on the way up
+  {
+    testing_concurrent_btree btr;
+    string k;
+    ALWAYS_ASSERT(!btr.select(0, k));
+    ALWAYS_ASSERT(btr.size_estimate() == 0);
+
+    vector<string> shuffled(keys);
+    for (size_t i = shuffled.size(); i > 1; i--)
+      swap(shuffled[i - 1], shuffled[r.next() % i]);
+    for (size_t i = 0; i < shuffled.size(); i++) {
+      ALWAYS_ASSERT(btr.insert(varkey(shuffled[i]), m[shuffled[i]]));
+      if (!(i % 2000)) {
+        btr.invariant_checker();
+        btr.count_invariant_checker();
+      }
+    }
+    btr.invariant_checker();
+    btr.count_invariant_checker();
+
+    const auto roughly = [](size_t a, size_t b, size_t slack) {
+      return a + slack >= b && b + slack >= a;
+    };
+    const size_t slack = n / 16;
+    ALWAYS_ASSERT(roughly(btr.size_estimate(), n, slack));
+    for (size_t i = 0; i < n; i += 101) {
+      ALWAYS_ASSERT(roughly(btr.rank(varkey(keys[i])), i, slack));
+      ALWAYS_ASSERT(btr.select(i, k));
+      const size_t pos =
+        lower_bound(keys.begin(), keys.end(), k) - keys.begin();
+      ALWAYS_ASSERT(pos < n && keys[pos] == k);
+      ALWAYS_ASSERT(roughly(pos, i, slack));
+    }
+
+    // remove every other key
+    for (size_t i = 0; i < n; i += 2)
+      ALWAYS_ASSERT(btr.remove(varkey(keys[i])));
+    btr.invariant_checker();
+    btr.count_invariant_checker();
+    ALWAYS_ASSERT(roughly(btr.size_estimate(), n / 2, slack));
+    for (size_t i = 1; i < n; i += 101)
+      ALWAYS_ASSERT(roughly(btr.rank(varkey(keys[i])), i / 2, slack));
+    btr.compact();
+    btr.invariant_checker();
+    btr.count_invariant_checker();
+    ALWAYS_ASSERT(roughly(btr.size_estimate(), n / 2, slack));
+
+    for (size_t i = 1; i < n; i += 2)
+      ALWAYS_ASSERT(btr.remove(varkey(keys[i])));
+    btr.invariant_checker();
+    btr.count_invariant_checker();
+    ALWAYS_ASSERT(roughly(btr.size_estimate(), 0, slack));
+  }
+  cout << "test_subtree_counts passed" << endl;
+#endif
+}
+
+static void
+test_cursor()
+{
+#ifndef NDB_MASSTREE
+  typedef typename testing_concurrent_btree::value_type value_type;
+  typedef typename testing_concurrent_btree::cursor cursor;
+
+  // long keys w/ shared prefixes, so the cursor has to walk in and out of
+  // layers
+  map<string, value_type> m;
+  fast_random r(1209381);
+  for (size_t i = 0; i < 5000; i++)
+    m[u64_varkey(r.next() % 100000).str()] = (value_type) (m.size() + 1);
+  for (size_t i = 0; i < 100; i++) {
+    const string base = r.next_string(8);
+    for (size_t len = 0; len <= 8; len++)
+      m[base.substr(0, len)] = (value_type) (m.size() + 1);
+    for (size_t j = 0; j < 1 + (i % 40); j++)
+      m[base + r.next_readable_string(r.next() % 30)] =
+        (value_type) (m.size() + 1);
+  }
+  vector<string> keys;
+  for (auto &p : m)
+    keys.push_back(p.first);
+  const size_t n = keys.size();
+
+  testing_concurrent_btree btr;
+  for (auto &p : m)
+    ALWAYS_ASSERT(btr.insert(varkey(p.first), p.second));
+  btr.invariant_checker();
+
+  scoped_rcu_region guard;
+  cursor c(btr);
+
+  // full scans, both ways
+  ALWAYS_ASSERT(c.seek(varkey("")));
+  for (size_t i = 0; i < n; i++) {
+    ALWAYS_ASSERT(c.valid());
+    ALWAYS_ASSERT(c.key() == keys[i]);
+    ALWAYS_ASSERT(c.value() == m[keys[i]]);
+    c.next();
+  }
+  ALWAYS_ASSERT(!c.valid());
+  ALWAYS_ASSERT(c.rseek(varkey(keys[n - 1])));
+  for (size_t i = n; i > 0; i--) {
+    ALWAYS_ASSERT(c.valid());
+    ALWAYS_ASSERT(c.key() == keys[i - 1]);
+    c.prev();
+  }
+  ALWAYS_ASSERT(!c.valid());
+
+  // batches
+  {
+    ALWAYS_ASSERT(c.seek(varkey("")));
+    vector<pair<string, value_type>> out;
+    while (c.next_n(7, out))
+      ;
+    ALWAYS_ASSERT(out.size() == n);
+    for (size_t i = 0; i < n; i++) {
+      ALWAYS_ASSERT(out[i].first == keys[i]);
+      ALWAYS_ASSERT(out[i].second == m[keys[i]]);
+    }
+  }
+
+  // seeks land on the nearest key, and changing direction mid-batch works
+  for (size_t i = 1; i + 1 < n; i += 37) {
+    ALWAYS_ASSERT(c.seek(varkey(keys[i])));
+    ALWAYS_ASSERT(c.key() == keys[i]);
+    ALWAYS_ASSERT(c.rseek(varkey(keys[i])));
+    ALWAYS_ASSERT(c.key() == keys[i]);
+    const string past = keys[i] + string(1, '\0');
+    if (past != keys[i + 1]) {
+      ALWAYS_ASSERT(c.seek(varkey(past)));
+      ALWAYS_ASSERT(c.key() == keys[i + 1]);
+      ALWAYS_ASSERT(c.rseek(varkey(past)));
+      ALWAYS_ASSERT(c.key() == keys[i]);
+    }
+    ALWAYS_ASSERT(c.seek(varkey(keys[i])));
+    const size_t steps = 1 + (i % (2 * cursor::BatchSize));
+    size_t j = i;
+    for (size_t s = 0; s < steps && j + 1 < n; s++, j++)
+      ALWAYS_ASSERT(c.next() && c.key() == keys[j + 1]);
+    for (size_t s = 0; s < steps + 1 && j > 0; s++, j--)
+      ALWAYS_ASSERT(c.prev() && c.key() == keys[j - 1]);
+  }
+  ALWAYS_ASSERT(!c.seek(varkey(keys[n - 1] + "a")));
+  ALWAYS_ASSERT(c.rseek(varkey(keys[n - 1] + "a")));
+  ALWAYS_ASSERT(c.key() == keys[n - 1]);
+
+  // keys removed or added ahead of the cursor after it buffered them are
+  // noticed, since their leaves changed
+  for (size_t i = 0; i + 100 < n; i += 997) {
+    ALWAYS_ASSERT(c.seek(varkey(keys[i])));
+    for (size_t j = i + 1; j <= i + 20; j++)
+      ALWAYS_ASSERT(btr.remove(varkey(keys[j])));
+    ALWAYS_ASSERT(c.next());
+    ALWAYS_ASSERT(c.key() == keys[i + 21]);
+    ALWAYS_ASSERT(btr.insert(varkey(keys[i + 22]), m[keys[i + 22]]) == false);
+    ALWAYS_ASSERT(btr.remove(varkey(keys[i + 22])));
+    ALWAYS_ASSERT(btr.insert(varkey(keys[i + 1]), m[keys[i + 1]]));
+    ALWAYS_ASSERT(c.next());
+    ALWAYS_ASSERT(c.key() == keys[i + 23]);
+    ALWAYS_ASSERT(c.prev());
+    ALWAYS_ASSERT(c.key() == keys[i + 21]);
+    ALWAYS_ASSERT(c.prev());
+    ALWAYS_ASSERT(c.key() == keys[i + 1]);
+    for (size_t j = i + 2; j <= i + 22; j++)
+      if (j != i + 21)
+        ALWAYS_ASSERT(btr.insert(varkey(keys[j]), m[keys[j]]));
+  }
+  btr.invariant_checker();
+  cout << "test_cursor passed" << endl;
+#endif
+}
+
+#ifndef NDB_MASSTREE
+// runs a mix of short and long keys through a btree w/ the given fanouts,
+// so splits and merges get exercised at each level
+template <unsigned int NLeafKeys, unsigned int NInternalKeys>
+struct testing_fanout_btree_traits
+  : public btree_fanout_config<NLeafKeys, NInternalKeys> {
+  typedef std::atomic<uint64_t> VersionType;
+  static const bool RcuRespCaller = false;
+};
+
+template <unsigned int NLeafKeys, unsigned int NInternalKeys>
+static void
+test_node_fanout_instance()
+{
+  typedef
+    btree<testing_fanout_btree_traits<NLeafKeys, NInternalKeys>>
+    btree_type;
+
+  btree_type btr;
+  fast_random r(9234512);
+  const size_t nkeys = 20000;
+  map<string, typename btree_type::value_type> m;
+  for (size_t i = 0; i < nkeys; i++) {
+    const string k = (i % 4) ?
+      u64_varkey(r.next() % (nkeys * 4)).str() :
+      r.next_readable_string(r.next() % 32);
+    const typename btree_type::value_type v =
+      (typename btree_type::value_type) (i + 1);
+    btr.insert(varkey(k), v);
+    m[k] = v;
+  }
+  btr.invariant_checker();
+  btr.count_invariant_checker();
+  ALWAYS_ASSERT(btr.size() == m.size());
+  for (auto &p : m) {
+    typename btree_type::value_type v = 0;
+    ALWAYS_ASSERT(btr.search(varkey(p.first), v));
+    ALWAYS_ASSERT(v == p.second);
+  }
+
+  size_t i = 0;
+  for (auto it = m.begin(); it != m.end(); ++i) {
+    if (i % 3) {
+      ++it;
+      continue;
+    }
+    ALWAYS_ASSERT(btr.remove(varkey(it->first)));
+    m.erase(it++);
+  }
+  btr.invariant_checker();
+  btr.count_invariant_checker();
+  ALWAYS_ASSERT(btr.size() == m.size());
+
+  btree_type loaded;
+  ALWAYS_ASSERT(loaded.bulk_load(m.begin(), m.end(), 0.6));
+  loaded.invariant_checker();
+  loaded.count_invariant_checker();
+  ALWAYS_ASSERT(loaded.size() == m.size());
+
+  for (auto &p : m)
+    ALWAYS_ASSERT(btr.remove(varkey(p.first)));
+  btr.invariant_checker();
+  btr.count_invariant_checker();
+  ALWAYS_ASSERT(btr.size() == 0);
+}
+#endif
+
+static void
+test_node_fanouts()
+{
+#ifndef NDB_MASSTREE
+  test_node_fanout_instance<15, 15>();
+  test_node_fanout_instance<15, 63>();
+  test_node_fanout_instance<31, 31>();
+  test_node_fanout_instance<63, 15>();
+  cout << "test_node_fanouts passed" << endl;
+#endif
+}
+
 namespace mp_test1_ns {
 
   static const size_t nkeys = 20000;
@@ -1183,6 +1942,10 @@ mp_test_inserts_removes()
     for (auto &p : workers)
       p->join();
     btr.invariant_checker();
+    // concurrent inserts may lose a few count updates, but not many
+    const size_t nkeys = nthreads * keys_per_thread;
+    ALWAYS_ASSERT(btr.size_estimate() >= nkeys - nkeys / 16 &&
+                  btr.size_estimate() <= nkeys + nkeys / 16);
     workers.clear();
 
     for (size_t i = 0; i < nthreads; i++)
@@ -1207,6 +1970,126 @@ mp_test_inserts_removes()
   }
 }
 
+namespace mp_test_compact_ns {
+  static const size_t nthreads = 4;
+  static const size_t ngroups_per_thread = 500;
+  static const size_t nrounds = 10;
+
+  static volatile bool running = false;
+
+  static inline string
+  group_prefix(size_t g)
+  {
+    return u64_varkey(g).str();
+  }
+
+  // queue-like: fills up and drains the layers of its own groups
+  class queue_worker : public btree_worker {
+  public:
+    queue_worker(unsigned int thread, testing_concurrent_btree &btr)
+      : btree_worker(btr), thread(thread) {}
+    virtual void
+    run()
+    {
+      for (size_t round = 0; round < nrounds; round++)
+        for (size_t g = thread * ngroups_per_thread;
+             g < (thread + 1) * ngroups_per_thread;
+             g++) {
+          const string prefix = group_prefix(g);
+          string keys[3];
+          for (size_t j = 0; j < 3; j++) {
+            keys[j] = prefix + u64_varkey(round * 3 + j).str();
+            ALWAYS_ASSERT(btr->insert(varkey(keys[j]), (typename testing_concurrent_btree::value_type) (g + 1)));
+          }
+          for (size_t j = 0; j < 3; j++) {
+            typename testing_concurrent_btree::value_type v = 0;
+            ALWAYS_ASSERT(btr->search(varkey(keys[j]), v));
+            ALWAYS_ASSERT(v == (typename testing_concurrent_btree::value_type) (g + 1));
+          }
+          // the last round leaves one key behind in the odd groups
+          const bool keep_one = (g % 2) && round == nrounds - 1;
+          for (size_t j = keep_one ? 1 : 0; j < 3; j++)
+            ALWAYS_ASSERT(btr->remove(varkey(keys[j])));
+        }
+    }
+  private:
+    unsigned int thread;
+  };
+
+  // the 8-byte group prefixes share a key slice with the group layers
+  class search_worker : public btree_worker {
+  public:
+    search_worker(testing_concurrent_btree &btr) : btree_worker(btr) {}
+    virtual void
+    run()
+    {
+      while (running)
+        for (size_t g = 0; g < nthreads * ngroups_per_thread; g++) {
+          typename testing_concurrent_btree::value_type v = 0;
+          ALWAYS_ASSERT(btr->search(varkey(group_prefix(g)), v));
+          ALWAYS_ASSERT(v == (typename testing_concurrent_btree::value_type) (g + 1));
+        }
+    }
+  };
+
+  class compact_worker : public btree_worker {
+  public:
+    compact_worker(testing_concurrent_btree &btr)
+      : btree_worker(btr), nreclaimed(0) {}
+    virtual void
+    run()
+    {
+      while (running)
+        nreclaimed += btr->compact();
+    }
+    size_t nreclaimed;
+  };
+}
+
+static void
+mp_test_compact()
+{
+#ifndef NDB_MASSTREE
+  using namespace mp_test_compact_ns;
+  testing_concurrent_btree btr;
+  const size_t ngroups = nthreads * ngroups_per_thread;
+  for (size_t g = 0; g < ngroups; g++)
+    ALWAYS_ASSERT(btr.insert(varkey(group_prefix(g)), (typename testing_concurrent_btree::value_type) (g + 1)));
+
+  vector<unique_ptr<btree_worker>> workers;
+  for (size_t i = 0; i < nthreads; i++)
+    workers.emplace_back(new queue_worker(i, btr));
+  search_worker searcher(btr);
+  compact_worker compactor(btr);
+  running = true;
+  searcher.start();
+  compactor.start();
+  for (auto &p : workers)
+    p->start();
+  for (auto &p : workers)
+    p->join();
+  running = false;
+  searcher.join();
+  compactor.join();
+  btr.invariant_checker();
+
+  typename testing_concurrent_btree::compact_stats stats;
+  btr.compact(&stats);
+  btr.invariant_checker();
+  ALWAYS_ASSERT(compactor.nreclaimed + stats.nodes_reclaimed() > 0);
+  // every drained layer is gone, and every layer w/ one key left is folded
+  ALWAYS_ASSERT(!btr.compact());
+
+  ALWAYS_ASSERT(btr.size() == ngroups + ngroups / 2);
+  for (size_t g = 0; g < ngroups; g++) {
+    typename testing_concurrent_btree::value_type v = 0;
+    ALWAYS_ASSERT(btr.search(varkey(group_prefix(g)), v));
+    const string last_key = group_prefix(g) + u64_varkey((nrounds - 1) * 3).str();
+    ALWAYS_ASSERT(btr.search(varkey(last_key), v) == bool(g % 2));
+  }
+#endif
+}
+
 namespace mp_test5_ns {
 
   static const size_t niters = 100000;
@@ -1817,6 +2700,120 @@ perf_test()
   }
 }
 
+// random point lookups, one at a time vs. batched w/ multi_search()
+static void multi_search_perf_test() UNUSED;
+static void
+multi_search_perf_test()
+{
+  const size_t nkeys = 10000000;
+  const size_t nlookups = 10000000;
+  const size_t batch_size = 16;
+
+  testing_concurrent_btree btr;
+  for (size_t i = 0; i < nkeys; i++)
+    btr.insert(u64_varkey(i), (typename testing_concurrent_btree::value_type) i);
+
+  fast_random r(1290123);
+  vector<u64_varkey> keys;
+  for (size_t i = 0; i < nlookups; i++)
+    keys.emplace_back(r.next() % nkeys);
+
+  {
+    scoped_rate_timer t("btree random lookups", nlookups);
+    for (size_t i = 0; i < nlookups; i++) {
+      typename testing_concurrent_btree::value_type v = 0;
+      ALWAYS_ASSERT(btr.search(keys[i], v));
+    }
+  }
+  {
+    scoped_rate_timer t("btree random batched lookups", nlookups);
+    varkey batch[batch_size];
+    typename testing_concurrent_btree::value_type values[batch_size];
+    bool found[batch_size];
+    for (size_t i = 0; i < nlookups; i += batch_size) {
+      const size_t n = min(batch_size, nlookups - i);
+      for (size_t j = 0; j < n; j++)
+        batch[j] = keys[i + j];
+      ALWAYS_ASSERT(btr.multi_search(n, batch, values, found) == n);
+    }
+  }
+}
+
+static void bulk_load_perf_test() UNUSED;
+static void
+bulk_load_perf_test()
+{
+  const size_t nkeys = 10000000;
+
+  vector<pair<u64_varkey, typename testing_concurrent_btree::value_type>> kvs;
+  for (size_t i = 0; i < nkeys; i++)
+    kvs.emplace_back(
+        u64_varkey(i), (typename testing_concurrent_btree::value_type) (i + 1));
+
+  {
+    testing_concurrent_btree btr;
+    scoped_rate_timer t("btree sequential inserts", nkeys);
+    for (auto &p : kvs)
+      btr.insert(p.first, p.second);
+  }
+  {
+    testing_concurrent_btree btr;
+    scoped_rate_timer t("btree bulk load", nkeys);
+    ALWAYS_ASSERT(btr.bulk_load(kvs.begin(), kvs.end()));
+  }
+}
+
+static void compact_perf_test() UNUSED;
+static void
+compact_perf_test()
+{
+#ifndef NDB_MASSTREE
+  // queue-like: 1M groups of 16-byte keys sharing their first 8 bytes, each
+  // drained down to one key (every 4th group is drained completely)
+  const size_t ngroups = 1000000;
+  const size_t nsearches = 10000000;
+  testing_concurrent_btree btr;
+  vector<string> keys;
+  for (size_t g = 0; g < ngroups; g++) {
+    for (size_t j = 0; j < 4; j++)
+      btr.insert(varkey(u64_varkey(g).str() + u64_varkey(j).str()),
+                 (typename testing_concurrent_btree::value_type) (g + 1));
+    for (size_t j = 0; j < 4; j++) {
+      const string k = u64_varkey(g).str() + u64_varkey(j).str();
+      if (j == 3 && (g % 4))
+        keys.push_back(k);
+      else
+        btr.remove(varkey(k));
+    }
+  }
+
+  fast_random r(9502341);
+  {
+    scoped_rate_timer t("btree searches before compaction", nsearches);
+    for (size_t i = 0; i < nsearches; i++) {
+      typename testing_concurrent_btree::value_type v = 0;
+      btr.search(varkey(keys[r.next() % keys.size()]), v);
+    }
+  }
+  {
+    scoped_rate_timer t("btree compaction", ngroups);
+    typename testing_concurrent_btree::compact_stats stats;
+    btr.compact(&stats);
+    cerr << "leaves merged: " << stats.leaves_merged_
+         << ", internal nodes merged: " << stats.internals_merged_
+         << ", layers removed: " << stats.layers_removed_
+         << ", layers collapsed: " << stats.layers_collapsed_ << endl;
+  }
+  {
+    scoped_rate_timer t("btree searches after compaction", nsearches);
+    for (size_t i = 0; i < nsearches; i++) {
+      typename testing_concurrent_btree::value_type v = 0;
+      btr.search(varkey(keys[r.next() % keys.size()]), v);
+    }
+  }
+#endif
+}
+
 namespace read_only_perf_test_ns {
   const size_t nkeys = 140000000; // 140M
   //const size_t nkeys = 100000; // 100K
@@ -1978,6 +2975,7 @@ TestConcurrentBtreeFast()
   test7();
   test_varlen_single_layer();
   test_varlen_multi_layer();
+  test_long_key_suffixes();
   test_two_layer();
   test_two_layer_range_scan();
   test_multi_layer_scan();
@@ -1985,8 +2983,17 @@ TestConcurrentBtreeFast()
   test_null_keys_2();
   test_random_keys();
   test_insert_remove_mix();
+  test_multi_search();
+  test_bulk_load();
+  test_compact();
+  test_lazy_leaf_removes();
+  test_subtree_counts();
+  test_cursor();
+  test_node_fanouts();
+  test_key_slice_search();
   mp_test_pinning();
   mp_test_inserts_removes();
+  mp_test_compact();
   cout << "testing_concurrent_btree::TestFast passed" << endl;
 }
 
@@ -2004,6 +3011,9 @@ TestConcurrentBtreeSlow()
   mp_test8();
   mp_test_long_keys();
   //perf_test();
+  //multi_search_perf_test();
+  //bulk_load_perf_test();
+  //compact_perf_test();
   //read_only_perf_test();
   //write_only_perf_test();
   cout << "testing_concurrent_btree::TestSlow passed" << endl;
@@ -26,6 +26,10 @@
 #include "small_vector.h"
 #include "ownership_checker.h"
 
+#if defined(BTREE_NODE_SIMD_SEARCH) && (defined(__AVX2__) || defined(__SSE4_2__))
+#include <immintrin.h>
+#endif
+
 namespace private_ {
   template <typename T, typename P> struct u64manip;
   template <typename P>
@@ -180,6 +184,167 @@ namespace private_ {
   };
 }
 
+/**
+ * key slice search primitives used by the btree nodes. all of these operate
+ * on a sorted array of unsigned key slices keys[0, n), and count how many
+ * slices compare less than (or less than or equal to) k. since the array is
+ * sorted, the count is also the position of the first slice >= k (or > k).
+ *
+ * the SIMD versions compare 4 (AVX2) or 2 (SSE4.2) slices at a time with a
+ * compare + movemask, instead of doing a branchy binary search. x86 only has
+ * signed 64-bit compares, so both operands are biased by flipping the sign bit
+ * first. which version the nodes use is picked at compile time; the scalar
+ * versions are always available (for testing)
+ *
+ * these are called w/o any locks held, so the keys might be garbage- callers
+ * are expected to validate the node version afterwards. the only guarantee
+ * we make is that the count returned is in [0, n]
+ */
+namespace private_ {
+  static inline ALWAYS_INLINE size_t
+  scalar_count_slices_lt(const uint64_t *keys, size_t n, uint64_t k)
+  {
+    size_t lower = 0, upper = n;
+    while (lower < upper) {
+      const size_t i = (lower + upper) / 2;
+      if (keys[i] < k)
+        lower = i + 1;
+      else
+        upper = i;
+    }
+    return lower;
+  }
+
+  static inline ALWAYS_INLINE size_t
+  scalar_count_slices_le(const uint64_t *keys, size_t n, uint64_t k)
+  {
+    size_t lower = 0, upper = n;
+    while (lower < upper) {
+      const size_t i = (lower + upper) / 2;
+      if (keys[i] <= k)
+        lower = i + 1;
+      else
+        upper = i;
+    }
+    return lower;
+  }
+
+#if defined(BTREE_NODE_SIMD_SEARCH) && defined(__AVX2__)
+#define BTREE_SIMD_KEY_SEARCH "avx2"
+  static inline ALWAYS_INLINE size_t
+  simd_count_slices_gt_helper(const uint64_t *keys, size_t n, uint64_t k,
+                              size_t &i)
+  {
+    const __m256i bias = _mm256_set1_epi64x(0x8000000000000000UL);
+    const __m256i kv = _mm256_xor_si256(_mm256_set1_epi64x(k), bias);
+    size_t ngt = 0;
+    for (i = 0; i + 4 <= n; i += 4) {
+      const __m256i v = _mm256_xor_si256(
+          _mm256_loadu_si256((const __m256i *) &keys[i]), bias);
+      ngt += __builtin_popcount(_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(v, kv))));
+    }
+    return ngt;
+  }
+
+  static inline ALWAYS_INLINE size_t
+  simd_count_slices_lt_helper(const uint64_t *keys, size_t n, uint64_t k,
+                              size_t &i)
+  {
+    const __m256i bias = _mm256_set1_epi64x(0x8000000000000000UL);
+    const __m256i kv = _mm256_xor_si256(_mm256_set1_epi64x(k), bias);
+    size_t nlt = 0;
+    for (i = 0; i + 4 <= n; i += 4) {
+      const __m256i v = _mm256_xor_si256(
+          _mm256_loadu_si256((const __m256i *) &keys[i]), bias);
+      nlt += __builtin_popcount(_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(kv, v))));
+    }
+    return nlt;
+  }
+#elif defined(BTREE_NODE_SIMD_SEARCH) && defined(__SSE4_2__)
+#define BTREE_SIMD_KEY_SEARCH "sse4.2"
+  static inline ALWAYS_INLINE size_t
+  simd_count_slices_gt_helper(const uint64_t *keys, size_t n, uint64_t k,
+                              size_t &i)
+  {
+    const __m128i bias = _mm_set1_epi64x(0x8000000000000000UL);
+    const __m128i kv = _mm_xor_si128(_mm_set1_epi64x(k), bias);
+    size_t ngt = 0;
+    for (i = 0; i + 2 <= n; i += 2) {
+      const __m128i v = _mm_xor_si128(
+          _mm_loadu_si128((const __m128i *) &keys[i]), bias);
+      ngt += __builtin_popcount(_mm_movemask_pd(
+            _mm_castsi128_pd(_mm_cmpgt_epi64(v, kv))));
+    }
+    return ngt;
+  }
+
+  static inline ALWAYS_INLINE size_t
+  simd_count_slices_lt_helper(const uint64_t *keys, size_t n, uint64_t k,
+                              size_t &i)
+  {
+    const __m128i bias = _mm_set1_epi64x(0x8000000000000000UL);
+    const __m128i kv = _mm_xor_si128(_mm_set1_epi64x(k), bias);
+    size_t nlt = 0;
+    for (i = 0; i + 2 <= n; i += 2) {
+      const __m128i v = _mm_xor_si128(
+          _mm_loadu_si128((const __m128i *) &keys[i]), bias);
+      nlt += __builtin_popcount(_mm_movemask_pd(
+            _mm_castsi128_pd(_mm_cmpgt_epi64(kv, v))));
+    }
+    return nlt;
+  }
+#endif
+
+#ifdef BTREE_SIMD_KEY_SEARCH
+  static inline ALWAYS_INLINE size_t
+  simd_count_slices_lt(const uint64_t *keys, size_t n, uint64_t k)
+  {
+    size_t i;
+    size_t nlt = simd_count_slices_lt_helper(keys, n, k, i);
+    for (; i < n; i++)
+      nlt += keys[i] < k;
+    return nlt;
+  }
+
+  static inline ALWAYS_INLINE size_t
+  simd_count_slices_le(const uint64_t *keys, size_t n, uint64_t k)
+  {
+    size_t i;
+    const size_t ngt = simd_count_slices_gt_helper(keys, n, k, i);
+    size_t nle = i - ngt;
+    for (; i < n; i++)
+      nle += keys[i] <= k;
+    return nle;
+  }
+
+  static inline ALWAYS_INLINE size_t
+  count_slices_lt(const uint64_t *keys, size_t n, uint64_t k)
+  {
+    return simd_count_slices_lt(keys, n, k);
+  }
+
+  static inline ALWAYS_INLINE size_t
+  count_slices_le(const uint64_t *keys, size_t n, uint64_t k)
+  {
+    return simd_count_slices_le(keys, n, k);
+  }
+#else
+  static inline ALWAYS_INLINE size_t
+  count_slices_lt(const uint64_t *keys, size_t n, uint64_t k)
+  {
+    return scalar_count_slices_lt(keys, n, k);
+  }
+
+  static inline ALWAYS_INLINE size_t
+  count_slices_le(const uint64_t *keys, size_t n, uint64_t k)
+  {
+    return scalar_count_slices_le(keys, n, k);
+  }
+#endif
+}
+
 /**
  * manipulates a btree version
  *
@@ -477,11 +642,32 @@ public:
   }
 };
 
-struct base_btree_config {
-  static const unsigned int NKeysPerNode = 15;
+/**
+ * Node fanouts can be picked at build time (see the LEAF_KEYS and
+ * INTERNAL_KEYS options in the Makefile). Narrow leaves keep the leaf-level
+ * split/lock contention low, while wide internal nodes cut down on the height
+ * of the tree. Leaves need at least sizeof(key_slice) + 3 slots so we can
+ * always split them (up to sizeof(key_slice) + 2 keys can share a key slice)
+ */
+#ifndef BTREE_NKEYS_PER_LEAF_NODE
+#define BTREE_NKEYS_PER_LEAF_NODE 15
+#endif
+
+#ifndef BTREE_NKEYS_PER_INTERNAL_NODE
+#define BTREE_NKEYS_PER_INTERNAL_NODE 15
+#endif
+
+template <unsigned int NLeafKeys, unsigned int NInternalKeys>
+struct btree_fanout_config {
+  static const unsigned int NKeysPerLeafNode = NLeafKeys;
+  static const unsigned int NKeysPerInternalNode = NInternalKeys;
   static const bool RcuRespCaller = true;
 };
 
+typedef
+  btree_fanout_config<BTREE_NKEYS_PER_LEAF_NODE, BTREE_NKEYS_PER_INTERNAL_NODE>
+  base_btree_config;
+
 struct concurrent_btree_traits : public base_btree_config {
   typedef std::atomic<uint64_t> VersionType;
 };
@@ -521,8 +707,15 @@ public:
       disabled_rcu_region>::type rcu_region;
 
   // public to assist in testing
-  static const unsigned int NKeysPerNode    = P::NKeysPerNode;
-  static const unsigned int NMinKeysPerNode = P::NKeysPerNode / 2;
+  static const unsigned int NKeysPerLeafNode        = P::NKeysPerLeafNode;
+  static const unsigned int NMinKeysPerLeafNode     = P::NKeysPerLeafNode / 2;
+  static const unsigned int NKeysPerInternalNode    = P::NKeysPerInternalNode;
+  static const unsigned int NMinKeysPerInternalNode = P::NKeysPerInternalNode / 2;
+
+  // the node header must be able to hold the key slot count of either type
+  static const unsigned int NKeysPerNode =
+    NKeysPerLeafNode > NKeysPerInternalNode ?
+      NKeysPerLeafNode : NKeysPerInternalNode;
 
 private:
 
@@ -543,18 +736,34 @@ private:
     std::thread::id lock_owner_;
 #endif /* BTREE_LOCK_OWNERSHIP_CHECKING */
 
+#ifdef BTREE_SUBTREE_COUNTS
     /**
-     * Keys are assumed to be stored in contiguous sorted order, so that all
-     * the used slots are grouped together. That is, elems in positions
-     * [0, key_slots_used) are valid, and elems in positions
-     * [key_slots_used, NKeysPerNode) are empty
+     * Approximate number of keys reachable from this node, including the
+     * keys of the layers hanging off of it. pending_ is the part of count_
+     * which has not been pushed up into the parent yet, so a parent's count_
+     * is the sum of (count_ - pending_) over its children. Both are only
+     * ever changed with atomic adds (see btree::count_add()) and moved
+     * between nodes under their locks when nodes split or merge
+     */
+    int64_t count_;
+    int64_t pending_;
+#endif /* BTREE_SUBTREE_COUNTS */
+
+    /**
+     * Keys (leaf_node::keys_ and internal_node::keys_, which are sized by
+     * their own fanouts) are assumed to be stored in contiguous sorted order,
+     * so that all the used slots are grouped together. That is, elems in
+     * positions [0, key_slots_used) are valid, and elems in positions
+     * [key_slots_used, NKeysPer{Leaf,Internal}Node) are empty
      */
-    key_slice keys_[NKeysPerNode];
 
     node() :
       hdr_()
 #ifdef BTREE_LOCK_OWNERSHIP_CHECKING
       , lock_owner_()
+#endif
+#ifdef BTREE_SUBTREE_COUNTS
+      , count_(0), pending_(0)
 #endif
     {}
     ~node()
@@ -753,17 +962,127 @@ private:
       node *n_;
     };
 
+    key_slice keys_[NKeysPerLeafNode];
+
     key_slice min_key_; // really is min_key's key slice
-    value_or_node_ptr values_[NKeysPerNode];
+    value_or_node_ptr values_[NKeysPerLeafNode];
 
     // format is:
     // [ slice_length | type | unused ]
     // [    0:4       |  4:5 |  5:8   ]
-    uint8_t lengths_[NKeysPerNode];
+    uint8_t lengths_[NKeysPerLeafNode];
 
     leaf_node *prev_;
     leaf_node *next_;
 
+#ifdef BTREE_LEAF_SUFFIX_SLAB
+    /**
+     * all the suffixes of a leaf share a single slab. slot i names the bytes
+     * [off, off + len) of data_, packed into one word so readers always see
+     * a consistent (off, len) pair. bytes are only ever appended to a slab,
+     * so a suffix never changes under an optimistic reader (or under a
+     * varkey handed out by suffix()); once a slab runs out of room the live
+     * suffixes are copied into a new slab, and the old one is freed through
+     * RCU
+     *
+     * suffixes are stored whole, without prefix compression: search and
+     * scans hand out varkeys which point straight into the slab, which a
+     * shared prefix kept apart from the rest of the suffix would rule out
+     */
+    struct suffix_slab {
+      uint32_t capacity_;
+      uint32_t used_;
+      uint64_t slots_[NKeysPerLeafNode];
+      uint8_t data_[0];
+
+      static inline uint64_t
+      make_slot(uint32_t off, uint32_t len)
+      {
+        return (uint64_t(off) << 32) | len;
+      }
+
+      static inline uint32_t
+      slot_off(uint64_t slot)
+      {
+        return slot >> 32;
+      }
+
+      static inline uint32_t
+      slot_len(uint64_t slot)
+      {
+        return slot & 0xffffffff;
+      }
+    };
+
+    // starts out empty- once set, doesn't get freed until dtor (even if all
+    // keys w/ suffixes get removed)
+    suffix_slab *suffixes_;
+
+    inline ALWAYS_INLINE varkey
+    suffix(size_t i) const
+    {
+      const suffix_slab * const s = suffixes_;
+      if (!s)
+        return varkey();
+      const uint64_t slot = s->slots_[i];
+      INVARIANT(suffix_slab::slot_off(slot) + suffix_slab::slot_len(slot) <= s->capacity_);
+      return varkey(&s->data_[suffix_slab::slot_off(slot)], suffix_slab::slot_len(slot));
+    }
+
+    /**
+     * make sure the slab can take nkeys more suffixes of nbytes in total
+     * (besides the live suffixes of every slot but skip_slot), moving to a
+     * new slab if it cannot
+     */
+    void reserve_suffixes(size_t nbytes, size_t nkeys = 1,
+                          size_t skip_slot = NKeysPerLeafNode);
+
+    inline void
+    set_suffix(size_t i, const uint8_t *p, size_t l)
+    {
+      INVARIANT(this->is_modifying());
+      if (!suffixes_ || (suffixes_->capacity_ - suffixes_->used_) < l)
+        reserve_suffixes(l, 1, i);
+      suffix_slab * const s = suffixes_;
+      NDB_MEMCPY(&s->data_[s->used_], p, l);
+      s->slots_[i] = suffix_slab::make_slot(s->used_, l);
+      s->used_ += l;
+    }
+
+    inline void
+    clear_suffix(size_t i)
+    {
+      INVARIANT(this->is_modifying());
+      if (suffixes_)
+        suffixes_->slots_[i] = 0;
+    }
+
+    // moves the suffixes of [p, n) to the right by k slots
+    inline void
+    sift_suffixes_right(size_t p, size_t n, size_t k = 1)
+    {
+      if (suffixes_)
+        sift_right(suffixes_->slots_, p, n, k);
+    }
+
+    // moves the suffixes of [p + k, n) to the left by k slots
+    inline void
+    sift_suffixes_left(size_t p, size_t n, size_t k = 1)
+    {
+      INVARIANT(k <= n);
+      if (!suffixes_)
+        return;
+      sift_left(suffixes_->slots_, p, n, k);
+      for (size_t i = std::max(p, n - k); i < n; i++)
+        suffixes_->slots_[i] = 0;
+    }
+
+    /**
+     * moves the suffixes of src's slots [p, n) into this leaf, starting at
+     * slot dest (the slots in src are left empty)
+     */
+    void move_suffixes(size_t dest, leaf_node *src, size_t p, size_t n);
+#else
     // starts out empty- once set, doesn't get freed until dtor (even if all
     // keys w/ suffixes get removed)
     imstring *suffixes_;
@@ -781,7 +1100,7 @@ private:
     {
       INVARIANT(this->is_modifying());
       INVARIANT(!suffixes_);
-      suffixes_ = new imstring[NKeysPerNode];
+      suffixes_ = new imstring[NKeysPerLeafNode];
       //++g_evt_suffixes_array_created;
     }
 
@@ -793,6 +1112,54 @@ private:
         alloc_suffixes();
     }
 
+    inline void
+    set_suffix(size_t i, const uint8_t *p, size_t l)
+    {
+      ensure_suffixes();
+      rcu_imstring s(p, l);
+      suffixes_[i].swap(s);
+    }
+
+    inline void
+    clear_suffix(size_t i)
+    {
+      INVARIANT(this->is_modifying());
+      if (suffixes_) {
+        rcu_imstring s;
+        suffixes_[i].swap(s);
+      }
+    }
+
+    inline void
+    sift_suffixes_right(size_t p, size_t n, size_t k = 1)
+    {
+      if (suffixes_)
+        sift_swap_right(suffixes_, p, n, k);
+    }
+
+    inline void
+    sift_suffixes_left(size_t p, size_t n, size_t k = 1)
+    {
+      if (suffixes_)
+        sift_swap_left(suffixes_, p, n, k);
+    }
+
+    inline void
+    move_suffixes(size_t dest, leaf_node *src, size_t p, size_t n)
+    {
+      if (src->suffixes_) {
+        ensure_suffixes();
+        swap_with(&suffixes_[dest], src->suffixes_, p, n);
+      }
+    }
+#endif /* BTREE_LEAF_SUFFIX_SLAB */
+
+    inline void
+    set_suffix(size_t i, const varkey &k)
+    {
+      set_suffix(i, k.data(), k.size());
+    }
+
     leaf_node();
     ~leaf_node();
 
@@ -812,14 +1179,14 @@ private:
     inline size_t
     keyslice_length(size_t n) const
     {
-      INVARIANT(n < NKeysPerNode);
+      INVARIANT(n < NKeysPerLeafNode);
       return lengths_[n] & LEN_LEN_MASK;
     }
 
     inline void
     keyslice_set_length(size_t n, size_t len, bool layer)
     {
-      INVARIANT(n < NKeysPerNode);
+      INVARIANT(n < NKeysPerLeafNode);
       INVARIANT(this->is_modifying());
       INVARIANT(len <= 9);
       INVARIANT(!layer || len == 9);
@@ -829,14 +1196,14 @@ private:
     inline bool
     value_is_layer(size_t n) const
     {
-      INVARIANT(n < NKeysPerNode);
+      INVARIANT(n < NKeysPerLeafNode);
       return lengths_[n] & LEN_TYPE_MASK;
     }
 
     inline void
     value_set_layer(size_t n)
     {
-      INVARIANT(n < NKeysPerNode);
+      INVARIANT(n < NKeysPerLeafNode);
       INVARIANT(this->is_modifying());
       INVARIANT(keyslice_length(n) == 9);
       INVARIANT(!value_is_layer(n));
@@ -851,6 +1218,19 @@ private:
     key_search(key_slice k, size_t len) const
     {
       size_t n = this->key_slots_used();
+#ifdef BTREE_SIMD_KEY_SEARCH
+      // keys which share a slice are ordered by length, so scan forward
+      // from the first slot >= k
+      for (size_t i = private_::count_slices_lt(this->keys_, n, k);
+           i < n && this->keys_[i] == k; i++) {
+        const size_t len0 = this->keyslice_length(i);
+        if (len0 == len)
+          return key_search_ret(i, n);
+        if (len0 > len)
+          break;
+      }
+      return key_search_ret(-1, n);
+#else
       ssize_t lower = 0;
       ssize_t upper = n;
       while (lower < upper) {
@@ -865,6 +1245,7 @@ private:
           upper = i;
       }
       return key_search_ret(-1, n);
+#endif
     }
 
     /**
@@ -876,6 +1257,19 @@ private:
     {
       ssize_t ret = -1;
       size_t n = this->key_slots_used();
+#ifdef BTREE_SIMD_KEY_SEARCH
+      size_t i = private_::count_slices_lt(this->keys_, n, k);
+      ret = ssize_t(i) - 1;
+      for (; i < n && this->keys_[i] == k; i++) {
+        const size_t len0 = this->keyslice_length(i);
+        if (len0 == len)
+          return key_search_ret(i, n);
+        if (len0 > len)
+          break;
+        ret = i;
+      }
+      return key_search_ret(ret, n);
+#else
       ssize_t lower = 0;
       ssize_t upper = n;
       while (lower < upper) {
@@ -892,6 +1286,7 @@ private:
         }
       }
       return key_search_ret(ret, n);
+#endif
     }
 
     void
@@ -939,7 +1334,8 @@ private:
      * the responsiblity value of the min/max key, respectively, is determined
      * by the parent
      */
-    node *children_[NKeysPerNode + 1];
+    key_slice keys_[NKeysPerInternalNode];
+    node *children_[NKeysPerInternalNode + 1];
 
     internal_node();
     ~internal_node();
@@ -961,6 +1357,12 @@ private:
     key_search(key_slice k) const
     {
       size_t n = this->key_slots_used();
+#ifdef BTREE_SIMD_KEY_SEARCH
+      const size_t i = private_::count_slices_lt(this->keys_, n, k);
+      if (i < n && this->keys_[i] == k)
+        return key_search_ret(i, n);
+      return key_search_ret(-1, n);
+#else
       ssize_t lower = 0;
       ssize_t upper = n;
       while (lower < upper) {
@@ -974,6 +1376,7 @@ private:
           lower = i + 1;
       }
       return key_search_ret(-1, n);
+#endif
     }
 
     /**
@@ -985,6 +1388,12 @@ private:
     {
       ssize_t ret = -1;
       size_t n = this->key_slots_used();
+#ifdef BTREE_SIMD_KEY_SEARCH
+      // internal nodes have unique key slices, so the last slot <= k is
+      // either an exact match or the tightest lower bound
+      ret = ssize_t(private_::count_slices_le(this->keys_, n, k)) - 1;
+      return key_search_ret(ret, n);
+#else
       ssize_t lower = 0;
       ssize_t upper = n;
       while (lower < upper) {
@@ -1000,6 +1409,7 @@ private:
         }
       }
       return key_search_ret(ret, n);
+#endif
     }
 
     void
@@ -1165,6 +1575,8 @@ private:
 
   node *volatile root_;
 
+  uint32_t table_id_;
+
 public:
 
   // XXX(stephentu): trying out a very opaque node API for now
@@ -1176,10 +1588,12 @@ public:
     uint64_t new_version;
   };
 
-  btree() : root_(leaf_node::alloc())
+  btree() : root_(leaf_node::alloc()), table_id_(0)
   {
     static_assert(
-        NKeysPerNode > (sizeof(key_slice) + 2), "XX"); // so we can always do a split
+        NKeysPerLeafNode > (sizeof(key_slice) + 2), "XX"); // so we can always do a split
+    static_assert(
+        NMinKeysPerInternalNode >= 1, "XX");
     static_assert(
         NKeysPerNode <=
         (VersionManip::HDR_KEY_SLOTS_MASK >> VersionManip::HDR_KEY_SLOTS_SHIFT), "XX");
@@ -1202,6 +1616,22 @@ public:
     root_ = NULL;
   }
 
+  /**
+   * The id of the table this tree holds, which the log tags each write w/
+   * (see base_txn_btree::TableId()). 0 if not set
+   */
+  inline uint32_t
+  table_id() const
+  {
+    return table_id_;
+  }
+
+  inline void
+  set_table_id(uint32_t id)
+  {
+    table_id_ = id;
+  }
+
   /**
    * NOT THREAD SAFE
    */
@@ -1226,6 +1656,21 @@ public:
     root_->invariant_checker(NULL, NULL, NULL, NULL, true);
   }
 
+  /**
+   * Checks that the subtree counts (see count_add()) add up to the number
+   * of keys in the tree. Modifications racing with splits and merges can
+   * lose count updates, so this only holds if the tree was never modified
+   * concurrently. Not thread safe
+   */
+  inline void
+  count_invariant_checker() const
+  {
+#ifdef BTREE_SUBTREE_COUNTS
+    int64_t keys = 0;
+    count_invariant_checker(root_, keys);
+#endif /* BTREE_SUBTREE_COUNTS */
+  }
+
           /** NOTE: the public interface assumes that the caller has taken care
            * of setting up RCU */
 
@@ -1238,6 +1683,26 @@ public:
     return search_impl(k, v, ns, search_info);
   }
 
+  // how many descents multi_search() interleaves at once
+  static const size_t MultiSearchGroupSize = 16;
+
+  /**
+   * Batched version of search(): looks up keys[0, n), setting found[i], and
+   * values[i] if the key was found. If search_infos is not NULL, then
+   * search_infos[i] is set in the same way search() sets search_info.
+   *
+   * The descents of up to MultiSearchGroupSize keys proceed in lockstep, one
+   * node per key at a time. Each key's next node is prefetched before moving
+   * on to the other keys, so the cache misses of independent lookups overlap
+   * instead of being paid one after another.
+   *
+   * Returns the number of keys found
+   */
+  size_t
+  multi_search(size_t n, const key_type *keys,
+               value_type *values, bool *found,
+               versioned_node_t *search_infos = nullptr) const;
+
   /**
    * The low level callback interface is as follows:
    *
@@ -1329,6 +1794,13 @@ private:
                              const key_type *upper,
                              low_level_search_range_callback &callback) const;
 
+  bool rsearch_range_at_layer(leaf_node *leaf,
+                              string_type &prefix,
+                              const key_type *upper,
+                              bool inc_upper,
+                              const key_type *lower,
+                              low_level_search_range_callback &callback) const;
+
 public:
 
   /**
@@ -1380,15 +1852,19 @@ public:
                     low_level_search_range_callback &callback,
                     string_type *buf = nullptr) const;
 
-  // (lower, upper]
+  /**
+   * For all keys in (*lower, upper], invoke callback in descending order.
+   * If lower is NULL, then there is no lower bound
+   *
+   * Walks the leaf level right-to-left via the prev_ pointers, and provides
+   * the same weakly consistent guarantees as search_range_call(). The
+   * optional string buffer follows the same rules as well.
+   */
   void
   rsearch_range_call(const key_type &upper,
                      const key_type *lower,
                      low_level_search_range_callback &callback,
-                     std::string *buf = nullptr) const
-  {
-    NDB_UNIMPLEMENTED("rsearch_range_call");
-  }
+                     std::string *buf = nullptr) const;
 
   /**
    * Callback is expected to implement bool operator()(key_slice k, value_type v),
@@ -1413,9 +1889,108 @@ public:
                 F& callback,
                 std::string *buf = nullptr) const
   {
-    NDB_UNIMPLEMENTED("rsearch_range");
+    type_callback_wrapper<F> w(&callback);
+    rsearch_range_call(upper, lower, w, buf);
   }
 
+  /**
+   * A resumable iterator over the tree, for callers which cannot be written
+   * as a single search_range() callback (eg merge joins, paginated scans).
+   *
+   * The cursor reads up to BatchSize keys ahead with one search_range_call()
+   * (or rsearch_range_call() when moving backwards), remembering the leaf
+   * and leaf version each key was read from. Stepping onto a buffered key
+   * whose leaf has changed since re-seeks from the current key instead, so
+   * the cursor provides the same weakly consistent guarantees as
+   * search_range_call(), but between steps rather than for a whole scan.
+   *
+   * The buffered leaves are dereferenced on every step, so the cursor must
+   * be used from within a single RCU region which covers its whole lifetime
+   */
+  class cursor {
+  public:
+    static const size_t BatchSize = 32;
+
+    cursor(const btree &btr)
+      : btr_(&btr), n_(0), pos_(0) {}
+
+    // positions the cursor at the smallest key >= k
+    inline bool seek(const key_type &k) { return fill(k, false, false); }
+
+    // positions the cursor at the largest key <= k
+    inline bool rseek(const key_type &k) { return fill(k, false, true); }
+
+    // false if the cursor ran off either end of the tree, or the last seek
+    // found nothing. once invalid, the cursor must be re-seeked
+    inline bool valid() const { return pos_ < n_; }
+
+    inline const string_type &
+    key() const
+    {
+      INVARIANT(valid());
+      return entries_[pos_].key_;
+    }
+
+    inline value_type
+    value() const
+    {
+      INVARIANT(valid());
+      return entries_[pos_].value_;
+    }
+
+    // moves to the next larger key, returns valid()
+    bool next();
+
+    // moves to the next smaller key, returns valid()
+    bool prev();
+
+    /**
+     * Appends the current <key, value> pair and the ones after it (at most
+     * n pairs) to out, leaving the cursor on the first pair not appended.
+     * Returns the number of pairs appended
+     */
+    size_t next_n(size_t n,
+                  std::vector<std::pair<string_type, value_type>> &out);
+
+  private:
+    struct entry {
+      string_type key_;
+      value_type value_;
+      const node_opaque_t *node_;
+      uint64_t version_;
+    };
+
+    class fill_callback : public low_level_search_range_callback {
+    public:
+      fill_callback(cursor *c, const string_type *skip)
+        : c_(c), skip_(skip) {}
+      virtual void on_resp_node(const node_opaque_t *n, uint64_t version) {}
+      virtual bool invoke(const string_type &k, value_type v,
+                          const node_opaque_t *n, uint64_t version);
+    private:
+      cursor *const c_;
+      const string_type *const skip_;
+    };
+
+    // is the buffered entry still what its leaf holds?
+    inline bool
+    still_valid(const entry &e) const
+    {
+      return ExtractVersionNumber(e.node_) == e.version_;
+    }
+
+    // refills the buffer w/ the keys >= k (or <= k if reverse), leaving k
+    // out if exclusive
+    bool fill(const key_type &k, bool exclusive, bool reverse);
+
+    const btree *btr_;
+    std::vector<entry> entries_; // [0, n_) in ascending key order
+    size_t n_;
+    size_t pos_;
+    string_type seek_key_;
+    string_type buf_;
+  };
+
   /**
    * returns true if key k did not already exist, false otherwise
    * If k exists with a different mapping, still returns false
@@ -1457,6 +2032,85 @@ public:
     return remove_stable_location((node **) &root_, k, old_v);
   }
 
+  /**
+   * NOT THREAD SAFE
+   */
+  inline bool
+  empty() const
+  {
+    return root_->is_leaf_node() && !root_->key_slots_used();
+  }
+
+  /**
+   * Loads [begin, end) into an empty tree, where the range holds
+   * <key, value_type> pairs (the key is anything key_type can be built
+   * from) sorted in ascending key order, with no duplicate keys. The key
+   * memory must stay valid for the duration of the call.
+   *
+   * Instead of descending from the root once per key, the leaves are packed
+   * left to right, each to about fill_factor * NKeysPerLeafNode keys (keys
+   * which share a key slice are never split across leaves), and the internal
+   * levels are then built on top of them. No locks are taken and no versions
+   * are bumped, so the tree must not be accessed concurrently.
+   *
+   * Returns false (and loads nothing) if the tree is not empty
+   *
+   * NOT THREAD SAFE
+   */
+  template <typename ForwardIterator>
+  bool
+  bulk_load(ForwardIterator begin, ForwardIterator end,
+            double fill_factor = 1.0)
+  {
+    if (!empty())
+      return false;
+    std::vector<bulk_load_entry> entries;
+    for (; begin != end; ++begin)
+      entries.emplace_back(key_type(begin->first), begin->second);
+    bulk_load_impl(entries, fill_factor);
+    return true;
+  }
+
+  struct compact_stats {
+    size_t leaves_merged_;    // underfull leaves folded into their left sibling
+    size_t internals_merged_; // internal nodes folded into their left sibling
+    size_t layers_removed_;   // empty layers unlinked from their parent leaf
+    size_t layers_collapsed_; // one-key layers folded back into a key suffix
+    compact_stats()
+      : leaves_merged_(0), internals_merged_(0),
+        layers_removed_(0), layers_collapsed_(0) {}
+    inline size_t
+    nodes_reclaimed() const
+    {
+      return leaves_merged_ + internals_merged_ +
+             layers_removed_ + layers_collapsed_;
+    }
+  };
+
+  /**
+   * One online compaction pass over the tree. remove() never gives back
+   * layers (a layer whose keys are all removed stays behind as an empty
+   * leaf, and a layer down to one key is never folded back into a suffix),
+   * and it leaves leaves underfull when key slices prevent stealing or
+   * merging. Queue-like workloads accumulate both. This pass, working
+   * bottom-up:
+   *   1) unlinks empty layers from their parent leaf
+   *   2) turns layers holding a single (non-layer) key back into a suffix
+   *   3) merges adjacent underfull leaves sharing a parent, as long as the
+   *      parent does not underflow. since that blocks every merge when the
+   *      parents are minimally full too (eg after a sparse bulk_load()),
+   *      adjacent internal nodes which fit into one are merged as well
+   *
+   * Every change takes the same locks, in the same order, as remove() does,
+   * so this can run concurrently with readers and writers; anything which
+   * changes underneath the pass is simply skipped until the next one.
+   * The whole pass runs in one RCU region.
+   *
+   * Returns the number of nodes reclaimed; if stats is not null, the
+   * breakdown is stored there
+   */
+  size_t compact(compact_stats *stats = nullptr);
+
 private:
   bool
   insert_stable_location(node **root_location, const key_type &k, value_type v,
@@ -1466,6 +2120,53 @@ private:
   bool
   remove_stable_location(node **root_location, const key_type &k, value_type *old_v);
 
+  struct bulk_load_entry {
+    key_type k_;
+    value_type v_;
+    bulk_load_entry() {} // for STL
+    bulk_load_entry(const key_type &k, value_type v) : k_(k), v_(v) {}
+  };
+
+  void
+  bulk_load_impl(const std::vector<bulk_load_entry> &entries,
+                 double fill_factor);
+
+  /**
+   * builds the layer holding entries [0, n) (whose keys are relative to
+   * the layer) bottom-up, and returns its root
+   */
+  node *
+  bulk_load_layer(const bulk_load_entry *entries, size_t n,
+                  double fill_factor);
+
+  // compacts the layer (or the part of a layer) rooted at n. assumes RCU
+  // region scope
+  void compact_layer(node *n, compact_stats &stats);
+
+  // compacts the layers hanging off of leaf, then tries to reclaim them
+  void compact_leaf(leaf_node *leaf, compact_stats &stats);
+
+  enum compact_status {
+    C_NONE,
+    C_LAYER_REMOVED,
+    C_LAYER_COLLAPSED,
+  };
+
+  // tries to unlink (if empty) or fold back into leaf (if holding one key)
+  // the layer rooted at subroot
+  compact_status compact_try_collapse_layer(
+      leaf_node *leaf, node *subroot);
+
+  // merges adjacent children of parent where possible
+  void compact_merge_children(internal_node *parent, compact_stats &stats);
+
+  // tries to merge right, the (child_idx + 1)-th child of parent, into left,
+  // the child_idx-th. version is the stable version of parent which both
+  // children were read at
+  bool compact_try_merge_children(
+      internal_node *parent, uint64_t version, size_t child_idx,
+      node *left, node *right);
+
 public:
 
   /**
@@ -1492,6 +2193,18 @@ public:
   void tree_walk(tree_walk_callback &callback) const;
 
 private:
+#ifdef BTREE_SUBTREE_COUNTS
+  // rank() within the layer rooted at n
+  int64_t rank_at_layer(const node *n, const key_type &k) const;
+
+  // select() within the layer rooted at n, appending to k
+  bool select_at_layer(const node *n, int64_t i, string_type &k) const;
+
+  // checks that the counts of the layer rooted at n (counting the keys
+  // below it in keys) add up. not thread safe
+  static void count_invariant_checker(const node *n, int64_t &keys);
+#endif /* BTREE_SUBTREE_COUNTS */
+
   class size_walk_callback : public tree_walk_callback {
   public:
     size_walk_callback() : spec_size_(0), size_(0) {}
@@ -1518,6 +2231,42 @@ public:
     return c.get_size();
   }
 
+  /**
+   * The functions below answer from the subtree counts kept in every node
+   * (see count_add()) if BTREE_SUBTREE_COUNTS is defined, so they only
+   * descend the tree once. The counts are kept up to date lazily, so the
+   * answers are only estimates, even without concurrent modifications.
+   *
+   * Without BTREE_SUBTREE_COUNTS, they fall back to scanning the keys, and
+   * give the same answers size() and search_range() would
+   */
+
+  /**
+   * Estimated number of keys in the tree. Reads the root's count in
+   * constant time
+   */
+  size_t size_estimate() const;
+
+  /**
+   * Estimated number of keys strictly less than k
+   */
+  size_t rank(const key_type &k) const;
+
+  /**
+   * Estimated number of keys in [lower, *upper). If upper is NULL, then
+   * there is no upper bound
+   */
+  size_t estimate_range_count(const key_type &lower,
+                              const key_type *upper) const;
+
+  /**
+   * Sets k to the key at (about) position i of the tree, in ascending
+   * order starting at 0. If i is past the end, the largest key is picked.
+   * Returns false (leaving k arbitrary) if no key was found, eg if the
+   * tree is empty
+   */
+  bool select(size_t i, string_type &k) const;
+
   static inline uint64_t
   ExtractVersionNumber(const node_opaque_t *n)
   {
@@ -1627,6 +2376,8 @@ private:
 
   leaf_node *leftmost_descend_layer(node *n) const;
 
+  leaf_node *rightmost_descend_layer(node *n) const;
+
   /**
    * Assumes RCU region scope is held
    */
@@ -1634,6 +2385,30 @@ private:
                    typename util::vec<leaf_node *>::type &leaf_nodes,
                    versioned_node_t *search_info = nullptr) const;
 
+  // per-key state of a multi_search() descent
+  struct multi_search_state {
+    node *cur_;
+    key_type kcur_;
+    key_slice kslice_;
+    size_t kslicelen_;
+    bool done_;
+  };
+
+  enum multi_search_status {
+    MS_CONTINUE, // cur_ was advanced (or must be retried)
+    MS_FOUND,
+    MS_NOT_FOUND,
+    MS_FALLBACK, // ran into a concurrent delete, redo w/ search_impl()
+  };
+
+  /**
+   * Processes the current node of a multi_search() descent. Assumes RCU
+   * region scope is held
+   */
+  multi_search_status
+  multi_search_step(multi_search_state &s, value_type &v,
+                    versioned_node_t *search_info) const;
+
   static leaf_node *
   FindRespLeafNode(
       leaf_node *leaf, uint64_t kslice, uint64_t &version);
@@ -1641,7 +2416,8 @@ private:
   /**
    * traverses the lower leaf levels for a leaf node resp for kslice such that
    * version is stable and not deleting. resp info is given via idxmatch +
-   * idxlowerbound
+   * idxlowerbound. returns NULL if leaf was a layer root which has since
+   * been reclaimed by compact()
    *
    * if idxmatch != -1, then ignore idxlowerbound
    *
@@ -1721,8 +2497,7 @@ private:
     sift_left(leaf->keys_, pos, n);
     sift_left(leaf->values_, pos, n);
     sift_left(leaf->lengths_, pos, n);
-    if (leaf->suffixes_)
-      sift_swap_left(leaf->suffixes_, pos, n);
+    leaf->sift_suffixes_left(pos, n);
     leaf->dec_key_slots_used();
   }
 
@@ -1761,6 +2536,150 @@ private:
     {}
   };
 
+  static inline node *
+  ParentNode(const insert_parent_entry &e)
+  {
+    return e.first;
+  }
+
+  static inline node *
+  ParentNode(const remove_parent_entry &e)
+  {
+    return e.parent_;
+  }
+
+  /**
+   * A node's pending_ is pushed up into its parent once it grows past
+   * 2^-CountDriftShift of the node's count_
+   */
+  static const unsigned int CountDriftShift = 6;
+
+  /**
+   * Adds delta keys to the count of n, whose ancestors within its layer are
+   * parents (top-down, as collected on the way down by insert0() and
+   * remove0()). The parents need not be locked, and need not even still be
+   * n's ancestors- the counts are only estimates.
+   *
+   * A change only moves up one level once the pending_ of a node exceeds
+   * 2^-CountDriftShift of its count_. Since small nodes report (almost)
+   * every change, while big ones report only every so often, most updates
+   * never get past the parent of the leaf, and the root is rarely written
+   * to. In exchange, the count of every level below a node may lag behind
+   * by that fraction.
+   *
+   * n_locked says whether the caller holds the lock on n
+   */
+  template <typename ParentVec>
+  static inline void
+  count_add(node *n, int64_t delta, const ParentVec &parents,
+            bool n_locked = true)
+  {
+#ifdef BTREE_SUBTREE_COUNTS
+    auto rit = parents.rbegin();
+    if (n_locked) {
+      // nobody else changes the counts of a locked node (short of the rare
+      // unlocked layer update getting lost), so skip the atomics
+      n->count_ += delta;
+      if (rit == parents.rend() && n->is_root())
+        return;
+      const int64_t pending = n->pending_ + delta;
+      if (rit == parents.rend() ||
+          (pending <= (n->count_ >> CountDriftShift) &&
+           pending >= -(n->count_ >> CountDriftShift))) {
+        n->pending_ = pending;
+        return;
+      }
+      n->pending_ = 0;
+      delta = pending;
+      n = ParentNode(*rit++);
+    }
+    for (;; ++rit) {
+      const int64_t count = __sync_add_and_fetch(&n->count_, delta);
+      const bool top = rit == parents.rend();
+      if (top && n->is_root())
+        return;
+      const int64_t pending = n->pending_ + delta;
+      const int64_t slack = count >> CountDriftShift;
+      // with no parent at hand, the change stays pending until somebody
+      // who does know the parent comes through
+      if (top || (pending <= slack && pending >= -slack)) {
+        __sync_fetch_and_add(&n->pending_, delta);
+        return;
+      }
+      delta += __sync_lock_test_and_set(&n->pending_, 0);
+      n = ParentNode(*rit);
+    }
+#endif /* BTREE_SUBTREE_COUNTS */
+  }
+
+  // the part of n's count which its parent's count already includes
+  static inline int64_t
+  count_reported(const node *n)
+  {
+#ifdef BTREE_SUBTREE_COUNTS
+    return n->count_ - n->pending_;
+#else
+    return 0;
+#endif /* BTREE_SUBTREE_COUNTS */
+  }
+
+  // sum of the reported counts of children [begin, end) of n
+  static inline int64_t
+  count_children(const internal_node *n, size_t begin, size_t end)
+  {
+    int64_t ret = 0;
+#ifdef BTREE_SUBTREE_COUNTS
+    for (size_t i = begin; i < end; i++)
+      ret += count_reported(n->children_[i]);
+#endif /* BTREE_SUBTREE_COUNTS */
+    return ret;
+  }
+
+  // number of keys held by slots [begin, end) of n, taking the count of the
+  // layers they point to
+  static inline int64_t
+  count_slots(const leaf_node *n, size_t begin, size_t end)
+  {
+    int64_t ret = 0;
+#ifdef BTREE_SUBTREE_COUNTS
+    for (size_t i = begin; i < end; i++)
+      ret += n->value_is_layer(i) ? n->values_[i].n_->count_ : 1;
+#endif /* BTREE_SUBTREE_COUNTS */
+    return ret;
+  }
+
+  // sets the count of a node not yet reachable by other threads
+  static inline void
+  count_set(node *n, int64_t count)
+  {
+#ifdef BTREE_SUBTREE_COUNTS
+    n->count_ = count;
+    n->pending_ = 0;
+#endif /* BTREE_SUBTREE_COUNTS */
+  }
+
+  // moves count keys from src to dst, siblings which are both locked (or
+  // not yet reachable), and whose parent sees no change in their total
+  static inline void
+  count_move(node *dst, node *src, int64_t count)
+  {
+#ifdef BTREE_SUBTREE_COUNTS
+    __sync_fetch_and_add(&dst->count_, count);
+    __sync_fetch_and_sub(&src->count_, count);
+#endif /* BTREE_SUBTREE_COUNTS */
+  }
+
+  // folds the count of src into dst, where src is about to be merged into
+  // dst and released
+  static inline void
+  count_merge(node *dst, node *src)
+  {
+#ifdef BTREE_SUBTREE_COUNTS
+    __sync_fetch_and_add(&dst->count_, src->count_);
+    __sync_fetch_and_add(&dst->pending_, src->pending_);
+#endif /* BTREE_SUBTREE_COUNTS */
+  }
+
   remove_status
   remove0(node *np,
           key_slice *min_key,
@@ -29,32 +29,33 @@ btree<P>::node::base_invariant_unique_keys_check() const
     const leaf_node *leaf = AsLeaf(this);
     typedef std::pair<key_slice, size_t> leaf_key;
     leaf_key prev;
-    prev.first = keys_[0];
+    prev.first = leaf->keys_[0];
     prev.second = leaf->keyslice_length(0);
     ALWAYS_ASSERT(prev.second <= 9);
     ALWAYS_ASSERT(!leaf->value_is_layer(0) || prev.second == 9);
     if (!leaf->value_is_layer(0) && prev.second == 9) {
       ALWAYS_ASSERT(leaf->suffixes_);
-      ALWAYS_ASSERT(leaf->suffixes_[0].size() >= 1);
+      ALWAYS_ASSERT(leaf->suffix(0).size() >= 1);
     }
     for (size_t i = 1; i < n; i++) {
       leaf_key cur_key;
-      cur_key.first = keys_[i];
+      cur_key.first = leaf->keys_[i];
       cur_key.second = leaf->keyslice_length(i);
       ALWAYS_ASSERT(cur_key.second <= 9);
       ALWAYS_ASSERT(!leaf->value_is_layer(i) || cur_key.second == 9);
       if (!leaf->value_is_layer(i) && cur_key.second == 9) {
         ALWAYS_ASSERT(leaf->suffixes_);
-        ALWAYS_ASSERT(leaf->suffixes_[i].size() >= 1);
+        ALWAYS_ASSERT(leaf->suffix(i).size() >= 1);
       }
       ALWAYS_ASSERT(cur_key > prev);
       prev = cur_key;
     }
   } else {
-    key_slice prev = keys_[0];
+    const internal_node *internal = AsInternal(this);
+    key_slice prev = internal->keys_[0];
     for (size_t i = 1; i < n; i++) {
-      ALWAYS_ASSERT(keys_[i] > prev);
-      prev = keys_[i];
+      ALWAYS_ASSERT(internal->keys_[i] > prev);
+      prev = internal->keys_[i];
     }
   }
 }
@@ -69,20 +70,22 @@ btree<P>::node::base_invariant_checker(const key_slice *min_key,
   ALWAYS_ASSERT(!is_modifying());
   ALWAYS_ASSERT(this->is_root() == is_root);
   size_t n = this->key_slots_used();
-  ALWAYS_ASSERT(n <= NKeysPerNode);
+  ALWAYS_ASSERT(n <= (is_leaf_node() ? NKeysPerLeafNode : NKeysPerInternalNode));
   if (is_root) {
     if (is_internal_node())
       ALWAYS_ASSERT(n >= 1);
   } else {
     if (is_internal_node())
-      ALWAYS_ASSERT(n >= NMinKeysPerNode);
+      ALWAYS_ASSERT(n >= NMinKeysPerInternalNode);
     else
       // key-slices constrain splits
       ALWAYS_ASSERT(n >= 1);
   }
+  const key_slice *keys = is_leaf_node() ?
+    AsLeaf(this)->keys_ : AsInternal(this)->keys_;
   for (size_t i = 0; i < n; i++) {
-    ALWAYS_ASSERT(!min_key || keys_[i] >= *min_key);
-    ALWAYS_ASSERT(!max_key || keys_[i] < *max_key);
+    ALWAYS_ASSERT(!min_key || keys[i] >= *min_key);
+    ALWAYS_ASSERT(!max_key || keys[i] < *max_key);
   }
   base_invariant_unique_keys_check();
 }
@@ -115,12 +118,99 @@ btree<P>::leaf_node::leaf_node()
 template <typename P>
 btree<P>::leaf_node::~leaf_node()
 {
+#ifdef BTREE_LEAF_SUFFIX_SLAB
+  if (suffixes_)
+    delete [] (uint8_t *) suffixes_;
+#else
   if (suffixes_)
     delete [] suffixes_;
+#endif
   //suffixes_ = NULL;
   //++evt_btree_leaf_node_deletes;
 }
 
+#ifdef BTREE_LEAF_SUFFIX_SLAB
+template <typename P>
+void
+btree<P>::leaf_node::reserve_suffixes(
+    size_t nbytes, size_t nkeys, size_t skip_slot)
+{
+  INVARIANT(this->is_modifying());
+  suffix_slab * const old_slab = suffixes_;
+  if (old_slab && (old_slab->capacity_ - old_slab->used_) >= nbytes)
+    return;
+
+  size_t live = 0, nlive = 0;
+  if (old_slab)
+    for (size_t i = 0; i < NKeysPerLeafNode; i++)
+      if (i != skip_slot && suffix_slab::slot_len(old_slab->slots_[i])) {
+        live += suffix_slab::slot_len(old_slab->slots_[i]);
+        nlive++;
+      }
+
+  // make room for a full leaf of suffixes like the ones seen so far, so
+  // filling up the leaf does not have to copy them again
+  const size_t avg = (live + nbytes) / (nlive + nkeys);
+  const size_t capacity = util::round_up<size_t, 3>(
+      std::max(live + nbytes, avg * NKeysPerLeafNode));
+  INVARIANT(capacity <= std::numeric_limits<uint32_t>::max());
+  suffix_slab * const slab =
+    (suffix_slab *) new uint8_t[sizeof(suffix_slab) + capacity];
+  slab->capacity_ = capacity;
+  slab->used_ = 0;
+  for (size_t i = 0; i < NKeysPerLeafNode; i++) {
+    slab->slots_[i] = 0;
+    if (!old_slab || i == skip_slot)
+      continue;
+    const uint64_t slot = old_slab->slots_[i];
+    const uint32_t len = suffix_slab::slot_len(slot);
+    if (!len)
+      continue;
+    NDB_MEMCPY(&slab->data_[slab->used_],
+               &old_slab->data_[suffix_slab::slot_off(slot)], len);
+    slab->slots_[i] = suffix_slab::make_slot(slab->used_, len);
+    slab->used_ += len;
+  }
+
+  // readers may still be looking at the old slab
+  COMPILER_MEMORY_FENCE;
+  suffixes_ = slab;
+  if (old_slab)
+    rcu::s_instance.free_array((uint8_t *) old_slab);
+}
+
+template <typename P>
+void
+btree<P>::leaf_node::move_suffixes(
+    size_t dest, leaf_node *src, size_t p, size_t n)
+{
+  INVARIANT(this->is_modifying());
+  INVARIANT(src != this);
+  suffix_slab * const src_slab = src->suffixes_;
+  if (!src_slab)
+    return;
+  size_t nbytes = 0, nkeys = 0;
+  for (size_t i = p; i < n; i++)
+    if (suffix_slab::slot_len(src_slab->slots_[i])) {
+      nbytes += suffix_slab::slot_len(src_slab->slots_[i]);
+      nkeys++;
+    }
+  if (!nkeys && !suffixes_)
+    return;
+  if (nkeys)
+    reserve_suffixes(nbytes, nkeys);
+  for (size_t i = p; i < n; i++, dest++) {
+    const uint64_t slot = src_slab->slots_[i];
+    const uint32_t len = suffix_slab::slot_len(slot);
+    if (len)
+      set_suffix(dest, &src_slab->data_[suffix_slab::slot_off(slot)], len);
+    else
+      clear_suffix(dest);
+    src_slab->slots_[i] = 0;
+  }
+}
+#endif /* BTREE_LEAF_SUFFIX_SLAB */
+
 template <typename P>
 void
 btree<P>::leaf_node::invariant_checker_impl(const key_slice *min_key,
@@ -279,10 +369,12 @@ process:
         // found
         typename leaf_node::value_or_node_ptr vn = leaf->values_[ret];
         const bool is_layer = leaf->value_is_layer(ret);
-        INVARIANT(!is_layer || kslicelen == 9);
         varkey suffix(leaf->suffix(ret));
         if (unlikely(!leaf->check_version(version)))
           goto process;
+        // only holds once the version checks out: a reader racing with a
+        // sift can find a key slice next to another key's length byte
+        INVARIANT(!is_layer || kslicelen == 9);
         leaf_nodes.push_back(leaf);
 
         if (!is_layer) {
@@ -566,6 +658,301 @@ btree<P>::search_range_call(const key_type &lower,
   }
 }
 
+// reverse counterpart of search_range_at_layer(): emits keys in (*lower,
+// *upper] (or [.., *upper] if inc_upper) in descending order, starting at leaf
+// and walking left. a NULL bound means unbounded on that side.
+//
+// all args relative to prefix, with the same restoration guarantee as
+// search_range_at_layer()
+//
+// returns true if we keep going
+template <typename P>
+bool
+btree<P>::rsearch_range_at_layer(
+    leaf_node *leaf,
+    string_type &prefix,
+    const key_type *upper,
+    bool inc_upper,
+    const key_type *lower,
+    low_level_search_range_callback &callback) const
+{
+  VERBOSE(std::cerr << "rsearch_range_at_layer: prefix.size()=" << prefix.size() << std::endl);
+
+  key_slice last_keyslice = 0;
+  size_t last_keyslice_len = 0;
+  bool emitted_last_keyslice = false;
+  if (upper && !inc_upper) {
+    last_keyslice = upper->slice();
+    last_keyslice_len = std::min(upper->size(), size_t(9));
+    emitted_last_keyslice = true;
+  }
+
+  const key_slice upper_slice =
+    upper ? upper->slice() : std::numeric_limits<key_slice>::max();
+  const key_slice lower_slice = lower ? lower->slice() : 0;
+  key_slice next_key = upper_slice;
+  const size_t prefix_size = prefix.size();
+  string_restore<string_type> restorer(prefix, prefix_size);
+  while (true) {
+    leaf->prefetch();
+
+    typename util::vec<leaf_kvinfo>::type buf;
+    const uint64_t version = leaf->stable_version();
+    if (unlikely(RawVersionManip::IsDeleting(version))) {
+      // leaf was merged away- its keys now live in the left sibling
+      leaf_node *sibling = leaf->prev_ ? leaf->prev_ : leaf->next_;
+      INVARIANT(sibling);
+      leaf = sibling;
+      continue;
+    }
+    const key_slice leaf_min_key = leaf->min_key_;
+    if (leaf_min_key > next_key) {
+      // go left
+      leaf_node *left_sibling = leaf->prev_;
+      if (unlikely(!leaf->check_version(version)))
+        continue;
+      leaf = left_sibling;
+      INVARIANT(leaf);
+      continue;
+    }
+    leaf_node *const right_sibling = leaf->next_;
+    if (right_sibling && right_sibling->min_key_ <= next_key) {
+      // leaf split since we found it, so the keys we want moved right. see
+      // FindRespLeafNode() for why we only validate the version of leaf
+      if (unlikely(!leaf->check_version(version)))
+        continue;
+      leaf = right_sibling;
+      continue;
+    }
+
+    // grab all keys in [lower_slice, next_key]. boundary conditions are
+    // checked later (outside of the critical section)
+    for (size_t i = 0; i < leaf->key_slots_used(); i++) {
+      if (leaf->keys_[i] >= lower_slice && leaf->keys_[i] <= next_key)
+        buf.emplace_back(
+            leaf->keys_[i],
+            leaf->values_[i],
+            leaf->value_is_layer(i),
+            leaf->keyslice_length(i),
+            leaf->suffix(i));
+    }
+
+    leaf_node *const left_sibling = leaf->prev_;
+
+    if (unlikely(!leaf->check_version(version)))
+      continue;
+
+    callback.on_resp_node(leaf, RawVersionManip::Version(version));
+
+    for (ssize_t i = buf.size() - 1; i >= 0; i--) {
+      // check to see if we already emitted a key >= buf[i]: if so, don't emit it
+      if (emitted_last_keyslice &&
+          ((buf[i].key_ > last_keyslice) ||
+           (buf[i].key_ == last_keyslice && buf[i].length_ >= last_keyslice_len)))
+        continue;
+
+      // check if we are after the end
+      if (upper && buf[i].key_ == upper_slice) {
+        if (buf[i].length_ == 9) {
+          if (upper->size() <= 8)
+            continue;
+          if (!buf[i].layer_ && buf[i].suffix_ > upper->shift())
+            continue;
+        } else if (buf[i].length_ > upper->size()) {
+          continue;
+        }
+      }
+
+      // check if we are at or before the start. keys only get smaller from
+      // here on out, so we are done with this layer
+      if (lower && buf[i].key_ == lower_slice) {
+        if (buf[i].length_ <= 8) {
+          if (buf[i].length_ <= lower->size())
+            return true;
+        } else if (!buf[i].layer_) {
+          INVARIANT(buf[i].length_ == 9);
+          if (lower->size() > 8 && buf[i].suffix_ <= lower->shift())
+            return true;
+        }
+      }
+
+      const size_t ncpy = std::min(buf[i].length_, size_t(8));
+      prefix.replace(prefix_size, string_type::npos, buf[i].keyslice(), ncpy);
+      if (buf[i].layer_) {
+        // recurse into layer, carrying over any bound which shares this slice
+        leaf_node *const next_layer = rightmost_descend_layer(buf[i].vn_.n_);
+        key_type layer_upper, layer_lower;
+        const bool layer_has_upper =
+          upper && buf[i].key_ == upper_slice && upper->size() > 8;
+        const bool layer_has_lower =
+          lower && buf[i].key_ == lower_slice && lower->size() > 8;
+        if (layer_has_upper)
+          layer_upper = upper->shift();
+        if (layer_has_lower)
+          layer_lower = lower->shift();
+        if (!rsearch_range_at_layer(
+              next_layer, prefix,
+              layer_has_upper ? &layer_upper : NULL, inc_upper,
+              layer_has_lower ? &layer_lower : NULL, callback))
+          return false;
+      } else {
+        if (buf[i].length_ == 9)
+          prefix.append((const char *) buf[i].suffix_.data(), buf[i].suffix_.size());
+        if (!callback.invoke(prefix, buf[i].vn_.v_, leaf, RawVersionManip::Version(version)))
+          return false;
+      }
+      last_keyslice = buf[i].key_;
+      last_keyslice_len = buf[i].length_;
+      emitted_last_keyslice = true;
+    }
+
+    if (!left_sibling || leaf_min_key <= lower_slice)
+      // we're done
+      return true;
+
+    INVARIANT(leaf_min_key > 0);
+    next_key = leaf_min_key - 1;
+    leaf = left_sibling;
+  }
+
+  return true;
+}
+
+template <typename P>
+void
+btree<P>::rsearch_range_call(const key_type &upper,
+                             const key_type *lower,
+                             low_level_search_range_callback &callback,
+                             string_type *buf) const
+{
+  rcu_region guard;
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  if (unlikely(lower && upper <= *lower))
+    return;
+  typename util::vec<leaf_node *>::type leaf_nodes;
+  value_type v = 0;
+  search_impl(upper, v, leaf_nodes);
+  INVARIANT(!leaf_nodes.empty());
+  bool first = true;
+  string_type prefix_tmp, *prefix_px;
+  if (buf)
+    prefix_px = buf;
+  else
+    prefix_px = &prefix_tmp;
+  string_type &prefix(*prefix_px);
+  INVARIANT(prefix.empty());
+  prefix.assign((const char *) upper.data(), 8 * (leaf_nodes.size() - 1));
+  while (!leaf_nodes.empty()) {
+    leaf_node *cur = leaf_nodes.back();
+    leaf_nodes.pop_back();
+    const size_t layer_prefix_len = 8 * leaf_nodes.size();
+    // the lower bound only constrains this layer if it shares the layer's
+    // prefix- otherwise every key in the layer is already > *lower
+    key_type layer_lower;
+    bool layer_has_lower = false;
+    if (lower && lower->size() >= layer_prefix_len &&
+        memcmp(lower->data(), upper.data(), layer_prefix_len) == 0) {
+      layer_lower = lower->shift_many(leaf_nodes.size());
+      layer_has_lower = true;
+    }
+    const key_type layer_upper = upper.shift_many(leaf_nodes.size());
+#ifdef CHECK_INVARIANTS
+    string_type prefix_before(prefix);
+#endif
+    if (!rsearch_range_at_layer(
+          cur, prefix, &layer_upper, first,
+          layer_has_lower ? &layer_lower : NULL, callback))
+      return;
+#ifdef CHECK_INVARIANTS
+    INVARIANT(prefix == prefix_before);
+#endif
+    first = false;
+    if (!leaf_nodes.empty()) {
+      INVARIANT(prefix.size() >= 8);
+      prefix.resize(prefix.size() - 8);
+    }
+  }
+}
+
+template <typename P>
+bool
+btree<P>::cursor::next()
+{
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  INVARIANT(valid());
+  if (++pos_ < n_ && likely(still_valid(entries_[pos_])))
+    return true;
+  // either out of buffered keys, or the leaf changed underneath us. the
+  // last fill may have stopped at the end of the tree, but keys could have
+  // been added since, so re-seek regardless
+  return fill(key_type(entries_[pos_ - 1].key_), true, false);
+}
+
+template <typename P>
+bool
+btree<P>::cursor::prev()
+{
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  INVARIANT(valid());
+  if (pos_ > 0 && likely(still_valid(entries_[pos_ - 1]))) {
+    pos_--;
+    return true;
+  }
+  return fill(key_type(entries_[pos_].key_), true, true);
+}
+
+template <typename P>
+size_t
+btree<P>::cursor::next_n(
+    size_t n, std::vector<std::pair<string_type, value_type>> &out)
+{
+  size_t i = 0;
+  for (; i < n && valid(); i++) {
+    out.emplace_back(key(), value());
+    next();
+  }
+  return i;
+}
+
+template <typename P>
+bool
+btree<P>::cursor::fill(const key_type &k, bool exclusive, bool reverse)
+{
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  // k may point into entries_, which is about to be overwritten
+  seek_key_.assign((const char *) k.data(), k.size());
+  const key_type seek_key(seek_key_);
+  fill_callback c(this, exclusive ? &seek_key_ : nullptr);
+  n_ = pos_ = 0;
+  buf_.clear();
+  if (reverse) {
+    btr_->rsearch_range_call(seek_key, nullptr, c, &buf_);
+    std::reverse(entries_.begin(), entries_.begin() + n_);
+    pos_ = n_ ? n_ - 1 : 0;
+  } else {
+    btr_->search_range_call(seek_key, nullptr, c, &buf_);
+  }
+  return valid();
+}
+
+template <typename P>
+bool
+btree<P>::cursor::fill_callback::invoke(
+    const string_type &k, value_type v,
+    const node_opaque_t *n, uint64_t version)
+{
+  if (skip_ && k == *skip_)
+    return true;
+  if (c_->n_ == c_->entries_.size())
+    c_->entries_.emplace_back();
+  entry &e = c_->entries_[c_->n_++];
+  e.key_.assign(k);
+  e.value_ = v;
+  e.node_ = n;
+  e.version_ = version;
+  return c_->n_ < BatchSize;
+}
+
 template <typename P>
 bool
 btree<P>::remove_stable_location(node **root_location, const key_type &k, value_type *old_v)
@@ -614,6 +1001,573 @@ retry:
   return false;
 }
 
+template <typename P>
+void
+btree<P>::bulk_load_impl(const std::vector<bulk_load_entry> &entries,
+                         double fill_factor)
+{
+  INVARIANT(empty());
+  INVARIANT(fill_factor > 0.0 && fill_factor <= 1.0);
+  if (entries.empty())
+    return;
+#ifdef CHECK_INVARIANTS
+  for (size_t i = 1; i < entries.size(); i++)
+    INVARIANT(entries[i - 1].k_ < entries[i].k_);
+#endif
+  rcu_region guard;
+  node * const new_root =
+    bulk_load_layer(&entries[0], entries.size(), fill_factor);
+  recursive_delete(root_);
+  root_ = new_root;
+}
+
+template <typename P>
+typename btree<P>::node *
+btree<P>::bulk_load_layer(const bulk_load_entry *entries, size_t n,
+                          double fill_factor)
+{
+  INVARIANT(n > 0);
+
+  // build the leaf level: all the keys which share a key slice go into the
+  // same leaf, and take at most 10 slots (one per length in [0, 8], plus one
+  // for either a suffix or the next layer)
+  const size_t leaf_fill =
+    std::min(
+        std::max(size_t(fill_factor * NKeysPerLeafNode), size_t(1)),
+        size_t(NKeysPerLeafNode));
+  std::vector<node *> level;
+  std::vector<key_slice> min_keys;
+  leaf_node *leaf = NULL;
+  size_t i = 0;
+  while (i < n) {
+    const key_slice kslice = entries[i].k_.slice();
+    size_t j = i;
+    size_t nslots = 0;
+    for (; j < n && entries[j].k_.slice() == kslice; j++)
+      if (entries[j].k_.size() <= 8)
+        nslots++;
+    // the keys sharing a slice are ordered by length, and the ones which
+    // don't fit in the slice come last
+    if (entries[j - 1].k_.size() > 8)
+      nslots++;
+
+    if (!leaf || leaf->key_slots_used() + nslots > leaf_fill) {
+      leaf_node * const new_leaf = leaf_node::alloc();
+#ifdef CHECK_INVARIANTS
+      new_leaf->lock();
+      new_leaf->mark_modifying();
+#endif /* CHECK_INVARIANTS */
+      if (leaf) {
+        new_leaf->min_key_ = kslice;
+        new_leaf->prev_ = leaf;
+        leaf->next_ = new_leaf;
+      }
+      level.push_back(new_leaf);
+      min_keys.push_back(new_leaf->min_key_);
+      leaf = new_leaf;
+    }
+
+    for (; i < j && entries[i].k_.size() <= 8; i++) {
+      const size_t pos = leaf->key_slots_used();
+      leaf->keys_[pos] = kslice;
+      leaf->values_[pos].v_ = entries[i].v_;
+      leaf->keyslice_set_length(pos, entries[i].k_.size(), false);
+      leaf->inc_key_slots_used();
+    }
+    if (i == j)
+      continue;
+
+    const size_t pos = leaf->key_slots_used();
+    leaf->keys_[pos] = kslice;
+    if (j - i == 1) {
+      leaf->values_[pos].v_ = entries[i].v_;
+      leaf->keyslice_set_length(pos, 9, false);
+      leaf->set_suffix(pos, entries[i].k_.shift());
+    } else {
+      std::vector<bulk_load_entry> sub_entries;
+      sub_entries.reserve(j - i);
+      for (size_t k = i; k < j; k++)
+        sub_entries.emplace_back(entries[k].k_.shift(), entries[k].v_);
+      leaf->values_[pos].n_ =
+        bulk_load_layer(&sub_entries[0], sub_entries.size(), fill_factor);
+      leaf->keyslice_set_length(pos, 9, true);
+    }
+    leaf->inc_key_slots_used();
+    i = j;
+  }
+
+  for (auto n : level)
+    count_set(n, count_slots(AsLeaf(n), 0, n->key_slots_used()));
+
+  // build the internal levels on top, splitting each level evenly between
+  // as many nodes as the fill factor asks for, but never so many that a
+  // node would end up with fewer than NMinKeysPerInternalNode keys
+  const size_t internal_fill =
+    std::min(
+        std::max(size_t(fill_factor * (NKeysPerInternalNode + 1)),
+                 size_t(NMinKeysPerInternalNode + 1)),
+        size_t(NKeysPerInternalNode + 1));
+  for (;;) {
+    if (level.size() == 1)
+      level[0]->set_root();
+#ifdef CHECK_INVARIANTS
+    for (auto n : level)
+      n->unlock();
+#endif /* CHECK_INVARIANTS */
+    if (level.size() == 1)
+      return level[0];
+
+    const size_t nchildren = level.size();
+    size_t nnodes = (nchildren + internal_fill - 1) / internal_fill;
+    while (nnodes > 1 && nchildren / nnodes < NMinKeysPerInternalNode + 1)
+      nnodes--;
+    INVARIANT((nchildren + nnodes - 1) / nnodes <= NKeysPerInternalNode + 1);
+
+    std::vector<node *> parent_level;
+    std::vector<key_slice> parent_min_keys;
+    size_t c = 0;
+    for (size_t p = 0; p < nnodes; p++) {
+      const size_t nc = nchildren / nnodes + (p < nchildren % nnodes ? 1 : 0);
+      internal_node * const internal = internal_node::alloc();
+#ifdef CHECK_INVARIANTS
+      internal->lock();
+      internal->mark_modifying();
+#endif /* CHECK_INVARIANTS */
+      internal->children_[0] = level[c];
+      for (size_t k = 1; k < nc; k++) {
+        internal->keys_[k - 1] = min_keys[c + k];
+        internal->children_[k] = level[c + k];
+      }
+      internal->set_key_slots_used(nc - 1);
+      count_set(internal, count_children(internal, 0, nc));
+      parent_level.push_back(internal);
+      parent_min_keys.push_back(min_keys[c]);
+      c += nc;
+    }
+    INVARIANT(c == nchildren);
+    level.swap(parent_level);
+    min_keys.swap(parent_min_keys);
+  }
+}
+
+template <typename P>
+size_t
+btree<P>::compact(compact_stats *stats)
+{
+  static event_counter evt_btree_compact_leaves_merged(
+      util::cxx_typename<btree<P>>::value() +
+      std::string("_btree_compact_leaves_merged"));
+  static event_counter evt_btree_compact_internals_merged(
+      util::cxx_typename<btree<P>>::value() +
+      std::string("_btree_compact_internals_merged"));
+  static event_counter evt_btree_compact_layers_removed(
+      util::cxx_typename<btree<P>>::value() +
+      std::string("_btree_compact_layers_removed"));
+  static event_counter evt_btree_compact_layers_collapsed(
+      util::cxx_typename<btree<P>>::value() +
+      std::string("_btree_compact_layers_collapsed"));
+  compact_stats s;
+  {
+    rcu_region guard;
+    compact_layer(root_, s);
+  }
+  evt_btree_compact_leaves_merged += s.leaves_merged_;
+  evt_btree_compact_internals_merged += s.internals_merged_;
+  evt_btree_compact_layers_removed += s.layers_removed_;
+  evt_btree_compact_layers_collapsed += s.layers_collapsed_;
+  if (stats)
+    *stats = s;
+  return s.nodes_reclaimed();
+}
+
+template <typename P>
+void
+btree<P>::compact_layer(node *n, compact_stats &stats)
+{
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  n->prefetch();
+  if (leaf_node *leaf = AsLeafCheck(n)) {
+    compact_leaf(leaf, stats);
+    return;
+  }
+
+  // compaction is best effort: if this node changes while we snapshot its
+  // children, we leave it for the next pass
+  internal_node *internal = AsInternal(n);
+  node *children[NKeysPerInternalNode + 1];
+  const uint64_t version = internal->stable_version();
+  if (unlikely(RawVersionManip::IsDeleting(version)))
+    return;
+  const size_t nchildren = internal->key_slots_used() + 1;
+  copy_into(&children[0], internal->children_, 0, nchildren);
+  if (unlikely(!internal->check_version(version)))
+    return;
+  for (size_t i = 0; i < nchildren; i++)
+    compact_layer(children[i], stats);
+  compact_merge_children(internal, stats);
+}
+
+template <typename P>
+void
+btree<P>::compact_merge_children(internal_node *parent, compact_stats &stats)
+{
+  // a successful merge pulls the next child into position i, so we retry at
+  // the same position
+  size_t i = 0;
+  while (true) {
+    const uint64_t version = parent->stable_version();
+    if (unlikely(RawVersionManip::IsDeleting(version)))
+      return;
+    if (i >= parent->key_slots_used())
+      return;
+    node *left = parent->children_[i];
+    node *right = parent->children_[i + 1];
+    if (unlikely(!parent->check_version(version)))
+      return;
+    if (!compact_try_merge_children(parent, version, i, left, right)) {
+      i++;
+      continue;
+    }
+    if (left->is_leaf_node()) {
+      stats.leaves_merged_++;
+    } else {
+      stats.internals_merged_++;
+      // left now has room to give up keys, which may unblock merges of its
+      // children
+      compact_merge_children(AsInternal(left), stats);
+    }
+  }
+}
+
+template <typename P>
+void
+btree<P>::compact_leaf(leaf_node *leaf, compact_stats &stats)
+{
+  size_t i = 0;
+  while (true) {
+    const uint64_t version = leaf->stable_version();
+    if (unlikely(RawVersionManip::IsDeleting(version)))
+      return;
+    if (i >= leaf->key_slots_used())
+      return;
+    const bool is_layer = leaf->value_is_layer(i);
+    node *const subroot = leaf->values_[i].n_;
+    if (unlikely(!leaf->check_version(version)))
+      // just re-read slot i
+      continue;
+    if (!is_layer) {
+      i++;
+      continue;
+    }
+    compact_layer(subroot, stats);
+    switch (compact_try_collapse_layer(leaf, subroot)) {
+    case C_NONE:
+      i++;
+      break;
+    case C_LAYER_REMOVED:
+      // slot i now holds the next key
+      stats.layers_removed_++;
+      break;
+    case C_LAYER_COLLAPSED:
+      stats.layers_collapsed_++;
+      i++;
+      break;
+    }
+  }
+}
+
+template <typename P>
+typename btree<P>::compact_status
+btree<P>::compact_try_collapse_layer(leaf_node *leaf, node *subroot)
+{
+  leaf_node *const sub = AsLeafCheck(subroot);
+  if (!sub)
+    return C_NONE;
+  {
+    const uint64_t version = sub->stable_version();
+    if (unlikely(RawVersionManip::IsDeleting(version)))
+      return C_NONE;
+    const size_t n = sub->key_slots_used();
+    const bool can_collapse =
+      n == 0 || (n == 1 && !sub->value_is_layer(0));
+    if (!can_collapse || !sub->check_version(version))
+      return C_NONE;
+  }
+
+  // same lock order as remove(): the layer root before the leaf which
+  // points to it
+  typename util::vec<node *>::type locked_nodes;
+  sub->lock();
+  locked_nodes.push_back(sub);
+  const size_t sub_n = sub->key_slots_used();
+  if (unlikely(sub->is_deleting() ||
+               sub_n > 1 ||
+               (sub_n == 1 && sub->value_is_layer(0))))
+    return UnlockAndReturn(locked_nodes, C_NONE);
+  leaf->lock();
+  locked_nodes.push_back(leaf);
+  if (unlikely(leaf->is_deleting()))
+    return UnlockAndReturn(locked_nodes, C_NONE);
+  const size_t n = leaf->key_slots_used();
+  ssize_t pos = -1;
+  for (size_t i = 0; i < n; i++)
+    if (leaf->value_is_layer(i) && leaf->values_[i].n_ == sub) {
+      pos = i;
+      break;
+    }
+  if (unlikely(pos == -1))
+    return UnlockAndReturn(locked_nodes, C_NONE);
+
+  if (!sub_n) {
+    // a non-root leaf must keep at least one key
+    if (n == 1 && !leaf->is_root())
+      return UnlockAndReturn(locked_nodes, C_NONE);
+    leaf->mark_modifying();
+    sub->mark_modifying();
+    leaf_node::release(sub);
+    leaf->keyslice_set_length(pos, 9, false);
+    remove_pos_from_leaf_node(leaf, pos, n);
+    return UnlockAndReturn(locked_nodes, C_LAYER_REMOVED);
+  }
+
+  // the suffix (relative to leaf) of the remaining key is its key slice
+  // followed by its own suffix, if any
+  const size_t sub_len = sub->keyslice_length(0);
+  INVARIANT(sub_len >= 1);
+  const key_slice sub_key_big_endian =
+    util::big_endian_trfm<key_slice>()(sub->keys_[0]);
+  std::string suffix(
+      (const char *) &sub_key_big_endian, std::min(sub_len, size_t(8)));
+  if (sub_len == 9) {
+    const varkey sub_suffix(sub->suffix(0));
+    suffix.append((const char *) sub_suffix.data(), sub_suffix.size());
+  }
+
+  // see the comment in insert0() for why we must mark modifying here
+  leaf->mark_modifying();
+  sub->mark_modifying();
+  leaf->values_[pos].v_ = sub->values_[0].v_;
+  leaf->keyslice_set_length(pos, 9, false);
+  leaf->set_suffix(pos, varkey(suffix));
+  leaf_node::release(sub);
+  return UnlockAndReturn(locked_nodes, C_LAYER_COLLAPSED);
+}
+
+template <typename P>
+bool
+btree<P>::compact_try_merge_children(
+    internal_node *parent, uint64_t version, size_t child_idx,
+    node *left, node *right)
+{
+  // leaves are only merged if one side is underfull (remove() already merges
+  // leaves falling below NMinKeysPerLeafNode whenever it can). internal nodes
+  // never fall below NMinKeysPerInternalNode, so those are merged whenever
+  // they fit (which requires both to be about minimally full). either way,
+  // the parent must be able to give up a key without underflowing
+  const bool is_leaf = left->is_leaf_node();
+  const size_t parent_n = parent->key_slots_used();
+  if (parent->is_root() ? parent_n <= 1 : parent_n <= NMinKeysPerInternalNode)
+    return false;
+  const auto can_merge = [is_leaf](size_t left_n, size_t right_n) {
+    if (is_leaf)
+      return left_n + right_n <= NKeysPerLeafNode &&
+             std::min(left_n, right_n) < NMinKeysPerLeafNode;
+    return left_n + right_n + 1 <= NKeysPerInternalNode;
+  };
+  if (!can_merge(left->key_slots_used(), right->key_slots_used()))
+    return false;
+
+  // locking discipline is left-to-right, bottom-to-top
+  typename util::vec<node *>::type locked_nodes;
+  left->lock();
+  locked_nodes.push_back(left);
+  right->lock();
+  locked_nodes.push_back(right);
+  parent->lock();
+  locked_nodes.push_back(parent);
+  // an unchanged parent means left and right are still its children (and
+  // thus not deleted)
+  if (unlikely(!parent->check_version(version)))
+    return UnlockAndReturn(locked_nodes, false);
+  INVARIANT(parent->key_slots_used() == parent_n);
+  INVARIANT(parent->children_[child_idx] == left);
+  INVARIANT(parent->children_[child_idx + 1] == right);
+  const size_t left_n = left->key_slots_used();
+  const size_t right_n = right->key_slots_used();
+  if (!can_merge(left_n, right_n))
+    return UnlockAndReturn(locked_nodes, false);
+
+  left->mark_modifying();
+  right->mark_modifying();
+  parent->mark_modifying();
+
+  if (is_leaf) {
+    leaf_node *const left_leaf = AsLeaf(left);
+    leaf_node *const right_leaf = AsLeaf(right);
+    INVARIANT(left_leaf->next_ == right_leaf);
+    INVARIANT(!left_n || !right_n ||
+              left_leaf->keys_[left_n - 1] < right_leaf->keys_[0]);
+
+    copy_into(&left_leaf->keys_[left_n], right_leaf->keys_, 0, right_n);
+    copy_into(&left_leaf->values_[left_n], right_leaf->values_, 0, right_n);
+    copy_into(&left_leaf->lengths_[left_n], right_leaf->lengths_, 0, right_n);
+    left_leaf->move_suffixes(left_n, right_leaf, 0, right_n);
+    left_leaf->set_key_slots_used(left_n + right_n);
+
+    // see the comments in remove0() on merging with the right sibling
+    left_leaf->next_ = right_leaf->next_;
+    if (right_leaf->next_)
+      right_leaf->next_->prev_ = left_leaf;
+
+    remove_pos_from_internal_node(parent, child_idx, child_idx + 1, parent_n);
+    count_merge(left_leaf, right_leaf);
+    leaf_node::release(right_leaf);
+  } else {
+    internal_node *const left_internal = AsInternal(left);
+    internal_node *const right_internal = AsInternal(right);
+
+    // the key separating left and right in the parent comes down between
+    // their keys
+    left_internal->keys_[left_n] = parent->keys_[child_idx];
+    copy_into(&left_internal->keys_[left_n + 1], right_internal->keys_, 0, right_n);
+    copy_into(&left_internal->children_[left_n + 1], right_internal->children_, 0, right_n + 1);
+    left_internal->set_key_slots_used(left_n + 1 + right_n);
+
+    remove_pos_from_internal_node(parent, child_idx, child_idx + 1, parent_n);
+    count_merge(left_internal, right_internal);
+    internal_node::release(right_internal);
+  }
+  return UnlockAndReturn(locked_nodes, true);
+}
+
+template <typename P>
+typename btree<P>::multi_search_status
+btree<P>::multi_search_step(multi_search_state &s, value_type &v,
+                            versioned_node_t *search_info) const
+{
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  node *const cur = s.cur_;
+  const uint64_t version = cur->stable_version();
+  if (unlikely(RawVersionManip::IsDeleting(version)))
+    return MS_FALLBACK;
+  node *next = nullptr;
+  if (leaf_node *leaf = AsLeafCheck(cur, version)) {
+    if (search_info) {
+      search_info->first = leaf;
+      search_info->second = RawVersionManip::Version(version);
+    }
+    key_search_ret kret = leaf->key_search(s.kslice_, s.kslicelen_);
+    ssize_t ret = kret.first;
+    if (ret != -1) {
+      typename leaf_node::value_or_node_ptr vn = leaf->values_[ret];
+      const bool is_layer = leaf->value_is_layer(ret);
+      varkey suffix(leaf->suffix(ret));
+      if (unlikely(!leaf->check_version(version)))
+        return MS_CONTINUE;
+      // see search_impl()
+      INVARIANT(!is_layer || s.kslicelen_ == 9);
+      if (!is_layer) {
+        if (s.kslicelen_ == 9 && suffix != s.kcur_.shift())
+          return MS_NOT_FOUND;
+        v = vn.v_;
+        return MS_FOUND;
+      }
+      // search the next layer
+      next = vn.n_;
+      s.kcur_ = s.kcur_.shift();
+      s.kslice_ = s.kcur_.slice();
+      s.kslicelen_ = std::min(s.kcur_.size(), size_t(9));
+    } else if (unlikely(s.kslice_ < leaf->min_key_)) {
+      // lost responsibility for the key during the descend, go left
+      leaf_node *left_sibling = leaf->prev_;
+      if (unlikely(!leaf->check_version(version)))
+        return MS_CONTINUE;
+      if (unlikely(!left_sibling))
+        return MS_FALLBACK;
+      next = left_sibling;
+    } else {
+      leaf_node *right_sibling = leaf->next_;
+      if (unlikely(!leaf->check_version(version)))
+        return MS_CONTINUE;
+      if (!right_sibling)
+        return MS_NOT_FOUND;
+      const uint64_t right_version = right_sibling->stable_version();
+      const key_slice right_min_key = right_sibling->min_key_;
+      if (unlikely(!right_sibling->check_version(right_version)))
+        return MS_CONTINUE;
+      if (likely(s.kslice_ < right_min_key))
+        return MS_NOT_FOUND;
+      next = right_sibling;
+    }
+  } else {
+    internal_node *internal = AsInternal(cur);
+    key_search_ret kret = internal->key_lower_bound_search(s.kslice_);
+    ssize_t ret = kret.first;
+    if (ret != -1)
+      next = internal->children_[ret + 1];
+    else
+      next = internal->children_[0];
+    if (unlikely(!internal->check_version(version)))
+      return MS_CONTINUE;
+    INVARIANT(kret.second);
+  }
+  // we don't know the type of next until we read its header, which is what
+  // we are trying to avoid stalling on, so prefetch as if it's the larger type
+  ::prefetch(next);
+  prefetch_bytes(next, std::max(size_t(LeafNodeAllocSize), size_t(InternalNodeAllocSize)));
+  s.cur_ = next;
+  return MS_CONTINUE;
+}
+
+template <typename P>
+size_t
+btree<P>::multi_search(size_t n, const key_type *keys,
+                       value_type *values, bool *found,
+                       versioned_node_t *search_infos) const
+{
+  rcu_region guard;
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  size_t nfound = 0;
+  multi_search_state states[MultiSearchGroupSize];
+  for (size_t base = 0; base < n; base += MultiSearchGroupSize) {
+    const size_t ngroup = std::min(n - base, size_t(MultiSearchGroupSize));
+    for (size_t i = 0; i < ngroup; i++) {
+      multi_search_state &s = states[i];
+      s.cur_ = root_;
+      s.kcur_ = keys[base + i];
+      s.kslice_ = s.kcur_.slice();
+      s.kslicelen_ = std::min(s.kcur_.size(), size_t(9));
+      s.done_ = false;
+    }
+    size_t nactive = ngroup;
+    while (nactive) {
+      for (size_t i = 0; i < ngroup; i++) {
+        multi_search_state &s = states[i];
+        if (s.done_)
+          continue;
+        const size_t idx = base + i;
+        versioned_node_t *const search_info =
+          search_infos ? &search_infos[idx] : nullptr;
+        const multi_search_status st =
+          multi_search_step(s, values[idx], search_info);
+        if (st == MS_CONTINUE)
+          continue;
+        s.done_ = true;
+        nactive--;
+        if (unlikely(st == MS_FALLBACK)) {
+          typename util::vec<leaf_node *>::type ns;
+          found[idx] = search_impl(keys[idx], values[idx], ns, search_info);
+        } else {
+          found[idx] = (st == MS_FOUND);
+        }
+        if (found[idx])
+          nfound++;
+      }
+    }
+  }
+  return nfound;
+}
+
 template <typename P>
 typename btree<P>::leaf_node *
 btree<P>::leftmost_descend_layer(node *n) const
@@ -631,6 +1585,23 @@ btree<P>::leftmost_descend_layer(node *n) const
   }
 }
 
+template <typename P>
+typename btree<P>::leaf_node *
+btree<P>::rightmost_descend_layer(node *n) const
+{
+  node *cur = n;
+  while (true) {
+    if (leaf_node *leaf = AsLeafCheck(cur))
+      return leaf;
+    internal_node *internal = AsInternal(cur);
+    uint64_t version = cur->stable_version();
+    node *child = internal->children_[internal->key_slots_used()];
+    if (unlikely(!internal->check_version(version)))
+      continue;
+    cur = child;
+  }
+}
+
 template <typename P>
 void
 btree<P>::tree_walk(tree_walk_callback &callback) const
@@ -696,6 +1667,262 @@ btree<P>::size_walk_callback::on_node_failure()
   spec_size_ = 0;
 }
 
+#ifdef BTREE_SUBTREE_COUNTS
+
+template <typename P>
+size_t
+btree<P>::size_estimate() const
+{
+  rcu_region guard;
+  const int64_t ret = root_->count_;
+  return ret > 0 ? ret : 0;
+}
+
+template <typename P>
+int64_t
+btree<P>::rank_at_layer(const node *n, const key_type &k) const
+{
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  const key_slice kslice = k.slice();
+  const size_t kslicelen = std::min(k.size(), size_t(9));
+  int64_t ret = 0;
+  const node *cur = n;
+  while (true) {
+    cur->prefetch();
+    const uint64_t version = cur->stable_version();
+    if (unlikely(RawVersionManip::IsDeleting(version))) {
+      // cur was merged away under us, start over
+      if (cur == n)
+        return ret;
+      ret = 0;
+      cur = n;
+      continue;
+    }
+    if (const internal_node *internal = AsInternalCheck(cur)) {
+      const key_search_ret kret = internal->key_lower_bound_search(kslice);
+      const size_t child_idx = (kret.first == -1) ? 0 : kret.first + 1;
+      int64_t before = 0;
+      for (size_t i = 0; i < child_idx; i++)
+        before += internal->children_[i]->count_;
+      const node *child = internal->children_[child_idx];
+      if (unlikely(!internal->check_version(version)))
+        continue;
+      ret += before;
+      cur = child;
+      continue;
+    }
+
+    // count the slots of the leaf before k. if k's slice points to a
+    // layer, k's rank within it comes on top
+    const leaf_node *leaf = AsLeaf(cur);
+    const size_t nslots = leaf->key_slots_used();
+    int64_t before = 0;
+    const node *layer = NULL;
+    for (size_t i = 0; i < nslots; i++) {
+      const key_slice k0 = leaf->keys_[i];
+      const size_t len0 = leaf->keyslice_length(i);
+      if (k0 > kslice || (k0 == kslice && len0 > kslicelen))
+        break;
+      if (k0 == kslice && len0 == kslicelen) {
+        if (kslicelen == 9) {
+          if (leaf->value_is_layer(i))
+            layer = leaf->values_[i].n_;
+          else if (leaf->suffix(i) < k.shift())
+            before++;
+        }
+        break;
+      }
+      before += leaf->value_is_layer(i) ? leaf->values_[i].n_->count_ : 1;
+    }
+    if (unlikely(!leaf->check_version(version)))
+      continue;
+    ret += before;
+    if (layer)
+      ret += rank_at_layer(layer, k.shift());
+    return ret;
+  }
+}
+
+template <typename P>
+bool
+btree<P>::select_at_layer(const node *n, int64_t i, string_type &k) const
+{
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  const node *cur = n;
+  int64_t idx = i;
+  while (true) {
+    cur->prefetch();
+    const uint64_t version = cur->stable_version();
+    if (unlikely(RawVersionManip::IsDeleting(version))) {
+      if (cur == n)
+        return false;
+      cur = n;
+      idx = i;
+      continue;
+    }
+    if (const internal_node *internal = AsInternalCheck(cur)) {
+      // the last child takes whatever is left over
+      const size_t n_children = internal->key_slots_used() + 1;
+      size_t child_idx = 0;
+      int64_t child_i = std::max(idx, int64_t(0));
+      for (; child_idx + 1 < n_children; child_idx++) {
+        const int64_t c = internal->children_[child_idx]->count_;
+        if (child_i < c)
+          break;
+        child_i -= std::max(c, int64_t(0));
+      }
+      const node *child = internal->children_[child_idx];
+      if (unlikely(!internal->check_version(version)))
+        continue;
+      idx = child_i;
+      cur = child;
+      continue;
+    }
+
+    const leaf_node *leaf = AsLeaf(cur);
+    const size_t nslots = leaf->key_slots_used();
+    if (!nslots) {
+      if (unlikely(!leaf->check_version(version)))
+        continue;
+      return false;
+    }
+    size_t slot = 0;
+    int64_t slot_i = std::max(idx, int64_t(0));
+    for (; slot + 1 < nslots; slot++) {
+      const int64_t c = leaf->value_is_layer(slot) ?
+        leaf->values_[slot].n_->count_ : 1;
+      if (slot_i < c)
+        break;
+      slot_i -= std::max(c, int64_t(0));
+    }
+    const key_slice slot_key_big_endian =
+      util::big_endian_trfm<key_slice>()(leaf->keys_[slot]);
+    const size_t slot_len = leaf->keyslice_length(slot);
+    const node *layer =
+      leaf->value_is_layer(slot) ? leaf->values_[slot].n_ : NULL;
+    const varkey suffix =
+      (!layer && slot_len == 9) ? varkey(leaf->suffix(slot)) : varkey();
+    if (unlikely(!leaf->check_version(version)))
+      continue;
+    k.append((const char *) &slot_key_big_endian, std::min(slot_len, size_t(8)));
+    if (layer)
+      return select_at_layer(layer, slot_i, k);
+    if (suffix.size())
+      k.append((const char *) suffix.data(), suffix.size());
+    return true;
+  }
+}
+
+template <typename P>
+size_t
+btree<P>::rank(const key_type &k) const
+{
+  rcu_region guard;
+  const int64_t ret = rank_at_layer(root_, k);
+  return ret > 0 ? ret : 0;
+}
+
+template <typename P>
+size_t
+btree<P>::estimate_range_count(const key_type &lower,
+                               const key_type *upper) const
+{
+  rcu_region guard;
+  const int64_t lo = rank_at_layer(root_, lower);
+  const int64_t hi = upper ? rank_at_layer(root_, *upper) : root_->count_;
+  return hi > lo ? hi - lo : 0;
+}
+
+template <typename P>
+bool
+btree<P>::select(size_t i, string_type &k) const
+{
+  rcu_region guard;
+  k.clear();
+  return select_at_layer(root_, i, k);
+}
+
+template <typename P>
+void
+btree<P>::count_invariant_checker(const node *n, int64_t &keys)
+{
+  // every key added to or removed from a layer is either in the count of
+  // its root already, or still pending in some node below
+  int64_t layer_keys = 0;
+  int64_t counted = 0;
+  std::vector<const node *> q;
+  q.push_back(n);
+  while (!q.empty()) {
+    const node *cur = q.back();
+    q.pop_back();
+    counted += cur == n ? cur->count_ : cur->pending_;
+    if (const leaf_node *leaf = AsLeafCheck(cur)) {
+      for (size_t i = 0; i < leaf->key_slots_used(); i++) {
+        if (leaf->value_is_layer(i))
+          count_invariant_checker(leaf->values_[i].n_, layer_keys);
+        else
+          layer_keys++;
+      }
+    } else {
+      const internal_node *internal = AsInternal(cur);
+      for (size_t i = 0; i <= internal->key_slots_used(); i++)
+        q.push_back(internal->children_[i]);
+    }
+  }
+  ALWAYS_ASSERT(counted == layer_keys);
+  keys += layer_keys;
+}
+
+#else
+
+template <typename P>
+size_t
+btree<P>::size_estimate() const
+{
+  return size();
+}
+
+template <typename P>
+size_t
+btree<P>::rank(const key_type &k) const
+{
+  return estimate_range_count(key_type(), &k);
+}
+
+template <typename P>
+size_t
+btree<P>::estimate_range_count(const key_type &lower,
+                               const key_type *upper) const
+{
+  // search_range() does not carry the upper bound into layers it reaches
+  // from the left, so stop the scan ourselves
+  size_t ret = 0;
+  auto f = [&ret, upper](const string_type &k0, value_type) {
+    if (upper && !(key_type(k0) < *upper))
+      return false;
+    ret++;
+    return true;
+  };
+  search_range(lower, nullptr, f);
+  return ret;
+}
+
+template <typename P>
+bool
+btree<P>::select(size_t i, string_type &k) const
+{
+  bool found = false;
+  auto f = [&](const string_type &k0, value_type) {
+    k.assign(k0);
+    found = true;
+    return i-- > 0;
+  };
+  search_range(key_type(), nullptr, f);
+  return found;
+}
+
+#endif /* BTREE_SUBTREE_COUNTS */
+
 template <typename P>
 typename btree<P>::leaf_node *
 btree<P>::FindRespLeafNode(
@@ -716,9 +1943,10 @@ retry:
       leaf = right;
       goto retry;
     }
-    // XXX(stephentu): not sure if we can *really* depend on this,
-    // need to convince ourselves why this is not possible!
-    ALWAYS_ASSERT(false);
+    // a deleted leaf w/o siblings is a layer root which compact() took
+    // out of its parent leaf, so the caller must start over from the top
+    INVARIANT(leaf->is_root());
+    return NULL;
   }
   if (unlikely(kslice < leaf->min_key_)) {
     // we need to go left
@@ -763,6 +1991,8 @@ btree<P>::FindRespLeafLowerBound(
       ssize_t &idxlowerbound)
 {
   leaf = FindRespLeafNode(leaf, kslice, version);
+  if (unlikely(!leaf))
+    return NULL;
 
   // use 0 for slice length, so we can a pointer <= all elements
   // with the same slice
@@ -805,6 +2035,8 @@ btree<P>::FindRespLeafExact(
       ssize_t &idxmatch)
 {
   leaf = FindRespLeafNode(leaf, kslice, version);
+  if (unlikely(!leaf))
+    return NULL;
   key_search_ret kret = leaf->key_search(kslice, kslicelen);
   idxmatch = kret.first;
   n = kret.second;
@@ -838,6 +2070,8 @@ retry_cur_leaf:
     ssize_t lenmatch, lenlowerbound;
     leaf_node *resp_leaf = FindRespLeafLowerBound(
         leaf, kslice, kslicelen, version, n, lenmatch, lenlowerbound);
+    if (unlikely(!resp_leaf))
+      return UnlockAndReturn(locked_nodes, I_RETRY);
 
     // len match case
     if (lenmatch != -1) {
@@ -879,6 +2113,9 @@ retry_cur_leaf:
         case I_NONE_MOD:
         case I_RETRY:
           INVARIANT(sub_locked_nodes.empty());
+          if (status == I_NONE_MOD)
+            // a new key went into the layer
+            count_add(resp_leaf, 1, parents, false);
           return status;
 
         case I_SPLIT:
@@ -891,6 +2128,12 @@ retry_cur_leaf:
           for (;;) {
             resp_leaf = FindRespLeafLowerBound(
                 resp_leaf, kslice, kslicelen, version, n, lenmatch, lenlowerbound);
+            // unlike above, we cannot unwind and retry here, since the
+            // subroot split is already done. nor do we need to: compact()
+            // only takes out a layer root which is empty or holds a single
+            // key which is not a layer, but this layer keeps the entry for
+            // subroot until it is unlocked (removing it needs its lock)
+            ALWAYS_ASSERT(resp_leaf);
             const uint64_t locked_version = resp_leaf->lock();
             if (likely(btree::CheckVersion(version, locked_version))) {
               locked_nodes.push_back(resp_leaf);
@@ -916,9 +2159,11 @@ retry_cur_leaf:
           new_root->children_[1] = ret;
           new_root->keys_[0] = mk;
           new_root->set_key_slots_used(1);
+          count_set(new_root, count_reported(subroot) + count_reported(ret));
           new_root->set_root();
           subroot->clear_root();
           resp_leaf->values_[lenmatch].n_ = new_root;
+          count_add(resp_leaf, 1, parents);
 
           // locks are still held here
           UnlockNodes(sub_locked_nodes);
@@ -953,16 +2198,11 @@ retry_cur_leaf:
         new_root->values_[0] = resp_leaf->values_[lenmatch];
         new_root->keyslice_set_length(0, std::min(old_slice.size(), size_t(9)), false);
         new_root->inc_key_slots_used();
-        if (new_root->keyslice_length(0) == 9) {
-          new_root->alloc_suffixes();
-          rcu_imstring i(old_slice.data() + 8, old_slice.size() - 8);
-          new_root->suffixes_[0].swap(i);
-        }
+        if (new_root->keyslice_length(0) == 9)
+          new_root->set_suffix(0, old_slice.shift());
+        count_set(new_root, 1);
         resp_leaf->values_[lenmatch].n_ = new_root;
-        {
-          rcu_imstring i;
-          resp_leaf->suffixes_[lenmatch].swap(i);
-        }
+        resp_leaf->clear_suffix(lenmatch);
         resp_leaf->value_set_layer(lenmatch);
 #ifdef CHECK_INVARIANTS
         new_root->unlock();
@@ -978,13 +2218,14 @@ retry_cur_leaf:
         if (status != I_NONE_MOD)
           INVARIANT(false);
         INVARIANT(sub_locked_nodes.empty());
+        count_add(resp_leaf, 1, parents);
         return UnlockAndReturn(locked_nodes, I_NONE_MOD);
       }
     }
 
     // lenlowerbound + 1 is the slot (0-based index) we want the new key to go
     // into, in the leaf node
-    if (n < NKeysPerNode) {
+    if (n < NKeysPerLeafNode) {
       const uint64_t locked_version = resp_leaf->lock();
       if (unlikely(!btree::CheckVersion(version, locked_version))) {
         resp_leaf->unlock();
@@ -1001,17 +2242,13 @@ retry_cur_leaf:
       resp_leaf->values_[lenlowerbound + 1].v_ = v;
       sift_right(resp_leaf->lengths_, lenlowerbound + 1, n);
       resp_leaf->keyslice_set_length(lenlowerbound + 1, kslicelen, false);
-      if (resp_leaf->suffixes_)
-        sift_swap_right(resp_leaf->suffixes_, lenlowerbound + 1, n);
-      if (kslicelen == 9) {
-        resp_leaf->ensure_suffixes();
-        rcu_imstring i(k.data() + 8, k.size() - 8);
-        resp_leaf->suffixes_[lenlowerbound + 1].swap(i);
-      } else if (resp_leaf->suffixes_) {
-        rcu_imstring i;
-        resp_leaf->suffixes_[lenlowerbound + 1].swap(i);
-      }
+      resp_leaf->sift_suffixes_right(lenlowerbound + 1, n);
+      if (kslicelen == 9)
+        resp_leaf->set_suffix(lenlowerbound + 1, k.shift());
+      else
+        resp_leaf->clear_suffix(lenlowerbound + 1);
       resp_leaf->inc_key_slots_used();
+      count_add(resp_leaf, 1, parents);
 
 //#ifdef CHECK_INVARIANTS
 //      resp_leaf->base_invariant_unique_keys_check();
@@ -1023,7 +2260,7 @@ retry_cur_leaf:
       }
       return UnlockAndReturn(locked_nodes, I_NONE_MOD);
     } else {
-      INVARIANT(n == NKeysPerNode);
+      INVARIANT(n == NKeysPerLeafNode);
 
       if (unlikely(resp_leaf != leaf))
         // sigh, we really do need parent points- if resp_leaf != leaf, then
@@ -1068,8 +2305,8 @@ retry_cur_leaf:
           // case we must grab its parent's lock
           INVARIANT(p->is_internal_node());
           size_t parent_n = p->key_slots_used();
-          INVARIANT(parent_n > 0 && parent_n <= NKeysPerNode);
-          if (parent_n < NKeysPerNode)
+          INVARIANT(parent_n > 0 && parent_n <= NKeysPerInternalNode);
+          if (parent_n < NKeysPerInternalNode)
             // can stop locking up now, since this node won't split
             break;
         }
@@ -1100,11 +2337,8 @@ retry_cur_leaf:
         new_leaf->keys_[0] = kslice;
         new_leaf->values_[0].v_ = v;
         new_leaf->keyslice_set_length(0, kslicelen, false);
-        if (kslicelen == 9) {
-          new_leaf->alloc_suffixes();
-          rcu_imstring i(k.data() + 8, k.size() - 8);
-          new_leaf->suffixes_[0].swap(i);
-        }
+        if (kslicelen == 9)
+          new_leaf->set_suffix(0, k.shift());
         new_leaf->set_key_slots_used(1);
 
       } else {
@@ -1120,27 +2354,27 @@ retry_cur_leaf:
         // partition, and indices [s, N) go into the right partition
         size_t left_split_point, right_split_point;
 
-        left_split_point = NKeysPerNode / 2;
+        left_split_point = NKeysPerLeafNode / 2;
         for (ssize_t i = left_split_point - 1; i >= 0; i--) {
           if (likely(resp_leaf->keys_[i] != resp_leaf->keys_[left_split_point]))
             break;
           left_split_point--;
         }
-        INVARIANT(left_split_point <= NKeysPerNode);
+        INVARIANT(left_split_point <= NKeysPerLeafNode);
         INVARIANT(left_split_point == 0 || resp_leaf->keys_[left_split_point - 1] != resp_leaf->keys_[left_split_point]);
 
-        right_split_point = NKeysPerNode / 2;
-        for (ssize_t i = right_split_point - 1; i >= 0 && i < ssize_t(NKeysPerNode) - 1; i++) {
+        right_split_point = NKeysPerLeafNode / 2;
+        for (ssize_t i = right_split_point - 1; i >= 0 && i < ssize_t(NKeysPerLeafNode) - 1; i++) {
           if (likely(resp_leaf->keys_[i] != resp_leaf->keys_[right_split_point]))
             break;
           right_split_point++;
         }
-        INVARIANT(right_split_point <= NKeysPerNode);
+        INVARIANT(right_split_point <= NKeysPerLeafNode);
         INVARIANT(right_split_point == 0 || resp_leaf->keys_[right_split_point - 1] != resp_leaf->keys_[right_split_point]);
 
         size_t split_point;
-        if (std::min(left_split_point, NKeysPerNode - left_split_point) <
-            std::min(right_split_point, NKeysPerNode - right_split_point))
+        if (std::min(left_split_point, NKeysPerLeafNode - left_split_point) <
+            std::min(right_split_point, NKeysPerLeafNode - right_split_point))
           split_point = right_split_point;
         else
           split_point = left_split_point;
@@ -1151,35 +2385,25 @@ retry_cur_leaf:
 
           copy_into(&new_leaf->keys_[0], resp_leaf->keys_, split_point, lenlowerbound + 1);
           new_leaf->keys_[pos] = kslice;
-          copy_into(&new_leaf->keys_[pos + 1], resp_leaf->keys_, lenlowerbound + 1, NKeysPerNode);
+          copy_into(&new_leaf->keys_[pos + 1], resp_leaf->keys_, lenlowerbound + 1, NKeysPerLeafNode);
 
           copy_into(&new_leaf->values_[0], resp_leaf->values_, split_point, lenlowerbound + 1);
           new_leaf->values_[pos].v_ = v;
-          copy_into(&new_leaf->values_[pos + 1], resp_leaf->values_, lenlowerbound + 1, NKeysPerNode);
+          copy_into(&new_leaf->values_[pos + 1], resp_leaf->values_, lenlowerbound + 1, NKeysPerLeafNode);
 
           copy_into(&new_leaf->lengths_[0], resp_leaf->lengths_, split_point, lenlowerbound + 1);
           new_leaf->keyslice_set_length(pos, kslicelen, false);
-          copy_into(&new_leaf->lengths_[pos + 1], resp_leaf->lengths_, lenlowerbound + 1, NKeysPerNode);
+          copy_into(&new_leaf->lengths_[pos + 1], resp_leaf->lengths_, lenlowerbound + 1, NKeysPerLeafNode);
 
-          if (resp_leaf->suffixes_) {
-            new_leaf->ensure_suffixes();
-            swap_with(&new_leaf->suffixes_[0], resp_leaf->suffixes_, split_point, lenlowerbound + 1);
-          }
-          if (kslicelen == 9) {
-            new_leaf->ensure_suffixes();
-            rcu_imstring i(k.data() + 8, k.size() - 8);
-            new_leaf->suffixes_[pos].swap(i);
-          } else if (new_leaf->suffixes_) {
-            rcu_imstring i;
-            new_leaf->suffixes_[pos].swap(i);
-          }
-          if (resp_leaf->suffixes_) {
-            new_leaf->ensure_suffixes();
-            swap_with(&new_leaf->suffixes_[pos + 1], resp_leaf->suffixes_, lenlowerbound + 1, NKeysPerNode);
-          }
+          new_leaf->move_suffixes(0, resp_leaf, split_point, lenlowerbound + 1);
+          if (kslicelen == 9)
+            new_leaf->set_suffix(pos, k.shift());
+          else
+            new_leaf->clear_suffix(pos);
+          new_leaf->move_suffixes(pos + 1, resp_leaf, lenlowerbound + 1, NKeysPerLeafNode);
 
           resp_leaf->set_key_slots_used(split_point);
-          new_leaf->set_key_slots_used(NKeysPerNode - split_point + 1);
+          new_leaf->set_key_slots_used(NKeysPerLeafNode - split_point + 1);
 
 #ifdef CHECK_INVARIANTS
           resp_leaf->base_invariant_unique_keys_check();
@@ -1193,13 +2417,10 @@ retry_cur_leaf:
           INVARIANT(size_t(lenlowerbound + 1) <= split_point);
 
           // put new key in original leaf
-          copy_into(&new_leaf->keys_[0], resp_leaf->keys_, split_point, NKeysPerNode);
-          copy_into(&new_leaf->values_[0], resp_leaf->values_, split_point, NKeysPerNode);
-          copy_into(&new_leaf->lengths_[0], resp_leaf->lengths_, split_point, NKeysPerNode);
-          if (resp_leaf->suffixes_) {
-            new_leaf->ensure_suffixes();
-            swap_with(&new_leaf->suffixes_[0], resp_leaf->suffixes_, split_point, NKeysPerNode);
-          }
+          copy_into(&new_leaf->keys_[0], resp_leaf->keys_, split_point, NKeysPerLeafNode);
+          copy_into(&new_leaf->values_[0], resp_leaf->values_, split_point, NKeysPerLeafNode);
+          copy_into(&new_leaf->lengths_[0], resp_leaf->lengths_, split_point, NKeysPerLeafNode);
+          new_leaf->move_suffixes(0, resp_leaf, split_point, NKeysPerLeafNode);
 
           sift_right(resp_leaf->keys_, lenlowerbound + 1, split_point);
           resp_leaf->keys_[lenlowerbound + 1] = kslice;
@@ -1207,19 +2428,14 @@ retry_cur_leaf:
           resp_leaf->values_[lenlowerbound + 1].v_ = v;
           sift_right(resp_leaf->lengths_, lenlowerbound + 1, split_point);
           resp_leaf->keyslice_set_length(lenlowerbound + 1, kslicelen, false);
-          if (resp_leaf->suffixes_)
-            sift_swap_right(resp_leaf->suffixes_, lenlowerbound + 1, split_point);
-          if (kslicelen == 9) {
-            resp_leaf->ensure_suffixes();
-            rcu_imstring i(k.data() + 8, k.size() - 8);
-            resp_leaf->suffixes_[lenlowerbound + 1].swap(i);
-          } else if (resp_leaf->suffixes_) {
-            rcu_imstring i;
-            resp_leaf->suffixes_[lenlowerbound + 1].swap(i);
-          }
+          resp_leaf->sift_suffixes_right(lenlowerbound + 1, split_point);
+          if (kslicelen == 9)
+            resp_leaf->set_suffix(lenlowerbound + 1, k.shift());
+          else
+            resp_leaf->clear_suffix(lenlowerbound + 1);
 
           resp_leaf->set_key_slots_used(split_point + 1);
-          new_leaf->set_key_slots_used(NKeysPerNode - split_point);
+          new_leaf->set_key_slots_used(NKeysPerLeafNode - split_point);
 
 #ifdef CHECK_INVARIANTS
           resp_leaf->base_invariant_unique_keys_check();
@@ -1240,6 +2456,12 @@ retry_cur_leaf:
       new_leaf->min_key_ = min_key;
       new_node = new_leaf;
 
+      // the parent will see the same total for the two halves, plus the new
+      // key
+      count_move(new_leaf, resp_leaf,
+                 count_slots(new_leaf, 0, new_leaf->key_slots_used()));
+      count_add(resp_leaf, 1, parents);
+
       if (insert_info) {
         insert_info->node = resp_leaf;
         insert_info->old_version = RawVersionManip::Version(resp_leaf->unstable_version()); // we hold lock on leaf
@@ -1277,7 +2499,7 @@ retry_cur_leaf:
     INVARIANT(new_child->key_slots_used() > 0);
     INVARIANT(n > 0);
     internal->mark_modifying();
-    if (n < NKeysPerNode) {
+    if (n < NKeysPerInternalNode) {
       sift_right(internal->keys_, child_idx, n);
       internal->keys_[child_idx] = mk;
       sift_right(internal->children_, child_idx + 1, n + 1);
@@ -1285,7 +2507,7 @@ retry_cur_leaf:
       internal->inc_key_slots_used();
       return UnlockAndReturn(locked_nodes, I_NONE_MOD);
     } else {
-      INVARIANT(n == NKeysPerNode);
+      INVARIANT(n == NKeysPerInternalNode);
       INVARIANT(ret == internal->key_lower_bound_search(mk).first);
 
       internal_node *new_internal = internal_node::alloc();
@@ -1301,50 +2523,52 @@ retry_cur_leaf:
       // (2) mk is the key we push up
       // (3) mk goes in the new node
 
-      const ssize_t split_point = NMinKeysPerNode - 1;
+      const ssize_t split_point = NMinKeysPerInternalNode - 1;
       if (ret < split_point) {
         // case (1)
         min_key = internal->keys_[split_point];
 
-        copy_into(&new_internal->keys_[0], internal->keys_, NMinKeysPerNode, NKeysPerNode);
-        copy_into(&new_internal->children_[0], internal->children_, NMinKeysPerNode, NKeysPerNode + 1);
-        new_internal->set_key_slots_used(NKeysPerNode - NMinKeysPerNode);
+        copy_into(&new_internal->keys_[0], internal->keys_, NMinKeysPerInternalNode, NKeysPerInternalNode);
+        copy_into(&new_internal->children_[0], internal->children_, NMinKeysPerInternalNode, NKeysPerInternalNode + 1);
+        new_internal->set_key_slots_used(NKeysPerInternalNode - NMinKeysPerInternalNode);
 
-        sift_right(internal->keys_, child_idx, NMinKeysPerNode - 1);
+        sift_right(internal->keys_, child_idx, NMinKeysPerInternalNode - 1);
         internal->keys_[child_idx] = mk;
-        sift_right(internal->children_, child_idx + 1, NMinKeysPerNode);
+        sift_right(internal->children_, child_idx + 1, NMinKeysPerInternalNode);
         internal->children_[child_idx + 1] = new_child;
-        internal->set_key_slots_used(NMinKeysPerNode);
+        internal->set_key_slots_used(NMinKeysPerInternalNode);
 
       } else if (ret == split_point) {
         // case (2)
         min_key = mk;
 
-        copy_into(&new_internal->keys_[0], internal->keys_, NMinKeysPerNode, NKeysPerNode);
-        copy_into(&new_internal->children_[1], internal->children_, NMinKeysPerNode + 1, NKeysPerNode + 1);
+        copy_into(&new_internal->keys_[0], internal->keys_, NMinKeysPerInternalNode, NKeysPerInternalNode);
+        copy_into(&new_internal->children_[1], internal->children_, NMinKeysPerInternalNode + 1, NKeysPerInternalNode + 1);
         new_internal->children_[0] = new_child;
-        new_internal->set_key_slots_used(NKeysPerNode - NMinKeysPerNode);
-        internal->set_key_slots_used(NMinKeysPerNode);
+        new_internal->set_key_slots_used(NKeysPerInternalNode - NMinKeysPerInternalNode);
+        internal->set_key_slots_used(NMinKeysPerInternalNode);
 
       } else {
         // case (3)
-        min_key = internal->keys_[NMinKeysPerNode];
+        min_key = internal->keys_[NMinKeysPerInternalNode];
 
-        size_t pos = child_idx - NMinKeysPerNode - 1;
+        size_t pos = child_idx - NMinKeysPerInternalNode - 1;
 
-        copy_into(&new_internal->keys_[0], internal->keys_, NMinKeysPerNode + 1, child_idx);
+        copy_into(&new_internal->keys_[0], internal->keys_, NMinKeysPerInternalNode + 1, child_idx);
         new_internal->keys_[pos] = mk;
-        copy_into(&new_internal->keys_[pos + 1], internal->keys_, child_idx, NKeysPerNode);
+        copy_into(&new_internal->keys_[pos + 1], internal->keys_, child_idx, NKeysPerInternalNode);
 
-        copy_into(&new_internal->children_[0], internal->children_, NMinKeysPerNode + 1, child_idx + 1);
+        copy_into(&new_internal->children_[0], internal->children_, NMinKeysPerInternalNode + 1, child_idx + 1);
         new_internal->children_[pos + 1] = new_child;
-        copy_into(&new_internal->children_[pos + 2], internal->children_, child_idx + 1, NKeysPerNode + 1);
+        copy_into(&new_internal->children_[pos + 2], internal->children_, child_idx + 1, NKeysPerInternalNode + 1);
 
-        new_internal->set_key_slots_used(NKeysPerNode - NMinKeysPerNode);
-        internal->set_key_slots_used(NMinKeysPerNode);
+        new_internal->set_key_slots_used(NKeysPerInternalNode - NMinKeysPerInternalNode);
+        internal->set_key_slots_used(NMinKeysPerInternalNode);
       }
 
       INVARIANT(internal->keys_[internal->key_slots_used() - 1] < new_internal->keys_[0]);
+      count_move(new_internal, internal,
+                 count_children(new_internal, 0, new_internal->key_slots_used() + 1));
       new_node = new_internal;
       return I_SPLIT;
     }
@@ -1393,6 +2617,7 @@ retry:
     new_root->children_[1] = ret;
     new_root->keys_[0] = mk;
     new_root->set_key_slots_used(1);
+    count_set(new_root, count_reported(local_root) + count_reported(ret));
     new_root->set_root();
     local_root->clear_root();
     COMPILER_MEMORY_FENCE;
@@ -1407,7 +2632,9 @@ retry:
 /**
  * remove is very tricky to get right!
  *
- * XXX: optimize remove so it holds less locks
+ * the common case only locks the leaf holding k; siblings and parents are
+ * only locked when the leaf goes empty, and steals from or merges with one
+ * of them
  */
 template <typename P>
 typename btree<P>::remove_status
@@ -1439,6 +2666,8 @@ retry_cur_leaf:
     ssize_t ret;
     leaf_node *resp_leaf = FindRespLeafExact(
         leaf, kslice, kslicelen, version, n, ret);
+    if (unlikely(!resp_leaf))
+      return UnlockAndReturn(locked_nodes, R_RETRY);
 
     if (ret == -1) {
       if (unlikely(!resp_leaf->check_version(version)))
@@ -1472,6 +2701,9 @@ retry_cur_leaf:
         case R_NONE_MOD:
         case R_RETRY:
           INVARIANT(sub_locked_nodes.empty());
+          if (status == R_NONE_MOD)
+            // a key was removed from the layer
+            count_add(resp_leaf, -1, parents, false);
           return status;
 
         case R_REPLACE_NODE:
@@ -1479,6 +2711,9 @@ retry_cur_leaf:
           for (;;) {
             resp_leaf = FindRespLeafExact(
                 resp_leaf, kslice, kslicelen, version, n, ret);
+            // the layer root cannot have been taken out by compact(), see
+            // the I_SPLIT case in insert0()
+            ALWAYS_ASSERT(resp_leaf);
             const uint64_t locked_version = resp_leaf->lock();
             if (likely(btree::CheckVersion(version, locked_version))) {
               locked_nodes.push_back(resp_leaf);
@@ -1493,9 +2728,10 @@ retry_cur_leaf:
           replace_node->set_root();
           subroot->clear_root();
           resp_leaf->values_[ret].n_ = replace_node;
+          count_add(resp_leaf, -1, parents);
 
-          // XXX: need to re-merge back when layer size becomes 1, but skip this
-          // for now
+          // layers which shrink to a single key are folded back into a
+          // suffix by compact(), not here
 
           // locks are still held here
           UnlockNodes(sub_locked_nodes);
@@ -1517,7 +2753,13 @@ retry_cur_leaf:
     }
 
     //INVARIANT(!resp_leaf->value_is_layer(ret));
-    if (n > NMinKeysPerNode) {
+
+    // leaves are allowed to fall below NMinKeysPerLeafNode (compact() merges
+    // sparse leaves back together), so a remove only needs to lock resp_leaf
+    // unless it takes the last key out of the leaf, in which case it falls
+    // back to stealing from or merging with a sibling below. this keeps
+    // removes from ever touching siblings or parents in the common case
+    if (n > 1) {
       const uint64_t locked_version = resp_leaf->lock();
       if (unlikely(!btree::CheckVersion(version, locked_version))) {
         resp_leaf->unlock();
@@ -1528,9 +2770,10 @@ retry_cur_leaf:
         *old_v = resp_leaf->values_[ret].v_;
       resp_leaf->mark_modifying();
       remove_pos_from_leaf_node(resp_leaf, ret, n);
+      count_add(resp_leaf, -1, parents);
       return UnlockAndReturn(locked_nodes, R_NONE_MOD);
     } else {
-
+      INVARIANT(n == 1);
       if (unlikely(resp_leaf != leaf))
         return UnlockAndReturn(locked_nodes, R_RETRY);
       const uint64_t locked_version = leaf->lock();
@@ -1549,19 +2792,24 @@ retry_cur_leaf:
 
       // NOTE: remember that our locking discipline is left-to-right,
       // bottom-to-top. Here, we must acquire all locks on nodes being
-      // modified in the tree. How we choose to handle removes is in the
-      // following preference:
+      // modified in the tree. The leaf is about to go empty, so we handle it
+      // in the following preference:
       //   1) steal from right node
       //   2) merge with right node
       //   3) steal from left node
       //   4) merge with left node
       //
-      // Btree invariants guarantee that at least one of the options above is
-      // available (except for the root node). We pick the right node first,
-      // because our locking discipline allows us to directly lock the right
-      // node.  If (1) and (2) cannot be satisfied, then we must first
-      // *unlock* the current node, lock the left node, relock the current
-      // node, and check nothing changed in between.
+      // Merging always fits, since the leaf contributes no keys, so one of
+      // the options above is available (except for the root node). We pick
+      // the right node first, because our locking discipline allows us to
+      // directly lock the right node. If (1) and (2) cannot be satisfied,
+      // then we must first *unlock* the current node, lock the left node,
+      // relock the current node, and check nothing changed in between.
+      //
+      // A steal takes about half of the sibling, rather than a single key
+      // slice: otherwise queue-like workloads which drain a leaf from the
+      // front would be one remove away from this path again, and would lock
+      // the parent on every remove.
 
       if (right_sibling) {
         right_sibling->lock();
@@ -1591,7 +2839,7 @@ retry_cur_leaf:
         if (unlikely(!p->check_version(p_version)))
           return UnlockAndReturn(locked_nodes, R_RETRY);
         size_t p_n = p->key_slots_used();
-        if (p_n > NMinKeysPerNode)
+        if (p_n > NMinKeysPerInternalNode)
           break;
         if (r) {
           r->lock();
@@ -1615,42 +2863,33 @@ retry_cur_leaf:
       if (right_sibling) {
         right_sibling->mark_modifying();
         size_t right_n = right_sibling->key_slots_used();
-        if (right_n > NMinKeysPerNode) {
-          // steal first contiguous key slices from right
-          INVARIANT(right_sibling->keys_[0] > leaf->keys_[n - 1]);
-
-          // indices [0, steal_point) will be taken from the right
-          size_t steal_point = 1;
-          for (size_t i = 0; i < right_n - 1; i++, steal_point++)
-            if (likely(right_sibling->keys_[i] != right_sibling->keys_[steal_point]))
-              break;
-
-          INVARIANT(steal_point <= sizeof(key_slice) + 2);
-          INVARIANT(steal_point <= right_n);
-
-          // to steal, we need to ensure:
-          // 1) we have enough room to steal
-          // 2) the right sibling will not be empty after the steal
-          if ((n - 1 + steal_point) <= NKeysPerNode && steal_point < right_n) {
-            sift_left(leaf->keys_, ret, n);
-            copy_into(&leaf->keys_[n - 1], right_sibling->keys_, 0, steal_point);
-            sift_left(leaf->values_, ret, n);
-            copy_into(&leaf->values_[n - 1], right_sibling->values_, 0, steal_point);
-            sift_left(leaf->lengths_, ret, n);
-            copy_into(&leaf->lengths_[n - 1], right_sibling->lengths_, 0, steal_point);
-            if (leaf->suffixes_)
-              sift_swap_left(leaf->suffixes_, ret, n);
-            if (right_sibling->suffixes_) {
-              leaf->ensure_suffixes();
-              swap_with(&leaf->suffixes_[n - 1], right_sibling->suffixes_, 0, steal_point);
-            }
+        if (right_n > NMinKeysPerLeafNode) {
+          // indices [0, steal_point) will be taken from the right. key
+          // slices which appear more than once must stay in the same node
+          size_t steal_point = std::max(right_n / 2, size_t(1));
+          while (steal_point < right_n &&
+                 right_sibling->keys_[steal_point - 1] ==
+                   right_sibling->keys_[steal_point])
+            steal_point++;
+
+          // the right sibling must not be empty after the steal
+          if (steal_point < right_n) {
+            INVARIANT(right_sibling->keys_[0] > leaf->keys_[n - 1]);
+            remove_pos_from_leaf_node(leaf, ret, n);
+            count_move(leaf, right_sibling,
+                       count_slots(right_sibling, 0, steal_point));
+
+            copy_into(&leaf->keys_[0], right_sibling->keys_, 0, steal_point);
+            copy_into(&leaf->values_[0], right_sibling->values_, 0, steal_point);
+            copy_into(&leaf->lengths_[0], right_sibling->lengths_, 0, steal_point);
+            leaf->move_suffixes(0, right_sibling, 0, steal_point);
 
             sift_left(right_sibling->keys_, 0, right_n, steal_point);
             sift_left(right_sibling->values_, 0, right_n, steal_point);
             sift_left(right_sibling->lengths_, 0, right_n, steal_point);
-            if (right_sibling->suffixes_)
-              sift_swap_left(right_sibling->suffixes_, 0, right_n, steal_point);
-            leaf->set_key_slots_used(n - 1 + steal_point);
+            right_sibling->sift_suffixes_left(0, right_n, steal_point);
+
+            leaf->set_key_slots_used(steal_point);
             right_sibling->set_key_slots_used(right_n - steal_point);
             new_key = right_sibling->keys_[0];
             right_sibling->min_key_ = new_key;
@@ -1658,25 +2897,17 @@ retry_cur_leaf:
 #ifdef CHECK_INVARIANTS
             leaf->base_invariant_unique_keys_check();
             right_sibling->base_invariant_unique_keys_check();
-            INVARIANT(leaf->keys_[n - 1 + steal_point - 1] < new_key);
+            INVARIANT(leaf->keys_[steal_point - 1] < new_key);
 #endif /* CHECK_INVARIANTS */
 
+            count_add(leaf, -1, parents);
             return R_STOLE_FROM_RIGHT;
-          } else {
-            // can't steal, so try merging- but only merge if we have room,
-            // otherwise just allow this node to have less elements
-            if ((n - 1 + right_n) > NKeysPerNode) {
-              INVARIANT(n > 1); // if we can't steal or merge, we must have
-                                // enough elements to just remove one w/o going empty
-              remove_pos_from_leaf_node(leaf, ret, n);
-              return UnlockAndReturn(locked_nodes, R_NONE_MOD);
-            }
           }
         }
 
         // merge right sibling into this node
         INVARIANT(right_sibling->keys_[0] > leaf->keys_[n - 1]);
-        INVARIANT((right_n + (n - 1)) <= NKeysPerNode);
+        INVARIANT((right_n + (n - 1)) <= NKeysPerLeafNode);
 
         sift_left(leaf->keys_, ret, n);
         copy_into(&leaf->keys_[n - 1], right_sibling->keys_, 0, right_n);
@@ -1687,13 +2918,8 @@ retry_cur_leaf:
         sift_left(leaf->lengths_, ret, n);
         copy_into(&leaf->lengths_[n - 1], right_sibling->lengths_, 0, right_n);
 
-        if (leaf->suffixes_)
-          sift_swap_left(leaf->suffixes_, ret, n);
-
-        if (right_sibling->suffixes_) {
-          leaf->ensure_suffixes();
-          swap_with(&leaf->suffixes_[n - 1], right_sibling->suffixes_, 0, right_n);
-        }
+        leaf->sift_suffixes_left(ret, n);
+        leaf->move_suffixes(n - 1, right_sibling, 0, right_n);
 
         leaf->set_key_slots_used(right_n + (n - 1));
         leaf->next_ = right_sibling->next_;
@@ -1712,6 +2938,8 @@ retry_cur_leaf:
 //#ifdef CHECK_INVARIANTS
 //        leaf->base_invariant_unique_keys_check();
 //#endif
+        count_merge(leaf, right_sibling);
+        count_add(leaf, -1, parents);
         leaf_node::release(right_sibling);
         return R_MERGE_WITH_RIGHT;
       }
@@ -1719,66 +2947,46 @@ retry_cur_leaf:
       if (left_sibling) {
         left_sibling->mark_modifying();
         size_t left_n = left_sibling->key_slots_used();
-        if (left_n > NMinKeysPerNode) {
-          // try to steal from left
-          INVARIANT(left_sibling->keys_[left_n - 1] < leaf->keys_[0]);
-
+        if (left_n > NMinKeysPerLeafNode) {
           // indices [steal_point, left_n) will be taken from the left
-          size_t steal_point = left_n - 1;
-          for (ssize_t i = steal_point - 1; i >= 0; i--, steal_point--)
-            if (likely(left_sibling->keys_[i] != left_sibling->keys_[steal_point]))
-              break;
-
-          size_t nstolen = left_n - steal_point;
-          INVARIANT(nstolen <= sizeof(key_slice) + 2);
-          INVARIANT(steal_point < left_n);
-
-          if ((n - 1 + nstolen) <= NKeysPerNode && steal_point > 0) {
-            sift_right(leaf->keys_, ret + 1, n, nstolen - 1);
-            sift_right(leaf->keys_, 0, ret, nstolen);
-            copy_into(&leaf->keys_[0], &left_sibling->keys_[0], left_n - nstolen, left_n);
-
-            sift_right(leaf->values_, ret + 1, n, nstolen - 1);
-            sift_right(leaf->values_, 0, ret, nstolen);
-            copy_into(&leaf->values_[0], &left_sibling->values_[0], left_n - nstolen, left_n);
-
-            sift_right(leaf->lengths_, ret + 1, n, nstolen - 1);
-            sift_right(leaf->lengths_, 0, ret, nstolen);
-            copy_into(&leaf->lengths_[0], &left_sibling->lengths_[0], left_n - nstolen, left_n);
-
-            if (leaf->suffixes_) {
-              sift_swap_right(leaf->suffixes_, ret + 1, n, nstolen - 1);
-              sift_swap_right(leaf->suffixes_, 0, ret, nstolen);
-            }
-            if (left_sibling->suffixes_) {
-              leaf->ensure_suffixes();
-              swap_with(&leaf->suffixes_[0], &left_sibling->suffixes_[0], left_n - nstolen, left_n);
-            }
-
-            left_sibling->set_key_slots_used(left_n - nstolen);
-            leaf->set_key_slots_used(n - 1 + nstolen);
+          size_t steal_point = left_n - std::max(left_n / 2, size_t(1));
+          while (steal_point > 0 &&
+                 left_sibling->keys_[steal_point - 1] ==
+                   left_sibling->keys_[steal_point])
+            steal_point--;
+
+          // the left sibling must not be empty after the steal
+          if (steal_point > 0) {
+            INVARIANT(left_sibling->keys_[left_n - 1] < leaf->keys_[0]);
+            const size_t nstolen = left_n - steal_point;
+            remove_pos_from_leaf_node(leaf, ret, n);
+            count_move(leaf, left_sibling,
+                       count_slots(left_sibling, steal_point, left_n));
+
+            copy_into(&leaf->keys_[0], left_sibling->keys_, steal_point, left_n);
+            copy_into(&leaf->values_[0], left_sibling->values_, steal_point, left_n);
+            copy_into(&leaf->lengths_[0], left_sibling->lengths_, steal_point, left_n);
+            leaf->move_suffixes(0, left_sibling, steal_point, left_n);
+
+            left_sibling->set_key_slots_used(steal_point);
+            leaf->set_key_slots_used(nstolen);
             new_key = leaf->keys_[0];
             leaf->min_key_ = new_key;
 
 #ifdef CHECK_INVARIANTS
             leaf->base_invariant_unique_keys_check();
             left_sibling->base_invariant_unique_keys_check();
-            INVARIANT(left_sibling->keys_[left_n - nstolen - 1] < new_key);
+            INVARIANT(left_sibling->keys_[steal_point - 1] < new_key);
 #endif /* CHECK_INVARIANTS */
 
+            count_add(leaf, -1, parents);
             return R_STOLE_FROM_LEFT;
-          } else {
-            if ((left_n + (n - 1)) > NKeysPerNode) {
-              INVARIANT(n > 1);
-              remove_pos_from_leaf_node(leaf, ret, n);
-              return UnlockAndReturn(locked_nodes, R_NONE_MOD);
-            }
           }
         }
 
         // merge this node into left sibling
         INVARIANT(left_sibling->keys_[left_n - 1] < leaf->keys_[0]);
-        INVARIANT((left_n + (n - 1)) <= NKeysPerNode);
+        INVARIANT((left_n + (n - 1)) <= NKeysPerLeafNode);
 
         copy_into(&left_sibling->keys_[left_n], leaf->keys_, 0, ret);
         copy_into(&left_sibling->keys_[left_n + ret], leaf->keys_, ret + 1, n);
@@ -1789,11 +2997,8 @@ retry_cur_leaf:
         copy_into(&left_sibling->lengths_[left_n], leaf->lengths_, 0, ret);
         copy_into(&left_sibling->lengths_[left_n + ret], leaf->lengths_, ret + 1, n);
 
-        if (leaf->suffixes_) {
-          left_sibling->ensure_suffixes();
-          swap_with(&left_sibling->suffixes_[left_n], leaf->suffixes_, 0, ret);
-          swap_with(&left_sibling->suffixes_[left_n + ret], leaf->suffixes_, ret + 1, n);
-        }
+        left_sibling->move_suffixes(left_n, leaf, 0, ret);
+        left_sibling->move_suffixes(left_n + ret, leaf, ret + 1, n);
 
         left_sibling->set_key_slots_used(left_n + (n - 1));
         left_sibling->next_ = leaf->next_;
@@ -1808,6 +3013,8 @@ retry_cur_leaf:
             left_sibling->prev_->next_ == left_sibling);
 
         //left_sibling->base_invariant_unique_keys_check();
+        count_merge(left_sibling, leaf);
+        count_add(left_sibling, -1, parents);
         leaf_node::release(leaf);
         return R_MERGE_WITH_LEFT;
       }
@@ -1816,6 +3023,7 @@ retry_cur_leaf:
       //INVARIANT(leaf == root);
       INVARIANT(leaf->is_root());
       remove_pos_from_leaf_node(leaf, ret, n);
+      count_add(leaf, -1, parents);
       return UnlockAndReturn(locked_nodes, R_NONE_MOD);
     }
   } else {
@@ -1885,7 +3093,7 @@ retry_cur_leaf:
             del_child_idx = child_idx + 1;
           }
 
-          if (n > NMinKeysPerNode) {
+          if (n > NMinKeysPerInternalNode) {
             remove_pos_from_internal_node(internal, del_key_idx, del_child_idx, n);
             return UnlockAndReturn(locked_nodes, R_NONE_MOD);
           }
@@ -1902,8 +3110,11 @@ retry_cur_leaf:
             INVARIANT(max_key);
             INVARIANT(right_sibling->keys_[0] > internal->keys_[n - 1]);
             INVARIANT(*max_key > internal->keys_[n - 1]);
-            if (right_n > NMinKeysPerNode) {
+            if (right_n > NMinKeysPerInternalNode) {
               // steal from right
+              count_move(internal, right_sibling,
+                         count_reported(right_sibling->children_[0]));
+
               sift_left(internal->keys_, del_key_idx, n);
               internal->keys_[n - 1] = *max_key;
 
@@ -1929,6 +3140,7 @@ retry_cur_leaf:
               copy_into(&internal->children_[n], right_sibling->children_, 0, right_n + 1);
 
               internal->set_key_slots_used(n + right_n);
+              count_merge(internal, right_sibling);
               internal_node::release(right_sibling);
               return R_MERGE_WITH_RIGHT;
             }
@@ -1941,8 +3153,11 @@ retry_cur_leaf:
             INVARIANT(left_sibling->keys_[left_n - 1] < internal->keys_[0]);
             INVARIANT(left_sibling->keys_[left_n - 1] < *min_key);
             INVARIANT(*min_key < internal->keys_[0]);
-            if (left_n > NMinKeysPerNode) {
+            if (left_n > NMinKeysPerInternalNode) {
               // steal from left
+              count_move(internal, left_sibling,
+                         count_reported(left_sibling->children_[left_n]));
+
               sift_right(internal->keys_, 0, del_key_idx);
               internal->keys_[0] = *min_key;
 
@@ -1971,6 +3186,7 @@ retry_cur_leaf:
               copy_into(&left_sibling->children_[left_child_j], internal->children_, del_child_idx + 1, n + 1);
 
               left_sibling->set_key_slots_used(n + left_n);
+              count_merge(left_sibling, internal);
               internal_node::release(internal);
               return R_MERGE_WITH_LEFT;
             }
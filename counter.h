@@ -98,6 +98,16 @@ public:
 #endif
   }
 
+  // for counters of a level (eg bytes in use) rather than of events. a
+  // core's count may wrap, the sum over the cores does not
+  inline ALWAYS_INLINE void
+  dec(uint64_t i = 1)
+  {
+#ifdef ENABLE_EVENT_COUNTERS
+    ctx_->counts_.my() -= i;
+#endif
+  }
+
   inline ALWAYS_INLINE event_counter &
   operator++()
   {
@@ -0,0 +1,195 @@
+#include <lz4.h>
+#include <lz4hc.h>
+#ifdef LOG_CODEC_ZSTD
+#include <zstd.h>
+#endif
+
+#include "log_codec.h"
+
+using namespace std;
+
+log_codec::log_codec(codec_id id, const string &name)
+  : evt_bytes_before_compress_("log_buffer_bytes_before_compress_" + name),
+    evt_bytes_after_compress_("log_buffer_bytes_after_compress_" + name),
+    id_(id), name_(name)
+{
+}
+
+namespace {
+
+  class lz4_codec : public log_codec {
+  public:
+    lz4_codec() : log_codec(CODEC_LZ4, "lz4") {}
+
+    size_t
+    state_size() const OVERRIDE
+    {
+      return LZ4_create_size();
+    }
+
+    size_t
+    compress_bound(size_t n) const OVERRIDE
+    {
+      return LZ4_compressBound(n);
+    }
+
+    size_t
+    compress(void *state, const uint8_t *src, size_t n,
+             uint8_t *dst, size_t dst_cap) OVERRIDE
+    {
+      const int ret = LZ4_compress_heap_limitedOutput(
+          state, (const char *) src, (char *) dst, n, dst_cap);
+      return ret > 0 ? ret : 0;
+    }
+
+    ssize_t
+    decompress(const uint8_t *src, size_t n,
+               uint8_t *dst, size_t dst_cap) const OVERRIDE
+    {
+      const int ret = LZ4_decompress_safe(
+          (const char *) src, (char *) dst, n, dst_cap);
+      return ret >= 0 ? ret : -1;
+    }
+
+  protected:
+    lz4_codec(codec_id id, const string &name) : log_codec(id, name) {}
+  };
+
+  // the LZ4HC encoder sets up its (large) state on every call, so there is
+  // no point in keeping one per core
+  class lz4hc_codec : public lz4_codec {
+  public:
+    lz4hc_codec() : lz4_codec(CODEC_LZ4HC, "lz4hc") {}
+
+    size_t
+    state_size() const OVERRIDE
+    {
+      return 0;
+    }
+
+    size_t
+    compress(void *state, const uint8_t *src, size_t n,
+             uint8_t *dst, size_t dst_cap) OVERRIDE
+    {
+      const int ret = LZ4_compressHC_limitedOutput(
+          (const char *) src, (char *) dst, n, dst_cap);
+      return ret > 0 ? ret : 0;
+    }
+  };
+
+#ifdef LOG_CODEC_ZSTD
+  // a thread's zstd context, created on first use and freed when the
+  // thread exits
+  template <typename T, T *(*Create)(), size_t (*Free)(T *)>
+  class zstd_ctx_holder {
+  public:
+    zstd_ctx_holder() : ctx_(nullptr) {}
+    ~zstd_ctx_holder()
+    {
+      if (ctx_)
+        Free(ctx_);
+    }
+
+    inline T *
+    get()
+    {
+      if (unlikely(!ctx_))
+        ctx_ = Create();
+      ALWAYS_ASSERT(ctx_);
+      return ctx_;
+    }
+
+  private:
+    zstd_ctx_holder(const zstd_ctx_holder &) = delete;
+    zstd_ctx_holder &operator=(const zstd_ctx_holder &) = delete;
+
+    T *ctx_;
+  };
+
+  // a zstd context is not placement constructible w/ the stable API, so
+  // each thread (the cores, the persister, recovery's readers) keeps its
+  // own instead of using the core's state
+  class zstd_codec : public log_codec {
+  public:
+    zstd_codec() : log_codec(CODEC_ZSTD, "zstd") {}
+
+    size_t
+    state_size() const OVERRIDE
+    {
+      return 0;
+    }
+
+    size_t
+    compress_bound(size_t n) const OVERRIDE
+    {
+      return ZSTD_compressBound(n);
+    }
+
+    size_t
+    compress(void *state, const uint8_t *src, size_t n,
+             uint8_t *dst, size_t dst_cap) OVERRIDE
+    {
+      const size_t ret = ZSTD_compressCCtx(
+          tl_cctx.get(), dst, dst_cap, src, n, Level);
+      return ZSTD_isError(ret) ? 0 : ret;
+    }
+
+    ssize_t
+    decompress(const uint8_t *src, size_t n,
+               uint8_t *dst, size_t dst_cap) const OVERRIDE
+    {
+      const size_t ret =
+        ZSTD_decompressDCtx(tl_dctx.get(), dst, dst_cap, src, n);
+      return ZSTD_isError(ret) ? -1 : ssize_t(ret);
+    }
+
+  private:
+    // zstd's default, which compresses about as fast as LZ4HC, but better
+    static const int Level = 3;
+
+    static thread_local
+      zstd_ctx_holder<ZSTD_CCtx, ZSTD_createCCtx, ZSTD_freeCCtx> tl_cctx;
+    static thread_local
+      zstd_ctx_holder<ZSTD_DCtx, ZSTD_createDCtx, ZSTD_freeDCtx> tl_dctx;
+  };
+
+  thread_local zstd_ctx_holder<ZSTD_CCtx, ZSTD_createCCtx, ZSTD_freeCCtx>
+    zstd_codec::tl_cctx;
+  thread_local zstd_ctx_holder<ZSTD_DCtx, ZSTD_createDCtx, ZSTD_freeDCtx>
+    zstd_codec::tl_dctx;
+#endif
+
+}
+
+log_codec *
+log_codec::Get(uint8_t id)
+{
+  for (auto c : All())
+    if (c->id() == id)
+      return c;
+  return nullptr;
+}
+
+log_codec *
+log_codec::Find(const string &name)
+{
+  for (auto c : All())
+    if (c->name() == name)
+      return c;
+  return nullptr;
+}
+
+const vector<log_codec *> &
+log_codec::All()
+{
+  // constructed on first use, so static initializers can use them too
+  static lz4_codec s_lz4;
+  static lz4hc_codec s_lz4hc;
+#ifdef LOG_CODEC_ZSTD
+  static zstd_codec s_zstd;
+  static const vector<log_codec *> s_all = {&s_lz4, &s_lz4hc, &s_zstd};
+#else
+  static const vector<log_codec *> s_all = {&s_lz4, &s_lz4hc};
+#endif
+  return s_all;
+}
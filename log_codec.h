@@ -0,0 +1,85 @@
+#ifndef _NDB_LOG_CODEC_H_
+#define _NDB_LOG_CODEC_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "macros.h"
+#include "counter.h"
+
+/**
+ * A compression codec for log buffers. A log buffer records the id() of the
+ * codec its txns were compressed w/ (see txn_logger::logbuf_header), so ids
+ * must never be reused, and recovery can read logs written w/ any mix of
+ * codecs.
+ *
+ * Codecs are singletons, see Get() and Find()
+ */
+class log_codec {
+public:
+
+  // 0 means not compressed
+  enum codec_id : uint8_t {
+    CODEC_LZ4 = 1,
+    CODEC_LZ4HC = 2, // LZ4 format, slower but better compression
+    CODEC_ZSTD = 3,  // only in builds w/ LOG_CODEC_ZSTD (make ZSTD=1)
+  };
+
+  virtual ~log_codec() {}
+
+  log_codec(const log_codec &) = delete;
+  log_codec &operator=(const log_codec &) = delete;
+
+  inline codec_id
+  id() const
+  {
+    return id_;
+  }
+
+  inline const std::string &
+  name() const
+  {
+    return name_;
+  }
+
+  // bytes of (per core) state compress() needs, 0 if none
+  virtual size_t state_size() const = 0;
+
+  // the most bytes compress() can produce from n bytes
+  virtual size_t compress_bound(size_t n) const = 0;
+
+  /**
+   * Compresses [src, src + n) into dst, which has room for dst_cap bytes.
+   * state is state_size() bytes owned by the calling core (or null if
+   * state_size() is 0). Returns the compressed size, or 0 if it does not
+   * fit
+   */
+  virtual size_t compress(void *state, const uint8_t *src, size_t n,
+                          uint8_t *dst, size_t dst_cap) = 0;
+
+  // returns the decompressed size, or -1 if src is malformed or does not
+  // fit in dst_cap bytes
+  virtual ssize_t decompress(const uint8_t *src, size_t n,
+                             uint8_t *dst, size_t dst_cap) const = 0;
+
+  // per codec log_buffer_bytes_{before,after}_compress
+  event_counter evt_bytes_before_compress_;
+  event_counter evt_bytes_after_compress_;
+
+  // null if there is no such codec
+  static log_codec *Get(uint8_t id);
+  static log_codec *Find(const std::string &name);
+
+  static const std::vector<log_codec *> &All();
+
+protected:
+  log_codec(codec_id id, const std::string &name);
+
+private:
+  const codec_id id_;
+  const std::string name_;
+};
+
+#endif /* _NDB_LOG_CODEC_H_ */
@@ -7,6 +7,9 @@
 /** options */
 //#define TUPLE_PREFETCH
 #define BTREE_NODE_PREFETCH
+#define BTREE_NODE_SIMD_SEARCH
+//#define BTREE_LEAF_SUFFIX_SLAB // or build with SUFFIX_SLAB=1
+//#define BTREE_SUBTREE_COUNTS // or build with SUBTREE_COUNTS=1
 //#define DIE_ON_ABORT
 //#define TRAP_LARGE_ALLOOCATIONS
 #define USE_BUILTIN_MEMFUNCS
@@ -189,6 +189,10 @@ class mbtree {
   // public to assist in testing
   static const unsigned int NKeysPerNode    = P::leaf_width;
   static const unsigned int NMinKeysPerNode = P::leaf_width / 2;
+  static const unsigned int NKeysPerLeafNode        = P::leaf_width;
+  static const unsigned int NMinKeysPerLeafNode     = P::leaf_width / 2;
+  static const unsigned int NKeysPerInternalNode    = P::internode_width;
+  static const unsigned int NMinKeysPerInternalNode = P::internode_width / 2;
 
   // XXX(stephentu): trying out a very opaque node API for now
   typedef node_type node_opaque_t;
@@ -228,7 +232,7 @@ private:
 public:
 #endif
 
-  mbtree() {
+  mbtree() : table_id_(0) {
     threadinfo ti;
     table_.initialize(ti);
   }
@@ -259,6 +263,14 @@ public:
   inline bool search(const key_type &k, value_type &v,
                      versioned_node_t *search_info = nullptr) const;
 
+  /**
+   * Batched version of search(), see btree::multi_search(). Masstree does
+   * its own node prefetching, so this just does the searches one at a time
+   */
+  inline size_t multi_search(size_t n, const key_type *keys,
+                             value_type *values, bool *found,
+                             versioned_node_t *search_infos = nullptr) const;
+
   /**
    * The low level callback interface is as follows:
    *
@@ -413,6 +425,39 @@ public:
   inline bool
   remove(const key_type &k, value_type *old_v = NULL);
 
+  /**
+   * NOT THREAD SAFE
+   */
+  inline bool empty() const;
+
+  /**
+   * See btree::bulk_load(). Masstree has no bottom-up build, so this just
+   * inserts the keys one at a time (fill_factor is ignored)
+   *
+   * NOT THREAD SAFE
+   */
+  template <typename ForwardIterator>
+  inline bool
+  bulk_load(ForwardIterator begin, ForwardIterator end,
+            double fill_factor = 1.0)
+  {
+    if (!empty())
+      return false;
+    for (; begin != end; ++begin)
+      insert(key_type(begin->first), begin->second);
+    return true;
+  }
+
+  /**
+   * See btree::compact(). Masstree's remove() already gives back empty
+   * nodes and layers, so there is nothing to do here
+   */
+  inline size_t
+  compact()
+  {
+    return 0;
+  }
+
   /**
    * The tree walk API is a bit strange, due to the optimistic nature of the
    * btree.
@@ -443,6 +488,28 @@ public:
    */
   inline size_t size() const;
 
+  /**
+   * See btree::size_estimate(). Masstree keeps no subtree counts, so these
+   * just count the keys
+   */
+  inline size_t
+  size_estimate() const
+  {
+    return size();
+  }
+
+  inline size_t
+  estimate_range_count(const key_type &lower, const key_type *upper) const
+  {
+    size_t ret = 0;
+    auto f = [&ret](const string_type &, value_type) {
+      ret++;
+      return true;
+    };
+    search_range(lower, upper, f);
+    return ret;
+  }
+
   static inline uint64_t
   ExtractVersionNumber(const node_opaque_t *n) {
     // XXX(stephentu): I think we must use stable_version() for
@@ -471,8 +538,18 @@ public:
     return sizeof(leaf_type);
   }
 
+  // see btree::table_id()
+  inline uint32_t table_id() const {
+    return table_id_;
+  }
+
+  inline void set_table_id(uint32_t id) {
+    table_id_ = id;
+  }
+
  private:
   Masstree::basic_table<P> table_;
+  uint32_t table_id_;
 
   static leaf_type* leftmost_descend_layer(node_base_type* n);
   class size_walk_callback;
@@ -580,6 +657,18 @@ inline size_t mbtree<P>::size() const
   return c.size_;
 }
 
+template <typename P>
+inline bool mbtree<P>::empty() const
+{
+  bool found = false;
+  auto f = [&found](const string_type &k, value_type v) {
+    found = true;
+    return false;
+  };
+  search_range(key_type(), nullptr, f);
+  return !found;
+}
+
 template <typename P>
 inline bool mbtree<P>::search(const key_type &k, value_type &v,
                               versioned_node_t *search_info) const
@@ -595,6 +684,19 @@ inline bool mbtree<P>::search(const key_type &k, value_type &v,
   return found;
 }
 
+template <typename P>
+inline size_t mbtree<P>::multi_search(size_t n, const key_type *keys,
+                                      value_type *values, bool *found,
+                                      versioned_node_t *search_infos) const
+{
+  size_t nfound = 0;
+  for (size_t i = 0; i < n; i++)
+    if ((found[i] = search(keys[i], values[i],
+                           search_infos ? &search_infos[i] : nullptr)))
+      nfound++;
+  return nfound;
+}
+
 template <typename P>
 inline bool mbtree<P>::insert(const key_type &k, value_type v,
                               value_type *old_v,
@@ -309,6 +309,8 @@ main(int argc, char **argv)
     cerr << "system properties:" << endl;
     cerr << "  btree_internal_node_size: " << concurrent_btree::InternalNodeSize() << endl;
     cerr << "  btree_leaf_node_size    : " << concurrent_btree::LeafNodeSize() << endl;
+    cerr << "  btree_internal_node_keys: " << concurrent_btree::NKeysPerInternalNode << endl;
+    cerr << "  btree_leaf_node_keys    : " << concurrent_btree::NKeysPerLeafNode << endl;
 
 #ifdef TUPLE_PREFETCH
     cerr << "  tuple_prefetch          : yes" << endl;
@@ -322,6 +324,12 @@ main(int argc, char **argv)
     cerr << "  btree_node_prefetch     : no" << endl;
 #endif
 
+#ifdef BTREE_SIMD_KEY_SEARCH
+    cerr << "  btree_node_key_search   : " << BTREE_SIMD_KEY_SEARCH << endl;
+#else
+    cerr << "  btree_node_key_search   : scalar" << endl;
+#endif
+
   }
 
   if (!stats_server_sockfile.empty()) {
@@ -359,7 +359,7 @@ struct purge_tree_walker : public Btree::tree_walk_callback {
         it != purge_stats_nkeys_node.end(); ++it)
       v += *it;
     const double avg_nkeys_node = double(v)/double(purge_stats_nkeys_node.size());
-    const double avg_fill_factor = avg_nkeys_node/double(Btree::NKeysPerNode);
+    const double avg_fill_factor = avg_nkeys_node/double(Btree::NKeysPerLeafNode);
     std::cerr << "btree node stats" << std::endl;
     std::cerr << "    avg_nkeys_node: " << avg_nkeys_node << std::endl;
     std::cerr << "    avg_fill_factor: " << avg_fill_factor << std::endl;
@@ -12,6 +12,10 @@
 #include <atomic>
 #include <thread>
 #include <sstream>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 
 #include <unistd.h>
 #include <sys/uio.h>
@@ -23,6 +27,7 @@
 #include <lz4.h>
 
 #include "macros.h"
+#include "aio_writer.h"
 #include "circbuf.h"
 #include "amd64.h"
 #include "record/serializer.h"
@@ -142,11 +147,67 @@ static atomic<uint64_t> g_bytes_written[g_nmax_loggers];
 static size_t g_nworkers = 1;
 static int g_verbose = 0;
 static int g_fsync_background = 0;
+static int g_direct_io = 0;
 static size_t g_readset = 30;
 static size_t g_writeset = 16;
 static size_t g_keysize = 8; // in bytes
 static size_t g_valuesize = 32; // in bytes
 
+/**
+ * A single slot channel from one thread to another: post() hands over a
+ * value, which the other side sees w/ peek() and hands back w/ consume()
+ */
+template <typename T>
+class one_way_post {
+public:
+  one_way_post() : full_(false) {}
+
+  inline bool
+  can_post()
+  {
+    lock_guard<mutex> l(mutex_);
+    return !full_;
+  }
+
+  // if wait, first waits for the last value posted to be consumed
+  inline void
+  post(const T &v, bool wait)
+  {
+    unique_lock<mutex> l(mutex_);
+    if (wait)
+      cv_.wait(l, [this]() { return !full_; });
+    ALWAYS_ASSERT(!full_);
+    v_ = v;
+    full_ = true;
+    cv_.notify_all();
+  }
+
+  // waits for a value to be posted
+  inline void
+  peek(T &v)
+  {
+    unique_lock<mutex> l(mutex_);
+    cv_.wait(l, [this]() { return full_; });
+    v = v_;
+  }
+
+  inline void
+  consume(T &v)
+  {
+    lock_guard<mutex> l(mutex_);
+    INVARIANT(full_);
+    v = v_;
+    full_ = false;
+    cv_.notify_all();
+  }
+
+private:
+  mutex mutex_;
+  condition_variable cv_;
+  bool full_;
+  T v_;
+};
+
 /** simulation framework */
 
 // all simulations are epoch based
@@ -732,6 +793,138 @@ private:
     g_ntxns_written.fetch_add(total_txns_written, memory_order_release);
   }
 
+  // like writer(), but w/ O_DIRECT writes kept in flight by an aio_writer.
+  // the buffers of a write are copied out (and zero padded), but are only
+  // returned, and count as persisted, once the write completes
+  void
+  direct_writer(unsigned id, int fd, const vector<unsigned> &assignment)
+  {
+    static const size_t Depth = 4;
+    static const size_t WriteSize = (1<<23);
+
+    struct direct_write {
+      uint64_t nbytes_;
+      uint64_t ntxns_;
+      vector<pair<unsigned, size_t>> nbufs_; // (worker, # of buffers)
+      vector<pair<unsigned, uint64_t>> epoch_prefixes_; // (worker, epoch)
+    };
+
+    aio_writer aio(Depth, WriteSize, true);
+    aio.set_file(fd, 0);
+    deque<direct_write> inflight;
+    vector<uint64_t> completed;
+    vector<pbuffer *> pxs;
+    uint64_t total_nbytes_written = 0,
+             total_txns_written = 0;
+
+    auto finish_writes = [&]() {
+      for (size_t i = 0; i < completed.size(); i++) {
+        direct_write &w = inflight.front();
+        for (auto &p : w.epoch_prefixes_) {
+          const uint64_t x0 =
+            per_thread_sync_epochs_[id].epochs_[p.first].load(memory_order_acquire);
+          if (p.second > x0)
+            per_thread_sync_epochs_[id].epochs_[p.first].store(
+                p.second, memory_order_release);
+        }
+        for (auto &p : w.nbufs_)
+          for (size_t j = 0; j < p.second; j++) {
+            pbuffer * const px = g_persist_buffers[p.first].deq();
+            INVARIANT(px->io_scheduled_);
+            g_all_buffers[p.first].enq(px);
+          }
+        total_nbytes_written += w.nbytes_;
+        total_txns_written += w.ntxns_;
+        inflight.pop_front();
+      }
+      completed.clear();
+    };
+
+    timer loop_timer;
+    bool batch_full = false;
+    while (keep_going_->load(memory_order_acquire)) {
+
+      // wait out the rest of the epoch for the writes in flight, so we can
+      // batch IO
+      const uint64_t epoch_us = g_epoch_time_ns / 1000;
+      uint64_t elapsed_us = loop_timer.lap();
+      if (!batch_full) {
+        timer wait_timer;
+        while (aio.ninflight() && elapsed_us < epoch_us) {
+          aio.reap(completed, epoch_us - elapsed_us);
+          finish_writes();
+          elapsed_us += wait_timer.lap();
+        }
+        if (elapsed_us < epoch_us) {
+          struct timespec ts;
+          ts.tv_sec = 0;
+          ts.tv_nsec = (epoch_us - elapsed_us) * 1000;
+          nanosleep(&ts, nullptr);
+        }
+      }
+      aio.reap(completed);
+      finish_writes();
+
+      if (aio.ninflight() == aio.depth()) {
+        aio.reap(completed, -1);
+        finish_writes();
+      }
+
+      direct_write w;
+      w.nbytes_ = w.ntxns_ = 0;
+      batch_full = false;
+      uint8_t *p = aio.next_buffer();
+      for (auto idx : assignment) {
+        INVARIANT(idx >= 0 && idx < g_nworkers);
+        g_persist_buffers[idx].peekall(pxs);
+        size_t nbufs = 0;
+        for (auto px : pxs) {
+          INVARIANT(px);
+          if (px->io_scheduled_)
+            // still in flight
+            continue;
+          if (w.nbytes_ + px->curoff_ > WriteSize) {
+            batch_full = true;
+            break;
+          }
+          memcpy(p + w.nbytes_, px->buf_.data(), px->curoff_);
+          w.nbytes_ += px->curoff_;
+          px->io_scheduled_ = true;
+          px->curoff_ = sizeof(logbuf_header);
+          px->remaining_ = px->header()->nentries_;
+          w.ntxns_ += px->header()->nentries_;
+          nbufs++;
+          INVARIANT(tidhelpers::CoreId(px->header()->last_tid_) == idx);
+          INVARIANT(tidhelpers::EpochId(px->header()->last_tid_) > 0);
+          if (nbufs == 1)
+            w.epoch_prefixes_.emplace_back(idx, 0);
+          w.epoch_prefixes_.back().second =
+            tidhelpers::EpochId(px->header()->last_tid_) - 1;
+        }
+        if (nbufs)
+          w.nbufs_.emplace_back(idx, nbufs);
+        if (batch_full)
+          break;
+      }
+
+      if (!w.nbytes_) {
+        nop_pause();
+        continue;
+      }
+
+      const size_t nbytespadded =
+        slow_round_up(w.nbytes_, size_t(aio_writer::Alignment));
+      memset(p + w.nbytes_, 0, nbytespadded - w.nbytes_);
+      aio.submit(nbytespadded, 0);
+      inflight.push_back(move(w));
+    }
+
+    aio.drain(completed);
+    finish_writes();
+    g_bytes_written[id].store(total_nbytes_written, memory_order_release);
+    g_ntxns_written.fetch_add(total_txns_written, memory_order_release);
+  }
+
   inline void
   advance_system_sync_epoch(const vector<vector<unsigned>> &assignments)
   {
@@ -783,7 +976,9 @@ public:
     timer tt;
     for (size_t i = 0; i < assignments.size(); i++)
       writers.emplace_back(
-        &onecopy_logbased_simulation::writer,
+        g_direct_io ?
+          &onecopy_logbased_simulation::direct_writer :
+          &onecopy_logbased_simulation::writer,
         this, i, fds[i], ref(assignments[i]));
     if (g_verbose)
       cerr << "assignments: " << assignments << endl;
@@ -1075,6 +1270,7 @@ main(int argc, char **argv)
     {
       {"verbose"     , no_argument       , &g_verbose , 1}   ,
       {"fsync-back"  , no_argument       , &g_fsync_background, 1},
+      {"direct-io"   , no_argument       , &g_direct_io, 1},
       {"num-threads" , required_argument , 0          , 't'} ,
       {"strategy"    , required_argument , 0          , 's'} ,
       {"readset"     , required_argument , 0          , 'r'} ,
@@ -1145,6 +1341,7 @@ main(int argc, char **argv)
   ALWAYS_ASSERT(g_valuesize >= 0);
   ALWAYS_ASSERT(!logfiles.empty());
   ALWAYS_ASSERT(logfiles.size() <= g_nmax_loggers);
+  ALWAYS_ASSERT(!g_direct_io || !g_fsync_background);
   ALWAYS_ASSERT(
       assignments.empty() ||
       database_simulation::AssignmentsValid(
@@ -1159,6 +1356,7 @@ main(int argc, char **argv)
          << ", logfiles=" << logfiles
          << ", strategy=" << strategy
          << ", fsync_background=" << g_fsync_background
+         << ", direct_io=" << g_direct_io
          << ", assignments=" << assignments
          << "}" << endl;
 
@@ -1171,7 +1369,8 @@ main(int argc, char **argv)
 
   vector<int> fds;
   for (auto &fname : logfiles) {
-    int fd = open(fname.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664);
+    int fd = open(fname.c_str(),
+                  O_CREAT|O_WRONLY|O_TRUNC|(g_direct_io ? O_DIRECT : 0), 0664);
     if (fd == -1) {
       perror("open");
       return 1;
@@ -246,10 +246,21 @@ struct basic_px_queue {
   empty_accept_from(basic_px_queue &source, uint64_t rcu_tick)
   {
     ALWAYS_ASSERT(empty());
+    accept_from(source, rcu_tick);
+  }
+
+  // like empty_accept_from(), but appends to this instance, whose entries
+  // must all be <= those accepted. returns the # of entries accepted
+  inline size_t
+  accept_from(basic_px_queue &source, uint64_t rcu_tick)
+  {
     INVARIANT(this != &source);
-    INVARIANT(!tail_);
+    INVARIANT(!tail_ || !source.head_ ||
+              tail_->rcu_tick_ <= source.head_->rcu_tick_);
+    size_t n = 0;
     px_group *p = source.head_, *pnext;
     while (p && p->rcu_tick_ <= rcu_tick) {
+      n += p->pxs_.size();
       pnext = p->next_;
       p->next_ = nullptr;
       if (!head_) {
@@ -266,6 +277,7 @@ struct basic_px_queue {
     }
     sanity_check();
     source.sanity_check();
+    return n;
   }
 
   // transfer *this* elements freelist to dest
@@ -335,6 +347,15 @@ struct basic_px_queue {
     return true;
   }
 
+  inline bool
+  get_earliest_epoch(uint64_t &e) const
+  {
+    if (!head_)
+      return false;
+    e = head_->rcu_tick_;
+    return true;
+  }
+
 private:
   void
   reap_chain(px_group *px)
@@ -18,12 +18,14 @@ using namespace std;
 using namespace util;
 
 rcu rcu::s_instance;
+size_t rcu::g_pending_watermark = rcu::DefaultPendingWatermark;
 
 static event_counter evt_rcu_deletes("rcu_deletes");
 static event_counter evt_rcu_frees("rcu_frees");
 static event_counter evt_rcu_local_reaps("rcu_local_reaps");
 static event_counter evt_rcu_incomplete_local_reaps("rcu_incomplete_local_reaps");
 static event_counter evt_rcu_loop_reaps("rcu_loop_reaps");
+static event_counter evt_rcu_inline_reclaims("rcu_inline_reclaims");
 static event_counter *evt_allocator_arena_allocations[::allocator::MAX_ARENAS] = {nullptr};
 static event_counter *evt_allocator_arena_deallocations[::allocator::MAX_ARENAS] = {nullptr};
 static event_counter evt_allocator_large_allocation("allocator_large_allocation");
@@ -36,8 +38,19 @@ static event_avg_counter evt_avg_time_inbetween_rcu_epochs_usec(
     "avg_time_inbetween_rcu_epochs_usec");
 static event_avg_counter evt_avg_time_inbetween_allocator_releases_usec(
     "avg_time_inbetween_allocator_releases_usec");
+static event_avg_counter evt_avg_rcu_reclaim_usec("avg_rcu_reclaim_usec");
+static event_avg_counter evt_avg_rcu_reclaim_lag_usec("avg_rcu_reclaim_lag_usec");
+static event_avg_counter evt_avg_rcu_epoch_ticks("avg_rcu_epoch_ticks");
 
 #ifdef MEMCHECK_MAGIC
+// objects are laid out relative to their hugepage (see initialize_page()),
+// so this is the offset of p into its object
+static inline uintptr_t
+object_offset(const void *p, size_t unit)
+{
+  return ((uintptr_t)p & (::allocator::GetHugepageSize() - 1)) % unit;
+}
+
 static void
 report_error_and_die(
     const void *p, size_t alloc_size, const char *msg,
@@ -54,7 +67,7 @@ report_error_and_die(
       cerr << prefix << "Allocator managed next ptr? " << ::allocator::ManagesPointer(pnext) << endl;
     } else {
       cerr << prefix << "Next ptr allocation size: " << pmd->unit_ << endl;
-      if (((uintptr_t)pnext % pmd->unit_) == 0) {
+      if (object_offset(pnext, pmd->unit_) == 0) {
         if (recurse)
           report_error_and_die(
               pnext, pmd->unit_, "", prefix + "    ", recurse - 1, false);
@@ -64,7 +77,7 @@ report_error_and_die(
         cerr << prefix << "Next ptr not properly aligned" << endl;
         if (recurse)
           report_error_and_die(
-              (const void *) slow_round_down((uintptr_t)pnext, (uintptr_t)pmd->unit_),
+              (const void *) ((uintptr_t)pnext - object_offset(pnext, pmd->unit_)),
               pmd->unit_, "", prefix + "    ", recurse - 1, false);
         else
           cerr << prefix << "recursion stopped" << endl;
@@ -73,7 +86,7 @@ report_error_and_die(
   }
   cerr << prefix << "Msg: " << msg << endl;
   cerr << prefix << "Allocation size: " << alloc_size << endl;
-  cerr << prefix << "Ptr aligned properly? " << (((uintptr_t)p % alloc_size) == 0) << endl;
+  cerr << prefix << "Ptr aligned properly? " << (object_offset(p, alloc_size) == 0) << endl;
   for (const char *buf = (const char *) p;
       buf < (const char *) p + alloc_size;
       buf += 8) {
@@ -87,7 +100,7 @@ static void
 check_pointer_or_die(void *p, size_t alloc_size)
 {
   ALWAYS_ASSERT(p);
-  if (unlikely(((uintptr_t)p % alloc_size) != 0))
+  if (unlikely(object_offset(p, alloc_size) != 0))
     report_error_and_die(p, alloc_size, "pointer not properly aligned");
   for (size_t off = sizeof(void **); off < alloc_size; off++)
     if (unlikely(
@@ -95,7 +108,7 @@ check_pointer_or_die(void *p, size_t alloc_size)
          (unsigned char) MEMCHECK_MAGIC ) )
       report_error_and_die(p, alloc_size, "memory magic not found");
   void *pnext = *((void **) p);
-  if (unlikely(((uintptr_t)pnext % alloc_size) != 0))
+  if (unlikely(object_offset(pnext, alloc_size) != 0))
     report_error_and_die(p, alloc_size, "next pointer not properly aligned");
 }
 #endif
@@ -103,9 +116,10 @@ check_pointer_or_die(void *p, size_t alloc_size)
 void *
 rcu::sync::alloc(size_t sz)
 {
-  if (pin_cpu_ == -1)
+  if (pin_cpu_ == -1) {
     // fallback to regular allocator
     return malloc(sz);
+  }
   auto sizes = ::allocator::ArenaSize(sz);
   auto arena = sizes.second;
   if (arena >= ::allocator::MAX_ARENAS) {
@@ -117,10 +131,12 @@ rcu::sync::alloc(size_t sz)
   void *p = arenas_[arena];
   INVARIANT(p);
 #ifdef MEMCHECK_MAGIC
-  const size_t alloc_size = (arena + 1) * ::allocator::AllocAlignment;
+  const size_t alloc_size = ::allocator::ArenaUnit(arena);
   check_pointer_or_die(p, alloc_size);
 #endif
   arenas_[arena] = *reinterpret_cast<void **>(p);
+  INVARIANT(alloc_stats_.ncached_[arena]);
+  alloc_stats_.ncached_[arena]--;
   evt_allocator_arena_allocations[arena]->inc();
   return p;
 }
@@ -149,8 +165,8 @@ rcu::sync::dealloc(void *p, size_t sz)
   ALWAYS_ASSERT(arena < ::allocator::MAX_ARENAS);
   *reinterpret_cast<void **>(p) = arenas_[arena];
 #ifdef MEMCHECK_MAGIC
-  const size_t alloc_size = (arena + 1) * ::allocator::AllocAlignment;
-  ALWAYS_ASSERT( ((uintptr_t)p % alloc_size) == 0 );
+  const size_t alloc_size = ::allocator::ArenaUnit(arena);
+  ALWAYS_ASSERT(object_offset(p, alloc_size) == 0);
   NDB_MEMSET(
       (char *) p + sizeof(void **),
       MEMCHECK_MAGIC, alloc_size - sizeof(void **));
@@ -160,6 +176,7 @@ rcu::sync::dealloc(void *p, size_t sz)
   arenas_[arena] = p;
   evt_allocator_arena_deallocations[arena]->inc();
   deallocs_[arena]++;
+  alloc_stats_.ncached_[arena]++;
 }
 
 bool
@@ -184,7 +201,7 @@ rcu::sync::do_release()
 {
 #ifdef MEMCHECK_MAGIC
   for (size_t i = 0; i < ::allocator::MAX_ARENAS; i++) {
-    const size_t alloc_size = (i + 1) * ::allocator::AllocAlignment;
+    const size_t alloc_size = ::allocator::ArenaUnit(i);
     void *p = arenas_[i];
     while (p) {
       check_pointer_or_die(p, alloc_size);
@@ -195,24 +212,38 @@ rcu::sync::do_release()
   ::allocator::ReleaseArenas(&arenas_[0]);
   NDB_MEMSET(&arenas_[0], 0, sizeof(arenas_));
   NDB_MEMSET(&deallocs_[0], 0, sizeof(deallocs_));
+  NDB_MEMSET(&alloc_stats_.ncached_[0], 0, sizeof(alloc_stats_.ncached_));
 }
 
 void
 rcu::sync::do_cleanup()
 {
   // compute cleaner epoch
-  const uint64_t clean_tick_exclusive = impl_->cleaning_rcu_tick_exclusive();
-  if (!clean_tick_exclusive)
-    return;
+  const uint64_t clean_tick_exclusive =
+    ticker::s_instance.global_last_tick_exclusive();
   const uint64_t clean_tick = clean_tick_exclusive - 1;
 
   INVARIANT(last_reaped_epoch_ <= clean_tick);
+  INVARIANT(reclaiming_ || scratch_.empty());
+  // wait out the epoch, unless the backlog is over the watermark
+  if (last_reaped_epoch_ + epoch_ticks_ > clean_tick &&
+      likely(npending_bytes_ <= g_pending_watermark))
+    return;
+  if (unlikely(reclaiming_))
+    return;
+  reclaim(clean_tick, false);
+}
+
+void
+rcu::sync::reclaim(uint64_t clean_tick, bool is_inline)
+{
+  INVARIANT(!reclaiming_);
   INVARIANT(scratch_.empty());
-  if (last_reaped_epoch_ == clean_tick)
+  if (last_reaped_epoch_ >= clean_tick)
     return;
 
-#ifdef ENABLE_EVENT_COUNTERS
   const uint64_t now = timer::cur_usec();
+#ifdef ENABLE_EVENT_COUNTERS
   if (last_reaped_timestamp_us_ > 0) {
     const uint64_t diff = now - last_reaped_timestamp_us_;
     evt_avg_time_inbetween_rcu_epochs_usec.offer(diff);
@@ -220,25 +251,72 @@ rcu::sync::do_cleanup()
   last_reaped_timestamp_us_ = now;
 #endif
   last_reaped_epoch_ = clean_tick;
+  const size_t backlog = npending_bytes_;
 
   scratch_.empty_accept_from(queue_, clean_tick);
   scratch_.transfer_freelist(queue_);
   rcu::px_queue &q = scratch_;
-  if (q.empty())
-    return;
-  scoped_rcu_region guard;
-  size_t n = 0;
-  for (auto it = q.begin(); it != q.end(); ++it, ++n) {
-    try {
-      it->run(*this);
-    } catch (...) {
-      cerr << "rcu::region_end: uncaught exception in free routine" << endl;
+  const bool reclaimed = !q.empty();
+  if (reclaimed) {
+    // entries are queued w/ the tick after the one they were freed in
+    uint64_t oldest_tick = 0;
+    q.get_earliest_epoch(oldest_tick);
+    const uint64_t cur_tick = ticker::s_instance.global_current_tick();
+    const uint64_t lag_usec =
+      (cur_tick + 1 - min(oldest_tick, cur_tick + 1)) * ticker::tick_us;
+
+    // the deleters may alloc() and dealloc_rcu(), which must not reclaim
+    // again while q is in use
+    reclaiming_ = true;
+    {
+      scoped_rcu_base<false> guard;
+      size_t n = 0;
+      for (auto it = q.begin(); it != q.end(); ++it, ++n) {
+        if (it->action < 0)
+          untrack_pending(-it->action);
+        else
+          alloc_stats_.npending_fn_--;
+        try {
+          it->run(*this);
+        } catch (...) {
+          cerr << "rcu::region_end: uncaught exception in free routine" << endl;
+        }
+      }
+      q.clear();
+      evt_rcu_deletes += n;
+      evt_avg_rcu_local_delete_queue_len.offer(n);
     }
+    reclaiming_ = false;
+
+    const uint64_t reclaim_usec = timer::cur_usec() - now;
+    alloc_stats_.nreclaims_++;
+    alloc_stats_.reclaim_usec_ += reclaim_usec;
+    alloc_stats_.max_reclaim_usec_ =
+      max(alloc_stats_.max_reclaim_usec_, reclaim_usec);
+    alloc_stats_.reclaim_lag_usec_ += lag_usec;
+    alloc_stats_.max_reclaim_lag_usec_ =
+      max(alloc_stats_.max_reclaim_lag_usec_, lag_usec);
+    if (is_inline) {
+      alloc_stats_.ninline_reclaims_++;
+      ++evt_rcu_inline_reclaims;
+    }
+    evt_avg_rcu_reclaim_usec.offer(reclaim_usec);
+    evt_avg_rcu_reclaim_lag_usec.offer(lag_usec);
   }
-  q.clear();
-  evt_rcu_deletes += n;
-  evt_avg_rcu_local_delete_queue_len.offer(n);
 
+  // AIMD on the epoch: halve it while the backlog is over half the
+  // watermark, so a burst of frees is caught within a few ticks, and grow
+  // it back a tick at a time once the backlog is small
+  if (backlog > g_pending_watermark / 2)
+    epoch_ticks_ = max(epoch_ticks_ / 2, uint64_t(1));
+  else if (backlog < g_pending_watermark / 8 &&
+           epoch_ticks_ < EpochTimeMultiplier)
+    epoch_ticks_++;
+  alloc_stats_.epoch_ticks_ = epoch_ticks_;
+  evt_avg_rcu_epoch_ticks.offer(epoch_ticks_);
+
+  if (!reclaimed)
+    return;
   // try to release memory from allocator slabs back
   if (try_release()) {
 #ifdef ENABLE_EVENT_COUNTERS
@@ -263,7 +341,8 @@ rcu::free_with_fn(void *p, deleter_t fn)
   INVARIANT(s.depth());
   // all threads are either at cur_tick or cur_tick + 1, so we must wait for
   // the system to move beyond cur_tick + 1
-  s.queue_.enqueue(delete_entry(p, fn), to_rcu_ticks(cur_tick + 1));
+  s.queue_.enqueue(delete_entry(p, fn), cur_tick + 1);
+  s.alloc_stats_.npending_fn_++;
   ++evt_rcu_frees;
 }
 
@@ -278,7 +357,8 @@ rcu::dealloc_rcu(void *p, size_t sz)
   INVARIANT(s.depth());
   // all threads are either at cur_tick or cur_tick + 1, so we must wait for
   // the system to move beyond cur_tick + 1
-  s.queue_.enqueue(delete_entry(p, sz), to_rcu_ticks(cur_tick + 1));
+  s.queue_.enqueue(delete_entry(p, sz), cur_tick + 1);
+  s.track_pending(sz);
   ++evt_rcu_frees;
 }
 
@@ -296,6 +376,12 @@ rcu::pin_current_thread(size_t cpu)
   s.do_release();
 }
 
+void
+rcu::SetPendingWatermark(size_t bytes)
+{
+  g_pending_watermark = bytes;
+}
+
 void
 rcu::fault_region()
 {
@@ -305,6 +391,95 @@ rcu::fault_region()
   ::allocator::FaultRegion(s.get_pin_cpu());
 }
 
+rcu::alloc_stats &
+rcu::alloc_stats::operator+=(const alloc_stats &s)
+{
+  for (size_t i = 0; i < ::allocator::MAX_ARENAS; i++) {
+    ncached_[i] += s.ncached_[i];
+    pending_bytes_[i] += s.pending_bytes_[i];
+  }
+  pending_large_bytes_ += s.pending_large_bytes_;
+  npending_fn_ += s.npending_fn_;
+  nreclaims_ += s.nreclaims_;
+  ninline_reclaims_ += s.ninline_reclaims_;
+  reclaim_usec_ += s.reclaim_usec_;
+  max_reclaim_usec_ = max(max_reclaim_usec_, s.max_reclaim_usec_);
+  reclaim_lag_usec_ += s.reclaim_lag_usec_;
+  max_reclaim_lag_usec_ = max(max_reclaim_lag_usec_, s.max_reclaim_lag_usec_);
+  epoch_ticks_ = max(epoch_ticks_, s.epoch_ticks_);
+  return *this;
+}
+
+void
+rcu::get_alloc_stats(vector<alloc_stats> &stats) const
+{
+  const size_t nregions = ::allocator::GetNumRegions();
+  stats.assign(nregions + 1, alloc_stats());
+  for (size_t i = 0; i < coreid::NMaxCores; i++) {
+    const sync * const s = syncs_.view(i);
+    if (!s)
+      continue;
+    const ssize_t cpu = s->get_pin_cpu();
+    stats[cpu >= 0 && size_t(cpu) < nregions ? cpu : nregions] +=
+      s->get_alloc_stats();
+  }
+}
+
+void
+rcu::dump_alloc_stats(ostream &o) const
+{
+  vector<alloc_stats> stats;
+  get_alloc_stats(stats);
+  // objects not on any free list, by size class
+  int64_t live[::allocator::MAX_ARENAS] = {0};
+  for (size_t cpu = 0; cpu < stats.size(); cpu++) {
+    const alloc_stats &s = stats[cpu];
+    const bool pinned = cpu + 1 < stats.size();
+    const ::allocator::region_stats r = pinned ?
+      ::allocator::GetRegionStats(cpu) : ::allocator::region_stats();
+    if (pinned) {
+      o << "cpu " << cpu
+        << " remaining " << r.remaining_bytes_
+        << " free " << r.free_bytes_
+        << " faulted " << r.faulted_bytes_
+        << " returned " << r.returned_bytes_
+        << " borrowed " << r.borrowed_bytes_
+        << " lent " << r.lent_bytes_;
+      for (size_t i = 0; i < ::allocator::MAX_ARENAS; i++)
+        live[i] += r.arenas_[i].nobjs_ - r.arenas_[i].nfree_;
+    } else {
+      o << "unpinned";
+    }
+    o << " pending_large " << s.pending_large_bytes_
+      << " pending_fn " << s.npending_fn_
+      << " epoch_ticks " << s.epoch_ticks_
+      << " reclaims " << s.nreclaims_
+      << " inline " << s.ninline_reclaims_
+      << " reclaim_us " << s.reclaim_usec_
+      << " max_reclaim_us " << s.max_reclaim_usec_
+      << " avg_lag_us "
+      << (s.nreclaims_ ? s.reclaim_lag_usec_ / s.nreclaims_ : 0)
+      << " max_lag_us " << s.max_reclaim_lag_usec_ << endl;
+    for (size_t i = 0; i < ::allocator::MAX_ARENAS; i++) {
+      live[i] -= s.ncached_[i];
+      const ::allocator::arena_stats &a = r.arenas_[i];
+      if (!a.nhugepgs_ && !s.ncached_[i] && !s.pending_bytes_[i])
+        continue;
+      o << (pinned ? "cpu " + to_string(cpu) : string("unpinned"))
+        << " size " << ::allocator::ArenaUnit(i)
+        << " hugepgs " << a.nhugepgs_
+        << " objs " << a.nobjs_
+        << " free " << a.nfree_
+        << " cached " << s.ncached_[i]
+        << " pending " << s.pending_bytes_[i] << endl;
+    }
+  }
+  for (size_t i = 0; i < ::allocator::MAX_ARENAS; i++)
+    if (live[i])
+      o << "all size " << ::allocator::ArenaUnit(i)
+        << " live " << max(live[i], int64_t(0)) << endl;
+}
+
 rcu::rcu()
   : syncs_()
 {
@@ -8,6 +8,7 @@
 #include <vector>
 #include <list>
 #include <utility>
+#include <limits>
 
 #include "allocator.h"
 #include "counter.h"
@@ -53,6 +54,31 @@ public:
   };
   typedef basic_px_queue<delete_entry, 4096> px_queue;
 
+  // the allocator state held by threads (see sync), for the allocator
+  // instrumentation (see allocator::GetRegionStats())
+  struct alloc_stats {
+    size_t ncached_[allocator::MAX_ARENAS]; // objects on the free lists
+    // freed w/ dealloc_rcu(), not reclaimed yet
+    size_t pending_bytes_[allocator::MAX_ARENAS];
+    size_t pending_large_bytes_; // ... over the largest size class
+    size_t npending_fn_; // free_with_fn()-s not run yet
+
+    // reclaims of the delete queue (see SetPendingWatermark()), and how
+    // many were done inline, as backpressure
+    size_t nreclaims_;
+    size_t ninline_reclaims_;
+    uint64_t reclaim_usec_; // time spent reclaiming
+    uint64_t max_reclaim_usec_;
+    // time from the free of the oldest entry of a reclaim to the reclaim
+    uint64_t reclaim_lag_usec_; // summed over the reclaims
+    uint64_t max_reclaim_lag_usec_;
+    uint64_t epoch_ticks_; // longest epoch of the threads, in ticker ticks
+
+    alloc_stats() { NDB_MEMSET(this, 0, sizeof(*this)); }
+
+    alloc_stats &operator+=(const alloc_stats &s);
+  };
+
   template <typename T>
   static inline void
   deleter(void *p)
@@ -67,6 +93,9 @@ public:
     delete [] (T *) p;
   }
 
+  // the longest an epoch gets, in ticker ticks. each thread reclaims its
+  // delete queue once per epoch, and shortens its epoch as its backlog
+  // grows (see SetPendingWatermark())
 #ifdef CHECK_INVARIANTS
   static const uint64_t EpochTimeMultiplier = 10; /* 10 * 1 ms */
 #else
@@ -89,10 +118,10 @@ public:
     friend class rcu;
     template <bool> friend class scoped_rcu_base;
   public:
-    px_queue queue_;
+    px_queue queue_; // by ticker tick
     px_queue scratch_;
     unsigned depth_; // 0 indicates no rcu region
-    unsigned last_reaped_epoch_;
+    uint64_t last_reaped_epoch_; // ticker tick
 #ifdef ENABLE_EVENT_COUNTERS
     uint64_t last_reaped_timestamp_us_;
     uint64_t last_release_timestamp_us_;
@@ -106,6 +135,11 @@ public:
     void *arenas_[allocator::MAX_ARENAS];
     size_t deallocs_[allocator::MAX_ARENAS]; // keeps track of the number of
                                              // un-released deallocations
+    alloc_stats alloc_stats_; // only written by the owner thread
+
+    uint64_t epoch_ticks_; // reclaim every this many ticks
+    size_t npending_bytes_; // sum of alloc_stats_.pending_*bytes_
+    bool reclaiming_;
 
   public:
 
@@ -118,12 +152,16 @@ public:
 #endif
       , impl_(impl)
       , pin_cpu_(-1)
+      , epoch_ticks_(EpochTimeMultiplier)
+      , npending_bytes_(0)
+      , reclaiming_(false)
     {
       ALWAYS_ASSERT(((uintptr_t)this % CACHELINE_SIZE) == 0);
       queue_.alloc_freelist(NQueueGroups);
       scratch_.alloc_freelist(NQueueGroups);
       NDB_MEMSET(&arenas_[0], 0, sizeof(arenas_));
       NDB_MEMSET(&deallocs_[0], 0, sizeof(deallocs_));
+      alloc_stats_.epoch_ticks_ = epoch_ticks_;
     }
 
     inline void
@@ -138,6 +176,12 @@ public:
       return pin_cpu_;
     }
 
+    inline const alloc_stats &
+    get_alloc_stats() const
+    {
+      return alloc_stats_;
+    }
+
     // allocate a block of memory of size sz. caller needs to remember
     // the size of the allocation when calling free
     void *alloc(size_t sz);
@@ -162,13 +206,50 @@ public:
 
     void do_release();
 
+    // reclaims the entries of queue_ up to clean_tick (inclusive)
+    void reclaim(uint64_t clean_tick, bool is_inline);
+
+    // backpressure: a thread whose backlog is over the watermark reclaims
+    // what it can before it enters its next (outermost) RCU region, so the
+    // deleters never run w/ the locks of a region held
+    inline void
+    check_backlog()
+    {
+      if (unlikely(npending_bytes_ > g_pending_watermark) && !reclaiming_)
+        reclaim(ticker::s_instance.global_last_tick_inclusive(), true);
+    }
+
+    inline void
+    track_pending(size_t sz)
+    {
+      npending_bytes_ += sz;
+      const size_t arena = allocator::ArenaSize(sz).second;
+      if (likely(arena < allocator::MAX_ARENAS))
+        alloc_stats_.pending_bytes_[arena] += sz;
+      else
+        alloc_stats_.pending_large_bytes_ += sz;
+    }
+
+    inline void
+    untrack_pending(size_t sz)
+    {
+      npending_bytes_ -= sz;
+      const size_t arena = allocator::ArenaSize(sz).second;
+      if (likely(arena < allocator::MAX_ARENAS))
+        alloc_stats_.pending_bytes_[arena] -= sz;
+      else
+        alloc_stats_.pending_large_bytes_ -= sz;
+    }
+
     inline void
     ensure_arena(size_t arena)
     {
       if (likely(arenas_[arena]))
         return;
       INVARIANT(pin_cpu_ >= 0);
-      arenas_[arena] = allocator::AllocateArenas(pin_cpu_, arena);
+      size_t n;
+      arenas_[arena] = allocator::AllocateArenas(pin_cpu_, arena, &n);
+      alloc_stats_.ncached_[arena] += n;
     }
   };
 
@@ -263,6 +344,25 @@ public:
 
   void fault_region();
 
+  // a thread whose dealloc_rcu() backlog (bytes freed but not reclaimed yet)
+  // is over bytes reclaims at every tick, and reclaims inline when it enters
+  // an RCU region. its epoch shrinks while the backlog is over half of
+  // bytes, and grows back to EpochTimeMultiplier ticks once it is under an
+  // eighth. the default, SIZE_MAX, keeps every epoch at its longest
+  static void SetPendingWatermark(size_t bytes);
+
+  static const size_t DefaultPendingWatermark =
+    std::numeric_limits<size_t>::max();
+
+  // the alloc_stats of the threads pinned to each allocator region (the
+  // last one sums up the unpinned threads). the other threads' counters are
+  // read w/o synchronization
+  void get_alloc_stats(std::vector<alloc_stats> &stats) const;
+
+  // one line per region, and per size class in use in a region, w/ both
+  // the region's counters and the alloc_stats of the threads pinned to it
+  void dump_alloc_stats(std::ostream &o) const;
+
   static rcu s_instance CACHE_ALIGNED; // system wide instance
 
   static void Test();
@@ -280,6 +380,8 @@ private:
   inline sync &mysync() { return syncs_.my(this); }
 
   percore_lazy<sync> syncs_;
+
+  static size_t g_pending_watermark;
 };
 
 template <bool DoCleanup>
@@ -295,6 +397,8 @@ public:
     : sync_(&rcu::s_instance.mysync()),
       guard_(ticker::s_instance)
   {
+    if (!sync_->depth_ && DoCleanup)
+      sync_->check_backlog();
     sync_->depth_++;
   }
 
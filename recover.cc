@@ -0,0 +1,123 @@
+/**
+ * Replays the files written by txn_logger (see txn_log_recovery) into one
+ * txn_btree per table found in the log, and reports how long each recovery
+ * phase took
+ */
+
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "txn_btree.h"
+#include "txn_proto2_impl.h"
+#include "txn_log_recovery.h"
+#include "util.h"
+
+using namespace std;
+using namespace util;
+
+static int g_verbose = 0;
+
+int
+main(int argc, char **argv)
+{
+  vector<string> logfiles;
+  uint64_t min_epoch = 0;
+  uint64_t max_epoch = txn_log_recovery::EpochUnknown;
+
+  while (1) {
+    static struct option long_options[] =
+    {
+      {"verbose"     , no_argument       , &g_verbose  , 1}   ,
+      {"logfile"     , required_argument , 0           , 'l'} ,
+      {"min-epoch"   , required_argument , 0           , 'm'} ,
+      {"max-epoch"   , required_argument , 0           , 'e'} ,
+      {0, 0, 0, 0}
+    };
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "l:m:e:", long_options, &option_index);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 0:
+      if (long_options[option_index].flag != 0)
+        break;
+      abort();
+      break;
+
+    case 'l':
+      logfiles.emplace_back(optarg);
+      break;
+
+    case 'm':
+      min_epoch = strtoul(optarg, nullptr, 10);
+      break;
+
+    case 'e':
+      max_epoch = strtoul(optarg, nullptr, 10);
+      break;
+
+    case '?':
+      /* getopt_long already printed an error message. */
+      exit(1);
+
+    default:
+      abort();
+    }
+  }
+  if (logfiles.empty()) {
+    cerr << "[usage] " << argv[0]
+         << " [--verbose] [--min-epoch e] [--max-epoch e]"
+         << " --logfile f [--logfile f ...]" << endl;
+    return 1;
+  }
+
+  if (g_verbose) {
+    cerr << "[recovery]" << endl;
+    cerr << "  logfiles   : " << logfiles   << endl;
+    cerr << "  min_epoch  : " << min_epoch  << endl;
+  }
+
+  txn_log_recovery r(logfiles);
+  if (!r.run(min_epoch, max_epoch)) {
+    cerr << "could not read the log files" << endl;
+    return 1;
+  }
+  const txn_log_recovery::stats &s = r.get_stats();
+
+  timer t;
+  // the log only has the tables' ids (see base_txn_btree::TableId())
+  vector<unique_ptr<txn_btree<transaction_proto2>>> btrs;
+  vector<pair<uint32_t, txn_btree<transaction_proto2> *>> tables;
+  for (auto id : r.table_ids()) {
+    btrs.emplace_back(new txn_btree<transaction_proto2>);
+    tables.emplace_back(id, btrs.back().get());
+  }
+  ALWAYS_ASSERT(r.load(tables));
+  const double load_ms = t.lap_ms();
+
+  // phases A and B run one thread per log file
+  const double reader_ms = (s.read_us_ + s.replay_us_) / 1000.0;
+  const double gb = double(s.nbytes_read_) / double(1 << 30);
+  cerr << "stats: " << s << endl;
+  cerr << "load_ms: " << load_ms << endl;
+  scoped_rcu_region guard;
+  size_t nkeys = 0;
+  for (auto &p : tables) {
+    if (g_verbose)
+      cerr << "  table " << hex << setw(8) << setfill('0') << p.first
+           << dec << setfill(' ') << ": " << p.second->size_estimate()
+           << " keys" << endl;
+    nkeys += p.second->size_estimate();
+  }
+  cerr << "keys loaded: " << nkeys << " in " << tables.size()
+       << " tables" << endl;
+  cerr << "read+replay throughput: " << (gb / (reader_ms / 1000.0))
+       << " GB/s, " << (gb / (reader_ms / 1000.0) / s.nfiles_)
+       << " GB/s/reader" << endl;
+  return 0;
+}
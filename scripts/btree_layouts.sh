@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# builds the test suite for each optional btree layout (see SUFFIX_SLAB and
+# SUBTREE_COUNTS in the Makefile) and runs the fast btree tests against it,
+# eg:
+#
+#   ./scripts/btree_layouts.sh USE_MALLOC_MODE=0
+#
+# run from the top level directory. the arguments are passed on to make.
+# the layouts only apply to silotree, so the builds use MASSTREE=0
+
+LAYOUTS=${LAYOUTS:-"SUFFIX_SLAB=0 SUFFIX_SLAB=1 SUBTREE_COUNTS=1"}
+
+for l in $LAYOUTS; do
+  suffix=""
+  if [ "$l" == "SUFFIX_SLAB=1" ]; then
+    suffix=".slab"
+  elif [ "$l" == "SUBTREE_COUNTS=1" ]; then
+    suffix=".counts"
+  fi
+  echo "=== $l"
+  make MASSTREE=0 DEBUG=1 CHECK_INVARIANTS=1 "$@" $l -j test >/dev/null || exit 1
+  ./out-perf.debug.check$suffix.silotree/test btree || exit 1
+done
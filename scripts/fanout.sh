@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# builds dbtest for each btree fanout pair (see LEAF_KEYS and INTERNAL_KEYS in
+# the Makefile) and reports throughput and memory use for each, eg:
+#
+#   ./scripts/fanout.sh --bench tpcc --num-threads 8 --scale-factor 8 --runtime 30
+#
+# run from the top level directory. the arguments are passed on to dbtest.
+# the fanouts only apply to silotree, so the builds use MASSTREE=0
+
+FANOUTS=${FANOUTS:-"15/15 15/31 15/63 31/31 31/63 63/63"}
+
+echo "leaf internal leaf_node_bytes internal_node_bytes db_size_mb memory_delta_mb agg_throughput"
+for f in $FANOUTS; do
+  leaf=${f%/*}
+  internal=${f#*/}
+  suffix=""
+  if [ "$leaf.$internal" != "15.15" ]; then
+    suffix=".fanout$leaf-$internal"
+  fi
+  make MASSTREE=0 LEAF_KEYS=$leaf INTERNAL_KEYS=$internal -j dbtest >/dev/null || exit 1
+  out=$(./out-perf$suffix.silotree/benchmarks/dbtest --verbose "$@" 2>&1 >/dev/null)
+  field() {
+    echo "$out" | grep "$1" | head -n 1 | sed "s/.*$1 *//" | awk '{print $1}'
+  }
+  echo "$leaf $internal" \
+    "$(field 'btree_leaf_node_size *:')" \
+    "$(field 'btree_internal_node_size *:')" \
+    "$(field 'DB size:')" \
+    "$(field 'memory delta:')" \
+    "$(field agg_throughput:)"
+done
@@ -6,6 +6,7 @@
  */
 
 #include <iostream>
+#include <map>
 #include <string>
 #include <system_error>
 #include <thread>
@@ -21,11 +22,21 @@
 using namespace std;
 using namespace util;
 
+// counterspecs which poll a text report instead of counters
+static const map<string, stats_command> TEXT_SPECS = {
+  {"abort-profile", stats_command::GET_ABORT_PROFILE},
+  {"allocator-stats", stats_command::GET_ALLOCATOR_STATS},
+};
+
 int
 main(int argc, char **argv)
 {
   if (argc != 3) {
-    cerr << "[usage] " << argv[0] << " sockfile counterspec" << endl;
+    cerr << "[usage] " << argv[0] << " sockfile counterspec" << endl
+         << "  counterspec is counter names joined by ':', or one of:";
+    for (auto &s : TEXT_SPECS)
+      cerr << " " << s.first;
+    cerr << endl;
     return 1;
   }
 
@@ -51,6 +62,26 @@ main(int argc, char **argv)
   int r;
   timer loop_timer;
   for (;;) {
+    auto text_it = TEXT_SPECS.find(argv[2]);
+    if (text_it != TEXT_SPECS.end()) {
+      const uint8_t cmd = (uint8_t) text_it->second;
+      pkt.assign((const char *) &cmd, sizeof(cmd));
+      if ((r = pkt.sendpkt(fd))) {
+        perror("send - disconnecting");
+        return 1;
+      }
+      if ((r = pkt.recvpkt(fd))) {
+        if (r == EOF)
+          return 0;
+        perror("recv - disconnecting");
+        return 1;
+      }
+      cout << timer::cur_usec() << endl;
+      cout.write(pkt.data(), pkt.size());
+      cout << endl;
+      sleep(1);
+      continue;
+    }
     for (auto &name : counter_names) {
       uint8_t buf[1 + name.size()];
       buf[0] = (uint8_t) stats_command::GET_COUNTER_VALUE;
@@ -4,7 +4,11 @@
 #include "macros.h"
 #include "fileutils.h"
 
-enum class stats_command : uint8_t { GET_COUNTER_VALUE = 0x1 };
+enum class stats_command : uint8_t {
+  GET_COUNTER_VALUE = 0x1,
+  GET_ABORT_PROFILE = 0x2, // response is abort_profiler::Report() text
+  GET_ALLOCATOR_STATS = 0x3, // response is rcu::dump_alloc_stats() text
+};
 
 struct get_counter_value_t {
   uint64_t timestamp_us_; // usec
@@ -1,3 +1,4 @@
+#include <sstream>
 #include <system_error>
 #include <thread>
 
@@ -5,7 +6,9 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include "abort_profiler.h"
 #include "counter.h"
+#include "rcu.h"
 #include "stats_server.h"
 #include "util.h"
 
@@ -59,6 +62,36 @@ stats_server::handle_cmd_get_counter_value(const string &name, packet &pkt)
   return true;
 }
 
+// cuts s at a line boundary if it does not fit
+static void
+assign_text(packet &pkt, const string &s)
+{
+  size_t n = s.size();
+  if (n > packet::MAX_DATA) {
+    n = s.rfind('\n', packet::MAX_DATA - 1);
+    n = n == string::npos ? 0 : n + 1;
+  }
+  pkt.assign(s.data(), n);
+}
+
+bool
+stats_server::handle_cmd_get_abort_profile(packet &pkt)
+{
+  ostringstream buf;
+  abort_profiler::Report(buf);
+  assign_text(pkt, buf.str());
+  return true;
+}
+
+bool
+stats_server::handle_cmd_get_allocator_stats(packet &pkt)
+{
+  ostringstream buf;
+  rcu::s_instance.dump_alloc_stats(buf);
+  assign_text(pkt, buf.str());
+  return true;
+}
+
 void
 stats_server::serve_client(int fd)
 {
@@ -86,6 +119,24 @@ stats_server::serve_client(int fd)
         pkt.sendpkt(fd);
         break;
       }
+    case static_cast<uint8_t>(stats_command::GET_ABORT_PROFILE):
+      {
+        if (!handle_cmd_get_abort_profile(pkt)) {
+          cerr << "error on handle_cmd_get_abort_profile(), dropping" << endl;
+          return;
+        }
+        pkt.sendpkt(fd);
+        break;
+      }
+    case static_cast<uint8_t>(stats_command::GET_ALLOCATOR_STATS):
+      {
+        if (!handle_cmd_get_allocator_stats(pkt)) {
+          cerr << "error on handle_cmd_get_allocator_stats(), dropping" << endl;
+          return;
+        }
+        pkt.sendpkt(fd);
+        break;
+      }
     default:
       cerr << "bad command- dropping connection" << endl;
       return;
@@ -1,10 +1,13 @@
 #include <iostream>
 #include <functional>
+#include <limits>
+#include <memory>
 #include <unordered_map>
 #include <tuple>
 #include <set>
 #include <unistd.h>
 
+#include "allocator.h"
 #include "circbuf.h"
 #include "pxqueue.h"
 #include "core.h"
@@ -229,6 +232,175 @@ CircbufTest()
   cout << "circbuf test passed" << endl;
 }
 
+// assumes no thread is pinned yet, so nothing else uses the regions
+void
+AllocatorTest()
+{
+  typedef ::allocator A;
+  static const size_t hugepgsize = A::GetHugepageSize();
+  const size_t ncpus = coreid::num_cpus_online();
+  const size_t cpu = ncpus - 1;
+  const size_t arena = 7;
+  const size_t unit = A::ArenaUnit(arena);
+  void *arenas[A::MAX_ARENAS];
+
+  // the size classes cover [1, MaxAllocSize], in order
+  for (size_t i = 0; i < A::MAX_ARENAS; i++) {
+    const size_t u = A::ArenaUnit(i);
+    ALWAYS_ASSERT((u % A::AllocAlignment) == 0);
+    ALWAYS_ASSERT(A::ArenaSize(u) == make_pair(u, i));
+    const size_t prev = i ? A::ArenaUnit(i - 1) : 0;
+    ALWAYS_ASSERT(prev < u);
+    ALWAYS_ASSERT(A::ArenaSize(prev + 1) == make_pair(u, i));
+  }
+  ALWAYS_ASSERT(A::ArenaUnit(A::MAX_ARENAS - 1) == A::MaxAllocSize);
+  ALWAYS_ASSERT(A::ArenaSize(A::MaxAllocSize + 1).second == A::MAX_ARENAS);
+
+  const A::region_stats s0 = A::GetRegionStats(cpu);
+  A::SetReturnWatermark(0);
+
+  // a hugepage w/ a live object is kept
+  NDB_MEMSET(&arenas[0], 0, sizeof(arenas));
+  size_t nobjs = 0;
+  void * const live = A::AllocateArenas(cpu, arena, &nobjs);
+  void * const pg = (void *) (uintptr_t(live) & ~(hugepgsize - 1));
+  arenas[arena] = *(void **) live;
+  size_t n = 0;
+  for (void *p = arenas[arena]; p; p = *(void **) p)
+    n++;
+  ALWAYS_ASSERT(nobjs == A::ObjectsPerHugepage(arena));
+  ALWAYS_ASSERT(n + 1 == nobjs);
+  A::ReleaseArenas(&arenas[0]);
+  A::region_stats s1 = A::GetRegionStats(cpu);
+  ALWAYS_ASSERT(s1.returned_bytes_ == s0.returned_bytes_);
+  ALWAYS_ASSERT(s1.free_bytes_ == s0.free_bytes_ + n * unit);
+  ALWAYS_ASSERT(s1.remaining_bytes_ == s0.remaining_bytes_ - hugepgsize);
+  ALWAYS_ASSERT(s1.faulted_bytes_ == s0.faulted_bytes_ + hugepgsize);
+  ALWAYS_ASSERT(s1.arenas_[arena].nhugepgs_ ==
+                s0.arenas_[arena].nhugepgs_ + 1);
+  ALWAYS_ASSERT(s1.arenas_[arena].nobjs_ ==
+                s0.arenas_[arena].nobjs_ + nobjs);
+  ALWAYS_ASSERT(s1.arenas_[arena].nfree_ == s0.arenas_[arena].nfree_ + n);
+
+  // ... until it has no live objects
+#ifdef ENABLE_EVENT_COUNTERS
+  counter_data u0, u1;
+  ALWAYS_ASSERT(event_counter::stat("allocator_total_region_usage_bytes", u0));
+#endif
+  NDB_MEMSET(&arenas[0], 0, sizeof(arenas));
+  *(void **) live = nullptr;
+  arenas[arena] = live;
+  A::ReleaseArenas(&arenas[0]);
+#ifdef ENABLE_EVENT_COUNTERS
+  ALWAYS_ASSERT(event_counter::stat("allocator_total_region_usage_bytes", u1));
+  ALWAYS_ASSERT(u1.count_ == u0.count_ - hugepgsize);
+#endif
+  s1 = A::GetRegionStats(cpu);
+  ALWAYS_ASSERT(s1.returned_bytes_ == s0.returned_bytes_ + hugepgsize);
+  ALWAYS_ASSERT(s1.free_bytes_ == s0.free_bytes_);
+  ALWAYS_ASSERT(s1.faulted_bytes_ == s0.faulted_bytes_);
+  ALWAYS_ASSERT(s1.arenas_[arena].nhugepgs_ == s0.arenas_[arena].nhugepgs_);
+  ALWAYS_ASSERT(s1.arenas_[arena].nfree_ == s0.arenas_[arena].nfree_);
+
+  // and is the next one handed out
+  A::SetReturnWatermark(numeric_limits<size_t>::max());
+  void * const p = A::AllocateArenas(cpu, arena);
+  ALWAYS_ASSERT((void *) (uintptr_t(p) & ~(hugepgsize - 1)) == pg);
+#ifdef ENABLE_EVENT_COUNTERS
+  ALWAYS_ASSERT(event_counter::stat("allocator_total_region_usage_bytes", u1));
+  ALWAYS_ASSERT(u1.count_ == u0.count_);
+#endif
+  s1 = A::GetRegionStats(cpu);
+  ALWAYS_ASSERT(s1.returned_bytes_ == s0.returned_bytes_);
+  NDB_MEMSET(&arenas[0], 0, sizeof(arenas));
+  arenas[arena] = p;
+  A::ReleaseArenas(&arenas[0]);
+
+  // a large class, whose unit does not divide the hugepage size
+  const size_t large = A::ArenaSize(3 * A::MaxSmallAllocSize).second;
+  const size_t lunit = A::ArenaUnit(large);
+  ALWAYS_ASSERT(large >= A::NSmallArenas && (hugepgsize % lunit) != 0);
+  for (size_t i = 0; i < 2; i++) {
+    void * const q = A::AllocateArenas(cpu, large, &nobjs);
+    ALWAYS_ASSERT(nobjs == A::ObjectsPerHugepage(large));
+    n = 0;
+    for (void *x = q; x; x = *(void **) x, n++) {
+      ALWAYS_ASSERT(A::PointerToCpu(x) == cpu);
+      NDB_MEMSET((char *) x + sizeof(void *), 0, lunit - sizeof(void *));
+    }
+    ALWAYS_ASSERT(n == nobjs);
+    NDB_MEMSET(&arenas[0], 0, sizeof(arenas));
+    arenas[large] = q;
+    A::ReleaseArenas(&arenas[0]);
+  }
+
+  // a core which runs out of its region borrows from another
+  if (ncpus > 1) {
+    const size_t remaining = A::GetRegionStats(cpu).remaining_bytes_;
+    if (remaining)
+      A::AllocateUnmanaged(cpu, remaining / hugepgsize);
+    const A::region_stats l0 = A::GetRegionStats(0);
+    void * const b = A::AllocateUnmanaged(cpu, 1);
+    ALWAYS_ASSERT(A::PointerToCpu(b) != cpu);
+    ALWAYS_ASSERT(A::GetRegionStats(cpu).borrowed_bytes_ ==
+                  s0.borrowed_bytes_ + hugepgsize);
+    NDB_MEMSET(b, 0, hugepgsize);
+    if (A::PointerToCpu(b) == 0) {
+      const A::region_stats l1 = A::GetRegionStats(0);
+      ALWAYS_ASSERT(l1.lent_bytes_ == l0.lent_bytes_ + hugepgsize);
+      ALWAYS_ASSERT(l1.remaining_bytes_ == l0.remaining_bytes_ - hugepgsize);
+    }
+  }
+
+  cout << "allocator test passed" << endl;
+}
+
+// assumes the calling thread is the only one in RCU regions
+void
+RcuReclaimTest()
+{
+  static const size_t sz = 64;
+  vector<rcu::alloc_stats> s0, s1;
+  rcu::s_instance.get_alloc_stats(s0);
+
+  // sleeps between regions, so the ticker gets to run even w/ one cpu
+  auto free_for = [](uint64_t usec, size_t n) {
+    const uint64_t start = timer::cur_usec();
+    while (timer::cur_usec() - start < usec) {
+      {
+        scoped_rcu_region guard;
+        for (size_t i = 0; i < n; i++)
+          rcu::s_instance.dealloc_rcu(rcu::s_instance.alloc(sz), sz);
+      }
+      usleep(10);
+    }
+  };
+
+  // a backlog over half the watermark shortens the epoch
+  rcu::SetPendingWatermark(64 << 10);
+  free_for(100000, 64);
+  rcu::s_instance.get_alloc_stats(s1);
+  ALWAYS_ASSERT(s1.back().nreclaims_ > s0.back().nreclaims_);
+  ALWAYS_ASSERT(s1.back().epoch_ticks_ < rcu::EpochTimeMultiplier);
+  // entries wait for the tick after the one they were freed in to end
+  ALWAYS_ASSERT(s1.back().max_reclaim_lag_usec_ >= 2 * ticker::tick_us);
+
+  // ... and one over the watermark is reclaimed inline, on region entry
+  rcu::SetPendingWatermark(0);
+  free_for(50000, 64);
+  rcu::s_instance.get_alloc_stats(s1);
+  ALWAYS_ASSERT(s1.back().ninline_reclaims_ > s0.back().ninline_reclaims_);
+  ALWAYS_ASSERT(s1.back().epoch_ticks_ == 1);
+
+  // w/o frees, the epoch grows back
+  rcu::SetPendingWatermark(rcu::DefaultPendingWatermark);
+  free_for(20 * ticker::tick_us, 0);
+  rcu::s_instance.get_alloc_stats(s1);
+  ALWAYS_ASSERT(s1.back().epoch_ticks_ > 1);
+
+  cout << "rcu reclaim test passed" << endl;
+}
+
 void
 CounterTest()
 {
@@ -277,6 +449,71 @@ UtilTest()
   cout << "util test passed" << endl;
 }
 
+// a full leaf's sorted key slices, and probes half of which hit them
+static void
+key_slice_search_input(uint64_t *keys, size_t nslots, vector<uint64_t> &probes)
+{
+  fast_random r(8274611);
+  for (size_t i = 0; i < nslots; i++)
+    keys[i] = r.next();
+  sort(&keys[0], &keys[nslots]);
+  for (size_t i = 0; i < 4096; i++)
+    probes.push_back((i % 2) ? keys[r.next() % nslots] : r.next());
+}
+
+// the btree node key slice search primitives agree w/ a linear count
+void
+KeySliceSearchTest()
+{
+  const size_t nslots = concurrent_btree::NKeysPerLeafNode;
+  uint64_t keys[nslots];
+  vector<uint64_t> probes;
+  key_slice_search_input(keys, nslots, probes);
+  for (size_t n = 0; n <= nslots; n++) {
+    for (auto p : probes) {
+      const size_t nlt = lower_bound(&keys[0], &keys[n], p) - &keys[0];
+      const size_t nle = upper_bound(&keys[0], &keys[n], p) - &keys[0];
+      ALWAYS_ASSERT(private_::scalar_count_slices_lt(keys, n, p) == nlt);
+      ALWAYS_ASSERT(private_::scalar_count_slices_le(keys, n, p) == nle);
+#ifdef BTREE_SIMD_KEY_SEARCH
+      ALWAYS_ASSERT(private_::simd_count_slices_lt(keys, n, p) == nlt);
+      ALWAYS_ASSERT(private_::simd_count_slices_le(keys, n, p) == nle);
+#endif
+    }
+  }
+  cout << "key slice search test passed" << endl;
+}
+
+// compares the btree node key slice search primitives on a full leaf
+void
+KeySliceSearchPerfTest()
+{
+  const size_t nslots = concurrent_btree::NKeysPerLeafNode;
+  const size_t nprobes = 10000000;
+  uint64_t keys[nslots];
+  vector<uint64_t> probes;
+  key_slice_search_input(keys, nslots, probes);
+
+  volatile size_t sink UNUSED = 0;
+  {
+    scoped_rate_timer t("scalar key slice search", nprobes);
+    size_t s = 0;
+    for (size_t i = 0; i < nprobes; i++)
+      s += private_::scalar_count_slices_lt(keys, nslots, probes[i % probes.size()]);
+    sink = s;
+  }
+#ifdef BTREE_SIMD_KEY_SEARCH
+  {
+    scoped_rate_timer t(string("simd (") + BTREE_SIMD_KEY_SEARCH + ") key slice search", nprobes);
+    size_t s = 0;
+    for (size_t i = 0; i < nprobes; i++)
+      s += private_::simd_count_slices_lt(keys, nslots, probes[i % probes.size()]);
+    ALWAYS_ASSERT(s == sink);
+  }
+#endif
+  cout << "key slice search perf test passed" << endl;
+}
+
 namespace small_vector_ns {
 
 typedef small_vector<string, 4> vec_type;
@@ -954,6 +1191,98 @@ Test()
 
 }
 
+namespace removebench {
+
+  // delete-heavy btree microbenchmark. every worker owns a disjoint range of
+  // keys, so leaves are rarely shared and any contention shows up on the
+  // internal nodes above them. two workloads are timed:
+  //   queue: insert at the tail and remove from the head of the range (the
+  //          new-order/delivery pattern in TPC-C)
+  //   ttl:   remove a pre-loaded range in random order (an expiry sweep)
+
+  static const size_t nkeys_per_worker = 1 << 18;
+  static const size_t nops_per_worker = 1 << 21;
+
+  static inline u64_varkey
+  mkkey(unsigned int id, uint64_t i)
+  {
+    return u64_varkey((uint64_t(id) << 40) | i);
+  }
+
+  class worker : public ndb_thread {
+  public:
+    worker(concurrent_btree &btr, unsigned int id, bool queue)
+      : ndb_thread(false, string("removebench-worker")),
+        btr(&btr), id(id), queue(queue), nremoves(0) {}
+
+    virtual void
+    run()
+    {
+      if (queue) {
+        uint64_t head = 0, tail = nkeys_per_worker;
+        for (size_t i = 0; i < nops_per_worker; i++) {
+          scoped_rcu_region guard;
+          ALWAYS_ASSERT(btr->remove(mkkey(id, head++)));
+          btr->insert(mkkey(id, tail), (concurrent_btree::value_type) tail);
+          tail++;
+          nremoves++;
+        }
+      } else {
+        vector<uint64_t> order(nkeys_per_worker);
+        for (size_t i = 0; i < nkeys_per_worker; i++)
+          order[i] = i;
+        fast_random r(id + 1);
+        for (size_t i = nkeys_per_worker - 1; i > 0; i--)
+          swap(order[i], order[r.next() % (i + 1)]);
+        for (auto i : order) {
+          scoped_rcu_region guard;
+          ALWAYS_ASSERT(btr->remove(mkkey(id, i)));
+          nremoves++;
+        }
+      }
+    }
+
+    concurrent_btree *const btr;
+    const unsigned int id;
+    const bool queue;
+    size_t nremoves;
+  };
+
+  static void
+  RunWorkload(const string &name, size_t nthreads, bool queue)
+  {
+    concurrent_btree btr;
+    for (size_t id = 0; id < nthreads; id++)
+      for (size_t i = 0; i < nkeys_per_worker; i++) {
+        scoped_rcu_region guard;
+        btr.insert(mkkey(id, i), (concurrent_btree::value_type) i);
+      }
+
+    vector<unique_ptr<worker>> workers;
+    for (size_t id = 0; id < nthreads; id++)
+      workers.emplace_back(new worker(btr, id, queue));
+    timer t;
+    for (auto &w : workers)
+      w->start();
+    size_t nremoves = 0;
+    for (auto &w : workers) {
+      w->join();
+      nremoves += w->nremoves;
+    }
+    const double secs = double(t.lap()) / 1000000.0;
+    cerr << "removebench " << name << " (" << nthreads << " threads): "
+         << (double(nremoves) / secs) << " removes/sec" << endl;
+  }
+
+  void
+  Test()
+  {
+    const size_t nthreads = coreid::num_cpus_online();
+    RunWorkload("queue", nthreads, true);
+    RunWorkload("ttl", nthreads, false);
+  }
+}
+
 class main_thread : public ndb_thread {
 public:
   main_thread(int argc, char **argv)
@@ -974,6 +1303,8 @@ public:
     // initialize the numa allocator subsystem with the number of CPUs running
     // + reasonable size per core
     ::allocator::Initialize(coreid::num_cpus_online(), size_t(128 * (1<<20)));
+    AllocatorTest();
+    RcuReclaimTest();
 #ifdef PROTO2_CAN_DISABLE_GC
     transaction_proto2_static::InitGC();
 #endif
@@ -985,11 +1316,20 @@ public:
     //small_vector_ns::Test();
     //small_map_ns::Test();
     //recordtest::Test();
+    //removebench::Test();
+    KeySliceSearchTest();
+    //KeySliceSearchPerfTest();
     //rcu::Test();
     extern void TestConcurrentBtreeFast();
     extern void TestConcurrentBtreeSlow();
     // either tests Masstree or Silotree, depending on NDB_MASSTREE
     TestConcurrentBtreeFast();
+    // 'test btree' stops after the fast btree tests (see
+    // scripts/btree_layouts.sh)
+    if (argc > 1 && string(argv[1]) == "btree") {
+      ret = 0;
+      return;
+    }
     TestConcurrentBtreeSlow();
     txn_btree_test();
     ret = 0;
@@ -986,9 +986,10 @@ public:
 #endif
   }
 
-  // NB: we round up allocation sizes because jemalloc will do this
-  // internally anyways, so we might as well grab more usable space (really
-  // just internal vs external fragmentation)
+  // NB: we round up allocation sizes to the allocator's size class (see
+  // allocator::ArenaSize()), since the rest of the object would go unused
+  // anyways, so we might as well grab more usable space (really just
+  // internal vs external fragmentation)
 
   static inline dbtuple *
   alloc_first(size_type sz, bool acquire_lock)
@@ -998,7 +999,7 @@ public:
       std::numeric_limits<node_size_type>::max() + sizeof(dbtuple);
     const size_t alloc_sz =
       std::min(
-          util::round_up<size_t, allocator::LgAllocAlignment>(sizeof(dbtuple) + sz),
+          allocator::ArenaSize(sizeof(dbtuple) + sz).first,
           max_alloc_sz);
     char *p = reinterpret_cast<char *>(rcu::s_instance.alloc(alloc_sz));
     INVARIANT(p);
@@ -1014,7 +1015,7 @@ public:
       std::numeric_limits<node_size_type>::max() + sizeof(dbtuple);
     const size_t alloc_sz =
       std::min(
-          util::round_up<size_t, allocator::LgAllocAlignment>(sizeof(dbtuple) + base->size),
+          allocator::ArenaSize(sizeof(dbtuple) + base->size).first,
           max_alloc_sz);
     char *p = reinterpret_cast<char *>(rcu::s_instance.alloc(alloc_sz));
     INVARIANT(p);
@@ -1036,7 +1037,7 @@ public:
       std::numeric_limits<node_size_type>::max() + sizeof(dbtuple);
     const size_t alloc_sz =
       std::min(
-          util::round_up<size_t, allocator::LgAllocAlignment>(sizeof(dbtuple) + needed_sz),
+          allocator::ArenaSize(sizeof(dbtuple) + needed_sz).first,
           max_alloc_sz);
     char *p = reinterpret_cast<char *>(rcu::s_instance.alloc(alloc_sz));
     INVARIANT(p);
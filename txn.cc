@@ -8,6 +8,8 @@
 
 #include <algorithm>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <vector>
 #include <utility>
@@ -53,6 +55,11 @@ CLASS_STATIC_COUNTER_IMPL(transaction_base, scopedperf::tsc_ctr, g_txn_commit_pr
 ABORT_REASONS(EVENT_COUNTER_IMPL_X)
 #undef EVENT_COUNTER_IMPL_X
 
+#define EVENT_AVG_COUNTER_IMPL_X(x) \
+  event_avg_counter transaction_base::g_ ## x ## _lock_hold_ctr(#x "_lock_hold_cycles");
+ABORT_REASONS(EVENT_AVG_COUNTER_IMPL_X)
+#undef EVENT_AVG_COUNTER_IMPL_X
+
 event_counter transaction_base::g_evt_read_logical_deleted_node_search
     ("read_logical_deleted_node_search");
 event_counter transaction_base::g_evt_read_logical_deleted_node_scan
@@ -65,3 +72,40 @@ event_counter transaction_base::g_evt_dbtuple_write_insert_failed
 event_counter transaction_base::evt_local_search_lookups("local_search_lookups");
 event_counter transaction_base::evt_local_search_write_set_hits("local_search_write_set_hits");
 event_counter transaction_base::evt_dbtuple_latest_replacement("dbtuple_latest_replacement");
+event_avg_counter transaction_base::evt_avg_commit_lock_hold_cycles("avg_commit_lock_hold_cycles");
+
+// id => <name, live tables w/ it>
+static mutex g_table_ids_mutex;
+static map<uint32_t, pair<string, size_t>> g_table_ids;
+
+void
+table_id_registry::Register(uint32_t id, const string &name, bool unique)
+{
+  std::lock_guard<mutex> l(g_table_ids_mutex);
+  if (unique && name == "<unknown>") {
+    cerr << "[ERROR] tables must be named when logging is on" << endl;
+    ALWAYS_ASSERT(false);
+  }
+  auto &e = g_table_ids[id];
+  if (e.second && e.first != name) {
+    cerr << "[ERROR] tables " << e.first << " and " << name
+         << " hash to the same id " << id << endl;
+    ALWAYS_ASSERT(false);
+  }
+  if (e.second && unique) {
+    cerr << "[ERROR] table " << name << " is already open" << endl;
+    ALWAYS_ASSERT(false);
+  }
+  e.first = name;
+  e.second++;
+}
+
+void
+table_id_registry::Unregister(uint32_t id)
+{
+  std::lock_guard<mutex> l(g_table_ids_mutex);
+  auto it = g_table_ids.find(id);
+  INVARIANT(it != g_table_ids.end() && it->second.second);
+  if (!--it->second.second)
+    g_table_ids.erase(it);
+}
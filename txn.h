@@ -18,6 +18,7 @@
 
 #include <unordered_map>
 
+#include "abort_profiler.h"
 #include "amd64.h"
 #include "btree_choice.h"
 #include "core.h"
@@ -135,6 +136,26 @@ protected:
     return 0;
   }
 
+  // how long an aborted commit held its write locks, by abort reason
+#define EVENT_AVG_COUNTER_DEF_X(x) \
+  static event_avg_counter g_ ## x ## _lock_hold_ctr;
+  ABORT_REASONS(EVENT_AVG_COUNTER_DEF_X)
+#undef EVENT_AVG_COUNTER_DEF_X
+
+  static event_avg_counter *
+  AbortReasonLockHoldCounter(abort_reason reason)
+  {
+    switch (reason) {
+#define EVENT_AVG_COUNTER_CASE_X(x) case x: return &g_ ## x ## _lock_hold_ctr;
+    ABORT_REASONS(EVENT_AVG_COUNTER_CASE_X)
+#undef EVENT_AVG_COUNTER_CASE_X
+    default:
+      break;
+    }
+    ALWAYS_ASSERT(false);
+    return 0;
+  }
+
 public:
 
   // only fires during invariant checking
@@ -157,10 +178,14 @@ protected:
   // the read set is a mapping from (tuple -> tid_read).
   // "write_set" is used to indicate if this read tuple
   // also belongs in the write set.
+  //
+  // the btree is only kept to attribute a failed validation to its table
+  // (see abort_profiler)
   struct read_record_t {
-    constexpr read_record_t() : tuple(), t() {}
-    constexpr read_record_t(const dbtuple *tuple, tid_t t)
-      : tuple(tuple), t(t) {}
+    constexpr read_record_t() : tuple(), t(), btr() {}
+    constexpr read_record_t(const dbtuple *tuple, tid_t t,
+                            const concurrent_btree *btr)
+      : tuple(tuple), t(t), btr(btr) {}
     inline const dbtuple *
     get_tuple() const
     {
@@ -171,9 +196,15 @@ protected:
     {
       return t;
     }
+    inline const concurrent_btree *
+    get_btree() const
+    {
+      return btr;
+    }
   private:
     const dbtuple *tuple;
     tid_t t;
+    const concurrent_btree *btr;
   };
 
   friend std::ostream &
@@ -184,6 +215,7 @@ protected:
     enum {
       FLAGS_INSERT  = 0x1,
       FLAGS_DOWRITE = 0x1 << 1,
+      FLAGS_UNLOCK  = 0x1 << 2,
     };
 
     constexpr inline write_record_t()
@@ -231,6 +263,20 @@ protected:
       INVARIANT(!do_write());
       btr.or_flags(FLAGS_DOWRITE);
     }
+    // set on the last write to its tuple: commit() unlocks the tuple
+    // right after installing it
+    inline bool
+    do_unlock() const
+    {
+      return btr.get_flags() & FLAGS_UNLOCK;
+    }
+    inline void
+    set_do_unlock()
+    {
+      INVARIANT(do_write());
+      INVARIANT(!do_unlock());
+      btr.or_flags(FLAGS_UNLOCK);
+    }
     inline concurrent_btree *
     get_btree() const
     {
@@ -256,14 +302,18 @@ protected:
     const string_type *k;
     const void *r;
     dbtuple::tuple_writer_t w;
-    marked_ptr<concurrent_btree> btr; // first bit for inserted, 2nd for dowrite
+    marked_ptr<concurrent_btree> btr; // bits for inserted, dowrite, unlock
   };
 
   friend std::ostream &
   operator<<(std::ostream &o, const write_record_t &r);
 
   // the absent set is a mapping from (btree_node -> version_number).
-  struct absent_record_t { uint64_t version; };
+  // btr is kept like read_record_t's
+  struct absent_record_t {
+    uint64_t version;
+    const concurrent_btree *btr;
+  };
 
   friend std::ostream &
   operator<<(std::ostream &o, const absent_record_t &r);
@@ -333,6 +383,7 @@ protected:
   static event_counter evt_local_search_lookups;
   static event_counter evt_local_search_write_set_hits;
   static event_counter evt_dbtuple_latest_replacement;
+  static event_avg_counter evt_avg_commit_lock_hold_cycles; // per tuple
 
   CLASS_STATIC_COUNTER_DECL(scopedperf::tsc_ctr, g_txn_commit_probe0, g_txn_commit_probe0_cg);
   CLASS_STATIC_COUNTER_DECL(scopedperf::tsc_ctr, g_txn_commit_probe1, g_txn_commit_probe1_cg);
@@ -376,6 +427,7 @@ operator<<(std::ostream &o, const transaction_base::read_record_t &r)
   //o << "[tuple=" << util::hexify(r.get_tuple())
   o << "[tuple=" << *r.get_tuple()
     << ", tid_read=" << g_proto_version_str(r.get_tid())
+    << ", btree=" << r.get_btree()
     << "]";
   return o;
 }
@@ -398,7 +450,7 @@ operator<<(
 inline ALWAYS_INLINE std::ostream &
 operator<<(std::ostream &o, const transaction_base::absent_record_t &r)
 {
-  o << "[v=" << r.version << "]";
+  o << "[v=" << r.version << ", btree=" << r.btr << "]";
   return o;
 }
 
@@ -619,6 +671,20 @@ protected:
           { return lhs.get_tuple() < rhs.get_tuple(); });
   }
 
+  // the first entry of tuple in dbtuples, null if there is none
+  static inline const dbtuple_write_info *
+  sorted_dbtuples_find(
+      const dbtuple_write_info_vec &dbtuples,
+      const dbtuple *tuple)
+  {
+    auto it = std::lower_bound(
+        dbtuples.begin(), dbtuples.end(),
+        dbtuple_write_info(tuple),
+        [](const dbtuple_write_info &lhs, const dbtuple_write_info &rhs)
+          { return lhs.get_tuple() < rhs.get_tuple(); });
+    return it != dbtuples.end() && it->get_tuple() == tuple ? &*it : nullptr;
+  }
+
 public:
 
   inline transaction(uint64_t flags, string_allocator_type &sa);
@@ -638,22 +704,30 @@ public:
 
   void dump_debug_info() const;
 
-#ifdef DIE_ON_ABORT
-  void
+  inline ALWAYS_INLINE void
   abort_trap(abort_reason reason)
   {
-    AbortReasonCounter(reason)->inc();
-    this->reason = reason; // for dump_debug_info() to see
-    dump_debug_info();
-    ::abort();
+    abort_profiler::Record(reason);
+    count_abort(reason);
   }
-#else
-  inline ALWAYS_INLINE void
-  abort_trap(abort_reason reason)
+
+  // like abort_trap(), for an abort over key of btr (see abort_profiler)
+  inline void
+  abort_trap(abort_reason reason,
+             const concurrent_btree *btr, const string_type &key)
   {
-    AbortReasonCounter(reason)->inc();
+    abort_profiler::Record(reason, btr, key.data(), key.size());
+    count_abort(reason);
+  }
+
+  // like abort_trap() w/ a key, for a record of btr whose key is not known
+  inline void
+  abort_trap(abort_reason reason,
+             const concurrent_btree *btr, const void *record)
+  {
+    abort_profiler::Record(reason, btr, record);
+    count_abort(reason);
   }
-#endif
 
   std::map<std::string, uint64_t> get_txn_counters() const;
 
@@ -685,6 +759,23 @@ public:
 protected:
   inline void abort_impl(abort_reason r);
 
+#ifdef DIE_ON_ABORT
+  void
+  count_abort(abort_reason reason)
+  {
+    AbortReasonCounter(reason)->inc();
+    this->reason = reason; // for dump_debug_info() to see
+    dump_debug_info();
+    ::abort();
+  }
+#else
+  inline ALWAYS_INLINE void
+  count_abort(abort_reason reason)
+  {
+    AbortReasonCounter(reason)->inc();
+  }
+#endif
+
   // assumes lock on marker is held on marker by caller, and marker is the
   // latest: removes marker from tree, and clears latest
   void cleanup_inserted_tuple_marker(
@@ -717,14 +808,17 @@ protected:
       const void *value,
       dbtuple::tuple_writer_t writer);
 
-  // reads the contents of tuple into v
+  // reads the contents of tuple, found in btr, into v
   // within this transaction context
   template <typename ValueReader>
   bool
-  do_tuple_read(const dbtuple *tuple, ValueReader &value_reader);
+  do_tuple_read(const dbtuple *tuple, ValueReader &value_reader,
+                const concurrent_btree *btr);
 
+  // n is a node of btr
   void
-  do_node_read(const typename concurrent_btree::node_opaque_t *n, uint64_t version);
+  do_node_read(const typename concurrent_btree::node_opaque_t *n, uint64_t version,
+               const concurrent_btree *btr);
 
 public:
   // expected public overrides
@@ -763,6 +857,10 @@ protected:
   // the logical node for actual deletion
   void on_logical_delete(dbtuple *tuple, const std::string &key, concurrent_btree *btr);
 
+  // Called w/ the lock on tuple held, just before a committing write
+  // (other than an insert) replaces tuple's latest value
+  void on_dbtuple_overwrite(const dbtuple *tuple);
+
   // if gen_commit_tid() is called, then on_tid_finish() will be called
   // with the commit tid. before on_tid_finish() is called, state is updated
   // with the resolution (commited, aborted) of this txn
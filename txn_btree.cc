@@ -3,10 +3,13 @@
 #include <memory>
 #include <atomic>
 #include <mutex>
+#include <sstream>
 
 #include "txn.h"
 #include "txn_proto2_impl.h"
 #include "txn_btree.h"
+#include "txn_checkpointer.h"
+#include "txn_log_recovery.h"
 #include "typed_txn_btree.h"
 #include "thread.h"
 #include "util.h"
@@ -17,9 +20,7 @@
 
 #include "scopedperf.hh"
 
-#if defined(NDB_MASSTREE)
 #define HAVE_REVERSE_RANGE_SCANS
-#endif
 
 using namespace std;
 using namespace util;
@@ -252,6 +253,916 @@ test2()
   }
 }
 
+template <template <typename> class TxnType, typename Traits>
+static void
+test_multi_get()
+{
+  for (size_t txn_flags_idx = 0;
+       txn_flags_idx < ARRAY_NELEMS(TxnFlags);
+       txn_flags_idx++) {
+    const uint64_t txn_flags = TxnFlags[txn_flags_idx];
+    txn_btree<TxnType> btr(sizeof(rec));
+    typename Traits::StringAllocator arena;
+
+    // even keys only
+    const size_t nkeys = 100;
+    for (size_t i = 0; i < nkeys; i++) {
+      TxnType<Traits> t(txn_flags, arena);
+      btr.insert_object(t, u64_varkey(2 * i), rec(2 * i));
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      // spans several batches, half of the keys are absent
+      TxnType<Traits> t(txn_flags, arena);
+      vector<string> keys;
+      for (size_t i = 0; i < 2 * nkeys; i++)
+        keys.push_back(u64_varkey(i).str());
+      vector<string> values(keys.size());
+      unique_ptr<bool[]> found(new bool[keys.size()]);
+      const size_t nfound =
+        btr.multi_get(t, keys.size(), &keys[0], &values[0], found.get());
+      ALWAYS_ASSERT_COND_IN_TXN(t, nfound == nkeys);
+      for (size_t i = 0; i < keys.size(); i++) {
+        ALWAYS_ASSERT_COND_IN_TXN(t, found[i] == !(i % 2));
+        if (found[i])
+          AssertByteEquality(rec(i), values[i]);
+      }
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      // racy insert of a key we found to be absent
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      const string keys[] = {u64_varkey(2).str(), u64_varkey(3).str()};
+      string values[2];
+      bool found[2];
+      ALWAYS_ASSERT_COND_IN_TXN(t0, btr.multi_get(t0, 2, keys, values, found) == 1);
+      ALWAYS_ASSERT_COND_IN_TXN(t0, found[0] && !found[1]);
+
+      btr.insert_object(t1, u64_varkey(3), rec(3));
+      AssertSuccessfulCommit(t1);
+
+      btr.insert_object(t0, u64_varkey(2), rec(2));
+      AssertFailedCommit(t0);
+    }
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_cursor()
+{
+  for (size_t txn_flags_idx = 0;
+       txn_flags_idx < ARRAY_NELEMS(TxnFlags);
+       txn_flags_idx++) {
+    const uint64_t txn_flags = TxnFlags[txn_flags_idx];
+    txn_btree<TxnType> btr2(sizeof(rec)), btr3(sizeof(rec));
+    typename Traits::StringAllocator arena;
+    typedef typename txn_btree<TxnType>::template cursor<Traits> cursor;
+
+    // multiples of 2 in one tree, multiples of 3 in the other
+    const size_t nkeys = 300;
+    for (size_t i = 0; i < nkeys; i++) {
+      TxnType<Traits> t(txn_flags, arena);
+      if (!(i % 2))
+        btr2.insert_object(t, u64_varkey(i), rec(i));
+      if (!(i % 3))
+        btr3.insert_object(t, u64_varkey(i), rec(i));
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      // merge join, w/ batch sizes which don't line up
+      TxnType<Traits> t(txn_flags, arena);
+      cursor c2(btr2, t, 5), c3(btr3, t, 7);
+      c2.seek(u64_varkey(0).str());
+      c3.seek(u64_varkey(0).str());
+      size_t i = 0;
+      while (c2.valid() && c3.valid()) {
+        if (c2.key() < c3.key()) {
+          c2.next();
+        } else if (c3.key() < c2.key()) {
+          c3.next();
+        } else {
+          ALWAYS_ASSERT_COND_IN_TXN(t, c2.key() == u64_varkey(i).str());
+          AssertByteEquality(rec(i), c2.value());
+          AssertByteEquality(rec(i), c3.value());
+          i += 6;
+          c2.next();
+          c3.next();
+        }
+      }
+      ALWAYS_ASSERT_COND_IN_TXN(t, i == nkeys);
+
+      // backwards from the middle, then pages of 11
+      ALWAYS_ASSERT_COND_IN_TXN(t, c3.rseek(u64_varkey(100).str()));
+      for (ssize_t j = 99; j >= 0; j -= 3) {
+        ALWAYS_ASSERT_COND_IN_TXN(t, c3.key() == u64_varkey(j).str());
+        c3.prev();
+      }
+      ALWAYS_ASSERT_COND_IN_TXN(t, !c3.valid());
+      ALWAYS_ASSERT_COND_IN_TXN(t, c2.seek(u64_varkey(1).str()));
+      vector<pair<string, string>> page;
+      size_t npages = 0;
+      while (c2.next_n(11, page))
+        npages++;
+      ALWAYS_ASSERT_COND_IN_TXN(t, npages == (nkeys / 2 - 1 + 10) / 11);
+      ALWAYS_ASSERT_COND_IN_TXN(t, page.size() == nkeys / 2 - 1);
+      for (size_t j = 0; j < page.size(); j++) {
+        ALWAYS_ASSERT_COND_IN_TXN(t, page[j].first == u64_varkey(2 * j + 2).str());
+        AssertByteEquality(rec(2 * j + 2), page[j].second);
+      }
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      // keys the cursor read ahead are protected like any other scan, even
+      // if the cursor never stepped onto them
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      cursor c(btr2, t0, 8);
+      ALWAYS_ASSERT_COND_IN_TXN(t0, c.seek(u64_varkey(10).str()));
+      ALWAYS_ASSERT_COND_IN_TXN(t0, c.key() == u64_varkey(10).str());
+
+      btr2.insert_object(t1, u64_varkey(13), rec(13));
+      AssertSuccessfulCommit(t1);
+
+      btr2.insert_object(t0, u64_varkey(1000), rec(1000));
+      AssertFailedCommit(t0);
+    }
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_bulk_load()
+{
+  for (size_t txn_flags_idx = 0;
+       txn_flags_idx < ARRAY_NELEMS(TxnFlags);
+       txn_flags_idx++) {
+    const uint64_t txn_flags = TxnFlags[txn_flags_idx];
+    txn_btree<TxnType> btr(sizeof(rec));
+    typename Traits::StringAllocator arena;
+
+    // even keys only
+    const size_t nkeys = 1000;
+    vector<pair<string, string>> kvs;
+    for (size_t i = 0; i < nkeys; i++) {
+      const rec r(2 * i);
+      kvs.emplace_back(
+          u64_varkey(2 * i).str(), string((const char *) &r, sizeof(r)));
+    }
+    ALWAYS_ASSERT(btr.bulk_load(kvs.begin(), kvs.end(), 0.5));
+    ALWAYS_ASSERT(!btr.bulk_load(kvs.begin(), kvs.end()));
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      string v;
+      for (size_t i = 0; i < nkeys; i++) {
+        ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(2 * i), v));
+        AssertByteEquality(rec(2 * i), v);
+        ALWAYS_ASSERT_COND_IN_TXN(t, !btr.search(t, u64_varkey(2 * i + 1), v));
+      }
+      size_t n = 0;
+      auto f = [&n](const typename txn_btree<TxnType>::keystring_type &k,
+                    const string &v) {
+        AssertByteEquality(rec(2 * n), v);
+        ALWAYS_ASSERT(varkey(k) == u64_varkey(2 * n++));
+        return true;
+      };
+      btr.search_range(t, u64_varkey(0).str(), nullptr, f);
+      ALWAYS_ASSERT_COND_IN_TXN(t, n == nkeys);
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      // loaded records conflict like any others
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      string v;
+      ALWAYS_ASSERT_COND_IN_TXN(t0, btr.search(t0, u64_varkey(2), v));
+
+      const rec r3(3), r5(5);
+      btr.put(t1, u64_varkey(2), string((const char *) &r3, sizeof(r3)));
+      btr.insert_object(t1, u64_varkey(3), r3);
+      AssertSuccessfulCommit(t1);
+
+      btr.put(t0, u64_varkey(4), string((const char *) &r5, sizeof(r5)));
+      AssertFailedCommit(t0);
+    }
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      string v;
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(2), v));
+      AssertByteEquality(rec(3), v);
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(3), v));
+      AssertByteEquality(rec(3), v);
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(4), v));
+      AssertByteEquality(rec(4), v);
+      AssertSuccessfulCommit(t);
+    }
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+}
+
+// a txn as txn_logger writes it: <key, value> pairs, w/ an empty value
+// for a remove
+struct test_log_txn {
+  uint64_t tid_;
+  vector<pair<string, string>> writes_;
+};
+
+// appends a log buffer w/ txns (which must share a core and epoch) to out,
+// laid out like txn_logger does (see txn_logger::logbuf_header), and
+// compressed w/ codec if not null. the writes all go to table_id, and the
+// header is stamped w/ seq (see txn_logger::segment_info)
+static void
+append_log_buffer(string &out, uint32_t table_id,
+                  const vector<test_log_txn> &txns,
+                  log_codec *codec = nullptr, uint32_t seq = 0)
+{
+  serializer<uint32_t, true> vs_uint32_t;
+  serializer<uint32_t, false> s_uint32_t;
+  serializer<uint64_t, false> s_uint64_t;
+  string data;
+  vector<size_t> txn_ends;
+  for (auto &txn : txns) {
+    uint8_t buf[1024];
+    uint8_t *p = s_uint64_t.write(&buf[0], txn.tid_);
+    p = vs_uint32_t.write(p, txn.writes_.size());
+    data.append((const char *) &buf[0], p - &buf[0]);
+    for (auto &w : txn.writes_) {
+      p = s_uint32_t.write(&buf[0], table_id);
+      p = vs_uint32_t.write(p, w.first.size());
+      data.append((const char *) &buf[0], p - &buf[0]);
+      data.append(w.first);
+      p = vs_uint32_t.write(&buf[0], w.second.size());
+      data.append((const char *) &buf[0], p - &buf[0]);
+      data.append(w.second);
+    }
+    txn_ends.push_back(data.size());
+  }
+  const txn_logger::logbuf_header hdr =
+    {txns.size(), txns.back().tid_, uint8_t(codec ? codec->id() : 0), 0, seq};
+  out.append((const char *) &hdr, sizeof(hdr));
+  if (!codec) {
+    out.append(data);
+    return;
+  }
+  // two txns per compressed chunk
+  vector<uint8_t> state(codec->state_size());
+  size_t start = 0;
+  for (size_t i = 1; i < txn_ends.size() + 1; i += 2) {
+    const size_t end = txn_ends[min(i, txn_ends.size() - 1)];
+    string chunk(codec->compress_bound(end - start), '\0');
+    const size_t n = codec->compress(
+        state.data(), (const uint8_t *) data.data() + start, end - start,
+        (uint8_t *) &chunk[0], chunk.size());
+    ALWAYS_ASSERT(n > 0);
+    const uint32_t n32 = n;
+    out.append((const char *) &n32, sizeof(n32));
+    out.append(chunk.data(), n);
+    start = end;
+  }
+}
+
+static void
+write_test_file(const string &fname, const string &contents)
+{
+  FILE *fp = fopen(fname.c_str(), "w");
+  ALWAYS_ASSERT(fp);
+  ALWAYS_ASSERT(fwrite(contents.data(), 1, contents.size(), fp) ==
+                contents.size());
+  fclose(fp);
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_log_recovery()
+{
+  typedef transaction_proto2_static tps;
+  typedef pair<uint32_t, string> table_key;
+  char tmpl[] = "/tmp/silo-recovery-XXXXXX";
+  ALWAYS_ASSERT(mkdtemp(tmpl));
+  const string dir(tmpl);
+  const vector<string> fnames = {dir + "/log0", dir + "/log1"};
+  const string pepoch_fname = txn_logger::PersistedEpochFile(fnames[0]);
+
+  // if compress, buffers are compressed w/
+  // codecs[(compress + buffer # + core) % codecs.size()], so they mix
+  // codecs (and uncompressed buffers) within a file
+  vector<log_codec *> codecs = {
+    nullptr,
+    log_codec::Get(log_codec::CODEC_LZ4),
+    log_codec::Get(log_codec::CODEC_LZ4HC),
+  };
+  ALWAYS_ASSERT(codecs[1] && codecs[2]);
+  ALWAYS_ASSERT(log_codec::Find("lz4hc") == codecs[2]);
+#ifdef LOG_CODEC_ZSTD
+  codecs.push_back(log_codec::Get(log_codec::CODEC_ZSTD));
+  ALWAYS_ASSERT(codecs[3] && log_codec::Find("zstd") == codecs[3]);
+#else
+  ALWAYS_ASSERT(!log_codec::Get(log_codec::CODEC_ZSTD));
+#endif
+  // the buffers alternate between two tables, which share key names
+  const string table_names[2] = {"table0", "table1"};
+  const uint32_t table_ids[2] = {
+    txn_btree<TxnType>::TableId(table_names[0]),
+    txn_btree<TxnType>::TableId(table_names[1]),
+  };
+  ALWAYS_ASSERT(table_ids[0] != table_ids[1]);
+  const uint32_t table0 = table_ids[0];
+  for (int compress = 0; compress < 2; compress++) {
+    // cores 0 and 1 log to the first file, core 2 to the second. each core
+    // writes its own keys, plus a few shared ones which get overwritten and
+    // removed from all cores. core 2 stops at epoch 4, cores 0 and 1 at 6
+    fast_random r(1234 + compress);
+    string files[2];
+    map<uint64_t, test_log_txn> all_txns; // by TID
+    map<uint64_t, uint32_t> txn_tables; // by TID
+    for (uint64_t epoch = 1; epoch <= 6; epoch++) {
+      for (uint64_t core = 0; core < 3; core++) {
+        if (core == 2 && epoch > 4)
+          continue;
+        // two buffers per epoch, the 1st of them partially full
+        for (size_t b = 0; b < 2; b++) {
+          vector<test_log_txn> txns;
+          for (size_t i = 0; i < 5; i++) {
+            test_log_txn txn;
+            txn.tid_ = tps::MakeTid(core, 10 * b + i + 1, epoch);
+            const size_t nwrites = 1 + r.next() % 3;
+            for (size_t w = 0; w < nwrites; w++) {
+              const bool shared = !(r.next() % 4);
+              const string k = shared ?
+                "shared" + to_string(r.next() % 10) :
+                "core" + to_string(core) + "-" + to_string(r.next() % 50);
+              const bool remove = !(r.next() % 5);
+              txn.writes_.emplace_back(
+                  k, remove ? string() : r.next_string(1 + r.next() % 40));
+            }
+            txns.push_back(txn);
+            all_txns[txn.tid_] = txn;
+            txn_tables[txn.tid_] = table_ids[b];
+          }
+          append_log_buffer(
+              files[core == 2], table_ids[b], txns,
+              compress ?
+                codecs[(compress + b + core) % codecs.size()] : nullptr);
+        }
+      }
+    }
+
+    // replays txns in TID order, up through max_epoch
+    auto expected = [&all_txns, &txn_tables](uint64_t max_epoch) {
+      map<table_key, string> m;
+      for (auto &p : all_txns) {
+        if (tps::EpochId(p.first) > max_epoch)
+          continue;
+        const uint32_t table_id = txn_tables[p.first];
+        for (auto &w : p.second.writes_)
+          if (w.second.empty())
+            m.erase(table_key(table_id, w.first));
+          else
+            m[table_key(table_id, w.first)] = w.second;
+      }
+      return m;
+    };
+    auto recovered = [](const txn_log_recovery &rec) {
+      map<table_key, string> m;
+      rec.scan([&m](uint32_t table_id, const string &k,
+                    const uint8_t *v, size_t vlen, uint64_t) {
+        ALWAYS_ASSERT(m.emplace(
+              table_key(table_id, k), string((const char *) v, vlen)).second);
+      });
+      return m;
+    };
+
+    // a crash in the middle of writing a buffer
+    {
+      string torn;
+      append_log_buffer(
+          torn, table0, {{tps::MakeTid(2, 100, 5), {{"shared0", "lost"}}}},
+          codecs[compress]);
+      files[1].append(torn.substr(0, torn.size() - 3));
+    }
+    write_test_file(fnames[0], files[0]);
+    write_test_file(fnames[1], files[1]);
+    unlink(pepoch_fname.c_str());
+
+    {
+      // w/o the logger's record, only epochs every core moved past count
+      txn_log_recovery rec(fnames);
+      ALWAYS_ASSERT(rec.run());
+      const txn_log_recovery::stats &s = rec.get_stats();
+      ALWAYS_ASSERT(s.persisted_epoch_ == 3);
+      ALWAYS_ASSERT(s.nfiles_torn_ == 1);
+      ALWAYS_ASSERT(s.nbuffers_ == 2 * (6 * 2 + 4));
+      ALWAYS_ASSERT(s.nbuffers_replayed_ == 2 * 3 * 3);
+      ALWAYS_ASSERT(s.ntxns_replayed_ == 5 * 2 * 3 * 3);
+      ALWAYS_ASSERT(recovered(rec) == expected(3));
+      ALWAYS_ASSERT(s.nkeys_ == expected(3).size());
+    }
+
+    {
+      write_test_file(pepoch_fname, string("\x04\0\0\0\0\0\0\0", 8));
+      txn_log_recovery rec(fnames);
+      ALWAYS_ASSERT(rec.run());
+      ALWAYS_ASSERT(rec.persisted_epoch() == 4);
+      ALWAYS_ASSERT(rec.table_ids().size() == 2);
+      const map<table_key, string> m = recovered(rec);
+      ALWAYS_ASSERT(m == expected(4));
+
+      // on top of a checkpoint of epoch 2, only the keys written since
+      txn_log_recovery rec1(fnames);
+      ALWAYS_ASSERT(rec1.run(2));
+      map<table_key, string> m1 = expected(2);
+      for (auto &p : recovered(rec1))
+        m1[p.first] = p.second;
+      for (auto &p : all_txns)
+        if (tps::EpochId(p.first) > 2 && tps::EpochId(p.first) <= 4)
+          for (auto &w : p.second.writes_) {
+            const table_key tk(txn_tables[p.first], w.first);
+            if (w.second.empty() && !m.count(tk))
+              m1.erase(tk);
+          }
+      ALWAYS_ASSERT(m1 == m);
+
+      // and into txn_btrees, each getting its own table's records
+      txn_btree<TxnType> btr0(128, false, table_names[0]),
+                         btr1(128, false, table_names[1]);
+      typename Traits::StringAllocator arena;
+      ALWAYS_ASSERT(rec.load(vector<txn_btree<TxnType> *>({&btr1, &btr0})));
+      for (size_t i = 0; i < 2; i++) {
+        TxnType<Traits> t(0, arena);
+        size_t n = 0;
+        auto it = m.lower_bound(table_key(table_ids[i], string()));
+        auto f = [&](const typename txn_btree<TxnType>::keystring_type &k,
+                     const string &v) {
+          ALWAYS_ASSERT(it != m.end() && it->first.first == table_ids[i]);
+          ALWAYS_ASSERT(k == it->first.second && v == it->second);
+          ++it;
+          n++;
+          return true;
+        };
+        (i ? btr1 : btr0).search_range(t, string(), nullptr, f);
+        ALWAYS_ASSERT_COND_IN_TXN(
+            t, it == m.end() || it->first.first != table_ids[i]);
+        ALWAYS_ASSERT_COND_IN_TXN(t, n > 0);
+        AssertSuccessfulCommit(t);
+      }
+
+      // the records of a table w/o a tree are left out, and two trees
+      // cannot share a table
+      txn_btree<TxnType> other(128, false, "other");
+      ALWAYS_ASSERT(rec.load(other));
+      {
+        scoped_rcu_region guard;
+        ALWAYS_ASSERT(other.size_estimate() == 0);
+      }
+      txn_btree<TxnType> dup0(128, false, table_names[0]),
+                         dup1(128, false, table_names[0]);
+      ALWAYS_ASSERT(!rec.load(vector<txn_btree<TxnType> *>({&dup0, &dup1})));
+    }
+  }
+
+  {
+    // a segmented log, whose segments end w/ their preallocated zeroes, or
+    // w/ the buffers of the segment their (recycled) file held before
+    const string logfile = dir + "/slog";
+    const vector<string> segs = {logfile + ".0", logfile + ".1"};
+    string seg0, seg1;
+    append_log_buffer(
+        seg0, table0, {{tps::MakeTid(0, 1, 1), {{"a", "1"}, {"b", "1"}}}},
+        nullptr, 4);
+    append_log_buffer(
+        seg0, table0, {{tps::MakeTid(0, 1, 2), {{"a", "2"}}}}, nullptr, 4);
+    seg0.append(256, '\0');
+    append_log_buffer(
+        seg1, table0, {{tps::MakeTid(0, 1, 3), {{"b", ""}, {"c", "3"}}}},
+        nullptr, 5);
+    append_log_buffer(
+        seg1, table0, {{tps::MakeTid(0, 1, 2), {{"d", "stale"}}}}, nullptr, 2);
+    seg1.append(100, '\0');
+    write_test_file(segs[0], seg0);
+    write_test_file(segs[1], seg1);
+    write_test_file(
+        txn_logger::SegmentManifestFile(logfile),
+        "segment " + segs[0] + " 2 4\n" +
+        "segment " + segs[1] + " 0 5\n" +
+        "spare " + dir + "/slog.2\n");
+    const string spepoch_fname = txn_logger::PersistedEpochFile(logfile);
+    write_test_file(spepoch_fname, string("\x03\0\0\0\0\0\0\0", 8));
+
+    vector<txn_logger::segment_info> segments;
+    ALWAYS_ASSERT(txn_logger::ReadSegmentManifest(logfile, segments));
+    ALWAYS_ASSERT(segments.size() == 2);
+    ALWAYS_ASSERT(segments[1].fname_ == segs[1]);
+    ALWAYS_ASSERT(segments[0].max_epoch_ == 2);
+    ALWAYS_ASSERT(segments[0].seq_ == 4 && segments[1].seq_ == 5);
+    ALWAYS_ASSERT(!txn_logger::ReadSegmentManifest(fnames[0], segments));
+
+    txn_log_recovery rec({logfile});
+    ALWAYS_ASSERT(rec.run());
+    const txn_log_recovery::stats &s = rec.get_stats();
+    ALWAYS_ASSERT(s.nfiles_ == 2);
+    ALWAYS_ASSERT(s.nfiles_torn_ == 0);
+    ALWAYS_ASSERT(s.nbuffers_ == 3);
+    ALWAYS_ASSERT(s.persisted_epoch_ == 3);
+    map<string, string> m;
+    rec.scan([&m](uint32_t, const string &k,
+                  const uint8_t *v, size_t vlen, uint64_t) {
+      m[k] = string((const char *) v, vlen);
+    });
+    ALWAYS_ASSERT(m == (map<string, string>({{"a", "2"}, {"c", "3"}})));
+
+    for (auto &fname : segs)
+      unlink(fname.c_str());
+    unlink(txn_logger::SegmentManifestFile(logfile).c_str());
+    unlink(spepoch_fname.c_str());
+  }
+
+  {
+    // a log written w/ direct IO, whose writes are padded to the alignment.
+    // the 2nd write ends too close to a boundary for the padding header to
+    // fit before it
+    const size_t align = txn_logger::g_direct_io_alignment;
+    auto pad = [align](string &out) {
+      const txn_logger::logbuf_header padding = {0, txn_logger::g_padding_tid};
+      out.append((const char *) &padding, sizeof(padding));
+      out.resize(util::slow_round_up(out.size(), align), '\0');
+    };
+    const string logfile = dir + "/dlog";
+    string data;
+    append_log_buffer(
+        data, table0, {{tps::MakeTid(0, 1, 1), {{"a", "1"}, {"b", "1"}}}});
+    pad(data);
+    for (size_t vlen = 1; ; vlen++) {
+      string buf;
+      append_log_buffer(
+          buf, table0, {{tps::MakeTid(0, 1, 2), {{"b", string(vlen, 'x')}}}});
+      if ((data.size() + buf.size()) % align == align - 8) {
+        data.append(buf);
+        break;
+      }
+    }
+    pad(data);
+    ALWAYS_ASSERT(data.size() == 3 * align);
+    append_log_buffer(
+        data, table0, {{tps::MakeTid(0, 1, 3), {{"a", ""}, {"c", "3"}}}});
+    pad(data);
+    write_test_file(logfile, data);
+    const string dpepoch_fname = txn_logger::PersistedEpochFile(logfile);
+    write_test_file(dpepoch_fname, string("\x03\0\0\0\0\0\0\0", 8));
+
+    txn_log_recovery rec({logfile});
+    ALWAYS_ASSERT(rec.run());
+    const txn_log_recovery::stats &s = rec.get_stats();
+    ALWAYS_ASSERT(s.nfiles_torn_ == 0);
+    ALWAYS_ASSERT(s.nbuffers_ == 3);
+    ALWAYS_ASSERT(s.persisted_epoch_ == 3);
+    map<string, string> m;
+    rec.scan([&m](uint32_t, const string &k,
+                  const uint8_t *v, size_t vlen, uint64_t) {
+      m[k] = string((const char *) v, vlen);
+    });
+    ALWAYS_ASSERT(m.size() == 2 && m["c"] == "3");
+    ALWAYS_ASSERT(m["b"].size() > 1000);
+
+    // a padding header cut off by a crash
+    write_test_file(logfile, data.substr(0, data.size() - 100));
+    txn_log_recovery rec1({logfile});
+    ALWAYS_ASSERT(rec1.run());
+    ALWAYS_ASSERT(rec1.get_stats().nbuffers_ == 3);
+    ALWAYS_ASSERT(rec1.get_stats().nfiles_torn_ == 1);
+
+    unlink(logfile.c_str());
+    unlink(dpepoch_fname.c_str());
+  }
+
+  {
+    // patches round trip, and are small when few bytes change
+    fast_random r(99);
+    for (size_t i = 0; i < 200; i++) {
+      const string base = r.next_string(r.next() % 400);
+      string v = base;
+      v.resize(r.next() % 2 ? base.size() : r.next() % 400, 'x');
+      const size_t nchanges = r.next() % 5;
+      for (size_t c = 0; c < nchanges && !v.empty(); c++)
+        v[r.next() % v.size()] = r.next_char();
+      string patch, applied;
+      txn_logger::EncodePatch(
+          (const uint8_t *) base.data(), base.size(),
+          (const uint8_t *) v.data(), v.size(), patch);
+      ALWAYS_ASSERT(txn_logger::ApplyPatch(
+            (const uint8_t *) base.data(), base.size(),
+            (const uint8_t *) patch.data(), patch.size(), applied));
+      ALWAYS_ASSERT(applied == v);
+      if (v.size() == base.size())
+        ALWAYS_ASSERT(patch.size() <= 2 + 8 * nchanges);
+    }
+    string applied;
+    ALWAYS_ASSERT(!txn_logger::ApplyPatch(
+          (const uint8_t *) "abc", 3, (const uint8_t *) "\x02\x01\x05xy", 5,
+          applied));
+
+    // an op logged buffer: [table id | key | kind | value] per write
+    auto append_op_log_buffer = [table0](
+        string &out, uint64_t tid,
+        const vector<pair<string, pair<uint8_t, string>>> &writes) {
+      serializer<uint32_t, true> vs_uint32_t;
+      uint8_t buf[16];
+      const txn_logger::logbuf_header hdr = {1, tid, 0, 1};
+      out.append((const char *) &hdr, sizeof(hdr));
+      out.append((const char *) &tid, sizeof(tid));
+      out.append((const char *) buf, vs_uint32_t.write(buf, writes.size()) - buf);
+      for (auto &w : writes) {
+        out.append((const char *) &table0, sizeof(table0));
+        out.append((const char *) buf, vs_uint32_t.write(buf, w.first.size()) - buf);
+        out.append(w.first);
+        out.push_back(w.second.first);
+        out.append((const char *) buf,
+                   vs_uint32_t.write(buf, w.second.second.size()) - buf);
+        out.append(w.second.second);
+      }
+    };
+    auto patch_of = [](const string &base, const string &v) {
+      string patch;
+      txn_logger::EncodePatch(
+          (const uint8_t *) base.data(), base.size(),
+          (const uint8_t *) v.data(), v.size(), patch);
+      return patch;
+    };
+    const uint8_t full = txn_logger::WRITE_FULL;
+    const uint8_t patch = txn_logger::WRITE_PATCH;
+    const string a0(300, 'a');
+    string a1 = a0, a2;
+    a1[10] = 'b';
+    a2 = a1 + "tail";
+    a2[200] = 'c';
+    const string logfile = dir + "/olog";
+    string data;
+    append_op_log_buffer(data, tps::MakeTid(0, 1, 1),
+        {{"a", {full, a0}}, {"b", {patch, patch_of(a0, a1)}},
+         {"c", {full, "c0"}}});
+    // patches apply in TID order, not in the order the buffers of
+    // different cores landed in the file
+    append_op_log_buffer(data, tps::MakeTid(1, 1, 3),
+        {{"a", {patch, patch_of(a1, a2)}}, {"c", {full, "c1"}}});
+    append_op_log_buffer(data, tps::MakeTid(0, 1, 2),
+        {{"a", {patch, patch_of(a0, a1)}}, {"c", {full, ""}}});
+    append_op_log_buffer(data, tps::MakeTid(0, 1, 3),
+        {{"d", {full, "d0"}}, {"d", {patch, patch_of("d0", "d1")}}});
+    write_test_file(logfile, data);
+    const string opepoch_fname = txn_logger::PersistedEpochFile(logfile);
+    write_test_file(opepoch_fname, string("\x03\0\0\0\0\0\0\0", 8));
+
+    txn_log_recovery rec({logfile});
+    ALWAYS_ASSERT(rec.run());
+    const txn_log_recovery::stats &s = rec.get_stats();
+    ALWAYS_ASSERT(s.nunresolved_ == 1);
+    ALWAYS_ASSERT(s.npatches_ == 3);
+    ALWAYS_ASSERT(s.nkeys_ == 3);
+    map<string, string> m;
+    rec.scan([&m](uint32_t, const string &k,
+                  const uint8_t *v, size_t vlen, uint64_t) {
+      m[k] = string((const char *) v, vlen);
+    });
+    ALWAYS_ASSERT(m == (map<string, string>(
+            {{"a", a2}, {"c", "c1"}, {"d", "d1"}})));
+
+    unlink(logfile.c_str());
+    unlink(opepoch_fname.c_str());
+  }
+
+  for (auto &fname : fnames)
+    unlink(fname.c_str());
+  unlink(pepoch_fname.c_str());
+  rmdir(dir.c_str());
+  cerr << "test_log_recovery passed" << endl;
+}
+
+namespace test_checkpoint_ns {
+
+  static const size_t naccounts = 10000;
+  static const uint64_t initial_balance = 100;
+
+  // moves money between random accounts, so the sum of the balances is the
+  // same in every consistent snapshot
+  template <template <typename> class TxnType, typename Traits>
+  class transfer_worker : public ndb_thread {
+  public:
+    transfer_worker(txn_btree<TxnType> &btr, atomic<bool> &running)
+      : btr(&btr), running(&running), ncommits(0) {}
+    virtual void run()
+    {
+      fast_random r(reinterpret_cast<unsigned long>(this));
+      while (running->load(memory_order_acquire)) {
+        typename Traits::StringAllocator arena;
+        TxnType<Traits> t(0, arena);
+        try {
+          const uint64_t a = r.next() % naccounts;
+          const uint64_t b = (a + 1 + r.next() % (naccounts - 1)) % naccounts;
+          string va, vb;
+          ALWAYS_ASSERT_COND_IN_TXN(t, btr->search(t, u64_varkey(a), va));
+          ALWAYS_ASSERT_COND_IN_TXN(t, btr->search(t, u64_varkey(b), vb));
+          rec ra = *((const rec *) va.data()), rb = *((const rec *) vb.data());
+          const uint64_t amt = min<uint64_t>(ra.v, r.next() % 10);
+          ra.v -= amt;
+          rb.v += amt;
+          btr->insert_object(t, u64_varkey(a), ra);
+          btr->insert_object(t, u64_varkey(b), rb);
+          if (t.commit(false))
+            ncommits++;
+        } catch (transaction_abort_exception &e) {
+        }
+      }
+    }
+    txn_btree<TxnType> *const btr;
+    atomic<bool> *const running;
+    size_t ncommits;
+  };
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_checkpoint()
+{
+  using namespace test_checkpoint_ns;
+  typedef transaction_proto2_static tps;
+  char tmpl[] = "/tmp/silo-checkpoint-XXXXXX";
+  ALWAYS_ASSERT(mkdtemp(tmpl));
+  const string dir(tmpl);
+
+  txn_btree<TxnType> accounts, other;
+  typename Traits::StringAllocator arena;
+  for (size_t i = 0; i < naccounts; i += 500) {
+    TxnType<Traits> t(0, arena);
+    for (size_t j = i; j < i + 500; j++)
+      accounts.insert_object(t, u64_varkey(j), rec(initial_balance));
+    AssertSuccessfulCommit(t);
+  }
+  {
+    TxnType<Traits> t(0, arena);
+    other.insert(t, string("b"), string("b0"));
+    other.insert(t, string("d"), string("d0"));
+    AssertSuccessfulCommit(t);
+  }
+  // so the snapshots include the records
+  txn_epoch_sync<TxnType>::sync();
+
+  // the table's records, read back from the checkpoint
+  auto read_table = [&dir](const txn_checkpointer::manifest &m,
+                           const string &name) {
+    map<string, string> ret;
+    for (auto &ti : m.tables_) {
+      if (ti.name_ != name)
+        continue;
+      string last;
+      ALWAYS_ASSERT(txn_checkpointer::ScanTable(dir, ti,
+            [&](const string &k, const uint8_t *v, size_t vlen) {
+              ALWAYS_ASSERT(ret.empty() || last < k);
+              last = k;
+              ret[k] = string((const char *) v, vlen);
+            }));
+      ALWAYS_ASSERT(ret.size() == ti.nrecords_);
+    }
+    return ret;
+  };
+
+  txn_checkpointer::manifest m;
+  {
+    txn_checkpointer ckpt(dir, 2);
+    ckpt.add_table(accounts, "accounts");
+    ckpt.add_table(other, "other table");
+
+    // checkpoints taken while the balances are moving are consistent
+    atomic<bool> running(true);
+    transfer_worker<TxnType, Traits> w0(accounts, running), w1(accounts, running);
+    w0.start(); w1.start();
+    uint64_t last_epoch = 0;
+    for (size_t i = 0; i < 3; i++) {
+      ALWAYS_ASSERT(ckpt.checkpoint(&m));
+      ALWAYS_ASSERT(m.id_ == i + 1);
+      ALWAYS_ASSERT(m.epoch_ >= last_epoch);
+      last_epoch = m.epoch_;
+      txn_checkpointer::manifest m0;
+      ALWAYS_ASSERT(txn_checkpointer::ReadManifest(dir, m0));
+      ALWAYS_ASSERT(m0.id_ == m.id_ && m0.epoch_ == m.epoch_);
+      ALWAYS_ASSERT(m0.tables_.size() == 2);
+      ALWAYS_ASSERT(m0.tables_[1].name_ == "other table");
+      const map<string, string> a = read_table(m0, "accounts");
+      ALWAYS_ASSERT(a.size() == naccounts);
+      uint64_t sum = 0;
+      for (auto &p : a)
+        sum += ((const rec *) p.second.data())->v;
+      ALWAYS_ASSERT(sum == naccounts * initial_balance);
+      ALWAYS_ASSERT(read_table(m0, "other table").size() == 2);
+    }
+    running.store(false, memory_order_release);
+    w0.join(); w1.join();
+    ALWAYS_ASSERT(w0.ncommits + w1.ncommits > 0);
+
+    // once the writes settle, a checkpoint has exactly what the tree has
+    txn_epoch_sync<TxnType>::sync();
+    ALWAYS_ASSERT(ckpt.checkpoint(&m));
+    const map<string, string> a = read_table(m, "accounts");
+    TxnType<Traits> t(0, arena);
+    auto it = a.begin();
+    auto f = [&](const typename txn_btree<TxnType>::keystring_type &k,
+                 const string &v) {
+      ALWAYS_ASSERT(it != a.end());
+      ALWAYS_ASSERT(k == it->first && v == it->second);
+      ++it;
+      return true;
+    };
+    accounts.search_range(t, string(), nullptr, f);
+    ALWAYS_ASSERT_COND_IN_TXN(t, it == a.end());
+    AssertSuccessfulCommit(t);
+
+    // the files of earlier checkpoints are gone
+    ALWAYS_ASSERT(access((dir + "/ckpt.1.0").c_str(), F_OK));
+  }
+
+  // recovery: the checkpoint, plus the log written since its epoch
+  const string logfile = dir + "/log0";
+  const string pepoch_fname = txn_logger::PersistedEpochFile(logfile);
+  {
+    const uint64_t e = m.epoch_ + 1;
+    string log;
+    append_log_buffer(log, txn_btree<TxnType>::TableId("accounts"), {
+        {tps::MakeTid(0, 1, e), {{u64_varkey(5).str(), "x"}}},
+        {tps::MakeTid(0, 2, e), {{u64_varkey(6).str(), ""}}}});
+    append_log_buffer(log, txn_btree<TxnType>::TableId("other table"), {
+        {tps::MakeTid(0, 3, e), {{"c", "c1"}}},
+        {tps::MakeTid(0, 4, e), {{"d", ""}}}});
+    write_test_file(logfile, log);
+    write_test_file(pepoch_fname, string((const char *) &e, sizeof(e)));
+  }
+  {
+    txn_log_recovery rec({logfile});
+    ALWAYS_ASSERT(rec.run(m.epoch_));
+    ALWAYS_ASSERT(rec.get_stats().nkeys_ == 2);
+    ALWAYS_ASSERT(rec.get_stats().nremoved_ == 2);
+    txn_btree<TxnType> accounts1(128, false, "accounts"),
+                       other1(128, false, "other table");
+    const vector<pair<string, txn_btree<TxnType> *>> tables =
+      {{"accounts", &accounts1}, {"other table", &other1}};
+    ALWAYS_ASSERT(rec.load(dir, tables));
+
+    map<string, string> expected = read_table(m, "accounts");
+    expected[u64_varkey(5).str()] = "x";
+    expected.erase(u64_varkey(6).str());
+    TxnType<Traits> t(0, arena);
+    auto it = expected.begin();
+    auto f = [&](const typename txn_btree<TxnType>::keystring_type &k,
+                 const string &v) {
+      ALWAYS_ASSERT(it != expected.end());
+      ALWAYS_ASSERT(k == it->first && v == it->second);
+      ++it;
+      return true;
+    };
+    accounts1.search_range(t, string(), nullptr, f);
+    ALWAYS_ASSERT_COND_IN_TXN(t, it == expected.end());
+    expected = {{"b", "b0"}, {"c", "c1"}};
+    it = expected.begin();
+    other1.search_range(t, string(), nullptr, f);
+    ALWAYS_ASSERT_COND_IN_TXN(t, it == expected.end());
+    AssertSuccessfulCommit(t);
+  }
+  {
+    // the log must be replayed from the checkpoint's epoch
+    txn_log_recovery rec({logfile});
+    ALWAYS_ASSERT(rec.run(m.epoch_ - 1));
+    txn_btree<TxnType> accounts1(128, false, "accounts"),
+                       other1(128, false, "other table");
+    const vector<pair<string, txn_btree<TxnType> *>> tables =
+      {{"accounts", &accounts1}, {"other table", &other1}};
+    ALWAYS_ASSERT(!rec.load(dir, tables));
+  }
+
+  for (auto &ti : m.tables_)
+    unlink((dir + "/" + ti.fname_).c_str());
+  unlink(txn_checkpointer::ManifestFile(dir).c_str());
+  unlink(logfile.c_str());
+  unlink(pepoch_fname.c_str());
+  ALWAYS_ASSERT(!rmdir(dir.c_str()));
+
+  txn_epoch_sync<TxnType>::sync();
+  txn_epoch_sync<TxnType>::finish();
+  cerr << "test_checkpoint passed" << endl;
+}
+
 template <template <typename> class TxnType, typename Traits>
 static void
 test_absent_key_race()
@@ -577,6 +1488,206 @@ test_insert_same_key()
   }
 }
 
+template <template <typename> class TxnType, typename Traits>
+static void
+test_abort_profiler()
+{
+  abort_profiler::SetSampleShift(0);
+  abort_profiler::Reset();
+  {
+    txn_btree<TxnType> btr(128, false, "abort_prof");
+    typename Traits::StringAllocator arena;
+    {
+      TxnType<Traits> t(0, arena);
+      btr.insert_object(t, u64_varkey(7), rec(1));
+      AssertSuccessfulCommit(t);
+    }
+
+    // t0 reads and writes key 7, t1 changes it in between, so t0 fails
+    // read validation over a key it knows
+    for (size_t i = 0; i < 3; i++) {
+      TxnType<Traits> t0(0, arena), t1(0, arena);
+      string v0;
+      ALWAYS_ASSERT_COND_IN_TXN(t0, btr.search(t0, u64_varkey(7), v0));
+      btr.insert_object(t0, u64_varkey(7), rec(2));
+      btr.insert_object(t1, u64_varkey(7), rec(3));
+      AssertSuccessfulCommit(t1);
+      AssertFailedCommit(t0);
+    }
+
+    abort_profiler::profile p;
+    abort_profiler::Snapshot(p);
+    ALWAYS_ASSERT(p.sample_shift_ == 0);
+    ALWAYS_ASSERT(
+        p.counts_[transaction_base::ABORT_REASON_READ_NODE_INTEREFERENCE] == 3);
+    ALWAYS_ASSERT(p.hot_keys_.size() == 1);
+    const abort_profiler::hot_key &h = p.hot_keys_[0];
+    ALWAYS_ASSERT(!h.is_address_);
+    ALWAYS_ASSERT(h.count_ == 3 && h.error_ == 0);
+    ALWAYS_ASSERT(h.reason_ == transaction_base::ABORT_REASON_READ_NODE_INTEREFERENCE);
+    ALWAYS_ASSERT(h.prefix() == u64_varkey(7).str());
+    ALWAYS_ASSERT(abort_profiler::TableName(h.table_) == "abort_prof");
+
+    // t0 held its lock on key 7 while failing validation, every other txn
+    // wrote one key and committed
+    ALWAYS_ASSERT(
+        p.nlock_holds_[transaction_base::ABORT_REASON_READ_NODE_INTEREFERENCE] == 3);
+    ALWAYS_ASSERT(
+        p.lock_hold_cycles_[transaction_base::ABORT_REASON_READ_NODE_INTEREFERENCE] > 0);
+    ALWAYS_ASSERT(p.ncommit_lock_holds_ == 4);
+    ALWAYS_ASSERT(p.commit_lock_hold_cycles_ > 0);
+
+    ostringstream report;
+    abort_profiler::Report(report);
+    ALWAYS_ASSERT(report.str().find("hot abort_prof ") != string::npos);
+    ALWAYS_ASSERT(report.str().find("lock_hold COMMITTED 4 ") != string::npos);
+
+    // reads and node scans which fail validation w/o having written their
+    // key are known by their table and the address of the tuple (node)
+    abort_profiler::Reset();
+    {
+      TxnType<Traits> t(0, arena);
+      btr.insert_object(t, u64_varkey(8), rec(1));
+      AssertSuccessfulCommit(t);
+    }
+    for (size_t i = 0; i < 2; i++) {
+      TxnType<Traits> t0(0, arena), t1(0, arena);
+      string v0;
+      ALWAYS_ASSERT_COND_IN_TXN(t0, btr.search(t0, u64_varkey(8), v0));
+      btr.insert_object(t1, u64_varkey(8), rec(2 + i));
+      AssertSuccessfulCommit(t1);
+      AssertFailedCommit(t0);
+    }
+    {
+      TxnType<Traits> t0(0, arena), t1(0, arena);
+      string v0;
+      ALWAYS_ASSERT_COND_IN_TXN(t0, !btr.search(t0, u64_varkey(9), v0));
+      btr.insert_object(t1, u64_varkey(9), rec(1));
+      AssertSuccessfulCommit(t1);
+      AssertFailedCommit(t0);
+    }
+
+    abort_profiler::Snapshot(p);
+    ALWAYS_ASSERT(p.hot_keys_.size() == 2);
+    const abort_profiler::hot_key &h8 = p.hot_keys_[0], &h9 = p.hot_keys_[1];
+    ALWAYS_ASSERT(h8.is_address_ && h8.prefix().empty());
+    ALWAYS_ASSERT(h8.count_ == 2);
+    ALWAYS_ASSERT(h8.reason_ == transaction_base::ABORT_REASON_READ_NODE_INTEREFERENCE);
+    ALWAYS_ASSERT(abort_profiler::TableName(h8.table_) == "abort_prof");
+    ALWAYS_ASSERT(h9.is_address_ && h9.key_hash_ != h8.key_hash_);
+    ALWAYS_ASSERT(h9.count_ == 1);
+    ALWAYS_ASSERT(h9.reason_ == transaction_base::ABORT_REASON_NODE_SCAN_READ_VERSION_CHANGED);
+    ALWAYS_ASSERT(abort_profiler::TableName(h9.table_) == "abort_prof");
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+  abort_profiler::Reset();
+  abort_profiler::SetSampleShift(2);
+  cerr << "test_abort_profiler passed" << endl;
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_async_gc()
+{
+  transaction_proto2_static::StartGCThreads();
+  ALWAYS_ASSERT(transaction_proto2_static::IsGCAsync());
+  {
+    const size_t nkeys = 1000;
+    txn_btree<TxnType> btr;
+    typename Traits::StringAllocator arena;
+    for (size_t i = 0; i < nkeys; i++) {
+      TxnType<Traits> t(0, arena);
+      btr.insert_object(t, u64_varkey(i), rec(i));
+      AssertSuccessfulCommit(t);
+    }
+    // an older version of every key (unless written over in place)
+    for (size_t i = 0; i < nkeys; i++) {
+      TxnType<Traits> t(0, arena);
+      btr.insert_object(t, u64_varkey(i), rec(i + 1));
+      AssertSuccessfulCommit(t);
+    }
+    for (size_t i = 0; i < nkeys; i++) {
+      TxnType<Traits> t(0, arena);
+      btr.remove(t, u64_varkey(i));
+      AssertSuccessfulCommit(t);
+    }
+
+    // this core only hands its queue over at the end of a txn, and the GC
+    // threads get to it a tick later
+    vector<transaction_proto2_static::gc_stats> stats;
+    uint64_t nreclaimed = 0, nbytes_reclaimed = 0, nbatches = 0;
+    size_t nleft = nkeys;
+    for (size_t i = 0; i < 1000; i++) {
+      txn_epoch_sync<TxnType>::sync();
+      {
+        TxnType<Traits> t(0, arena);
+        string v;
+        ALWAYS_ASSERT_COND_IN_TXN(t, !btr.search(t, u64_varkey(0), v));
+        AssertSuccessfulCommit(t);
+      }
+      transaction_proto2_static::GetGCStats(stats);
+      ALWAYS_ASSERT(!stats.empty());
+      nreclaimed = nbytes_reclaimed = nbatches = 0;
+      for (auto &s : stats) {
+        nreclaimed += s.nreclaimed_;
+        nbytes_reclaimed += s.nbytes_reclaimed_;
+        nbatches += s.nbatches_;
+      }
+      {
+        scoped_rcu_region guard;
+        nleft = btr.size_estimate();
+      }
+      if (!nleft && nreclaimed >= nkeys)
+        break;
+      usleep(1000);
+    }
+    ALWAYS_ASSERT(nleft == 0);
+    // at least each key's delete
+    ALWAYS_ASSERT(nreclaimed >= nkeys);
+    ALWAYS_ASSERT(nbytes_reclaimed >= nreclaimed * sizeof(dbtuple));
+    ALWAYS_ASSERT(nbatches > 0);
+    for (auto &s : stats)
+      cerr << s << endl;
+
+    // back to GC on the cores, w/ nothing left behind
+    transaction_proto2_static::StopGCThreads();
+    ALWAYS_ASSERT(!transaction_proto2_static::IsGCAsync());
+    transaction_proto2_static::GetGCStats(stats);
+    ALWAYS_ASSERT(stats.empty());
+    {
+      TxnType<Traits> t(0, arena);
+      btr.insert_object(t, u64_varkey(0), rec(0));
+      AssertSuccessfulCommit(t);
+    }
+    {
+      TxnType<Traits> t(0, arena);
+      btr.remove(t, u64_varkey(0));
+      AssertSuccessfulCommit(t);
+    }
+    for (size_t i = 0; i < 1000; i++) {
+      txn_epoch_sync<TxnType>::sync();
+      {
+        TxnType<Traits> t(0, arena);
+        string v;
+        ALWAYS_ASSERT_COND_IN_TXN(t, !btr.search(t, u64_varkey(0), v));
+        AssertSuccessfulCommit(t);
+      }
+      {
+        scoped_rcu_region guard;
+        nleft = btr.size_estimate();
+      }
+      if (!nleft)
+        break;
+      usleep(1000);
+    }
+    ALWAYS_ASSERT(nleft == 0);
+    txn_epoch_sync<TxnType>::finish();
+  }
+  cerr << "test_async_gc passed" << endl;
+}
+
 #define TESTREC_KEY_FIELDS(x, y) \
   x(int32_t,k0) \
   y(int32_t,k1)
@@ -1879,12 +2990,43 @@ read_only_perf()
   }
 }
 
+static void
+test_numa_assignments()
+{
+  const unsigned nmaxworkers = 3 * coreid::num_cpus_online();
+  for (unsigned nfds = 1; nfds <= 6; nfds++)
+    for (unsigned nworkers = 1; nworkers <= nmaxworkers; nworkers++) {
+      const vector<vector<unsigned>> assignments =
+        txn_logger::NumaAssignments(nfds, nworkers);
+      ALWAYS_ASSERT(txn_logger::AssignmentsValid(assignments, nfds, nworkers));
+      set<int> nodes;
+      for (unsigned w = 0; w < nworkers; w++)
+        nodes.insert(txn_logger::WorkerNumaNode(w));
+      // every logger gets work, and stays on one node if it can
+      ALWAYS_ASSERT(assignments.size() == min(size_t(nfds), size_t(nworkers)) ||
+                    nodes.size() > 1);
+      for (auto &a : assignments) {
+        ALWAYS_ASSERT(!a.empty());
+        if (nfds >= nodes.size())
+          ALWAYS_ASSERT(txn_logger::AssignmentNumaNode(a) != -1 ||
+                        nodes.count(-1));
+      }
+    }
+  cerr << "test_numa_assignments passed" << endl;
+}
+
 void txn_btree_test()
 {
   cerr << "Test proto2" << endl;
   test_typed_btree<transaction_proto2, default_stable_transaction_traits>();
   test1<transaction_proto2, default_transaction_traits>();
   test2<transaction_proto2, default_transaction_traits>();
+  test_multi_get<transaction_proto2, default_transaction_traits>();
+  test_cursor<transaction_proto2, default_transaction_traits>();
+  test_bulk_load<transaction_proto2, default_transaction_traits>();
+  test_log_recovery<transaction_proto2, default_transaction_traits>();
+  test_checkpoint<transaction_proto2, default_transaction_traits>();
+  test_numa_assignments();
   test_absent_key_race<transaction_proto2, default_transaction_traits>();
   test_inc_value_size<transaction_proto2, default_transaction_traits>();
   test_multi_btree<transaction_proto2, default_transaction_traits>();
@@ -1892,6 +3034,7 @@ void txn_btree_test()
   test_long_keys<transaction_proto2, default_transaction_traits>();
   test_long_keys2<transaction_proto2, default_transaction_traits>();
   test_insert_same_key<transaction_proto2, default_transaction_traits>();
+  test_abort_profiler<transaction_proto2, default_transaction_traits>();
 
   //mp_stress_test_allocator<transaction_proto2, default_transaction_traits>();
   mp_stress_test_insert_removes<transaction_proto2, default_transaction_traits>();
@@ -1900,6 +3043,7 @@ void txn_btree_test()
   mp_test3<transaction_proto2, default_transaction_traits>();
   mp_test_simple_write_skew<transaction_proto2, default_transaction_traits>();
   mp_test_batch_processing<transaction_proto2, default_transaction_traits>();
+  test_async_gc<transaction_proto2, default_transaction_traits>();
 
   //read_only_perf<transaction_proto1>();
   //read_only_perf<transaction_proto2>();
@@ -311,6 +311,26 @@ public:
     return this->do_search(t, k, r);
   }
 
+  // batched search(): values[i] and found[i] are set as search() would set
+  // them for keys[i]. returns the number of keys found
+  // precondition: max_bytes_read > 0
+  template <typename Traits>
+  inline size_t
+  multi_get(Transaction<Traits> &t,
+            size_t n,
+            const key_type *keys,
+            value_type *values,
+            bool *found,
+            size_type max_bytes_read = string_type::npos)
+  {
+    if (unlikely(!n))
+      return 0;
+    typename util::vec<single_value_reader_type>::type readers;
+    for (size_t i = 0; i < n; i++)
+      readers.emplace_back(&values[i], max_bytes_read);
+    return this->do_multi_search(t, n, keys, &readers[0], found);
+  }
+
   template <typename Traits>
   inline void
   search_range_call(Transaction<Traits> &t,
@@ -394,6 +414,167 @@ public:
         upper ? &u : nullptr, callback, max_bytes_read);
   }
 
+  /**
+   * A resumable iterator over the records t can see, for callers which
+   * cannot be written as a single search_range() callback (eg merge joins,
+   * paginated scans). See concurrent_btree::cursor.
+   *
+   * The cursor reads up to batch_size records ahead with one
+   * search_range_call() (or rsearch_range_call() when moving backwards).
+   * Those records join t's read set, and the leaves scanned join its node
+   * scan set, whether or not the caller ever steps onto them- so a larger
+   * batch_size means fewer tree descents but more to validate at commit.
+   * Buffered records need no revalidation of their own: commit aborts t if
+   * any of them changed
+   */
+  template <typename Traits>
+  class cursor {
+  public:
+    cursor(txn_btree &btr,
+           Transaction<Traits> &t,
+           size_t batch_size = 16,
+           size_type max_bytes_read = string_type::npos)
+      : btr_(&btr), t_(&t), batch_size_(batch_size),
+        max_bytes_read_(max_bytes_read), n_(0), pos_(0)
+    {
+      INVARIANT(batch_size > 0);
+    }
+
+    // positions the cursor at the smallest key >= k
+    inline bool seek(const key_type &k) { return fill(k, false, false); }
+
+    // positions the cursor at the largest key <= k
+    inline bool rseek(const key_type &k) { return fill(k, false, true); }
+
+    // false if the cursor ran off either end of the tree, or the last seek
+    // found nothing. once invalid, the cursor must be re-seeked
+    inline bool valid() const { return pos_ < n_; }
+
+    inline const keystring_type &
+    key() const
+    {
+      INVARIANT(valid());
+      return entries_[pos_].first;
+    }
+
+    inline const string_type &
+    value() const
+    {
+      INVARIANT(valid());
+      return entries_[pos_].second;
+    }
+
+    // moves to the next larger key, returns valid()
+    inline bool
+    next()
+    {
+      INVARIANT(valid());
+      if (++pos_ < n_)
+        return true;
+      return fill(entries_[pos_ - 1].first, true, false);
+    }
+
+    // moves to the next smaller key, returns valid()
+    inline bool
+    prev()
+    {
+      INVARIANT(valid());
+      if (pos_ > 0) {
+        pos_--;
+        return true;
+      }
+      return fill(entries_[pos_].first, true, true);
+    }
+
+    /**
+     * Appends the current <key, value> pair and the ones after it (at most
+     * n pairs) to out, leaving the cursor on the first pair not appended.
+     * Returns the number of pairs appended
+     */
+    size_t
+    next_n(size_t n,
+           std::vector<std::pair<keystring_type, string_type>> &out)
+    {
+      size_t i = 0;
+      for (; i < n && valid(); i++) {
+        out.emplace_back(key(), value());
+        next();
+      }
+      return i;
+    }
+
+  private:
+    struct fill_callback {
+      fill_callback(cursor *c, const key_type *skip)
+        : c(c), skip(skip) {}
+      inline bool
+      invoke(const keystring_type &k, const string_type &v)
+      {
+        if (skip && k == *skip)
+          return true;
+        if (c->n_ == c->entries_.size())
+          c->entries_.emplace_back();
+        c->entries_[c->n_].first.assign(k);
+        c->entries_[c->n_].second.assign(v);
+        return ++c->n_ < c->batch_size_;
+      }
+      cursor *const c;
+      const key_type *const skip;
+    };
+
+    // refills the buffer w/ the records >= k (or <= k if reverse), leaving
+    // k out if exclusive
+    bool
+    fill(const key_type &k, bool exclusive, bool reverse)
+    {
+      // k may point into entries_, which is about to be overwritten
+      seek_key_.assign(k);
+      fill_callback c(this, exclusive ? &seek_key_ : nullptr);
+      key_reader_type kr;
+      value_reader_type vr(max_bytes_read_);
+      n_ = pos_ = 0;
+      if (reverse) {
+        btr_->do_rsearch_range_call(*t_, seek_key_, nullptr, c, kr, vr);
+        std::reverse(entries_.begin(), entries_.begin() + n_);
+        pos_ = n_ ? n_ - 1 : 0;
+      } else {
+        btr_->do_search_range_call(*t_, seek_key_, nullptr, c, kr, vr);
+      }
+      return valid();
+    }
+
+    txn_btree *const btr_;
+    Transaction<Traits> *const t_;
+    const size_t batch_size_;
+    const size_type max_bytes_read_;
+    std::vector<std::pair<keystring_type, string_type>> entries_;
+    size_t n_;
+    size_t pos_;
+    key_type seek_key_;
+  };
+
+  /**
+   * Loads [begin, end), a range of <key_type, value_type> pairs sorted in
+   * ascending key order w/o duplicates, into an empty tree. This bypasses
+   * the transaction layer: the leaves are packed directly w/ records which
+   * look like they were committed before any transaction started (see
+   * concurrent_btree::bulk_load())
+   *
+   * Returns false (and loads nothing) if the tree is not empty, or if the
+   * Transaction cannot take records which bypassed it (ie persistence is
+   * enabled), in which case callers should insert() the records instead
+   *
+   * NOT THREAD SAFE: no transaction may touch this tree during the call
+   */
+  template <typename ForwardIterator>
+  inline bool
+  bulk_load(ForwardIterator begin, ForwardIterator end,
+            double fill_factor = 1.0)
+  {
+    return this->do_bulk_load(
+        begin, end, txn_btree_::tuple_writer, fill_factor);
+  }
+
   template <typename Traits>
   inline void
   put(Transaction<Traits> &t, const key_type &k, const value_type &v)
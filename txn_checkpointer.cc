@@ -0,0 +1,375 @@
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "txn_checkpointer.h"
+#include "txn_proto2_impl.h"
+#include "counter.h"
+#include "record/serializer.h"
+#include "rcu.h"
+#include "util.h"
+
+using namespace std;
+using namespace util;
+
+// table files are written out in chunks of (at least) this many bytes
+static const size_t WriteBufferSize = 1 << 20;
+
+static event_counter evt_checkpoints("checkpoints");
+static event_counter evt_checkpoint_bytes_written("checkpoint_bytes_written");
+static event_avg_counter evt_avg_checkpoint_time_ms("avg_checkpoint_time_ms");
+
+static bool
+write_fully(int fd, const char *p, size_t n)
+{
+  while (n) {
+    const ssize_t ret = write(fd, p, n);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("write");
+      return false;
+    }
+    p += ret;
+    n -= ret;
+  }
+  return true;
+}
+
+static bool
+fsync_dir(const string &dir)
+{
+  const int fd = open(dir.c_str(), O_RDONLY);
+  if (fd == -1) {
+    perror("open");
+    return false;
+  }
+  const bool ret = fsync(fd) == 0;
+  close(fd);
+  return ret;
+}
+
+txn_checkpointer::txn_checkpointer(const string &dir, size_t nthreads)
+  : dir_(dir), nthreads_(max<size_t>(1, nthreads)), ncheckpoints_(0),
+    round_(0), round_id_(0), round_tid_(0), next_table_(0), ndone_(0),
+    stop_workers_(false), stop_bg_(false)
+{
+  ReadManifest(dir_, last_);
+  // the scan threads live as long as this object, since core IDs are not
+  // recycled (see coreid)
+  for (size_t i = 0; i < nthreads_; i++)
+    workers_.emplace_back(&txn_checkpointer::worker, this);
+}
+
+txn_checkpointer::~txn_checkpointer()
+{
+  stop();
+  {
+    std::lock_guard<mutex> l(round_mutex_);
+    stop_workers_ = true;
+  }
+  round_cv_.notify_all();
+  for (auto &th : workers_)
+    th.join();
+}
+
+void
+txn_checkpointer::worker()
+{
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      unique_lock<mutex> l(round_mutex_);
+      round_cv_.wait(l, [&]() { return stop_workers_ || round_ != seen; });
+      if (stop_workers_)
+        return;
+      seen = round_;
+    }
+    for (;;) {
+      const size_t i = next_table_.fetch_add(1, memory_order_acq_rel);
+      if (i >= tables_.size())
+        break;
+      round_ok_[i] = write_table(i, round_id_, round_tid_, round_tables_[i]);
+    }
+    {
+      std::lock_guard<mutex> l(round_mutex_);
+      if (++ndone_ == nthreads_)
+        done_cv_.notify_all();
+    }
+  }
+}
+
+bool
+txn_checkpointer::write_table(
+    size_t idx, uint64_t id, uint64_t snapshot_tid, table_info &info)
+{
+  info.name_ = tables_[idx].name_;
+  info.fname_ = "ckpt." + to_string(id) + "." + to_string(idx);
+  info.nrecords_ = 0;
+  info.nbytes_ = 0;
+  const string fname = dir_ + "/" + info.fname_;
+  const int fd = open(fname.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664);
+  if (fd == -1) {
+    perror("open");
+    return false;
+  }
+
+  serializer<uint32_t, true> vs_uint32_t;
+  string buf;
+  buf.reserve(WriteBufferSize + (WriteBufferSize >> 2));
+  const record_callback append =
+    [&](const string &k, const uint8_t *v, size_t vlen) {
+      uint8_t lenbuf[8];
+      uint8_t *p = vs_uint32_t.write(&lenbuf[0], k.size());
+      buf.append((const char *) &lenbuf[0], p - &lenbuf[0]);
+      buf.append(k);
+      p = vs_uint32_t.write(&lenbuf[0], vlen);
+      buf.append((const char *) &lenbuf[0], p - &lenbuf[0]);
+      buf.append((const char *) v, vlen);
+      info.nrecords_++;
+    };
+
+  bool ok = true;
+  string pos;
+  for (bool more = true; more && ok; ) {
+    {
+      scoped_rcu_region guard;
+      more = tables_[idx].scan_(snapshot_tid, pos, ScanBatchSize, append);
+    }
+    if (buf.size() >= WriteBufferSize || !more) {
+      ok = write_fully(fd, buf.data(), buf.size());
+      info.nbytes_ += buf.size();
+      buf.clear();
+    }
+  }
+  if (ok && fsync(fd)) {
+    perror("fsync");
+    ok = false;
+  }
+  close(fd);
+  evt_checkpoint_bytes_written.inc(info.nbytes_);
+  return ok;
+}
+
+bool
+txn_checkpointer::checkpoint(manifest *m)
+{
+  INVARIANT(!rcu::s_instance.in_rcu_region());
+  std::lock_guard<mutex> l(checkpoint_mutex_);
+  timer t;
+
+  manifest ckpt;
+  ckpt.id_ = last_.id_ + 1;
+  {
+    scoped_rcu_region guard;
+    ckpt.snapshot_tid_ = transaction_proto2_static::PinSnapshot();
+  }
+  ckpt.epoch_ = transaction_proto2_static::EpochId(ckpt.snapshot_tid_);
+
+  {
+    unique_lock<mutex> rl(round_mutex_);
+    round_id_ = ckpt.id_;
+    round_tid_ = ckpt.snapshot_tid_;
+    round_tables_.assign(tables_.size(), table_info());
+    round_ok_.assign(tables_.size(), false);
+    next_table_.store(0, memory_order_release);
+    ndone_ = 0;
+    round_++;
+    round_cv_.notify_all();
+    done_cv_.wait(rl, [&]() { return ndone_ == nthreads_; });
+  }
+  transaction_proto2_static::UnpinSnapshot();
+  ckpt.tables_.swap(round_tables_);
+
+  bool ok = true;
+  for (auto b : round_ok_)
+    ok = ok && b;
+  if (ok)
+    ok = fsync_dir(dir_) && write_manifest(dir_, ckpt);
+  if (!ok) {
+    for (auto &ti : ckpt.tables_)
+      if (!ti.fname_.empty())
+        unlink((dir_ + "/" + ti.fname_).c_str());
+    return false;
+  }
+
+  // the previous checkpoint is no longer referenced
+  for (auto &ti : last_.tables_)
+    unlink((dir_ + "/" + ti.fname_).c_str());
+  last_ = ckpt;
+  ncheckpoints_++;
+  // also before the logger starts, see txn_logger::NoteRecoveredLoad()
+  txn_logger::NotifyCheckpoint(ckpt.epoch_);
+  if (m)
+    *m = ckpt;
+  ++evt_checkpoints;
+  evt_avg_checkpoint_time_ms.offer(t.lap() / 1000);
+  return true;
+}
+
+void
+txn_checkpointer::start(uint64_t interval_ms)
+{
+  ALWAYS_ASSERT(!bg_.joinable());
+  stop_bg_ = false;
+  bg_ = thread([this, interval_ms]() {
+    unique_lock<mutex> l(bg_mutex_);
+    while (!bg_cv_.wait_for(l, chrono::milliseconds(interval_ms),
+                            [this]() { return stop_bg_; })) {
+      l.unlock();
+      if (!checkpoint())
+        cerr << "txn_checkpointer: checkpoint to " << dir_ << " failed" << endl;
+      l.lock();
+    }
+  });
+}
+
+void
+txn_checkpointer::stop()
+{
+  if (!bg_.joinable())
+    return;
+  {
+    std::lock_guard<mutex> l(bg_mutex_);
+    stop_bg_ = true;
+  }
+  bg_cv_.notify_all();
+  bg_.join();
+}
+
+txn_checkpointer::manifest
+txn_checkpointer::last_checkpoint() const
+{
+  std::lock_guard<mutex> l(checkpoint_mutex_);
+  return last_;
+}
+
+string
+txn_checkpointer::ManifestFile(const string &dir)
+{
+  return dir + "/CHECKPOINT";
+}
+
+// the manifest is text:
+//   <id> <snapshot tid> <epoch> <ntables>
+// followed by a line per table:
+//   <file> <nrecords> <nbytes> <name>
+bool
+txn_checkpointer::write_manifest(const string &dir, const manifest &m)
+{
+  ostringstream oss;
+  oss << m.id_ << " " << m.snapshot_tid_ << " " << m.epoch_ << " "
+      << m.tables_.size() << "\n";
+  for (auto &ti : m.tables_)
+    oss << ti.fname_ << " " << ti.nrecords_ << " " << ti.nbytes_ << " "
+        << ti.name_ << "\n";
+  const string contents = oss.str();
+
+  const string fname = ManifestFile(dir);
+  const string tmpname = fname + ".tmp";
+  const int fd = open(tmpname.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664);
+  if (fd == -1) {
+    perror("open");
+    return false;
+  }
+  bool ok = write_fully(fd, contents.data(), contents.size());
+  if (ok && fsync(fd)) {
+    perror("fsync");
+    ok = false;
+  }
+  close(fd);
+  if (ok && rename(tmpname.c_str(), fname.c_str())) {
+    perror("rename");
+    ok = false;
+  }
+  return ok && fsync_dir(dir);
+}
+
+bool
+txn_checkpointer::ReadManifest(const string &dir, manifest &m)
+{
+  ifstream ifs(ManifestFile(dir));
+  if (!ifs)
+    return false;
+  manifest ret;
+  size_t ntables;
+  if (!(ifs >> ret.id_ >> ret.snapshot_tid_ >> ret.epoch_ >> ntables))
+    return false;
+  for (size_t i = 0; i < ntables; i++) {
+    table_info ti;
+    if (!(ifs >> ti.fname_ >> ti.nrecords_ >> ti.nbytes_))
+      return false;
+    ifs.get(); // the space before the name, which may contain spaces
+    if (!getline(ifs, ti.name_))
+      return false;
+    ret.tables_.push_back(ti);
+  }
+  m = ret;
+  return true;
+}
+
+bool
+txn_checkpointer::ScanTable(
+    const string &dir, const table_info &t, const record_callback &f)
+{
+  const string fname = dir + "/" + t.fname_;
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd == -1) {
+    perror("open");
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || uint64_t(st.st_size) != t.nbytes_) {
+    close(fd);
+    return false;
+  }
+  vector<uint8_t> data(t.nbytes_);
+  size_t n = 0;
+  while (n < data.size()) {
+    const ssize_t ret = read(fd, &data[n], data.size() - n);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR)
+        continue;
+      close(fd);
+      return false;
+    }
+    n += ret;
+  }
+  close(fd);
+
+  // check the whole file before handing out any records
+  serializer<uint32_t, true> vs_uint32_t;
+  const uint8_t * const end = data.data() + data.size();
+  uint64_t nrecords = 0;
+  for (const uint8_t *p = data.data(); p < end; nrecords++) {
+    uint32_t klen, vlen;
+    if (!(p = vs_uint32_t.failsafe_read(p, end - p, &klen)) ||
+        size_t(end - p) < klen)
+      return false;
+    p += klen;
+    if (!(p = vs_uint32_t.failsafe_read(p, end - p, &vlen)) ||
+        size_t(end - p) < vlen)
+      return false;
+    p += vlen;
+  }
+  if (nrecords != t.nrecords_)
+    return false;
+
+  string k;
+  for (const uint8_t *p = data.data(); p < end; ) {
+    uint32_t klen, vlen;
+    p = vs_uint32_t.read(p, &klen);
+    k.assign((const char *) p, klen);
+    p += klen;
+    p = vs_uint32_t.read(p, &vlen);
+    f(k, p, vlen);
+    p += vlen;
+  }
+  return true;
+}
@@ -0,0 +1,153 @@
+#ifndef _NDB_TXN_CHECKPOINTER_H_
+#define _NDB_TXN_CHECKPOINTER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "macros.h"
+#include "base_txn_btree.h"
+
+/**
+ * Writes checkpoints of a set of txn_btrees: a copy of every record as of a
+ * single read-only snapshot TID, taken while transactions keep running. The
+ * tables are scanned in parallel, a few keys per RCU region, and the GC is
+ * kept from reclaiming the snapshot's versions until the scan is done (see
+ * transaction_proto2_static::PinSnapshot()).
+ *
+ * A checkpoint in dir is one file per table, holding the table's records in
+ * ascending key order as [key len (varint) | key | value len (varint) |
+ * value], plus dir/CHECKPOINT, the manifest which names the files and
+ * records the snapshot. The manifest is only replaced (atomically) once all
+ * the table files are on disk, so the last complete checkpoint can always
+ * be read back, and the files of the one before are then removed.
+ *
+ * Recovery loads the last checkpoint and replays the log from the
+ * checkpoint's epoch on (see txn_log_recovery::load()), so the log before
+ * that epoch is no longer needed (see txn_logger::NotifyCheckpoint()). Note
+ * the snapshot may be ahead of what the log has persisted, which is fine
+ * since it is a consistent state
+ */
+class txn_checkpointer {
+public:
+
+  // keys scanned per RCU region
+  static const size_t ScanBatchSize = 256;
+
+  struct table_info {
+    std::string name_;
+    std::string fname_; // relative to the checkpoint's dir
+    uint64_t nrecords_;
+    uint64_t nbytes_;
+  };
+
+  struct manifest {
+    uint64_t id_; // increases by one w/ every checkpoint in a dir
+    uint64_t snapshot_tid_;
+    uint64_t epoch_; // records reflect all txns in epochs <= epoch_
+    std::vector<table_info> tables_;
+    manifest() : id_(0), snapshot_tid_(0), epoch_(0) {}
+  };
+
+  typedef std::function<
+    void (const std::string &, const uint8_t *, size_t)> record_callback;
+
+  // checkpoints go to dir (which must exist), w/ nthreads threads scanning
+  // tables. continues the numbering of the checkpoint already in dir, if
+  // there is one
+  txn_checkpointer(const std::string &dir, size_t nthreads = 1);
+  ~txn_checkpointer();
+
+  txn_checkpointer(const txn_checkpointer &) = delete;
+  txn_checkpointer &operator=(const txn_checkpointer &) = delete;
+
+  // tables can only be added before the first checkpoint. names must be
+  // unique, and are what recovery matches tables by
+  template <template <typename> class Transaction, typename P>
+  void
+  add_table(const base_txn_btree<Transaction, P> &btr, const std::string &name)
+  {
+    std::lock_guard<std::mutex> l(checkpoint_mutex_);
+    ALWAYS_ASSERT(!ncheckpoints_);
+    tables_.push_back({name,
+        [&btr](uint64_t t, std::string &pos, size_t n,
+               const record_callback &f) {
+          return btr.snapshot_scan(t, pos, n, f);
+        }});
+  }
+
+  /**
+   * Takes a checkpoint now, blocking until it is on disk. Returns false on
+   * an I/O error, in which case the previous checkpoint stays in place.
+   * Must not be called from within an RCU region. If m is not null, it is
+   * set to the new checkpoint's manifest
+   */
+  bool checkpoint(manifest *m = nullptr);
+
+  // takes a checkpoint every interval_ms in the background, until stop()
+  void start(uint64_t interval_ms);
+  void stop();
+
+  // the manifest of the last checkpoint taken by this object (id_ == 0 if
+  // none yet)
+  manifest last_checkpoint() const;
+
+  static std::string ManifestFile(const std::string &dir);
+
+  // reads dir's manifest, returns false if there is none
+  static bool ReadManifest(const std::string &dir, manifest &m);
+
+  // invokes f(key, value, value_len) on each record of table t (from dir's
+  // manifest), in ascending key order. returns false if the table's file
+  // cannot be read or does not match the manifest
+  static bool ScanTable(const std::string &dir, const table_info &t,
+                        const record_callback &f);
+
+private:
+
+  typedef std::function<
+    bool (uint64_t, std::string &, size_t, const record_callback &)> scan_fn;
+
+  struct table {
+    std::string name_;
+    scan_fn scan_;
+  };
+
+  void worker();
+  bool write_table(size_t idx, uint64_t id, uint64_t snapshot_tid,
+                   table_info &info);
+  static bool write_manifest(const std::string &dir, const manifest &m);
+
+  const std::string dir_;
+  const size_t nthreads_;
+  std::vector<table> tables_;
+  manifest last_;
+  size_t ncheckpoints_;
+  mutable std::mutex checkpoint_mutex_; // one checkpoint at a time
+
+  // the current round of work for the scan threads
+  std::mutex round_mutex_;
+  std::condition_variable round_cv_;
+  std::condition_variable done_cv_;
+  uint64_t round_;
+  uint64_t round_id_;
+  uint64_t round_tid_;
+  std::atomic<size_t> next_table_;
+  std::vector<table_info> round_tables_;
+  std::vector<uint8_t> round_ok_;
+  size_t ndone_;
+  bool stop_workers_;
+  std::vector<std::thread> workers_;
+
+  // background checkpoints
+  std::mutex bg_mutex_;
+  std::condition_variable bg_cv_;
+  bool stop_bg_;
+  std::thread bg_;
+};
+
+#endif /* _NDB_TXN_CHECKPOINTER_H_ */
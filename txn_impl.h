@@ -202,6 +202,7 @@ transaction<Protocol, Traits>::handle_last_tuple_in_group(
       // to it, so we do NOT need to lock the node (again), but we DO
       // need to apply the latest write
       last.entry->set_do_write();
+    last.entry->set_do_unlock();
   } else {
     dbtuple *tuple = last.get_tuple();
     if (unlikely(tuple->version == dbtuple::MAX_TID)) {
@@ -224,6 +225,7 @@ transaction<Protocol, Traits>::handle_last_tuple_in_group(
       return false; // signal abort
     }
     last.entry->set_do_write();
+    last.entry->set_do_unlock();
   }
   return true;
 }
@@ -255,6 +257,8 @@ transaction<Protocol, Traits>::commit(bool doThrow)
 
   dbtuple_write_info_vec write_dbtuples;
   std::pair<bool, tid_t> commit_tid(false, 0);
+  uint64_t lock_start_tsc = 0; // for the lock hold counters
+  bool time_lock_hold = false; // sampled for the abort profiler
 
   // copy write tuples to vector for sorting
   if (!write_set.empty()) {
@@ -284,6 +288,13 @@ transaction<Protocol, Traits>::commit(bool doThrow)
           static std::string probe2_name(
             std::string(__PRETTY_FUNCTION__) + std::string(":lock_write_nodes:")));
       ANON_REGION(probe2_name.c_str(), &transaction_base::g_txn_commit_probe2_cg);
+      time_lock_hold = abort_profiler::SampleLockHold();
+#ifdef ENABLE_EVENT_COUNTERS
+      lock_start_tsc = rdtsc();
+#else
+      if (unlikely(time_lock_hold))
+        lock_start_tsc = rdtsc();
+#endif
       // lock the logical nodes in sort order
       {
         PERF_DECL(
@@ -300,7 +311,8 @@ transaction<Protocol, Traits>::commit(bool doThrow)
         if (likely(last_px && last_px->tuple != it->tuple)) {
           // on boundary
           if (unlikely(!handle_last_tuple_in_group(*last_px, inserted_last_run))) {
-            abort_trap((reason = ABORT_REASON_WRITE_NODE_INTERFERENCE));
+            abort_trap((reason = ABORT_REASON_WRITE_NODE_INTERFERENCE),
+                       last_px->entry->get_btree(), last_px->entry->get_key());
             goto do_abort;
           }
           inserted_last_run = false;
@@ -318,7 +330,8 @@ transaction<Protocol, Traits>::commit(bool doThrow)
       }
       if (likely(last_px) &&
           unlikely(!handle_last_tuple_in_group(*last_px, inserted_last_run))) {
-        abort_trap((reason = ABORT_REASON_WRITE_NODE_INTERFERENCE));
+        abort_trap((reason = ABORT_REASON_WRITE_NODE_INTERFERENCE),
+                   last_px->entry->get_btree(), last_px->entry->get_key());
         goto do_abort;
       }
       commit_tid.first = true;
@@ -362,7 +375,15 @@ transaction<Protocol, Traits>::commit(bool doThrow)
 
           //std::cerr << "failed tuple: " << *it->get_tuple() << std::endl;
 
-          abort_trap((reason = ABORT_REASON_READ_NODE_INTEREFERENCE));
+          // the key is only known if the txn wrote the tuple too
+          const dbtuple_write_info * const w =
+            found ? sorted_dbtuples_find(write_dbtuples, it->get_tuple()) : nullptr;
+          if (w)
+            abort_trap((reason = ABORT_REASON_READ_NODE_INTEREFERENCE),
+                       w->entry->get_btree(), w->entry->get_key());
+          else
+            abort_trap((reason = ABORT_REASON_READ_NODE_INTEREFERENCE),
+                       it->get_btree(), it->get_tuple());
           goto do_abort;
         }
       }
@@ -376,7 +397,8 @@ transaction<Protocol, Traits>::commit(bool doThrow)
           if (unlikely(v != it->second.version)) {
             VERBOSE(std::cerr << "expected node " << util::hexify(it->first) << " at v="
                               << it->second.version << ", got v=" << v << std::endl);
-            abort_trap((reason = ABORT_REASON_NODE_SCAN_READ_VERSION_CHANGED));
+            abort_trap((reason = ABORT_REASON_NODE_SCAN_READ_VERSION_CHANGED),
+                       it->second.btr, it->first);
             goto do_abort;
           }
         }
@@ -405,6 +427,7 @@ transaction<Protocol, Traits>::commit(bool doThrow)
                                               // w/o creating a new chain
         } else {
           tuple->prefetch();
+          cast()->on_dbtuple_overwrite(tuple);
           const dbtuple::write_record_ret ret =
             tuple->write_record_at(
                 cast(), commit_tid.second,
@@ -437,17 +460,18 @@ transaction<Protocol, Traits>::commit(bool doThrow)
           if (unlikely(unlock_head))
             ret.head_->unlock();
         }
+        // the tuple's last write is in, so other txns can have it now,
+        // w/o waiting for the rest of the write set to be installed
+        if (it->do_unlock()) {
+          tuple->unlock();
+#ifdef ENABLE_EVENT_COUNTERS
+          evt_avg_commit_lock_hold_cycles.offer(rdtsc() - lock_start_tsc);
+#endif
+        }
         VERBOSE(std::cerr << "dbtuple " << util::hexify(tuple) << " is_locked? " << tuple->is_locked() << std::endl);
       }
-      // unlock
-      // NB: we can no longer un-lock after doing the writes above
-      for (typename dbtuple_write_info_vec::iterator it = write_dbtuples.begin();
-           it != write_dbtuples.end(); ++it) {
-        if (it->is_locked())
-          it->tuple->unlock();
-        else
-          INVARIANT(!it->is_insert());
-      }
+      if (unlikely(time_lock_hold))
+        abort_profiler::RecordCommitLockHold(rdtsc() - lock_start_tsc);
     }
   }
   state = TXN_COMMITED;
@@ -478,6 +502,14 @@ do_abort:
       INVARIANT(!it->is_insert());
     }
   }
+  if (lock_start_tsc) {
+    const uint64_t cycles = rdtsc() - lock_start_tsc;
+    if (time_lock_hold)
+      abort_profiler::RecordLockHold(reason, cycles);
+#ifdef ENABLE_EVENT_COUNTERS
+    AbortReasonLockHoldCounter(reason)->offer(cycles);
+#endif
+  }
 
   state = TXN_ABRT;
   if (commit_tid.first)
@@ -548,7 +580,8 @@ transaction<Protocol, Traits>::try_insert_new_tuple(
     auto it = absent_set.find(insert_info.node);
     if (it != absent_set.end()) {
       if (unlikely(it->second.version != insert_info.old_version)) {
-        abort_trap((reason = ABORT_REASON_WRITE_NODE_INTERFERENCE));
+        abort_trap((reason = ABORT_REASON_WRITE_NODE_INTERFERENCE),
+                   &btr, *key);
         return std::make_pair(tuple, true);
       }
       VERBOSE(std::cerr << "bump node=" << util::hexify(it->first) << " from v=" << insert_info.old_version
@@ -565,7 +598,8 @@ template <template <typename> class Protocol, typename Traits>
 template <typename ValueReader>
 bool
 transaction<Protocol, Traits>::do_tuple_read(
-    const dbtuple *tuple, ValueReader &value_reader)
+    const dbtuple *tuple, ValueReader &value_reader,
+    const concurrent_btree *btr)
 {
   INVARIANT(tuple);
   ++evt_local_search_lookups;
@@ -617,21 +651,24 @@ transaction<Protocol, Traits>::do_tuple_read(
   if (!is_snapshot_txn)
     // read-only txns do not need read-set tracking
     // (b/c we know the values are consistent)
-    read_set.emplace_back(tuple, start_t);
+    read_set.emplace_back(tuple, start_t, btr);
   return !v_empty;
 }
 
 template <template <typename> class Protocol, typename Traits>
 void
 transaction<Protocol, Traits>::do_node_read(
-    const typename concurrent_btree::node_opaque_t *n, uint64_t v)
+    const typename concurrent_btree::node_opaque_t *n, uint64_t v,
+    const concurrent_btree *btr)
 {
   INVARIANT(n);
   if (is_snapshot())
     return;
   auto it = absent_set.find(n);
   if (it == absent_set.end()) {
-    absent_set[n].version = v;
+    absent_record_t &r = absent_set[n];
+    r.version = v;
+    r.btr = btr;
   } else if (it->second.version != v) {
     const transaction_base::abort_reason r =
       transaction_base::ABORT_REASON_NODE_SCAN_READ_VERSION_CHANGED;
@@ -0,0 +1,551 @@
+#include <algorithm>
+#include <queue>
+#include <set>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "txn_log_recovery.h"
+#include "txn_proto2_impl.h"
+#include "record/serializer.h"
+#include "util.h"
+
+using namespace std;
+using namespace util;
+
+txn_log_recovery::txn_log_recovery(const vector<string> &logfiles)
+  : nparts_(max<size_t>(1, thread::hardware_concurrency())),
+    ran_(false),
+    min_epoch_(0)
+{
+  INVARIANT(!logfiles.empty());
+  pepoch_fname_ = txn_logger::PersistedEpochFile(logfiles[0]);
+  for (auto &fname : logfiles) {
+    vector<txn_logger::segment_info> segments;
+    if (!txn_logger::ReadSegmentManifest(fname, segments)) {
+      logfiles_.emplace_back(new logfile(fname));
+      continue;
+    }
+    for (auto &si : segments)
+      logfiles_.emplace_back(new logfile(si.fname_, si.seq_));
+  }
+  stats_.nfiles_ = logfiles_.size();
+}
+
+txn_log_recovery::~txn_log_recovery()
+{
+}
+
+template <typename F>
+const uint8_t *
+txn_log_recovery::decode_txns(
+    const uint8_t *p, const uint8_t *end,
+    uint64_t max_txns, uint64_t core, uint64_t epoch, bool ops,
+    uint64_t &ntxns, F &f)
+{
+  serializer<uint32_t, true> vs_uint32_t;
+  serializer<uint32_t, false> s_uint32_t;
+  serializer<uint64_t, false> s_uint64_t;
+  for (ntxns = 0; ntxns < max_txns && p < end; ntxns++) {
+    uint64_t tid;
+    uint32_t nwrites;
+    if (unlikely(!(p = s_uint64_t.failsafe_read(p, end - p, &tid))))
+      return nullptr;
+    if (unlikely(transaction_proto2_static::EpochId(tid) != epoch ||
+                 transaction_proto2_static::CoreId(tid) != core))
+      return nullptr;
+    if (unlikely(!(p = vs_uint32_t.failsafe_read(p, end - p, &nwrites))))
+      return nullptr;
+    for (uint32_t i = 0; i < nwrites; i++) {
+      uint32_t table_id, klen, vlen;
+      if (unlikely(!(p = s_uint32_t.failsafe_read(p, end - p, &table_id))))
+        return nullptr;
+      if (unlikely(!(p = vs_uint32_t.failsafe_read(p, end - p, &klen)) ||
+                   size_t(end - p) < klen))
+        return nullptr;
+      const uint8_t * const k = p;
+      p += klen;
+      uint8_t kind = txn_logger::WRITE_FULL;
+      if (ops) {
+        if (unlikely(p == end))
+          return nullptr;
+        kind = *p++;
+        if (unlikely(kind != txn_logger::WRITE_FULL &&
+                     kind != txn_logger::WRITE_PATCH))
+          return nullptr;
+      }
+      if (unlikely(!(p = vs_uint32_t.failsafe_read(p, end - p, &vlen)) ||
+                   size_t(end - p) < vlen))
+        return nullptr;
+      f(tid, table_id, k, klen, p, vlen, kind == txn_logger::WRITE_PATCH);
+      p += vlen;
+    }
+  }
+  return p;
+}
+
+namespace {
+  struct noop_write_fn {
+    inline void
+    operator()(uint64_t, uint32_t, const uint8_t *, size_t,
+               const uint8_t *, size_t, bool) const
+    {
+    }
+  };
+}
+
+void
+txn_log_recovery::read_logfile(logfile &lf)
+{
+  const int fd = open(lf.name_.c_str(), O_RDONLY);
+  if (fd == -1) {
+    perror("open");
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror("fstat");
+    close(fd);
+    return;
+  }
+  lf.data_.resize(st.st_size);
+  for (size_t off = 0; off < lf.data_.size(); ) {
+    const ssize_t ret = read(fd, &lf.data_[off], lf.data_.size() - off);
+    if (ret <= 0) {
+      if (ret == -1)
+        perror("read");
+      close(fd);
+      return;
+    }
+    off += ret;
+  }
+  close(fd);
+  lf.core_max_epochs_.assign(NMAXCORES, 0);
+
+  unique_ptr<uint8_t[]> scratch(new uint8_t[txn_logger::g_horizon_buffer_size]);
+  noop_write_fn noop;
+
+  // a buffer which does not decode cleanly can only be the one the crash
+  // interrupted (or the zeroes after it), so we stop there. a segment ends
+  // w/ the zeroes it was preallocated w/, or w/ what its file held as an
+  // earlier segment (whose headers have another seq_), which do not make
+  // it torn
+  const uint8_t *p = lf.data_.data();
+  const uint8_t * const end = p + lf.data_.size();
+  while (p < end) {
+    txn_logger::logbuf_header hdr;
+    if (size_t(end - p) < sizeof(hdr)) {
+      lf.torn_ = true;
+      break;
+    }
+    NDB_MEMCPY(&hdr, p, sizeof(hdr));
+    if (hdr.seq_ != lf.seq_)
+      break;
+    if (!hdr.nentries_ && hdr.last_tid_ == txn_logger::g_padding_tid) {
+      // the end of a direct IO write, see txn_logger::logbuf_header
+      const size_t off = slow_round_up(
+          size_t(p - lf.data_.data()) + sizeof(hdr),
+          txn_logger::g_direct_io_alignment);
+      if (off > lf.data_.size()) {
+        lf.torn_ = true;
+        break;
+      }
+      p = lf.data_.data() + off;
+      continue;
+    }
+    if (!hdr.nentries_) {
+      lf.torn_ = any_of(p, end, [](uint8_t b) { return b != 0; });
+      break;
+    }
+    const log_codec * const codec =
+      hdr.codec_ ? log_codec::Get(hdr.codec_) : nullptr;
+    if (hdr.codec_ && !codec) {
+      cerr << "txn_log_recovery: " << lf.name_ << ": unknown codec "
+           << unsigned(hdr.codec_) << " at offset "
+           << (p - lf.data_.data()) << endl;
+      lf.torn_ = true;
+      break;
+    }
+    const uint64_t core = transaction_proto2_static::CoreId(hdr.last_tid_);
+    const uint64_t epoch = transaction_proto2_static::EpochId(hdr.last_tid_);
+    const bool ops = hdr.ops_;
+    const uint8_t *q = p + sizeof(hdr);
+    const size_t nsegments = lf.segments_.size();
+    const size_t ndecompressed = lf.decompressed_.size();
+    uint64_t left = hdr.nentries_;
+    while (left) {
+      uint64_t ntxns;
+      if (!codec) {
+        const uint8_t * const e =
+          decode_txns(q, end, left, core, epoch, ops, ntxns, noop);
+        if (!e || ntxns != left)
+          break;
+        lf.segments_.push_back(
+            {core, epoch, q, size_t(e - q), ntxns, q == p + sizeof(hdr),
+             ops});
+        q = e;
+      } else {
+        serializer<uint32_t, false> s_uint32_t;
+        uint32_t clen;
+        const uint8_t * const c = s_uint32_t.failsafe_read(q, end - q, &clen);
+        if (!c || size_t(end - c) < clen)
+          break;
+        const ssize_t n = codec->decompress(
+            c, clen, scratch.get(), txn_logger::g_horizon_buffer_size);
+        if (n <= 0)
+          break;
+        const uint8_t * const e =
+          decode_txns(scratch.get(), scratch.get() + n, left,
+                      core, epoch, ops, ntxns, noop);
+        if (e != scratch.get() + n || !ntxns)
+          break;
+        uint8_t * const px = new uint8_t[n];
+        NDB_MEMCPY(px, scratch.get(), n);
+        lf.decompressed_.emplace_back(px);
+        lf.nbytes_decompressed_ += n;
+        lf.segments_.push_back(
+            {core, epoch, px, size_t(n), ntxns, q == p + sizeof(hdr), ops});
+        q = c + clen;
+      }
+      left -= ntxns;
+    }
+    if (left) {
+      // drop what we took from the partial buffer
+      lf.segments_.resize(nsegments);
+      lf.decompressed_.resize(ndecompressed);
+      lf.torn_ = true;
+      break;
+    }
+    lf.nbuffers_++;
+    lf.core_max_epochs_[core] = max(lf.core_max_epochs_[core], epoch);
+    p = q;
+  }
+  lf.ok_ = true;
+}
+
+void
+txn_log_recovery::add_version(version_chain &c, const version &v)
+{
+  // a key's versions come in TID order only within a txn (since a file
+  // interleaves the buffers of several cores), so the >= below lets a later
+  // write in the same txn win, and keeps a patch which follows its base in
+  // the same txn
+  const bool has_base = !c.base_.patch_;
+  if (has_base && v.tid_ < c.base_.tid_)
+    return;
+  if (v.patch_) {
+    c.patches_.push_back(v);
+    return;
+  }
+  c.base_ = v;
+  c.patches_.erase(
+      remove_if(c.patches_.begin(), c.patches_.end(),
+                [&v](const version &p) { return p.tid_ <= v.tid_; }),
+      c.patches_.end());
+}
+
+void
+txn_log_recovery::replay_logfile(
+    logfile &lf, uint64_t min_epoch, uint64_t max_epoch)
+{
+  lf.parts_.resize(nparts_);
+  auto apply = [this, &lf](uint64_t tid, uint32_t table_id,
+                           const uint8_t *k, size_t klen,
+                           const uint8_t *v, size_t vlen, bool patch) {
+    string key = TableKey(table_id, k, klen);
+    version_map &m = lf.parts_[partition_of(key)];
+    const version ver = {tid, v, uint32_t(vlen), patch};
+    auto it = m.find(key);
+    if (it == m.end()) {
+      version_chain c;
+      c.base_ = {0, nullptr, 0, true};
+      add_version(c, ver);
+      m.emplace(move(key), move(c));
+    } else {
+      add_version(it->second, ver);
+    }
+    lf.nwrites_replayed_++;
+  };
+  for (auto &seg : lf.segments_) {
+    if (seg.epoch_ <= min_epoch || seg.epoch_ > max_epoch)
+      continue;
+    uint64_t ntxns;
+    const uint8_t * const e =
+      decode_txns(seg.p_, seg.p_ + seg.n_, seg.ntxns_,
+                  seg.core_, seg.epoch_, seg.ops_, ntxns, apply);
+    ALWAYS_ASSERT(e == seg.p_ + seg.n_);
+    lf.ntxns_replayed_ += ntxns;
+    lf.nbuffers_replayed_ += seg.buffer_start_;
+  }
+}
+
+void
+txn_log_recovery::merge_partition(size_t part)
+{
+  version_map &m = logfiles_[0]->parts_[part];
+  for (size_t i = 1; i < logfiles_.size(); i++) {
+    for (auto &e : logfiles_[i]->parts_[part]) {
+      auto it = m.find(e.first);
+      if (it == m.end()) {
+        m.emplace(e.first, move(e.second));
+        continue;
+      }
+      // a txn only goes to one file, so TIDs do not tie across files
+      if (!e.second.base_.patch_)
+        add_version(it->second, e.second.base_);
+      for (auto &p : e.second.patches_)
+        add_version(it->second, p);
+    }
+    version_map().swap(logfiles_[i]->parts_[part]);
+  }
+  auto &out = merged_[part];
+  out.reserve(m.size());
+  string v;
+  for (auto &e : m) {
+    version_chain &c = e.second;
+    // stable, to keep the patches of a txn in order
+    stable_sort(c.patches_.begin(), c.patches_.end(),
+                [](const version &a, const version &b) {
+                  return a.tid_ < b.tid_;
+                });
+    if (c.base_.patch_) {
+      // left for a checkpoint to resolve
+      nunresolved_[part]++;
+    } else if (!c.patches_.empty()) {
+      v.assign((const char *) c.base_.v_, c.base_.vlen_);
+      bool ok = true;
+      for (auto &p : c.patches_) {
+        string applied;
+        ok = txn_logger::ApplyPatch(
+            (const uint8_t *) v.data(), v.size(), p.v_, p.vlen_, applied);
+        if (!ok)
+          break;
+        v.swap(applied);
+      }
+      if (!ok) {
+        cerr << "txn_log_recovery: malformed patch, dropping key" << endl;
+        nunresolved_[part]++;
+        continue;
+      }
+      npatches_[part] += c.patches_.size();
+      patched_[part].emplace_back(move(v));
+      const string &pv = patched_[part].back();
+      c.base_ = {c.patches_.back().tid_, (const uint8_t *) pv.data(),
+                 uint32_t(pv.size()), false};
+      vector<version>().swap(c.patches_);
+    }
+    // removes are kept, to be applied on top of a checkpoint
+    if (!c.base_.patch_ && !c.base_.vlen_)
+      nremoved_[part]++;
+    out.emplace_back(e.first, move(c));
+  }
+  version_map().swap(m);
+  sort(out.begin(), out.end(),
+       [](const pair<string, version_chain> &a,
+          const pair<string, version_chain> &b) {
+         return a.first < b.first;
+       });
+}
+
+bool
+txn_log_recovery::run(uint64_t min_epoch, uint64_t max_epoch)
+{
+  ALWAYS_ASSERT(!ran_);
+  ran_ = true;
+  min_epoch_ = min_epoch;
+
+  timer t;
+  {
+    vector<thread> readers;
+    for (auto &lf : logfiles_)
+      readers.emplace_back(&txn_log_recovery::read_logfile, this, ref(*lf));
+    for (auto &th : readers)
+      th.join();
+  }
+  stats_.read_us_ = t.lap();
+
+  vector<uint64_t> core_max_epochs(NMAXCORES, 0);
+  for (auto &lf : logfiles_) {
+    if (!lf->ok_)
+      return false;
+    stats_.nbytes_read_ += lf->data_.size();
+    stats_.nbytes_decompressed_ += lf->nbytes_decompressed_;
+    stats_.nbuffers_ += lf->nbuffers_;
+    stats_.nfiles_torn_ += lf->torn_;
+    for (size_t c = 0; c < NMAXCORES; c++)
+      core_max_epochs[c] = max(core_max_epochs[c], lf->core_max_epochs_[c]);
+  }
+
+  // a core has only persisted the epochs before the last one it has a
+  // buffer for, since more buffers of that epoch may have been lost. but
+  // an idle core stops writing buffers altogether, so use the logger's
+  // own record if it left one
+  const int fd = open(pepoch_fname_.c_str(), O_RDONLY);
+  if (fd != -1) {
+    uint64_t e = 0;
+    if (read(fd, &e, sizeof(e)) != sizeof(e))
+      e = 0;
+    close(fd);
+    stats_.persisted_epoch_ = e;
+  } else {
+    uint64_t e = numeric_limits<uint64_t>::max();
+    for (auto ce : core_max_epochs)
+      if (ce)
+        e = min(e, ce - 1);
+    stats_.persisted_epoch_ = e == numeric_limits<uint64_t>::max() ? 0 : e;
+  }
+  if (max_epoch == EpochUnknown)
+    max_epoch = stats_.persisted_epoch_;
+
+  {
+    vector<thread> replayers;
+    for (auto &lf : logfiles_)
+      replayers.emplace_back(
+          &txn_log_recovery::replay_logfile, this, ref(*lf),
+          min_epoch, max_epoch);
+    for (auto &th : replayers)
+      th.join();
+  }
+  stats_.replay_us_ = t.lap();
+
+  merged_.resize(nparts_);
+  patched_.resize(nparts_);
+  nremoved_.assign(nparts_, 0);
+  npatches_.assign(nparts_, 0);
+  nunresolved_.assign(nparts_, 0);
+  {
+    vector<thread> mergers;
+    for (size_t i = 0; i < nparts_; i++)
+      mergers.emplace_back(&txn_log_recovery::merge_partition, this, i);
+    for (auto &th : mergers)
+      th.join();
+  }
+  stats_.merge_us_ = t.lap();
+
+  for (auto &lf : logfiles_) {
+    stats_.nbuffers_replayed_ += lf->nbuffers_replayed_;
+    stats_.ntxns_replayed_ += lf->ntxns_replayed_;
+    stats_.nwrites_replayed_ += lf->nwrites_replayed_;
+  }
+  set<uint32_t> table_ids;
+  for (size_t i = 0; i < nparts_; i++) {
+    for (auto &e : merged_[i])
+      table_ids.insert(TableOf(e.first));
+    stats_.nkeys_ += merged_[i].size() - nremoved_[i] - nunresolved_[i];
+    stats_.nremoved_ += nremoved_[i];
+    stats_.npatches_ += npatches_[i];
+    stats_.nunresolved_ += nunresolved_[i];
+  }
+  table_ids_.assign(table_ids.begin(), table_ids.end());
+  return true;
+}
+
+void
+txn_log_recovery::NoteLoaded()
+{
+  txn_logger::NoteRecoveredLoad();
+}
+
+void
+txn_log_recovery::scan(const function<
+    void (uint32_t, const string &, const uint8_t *, size_t, uint64_t)> &f,
+    bool include_removed) const
+{
+  scan_chains([&](const string &tk, const version_chain &c) {
+    if (!c.base_.patch_ && (c.base_.vlen_ || include_removed))
+      f(TableOf(tk), tk.substr(sizeof(uint32_t)),
+        c.base_.v_, c.base_.vlen_, c.base_.tid_);
+  });
+}
+
+void
+txn_log_recovery::scan_chains(const function<
+    void (const string &, const version_chain &)> &f) const
+{
+  // k-way merge of the (sorted) partitions
+  typedef pair<size_t, size_t> cursor; // <partition, position>
+  auto cmp = [this](const cursor &a, const cursor &b) {
+    return merged_[a.first][a.second].first > merged_[b.first][b.second].first;
+  };
+  priority_queue<cursor, vector<cursor>, decltype(cmp)> q(cmp);
+  for (size_t i = 0; i < merged_.size(); i++)
+    if (!merged_[i].empty())
+      q.emplace(i, 0);
+  while (!q.empty()) {
+    cursor c = q.top();
+    q.pop();
+    const auto &e = merged_[c.first][c.second];
+    f(e.first, e.second);
+    if (++c.second < merged_[c.first].size())
+      q.push(c);
+  }
+}
+
+bool
+txn_log_recovery::merge_checkpoint(
+    const string &dir, const txn_checkpointer::table_info *ti,
+    const vector<logged_write> &logged,
+    vector<pair<string, string>> &out)
+{
+  // the logged writes are all newer than the checkpoint. base is the
+  // checkpoint's version of the key, if it has one
+  size_t i = 0;
+  auto emit_logged = [&](const string *base) {
+    const logged_write &w = logged[i++];
+    if (w.patches_) {
+      if (!base)
+        return; // unresolved
+      string v(*base), applied;
+      for (auto &p : *w.patches_) {
+        if (!txn_logger::ApplyPatch(
+              (const uint8_t *) v.data(), v.size(), p.v_, p.vlen_, applied))
+          return;
+        v.swap(applied);
+      }
+      out.emplace_back(w.k_, move(v));
+    } else if (w.vlen_) {
+      out.emplace_back(w.k_, string((const char *) w.v_, w.vlen_));
+    }
+  };
+  auto emit_logged_before = [&](const string *k) {
+    while (i < logged.size() && (!k || logged[i].k_ < *k))
+      emit_logged(nullptr);
+  };
+  if (ti && !txn_checkpointer::ScanTable(dir, *ti,
+        [&](const string &k, const uint8_t *v, size_t vlen) {
+          emit_logged_before(&k);
+          if (i < logged.size() && logged[i].k_ == k) {
+            const string base((const char *) v, vlen);
+            emit_logged(&base);
+          } else {
+            out.emplace_back(k, string((const char *) v, vlen));
+          }
+        }))
+    return false;
+  emit_logged_before(nullptr);
+  return true;
+}
+
+ostream &
+operator<<(ostream &o, const txn_log_recovery::stats &s)
+{
+  o << "{nfiles=" << s.nfiles_
+    << ", nbytes_read=" << s.nbytes_read_
+    << ", nbytes_decompressed=" << s.nbytes_decompressed_
+    << ", nbuffers=" << s.nbuffers_
+    << ", nbuffers_replayed=" << s.nbuffers_replayed_
+    << ", nfiles_torn=" << s.nfiles_torn_
+    << ", ntxns_replayed=" << s.ntxns_replayed_
+    << ", nwrites_replayed=" << s.nwrites_replayed_
+    << ", nkeys=" << s.nkeys_
+    << ", nremoved=" << s.nremoved_
+    << ", npatches=" << s.npatches_
+    << ", nunresolved=" << s.nunresolved_
+    << ", persisted_epoch=" << s.persisted_epoch_
+    << ", read_ms=" << (s.read_us_ / 1000.0)
+    << ", replay_ms=" << (s.replay_us_ / 1000.0)
+    << ", merge_ms=" << (s.merge_us_ / 1000.0)
+    << "}";
+  return o;
+}
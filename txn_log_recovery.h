@@ -0,0 +1,371 @@
+#ifndef _NDB_TXN_LOG_RECOVERY_H_
+#define _NDB_TXN_LOG_RECOVERY_H_
+
+#include <iostream>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "macros.h"
+#include "txn_btree.h"
+#include "txn_checkpointer.h"
+
+/**
+ * Rebuilds the committed state of a database from the files written by
+ * txn_logger (see txn_logger::logbuf_header for the on-disk format).
+ *
+ * Recovery runs in three parallel phases:
+ *   A) one thread per log file reads the file, decompresses it, and splits
+ *      it into runs of whole txns (stopping at a torn tail, if any)
+ *   B) the same threads decode the txns of every epoch which made it to
+ *      disk on all cores, keeping only the highest TID version of each key
+ *      (TIDs order all writes to a key, so this gives the same result as
+ *      replaying the txns in TID order)
+ *   C) the versions are merged across files and sorted by key, one thread
+ *      per hash partition of the keys
+ *
+ * The result can then be bulk loaded into empty txn_btrees, on its own or
+ * on top of a checkpoint (see txn_checkpointer). Each logged write carries
+ * the id of the table it went to (see base_txn_btree::TableId()), which
+ * routes it to the tree of the same id. Keys are only unique per table, so
+ * everything below is keyed by <table id, key>.
+ *
+ * A log written w/ op logging (see txn_logger::Init()) holds patches, which
+ * phase C applies in TID order on top of the newest full version of their
+ * key. The patches of a key w/ no full version in the log can only be
+ * applied to a checkpoint (see load()), and are dropped otherwise.
+ *
+ * Must run before txn_logger::Init(), which truncates the log files. The
+ * loaded records bypass the log, so they must be checkpointed before the
+ * log is truncated: once load() has run, txn_logger::Init() refuses to
+ * start until a checkpoint has been taken (see
+ * txn_logger::NoteRecoveredLoad())
+ */
+class txn_log_recovery {
+public:
+
+  static const uint64_t EpochUnknown = std::numeric_limits<uint64_t>::max();
+
+  struct stats {
+    size_t nfiles_;            // incl. each segment of a segmented log
+    size_t nbytes_read_;
+    size_t nbytes_decompressed_;
+    size_t nbuffers_;          // log buffers found on disk
+    size_t nbuffers_replayed_; // ... which were in the replayed epochs
+    size_t nfiles_torn_;       // files which ended w/ a partial buffer
+    size_t ntxns_replayed_;
+    size_t nwrites_replayed_;
+    size_t nkeys_;             // keys present after recovery
+    size_t nremoved_;          // keys whose last write was a remove
+    size_t npatches_;          // patches applied (see txn_logger::Init())
+    size_t nunresolved_;       // keys w/ patches but no full version
+    uint64_t persisted_epoch_;
+    uint64_t read_us_;         // phase A, wall clock
+    uint64_t replay_us_;       // phase B, wall clock
+    uint64_t merge_us_;        // phase C, wall clock
+
+    stats() { NDB_MEMSET(this, 0, sizeof(*this)); }
+  };
+
+  // logfiles are the ones given to txn_logger::Init(), segmented or not,
+  // and compressed or not (each log buffer says which codec it used)
+  txn_log_recovery(const std::vector<std::string> &logfiles);
+  ~txn_log_recovery();
+
+  txn_log_recovery(const txn_log_recovery &) = delete;
+  txn_log_recovery &operator=(const txn_log_recovery &) = delete;
+
+  /**
+   * Recovers the writes of txns in epochs (min_epoch, max_epoch]. If
+   * max_epoch is EpochUnknown, the last epoch which was persisted on all
+   * cores is used: the one recorded in txn_logger::PersistedEpochFile() if
+   * there is one, otherwise the last epoch every core has moved past in the
+   * logs. Returns false if a log file could not be read
+   *
+   * Can only be called once
+   */
+  bool run(uint64_t min_epoch = 0, uint64_t max_epoch = EpochUnknown);
+
+  inline const stats &
+  get_stats() const
+  {
+    return stats_;
+  }
+
+  // only valid after run()
+  inline uint64_t
+  persisted_epoch() const
+  {
+    return stats_.persisted_epoch_;
+  }
+
+  // the ids of the tables w/ writes in the replayed epochs, ascending. only
+  // valid after run()
+  inline const std::vector<uint32_t> &
+  table_ids() const
+  {
+    return table_ids_;
+  }
+
+  /**
+   * Invokes f(table_id, key, value, value_len, tid) on every recovered key
+   * (ie not removed by its last write, and not unresolved) in ascending
+   * <table id, key> order. value points into memory owned by this object.
+   * If include_removed, the removed keys are visited too, w/ a value_len
+   * of 0
+   */
+  void scan(const std::function<
+      void (uint32_t, const std::string &, const uint8_t *, size_t,
+            uint64_t)> &f,
+      bool include_removed = false) const;
+
+  /**
+   * Bulk loads the recovered records into tables, which must be empty: the
+   * records of table id tables[i].first go to tables[i].second, and those
+   * of the other tables are left out. Returns false if an id is given
+   * twice, see txn_btree::bulk_load() for when else it fails
+   */
+  template <template <typename> class Transaction>
+  bool
+  load(const std::vector<
+         std::pair<uint32_t, txn_btree<Transaction> *>> &tables) const
+  {
+    std::unordered_map<uint32_t, size_t> idx_of;
+    for (size_t i = 0; i < tables.size(); i++)
+      if (!idx_of.emplace(tables[i].first, i).second)
+        return false;
+    std::vector<std::vector<std::pair<std::string, std::string>>>
+      records(tables.size());
+    scan([&](uint32_t table_id, const std::string &k,
+             const uint8_t *v, size_t vlen, uint64_t) {
+      auto it = idx_of.find(table_id);
+      if (it != idx_of.end())
+        records[it->second].emplace_back(
+            k, std::string((const char *) v, vlen));
+    });
+    bool ret = true;
+    for (size_t i = 0; i < tables.size(); i++) {
+      if (!records[i].empty())
+        NoteLoaded();
+      ret = tables[i].second->bulk_load(
+          records[i].begin(), records[i].end()) && ret;
+    }
+    return ret;
+  }
+
+  // loads each of btrs w/ the records of its own table (see
+  // base_txn_btree::table_id())
+  template <template <typename> class Transaction>
+  bool
+  load(const std::vector<txn_btree<Transaction> *> &btrs) const
+  {
+    std::vector<std::pair<uint32_t, txn_btree<Transaction> *>> tables;
+    for (auto btr : btrs)
+      tables.emplace_back(btr->table_id(), btr);
+    return load(tables);
+  }
+
+  template <template <typename> class Transaction>
+  inline bool
+  load(txn_btree<Transaction> &btr) const
+  {
+    return load(std::vector<txn_btree<Transaction> *>({&btr}));
+  }
+
+  /**
+   * Like load(), but on top of the last checkpoint in ckpt_dir (if there is
+   * one): tables[i].second gets the records the checkpoint has for the table
+   * named tables[i].first, updated by the recovered writes to the tree's
+   * table id. Returns false if run() did not start at the checkpoint's
+   * epoch (ie min_epoch must be txn_checkpointer::manifest::epoch_), if two
+   * trees have the same table id, or if the checkpoint cannot be read
+   */
+  template <template <typename> class Transaction>
+  bool
+  load(const std::string &ckpt_dir,
+       const std::vector<
+         std::pair<std::string, txn_btree<Transaction> *>> &tables) const
+  {
+    txn_checkpointer::manifest m;
+    txn_checkpointer::ReadManifest(ckpt_dir, m);
+    if (m.epoch_ != min_epoch_)
+      return false;
+    std::unordered_map<uint32_t, size_t> idx_of;
+    for (size_t i = 0; i < tables.size(); i++)
+      if (!idx_of.emplace(tables[i].second->table_id(), i).second)
+        return false;
+    std::vector<std::vector<logged_write>> logged(tables.size());
+    scan_chains([&](const std::string &tk, const version_chain &c) {
+      auto it = idx_of.find(TableOf(tk));
+      if (it == idx_of.end())
+        return;
+      const std::string k = tk.substr(sizeof(uint32_t));
+      if (c.base_.patch_)
+        logged[it->second].push_back({k, nullptr, 0, &c.patches_});
+      else
+        logged[it->second].push_back({k, c.base_.v_, c.base_.vlen_, nullptr});
+    });
+    bool ret = true;
+    for (size_t i = 0; i < tables.size(); i++) {
+      const txn_checkpointer::table_info *ti = nullptr;
+      for (auto &t : m.tables_)
+        if (t.name_ == tables[i].first)
+          ti = &t;
+      std::vector<std::pair<std::string, std::string>> records;
+      if (!merge_checkpoint(ckpt_dir, ti, logged[i], records))
+        return false;
+      // the checkpoint alone does not need the log
+      if (!logged[i].empty())
+        NoteLoaded();
+      ret = tables[i].second->bulk_load(records.begin(), records.end()) && ret;
+    }
+    return ret;
+  }
+
+private:
+
+  // the <table id, key> pairs everything is keyed by: the id in big endian,
+  // so a table's keys stay together and in order
+  static inline std::string
+  TableKey(uint32_t table_id, const uint8_t *k, size_t klen)
+  {
+    std::string ret(sizeof(uint32_t) + klen, '\0');
+    for (size_t i = 0; i < sizeof(uint32_t); i++)
+      ret[i] = char(table_id >> (8 * (sizeof(uint32_t) - 1 - i)));
+    NDB_MEMCPY(&ret[sizeof(uint32_t)], k, klen);
+    return ret;
+  }
+
+  static inline uint32_t
+  TableOf(const std::string &tk)
+  {
+    INVARIANT(tk.size() >= sizeof(uint32_t));
+    uint32_t ret = 0;
+    for (size_t i = 0; i < sizeof(uint32_t); i++)
+      ret = (ret << 8) | uint8_t(tk[i]);
+    return ret;
+  }
+
+  // see txn_logger::NoteRecoveredLoad()
+  static void NoteLoaded();
+
+  // vlen_ == 0 means the key was removed (unless patch_)
+  struct version {
+    uint64_t tid_;
+    const uint8_t *v_;
+    uint32_t vlen_;
+    bool patch_; // a txn_logger::ApplyPatch() patch against the version before
+  };
+
+  // the newest full version of a key (base_.patch_ if there is none), and
+  // the patches newer than it, in the order they were seen
+  struct version_chain {
+    version base_;
+    std::vector<version> patches_;
+  };
+
+  typedef std::unordered_map<std::string, version_chain> version_map;
+
+  struct logged_write {
+    std::string k_;
+    const uint8_t *v_;
+    size_t vlen_; // 0 if removed
+    const std::vector<version> *patches_; // in TID order, if unresolved
+  };
+
+  // records of table ti of the checkpoint in dir (none if ti is null),
+  // updated by logged (in key order), go to out in key order
+  static bool merge_checkpoint(
+      const std::string &dir, const txn_checkpointer::table_info *ti,
+      const std::vector<logged_write> &logged,
+      std::vector<std::pair<std::string, std::string>> &out);
+
+  // a run of whole txns, all from the same core and epoch
+  struct segment {
+    uint64_t core_;
+    uint64_t epoch_;
+    const uint8_t *p_;
+    size_t n_;
+    uint64_t ntxns_;
+    bool buffer_start_; // the first segment of its log buffer?
+    bool ops_;          // see txn_logger::logbuf_header
+  };
+
+  struct logfile {
+    std::string name_;
+    uint32_t seq_; // of the segment, see txn_logger::logbuf_header
+    std::vector<uint8_t> data_;
+    std::vector<std::unique_ptr<uint8_t[]>> decompressed_;
+    std::vector<segment> segments_;
+    std::vector<uint64_t> core_max_epochs_; // indexed by core, 0 if unseen
+    std::vector<version_map> parts_; // phase B output, by key partition
+    bool ok_;
+    bool torn_;
+    size_t nbytes_decompressed_;
+    size_t nbuffers_;
+    size_t nbuffers_replayed_;
+    size_t ntxns_replayed_;
+    size_t nwrites_replayed_;
+
+    logfile(const std::string &name, uint32_t seq = 0)
+      : name_(name), seq_(seq), ok_(false), torn_(false),
+        nbytes_decompressed_(0), nbuffers_(0), nbuffers_replayed_(0),
+        ntxns_replayed_(0), nwrites_replayed_(0) {}
+  };
+
+  // decodes up to max_txns txns (of the given core and epoch) starting at
+  // p, until end, invoking
+  // f(tid, table_id, key, key_len, value, value_len, patch)
+  // for each write (ops says whether the writes carry a write_kind, see
+  // txn_logger::logbuf_header). sets ntxns to the number of txns decoded,
+  // and returns the end of the last one, or null if a txn is cut off or
+  // malformed
+  template <typename F>
+  static const uint8_t *
+  decode_txns(const uint8_t *p, const uint8_t *end,
+              uint64_t max_txns, uint64_t core, uint64_t epoch, bool ops,
+              uint64_t &ntxns, F &f);
+
+  // adds v to c, unless a newer full version makes it moot
+  static void add_version(version_chain &c, const version &v);
+
+  void read_logfile(logfile &lf); // phase A
+  void replay_logfile(logfile &lf, uint64_t min_epoch, uint64_t max_epoch); // phase B
+  void merge_partition(size_t part); // phase C
+
+  // like scan(), but visits every key (removed and unresolved ones too),
+  // keyed by TableKey()
+  void scan_chains(const std::function<
+      void (const std::string &, const version_chain &)> &f) const;
+
+  // the partition a key's versions go to in phase B/C
+  inline size_t
+  partition_of(const std::string &k) const
+  {
+    return std::hash<std::string>()(k) % nparts_;
+  }
+
+  const size_t nparts_;
+  std::string pepoch_fname_;
+  bool ran_;
+  uint64_t min_epoch_;
+  std::vector<std::unique_ptr<logfile>> logfiles_;
+  // phase C output: partition => sorted versions, w/ the patches applied
+  // to those which have a full version (the results are kept in patched_)
+  std::vector<std::vector<std::pair<std::string, version_chain>>> merged_;
+  std::vector<std::deque<std::string>> patched_; // by partition
+  std::vector<size_t> nremoved_; // by partition
+  std::vector<size_t> npatches_; // by partition
+  std::vector<size_t> nunresolved_; // by partition
+  std::vector<uint32_t> table_ids_;
+  stats stats_;
+};
+
+std::ostream &operator<<(std::ostream &o, const txn_log_recovery::stats &s);
+
+#endif /* _NDB_TXN_LOG_RECOVERY_H_ */
@@ -1,5 +1,9 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <thread>
+#include <deque>
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>
@@ -7,6 +11,7 @@
 #include <numa.h>
 
 #include "txn_proto2_impl.h"
+#include "aio_writer.h"
 #include "counter.h"
 #include "util.h"
 
@@ -19,6 +24,13 @@ bool txn_logger::g_persist = false;
 bool txn_logger::g_call_fsync = true;
 bool txn_logger::g_use_compression = false;
 bool txn_logger::g_fake_writes = false;
+int txn_logger::g_pepoch_fd = -1;
+uint64_t txn_logger::g_flush_deadline_us = 0;
+bool txn_logger::g_direct_io = false;
+bool txn_logger::g_pin_loggers_to_numa_nodes = false;
+bool txn_logger::g_op_logging = false;
+atomic<uint64_t> txn_logger::g_checkpoint_epoch(0);
+atomic<uint64_t> txn_logger::g_recovered_load_epoch(0);
 size_t txn_logger::g_nworkers = 0;
 txn_logger::epoch_array
   txn_logger::per_thread_sync_epochs_[txn_logger::g_nmax_loggers];
@@ -32,6 +44,10 @@ event_counter
   txn_logger::g_evt_log_buffer_epoch_boundary("log_buffer_epoch_boundary");
 event_counter
   txn_logger::g_evt_log_buffer_out_of_space("log_buffer_out_of_space");
+event_counter
+  txn_logger::g_evt_log_buffer_deadline("log_buffer_deadline");
+event_counter
+  txn_logger::g_evt_log_buffer_idle_flush("log_buffer_idle_flush");
 event_counter
   txn_logger::g_evt_log_buffer_bytes_before_compress("log_buffer_bytes_before_compress");
 event_counter
@@ -60,7 +76,13 @@ txn_logger::Init(
     vector<vector<unsigned>> *assignments_used,
     bool call_fsync,
     bool use_compression,
-    bool fake_writes)
+    bool fake_writes,
+    size_t segment_size,
+    uint64_t flush_deadline_us,
+    bool direct_io,
+    const vector<log_codec *> &codecs,
+    bool numa_aware,
+    bool op_logging)
 {
   INVARIANT(!g_persist);
   INVARIANT(g_nworkers == 0);
@@ -68,20 +90,38 @@ txn_logger::Init(
   INVARIANT(!logfiles.empty());
   INVARIANT(logfiles.size() <= g_nmax_loggers);
   INVARIANT(!use_compression || g_perthread_buffers > 1); // need 1 as scratch buf
-  vector<int> fds;
-  for (auto &fname : logfiles) {
-    int fd = open(fname.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664);
-    if (fd == -1) {
+  INVARIANT(codecs.size() <= 1 || codecs.size() == logfiles.size());
+  if (!fake_writes && g_recovered_load_epoch.load(memory_order_acquire)) {
+    cerr << "[ERROR] the log holds recovered records which are not in a "
+         << "checkpoint yet, refusing to truncate it" << endl;
+    ALWAYS_ASSERT(false);
+  }
+  if (!fake_writes) {
+    const string pepoch_fname = PersistedEpochFile(logfiles[0]);
+    g_pepoch_fd = open(pepoch_fname.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664);
+    if (g_pepoch_fd == -1) {
       perror("open");
       ALWAYS_ASSERT(false);
     }
-    fds.push_back(fd);
   }
   g_persist = true;
   g_call_fsync = call_fsync;
   g_use_compression = use_compression;
   g_fake_writes = fake_writes;
+  g_flush_deadline_us = flush_deadline_us;
+  g_direct_io = direct_io && !fake_writes;
+  g_op_logging = op_logging;
   g_nworkers = nworkers;
+  if (numa_aware && numa_available() == -1)
+    cerr << "[WARNING] no NUMA support, ignoring numa_aware" << endl;
+  else
+    g_pin_loggers_to_numa_nodes = numa_aware;
+
+  // after g_call_fsync is set, since a segmented log writes its manifest
+  vector<log_output *> fds;
+  for (auto &fname : logfiles)
+    fds.push_back(
+        new log_output(fname, fake_writes ? 0 : segment_size, g_direct_io));
 
   for (size_t i = 0; i < g_nmax_loggers; i++)
     for (size_t j = 0; j < g_nworkers; j++)
@@ -90,7 +130,9 @@ txn_logger::Init(
   vector<thread> writers;
   vector<vector<unsigned>> assignments(assignments_given);
 
-  if (assignments.empty()) {
+  if (assignments.empty() && g_pin_loggers_to_numa_nodes) {
+    assignments = NumaAssignments(fds.size(), g_nworkers);
+  } else if (assignments.empty()) {
     // compute assuming homogenous disks
     if (g_nworkers <= fds.size()) {
       // each thread gets its own logging worker
@@ -111,6 +153,24 @@ txn_logger::Init(
 
   INVARIANT(AssignmentsValid(assignments, fds.size(), g_nworkers));
 
+  if (g_pin_loggers_to_numa_nodes)
+    for (size_t i = 0; i < assignments.size(); i++)
+      if (AssignmentNumaNode(assignments[i]) == -1)
+        cerr << "[WARNING] logger " << i
+             << " has workers on more than one numa node" << endl;
+
+  // a core compresses w/ its logger's codec
+  if (use_compression)
+    for (size_t i = 0; i < assignments.size(); i++) {
+      log_codec * const codec =
+        codecs.empty() ? log_codec::Get(log_codec::CODEC_LZ4) :
+                         codecs[codecs.size() == 1 ? 0 : i];
+      ALWAYS_ASSERT(codec);
+      for (auto j : assignments[i])
+        for (size_t k = j; k < NMAXCORES; k += g_nworkers)
+          g_persist_ctxs[k].codec_ = codec;
+    }
+
   for (size_t i = 0; i < assignments.size(); i++) {
     writers.emplace_back(
         &txn_logger::writer,
@@ -125,6 +185,358 @@ txn_logger::Init(
     *assignments_used = assignments;
 }
 
+int
+txn_logger::WorkerNumaNode(unsigned worker)
+{
+  return numa_node_of_cpu(worker % numa_num_configured_cpus());
+}
+
+int
+txn_logger::AssignmentNumaNode(const vector<unsigned> &assignment)
+{
+  INVARIANT(!assignment.empty());
+  const int node = WorkerNumaNode(assignment[0]);
+  for (auto w : assignment)
+    if (WorkerNumaNode(w) != node)
+      return -1;
+  return node;
+}
+
+vector<vector<unsigned>>
+txn_logger::NumaAssignments(unsigned nfds, unsigned nworkers)
+{
+  INVARIANT(nfds > 0);
+
+  // the workers on each node, in order of the node's first worker
+  vector<pair<int, vector<unsigned>>> nodes;
+  for (unsigned w = 0; w < nworkers; w++) {
+    const int node = WorkerNumaNode(w);
+    auto it = find_if(nodes.begin(), nodes.end(),
+        [node](const pair<int, vector<unsigned>> &p) {
+          return p.first == node;
+        });
+    if (it == nodes.end()) {
+      nodes.emplace_back(node, vector<unsigned>());
+      it = nodes.end() - 1;
+    }
+    it->second.push_back(w);
+  }
+
+  vector<vector<unsigned>> assignments;
+  if (nfds < nodes.size()) {
+    // not enough loggers to go around, so logger i takes every nfds-th node
+    assignments.resize(nfds);
+    for (size_t i = 0; i < nodes.size(); i++) {
+      auto &a = assignments[i % nfds];
+      a.insert(a.end(), nodes[i].second.begin(), nodes[i].second.end());
+    }
+    return assignments;
+  }
+
+  // split the loggers evenly over the nodes, and each node's workers evenly
+  // over its loggers
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const vector<unsigned> &ws = nodes[i].second;
+    const size_t nloggers = min(
+        ws.size(), nfds / nodes.size() + (i < nfds % nodes.size()));
+    for (size_t j = 0; j < nloggers; j++)
+      assignments.emplace_back(
+          ws.begin() + j * ws.size() / nloggers,
+          ws.begin() + (j + 1) * ws.size() / nloggers);
+  }
+  return assignments;
+}
+
+void
+txn_logger::EncodePatch(const uint8_t *base, size_t base_len,
+                        const uint8_t *v, size_t vlen,
+                        string &out)
+{
+  // runs closer than this are merged, since a run costs at least two bytes
+  // of gap + len on top of its contents
+  static const size_t MinGap = 4;
+
+  serializer<uint32_t, true> vs_uint32_t;
+  auto append_varint = [&out, &vs_uint32_t](uint32_t x) {
+    uint8_t buf[5];
+    out.append((const char *) buf, vs_uint32_t.write(buf, x) - buf);
+  };
+
+  append_varint(vlen);
+  const size_t common = min(base_len, vlen);
+  size_t prev_end = 0;
+  size_t i = 0;
+  while (i < vlen) {
+    if (i < common && base[i] == v[i]) {
+      i++;
+      continue;
+    }
+    // a run starts at i. it ends at the first MinGap equal bytes (or at
+    // the end of the value, past the base)
+    size_t j = i + 1, nequal = 0;
+    for (; j < vlen && nequal < MinGap; j++)
+      nequal = (j < common && base[j] == v[j]) ? nequal + 1 : 0;
+    const size_t run_end = j - nequal;
+    append_varint(i - prev_end);
+    append_varint(run_end - i);
+    out.append((const char *) v + i, run_end - i);
+    prev_end = run_end;
+    i = j;
+  }
+}
+
+bool
+txn_logger::ApplyPatch(const uint8_t *base, size_t base_len,
+                       const uint8_t *patch, size_t patch_len,
+                       string &out)
+{
+  serializer<uint32_t, true> vs_uint32_t;
+  const uint8_t *p = patch;
+  const uint8_t * const end = patch + patch_len;
+  uint32_t vlen;
+  if (!(p = vs_uint32_t.failsafe_read(p, end - p, &vlen)))
+    return false;
+  out.assign((const char *) base, min(size_t(vlen), base_len));
+  out.resize(vlen);
+  size_t off = 0;
+  while (p < end) {
+    uint32_t gap, len;
+    if (!(p = vs_uint32_t.failsafe_read(p, end - p, &gap)) ||
+        !(p = vs_uint32_t.failsafe_read(p, end - p, &len)) ||
+        size_t(end - p) < len ||
+        off + gap + len > vlen)
+      return false;
+    off += gap;
+    NDB_MEMCPY(&out[off], p, len);
+    p += len;
+    off += len;
+  }
+  return true;
+}
+
+void *
+txn_logger::alloc_local(size_t sz)
+{
+  void * const p =
+    g_pin_loggers_to_numa_nodes ? numa_alloc_local(sz) : malloc(sz);
+  ALWAYS_ASSERT(p);
+  return p;
+}
+
+/**
+ * A segment manifest has a line per live segment, oldest first:
+ *   segment <file> <max epoch>
+ * followed by a line per spare (recyclable) segment file:
+ *   spare <file>
+ */
+bool
+txn_logger::ReadSegmentManifest(
+    const string &logfile, vector<segment_info> &segments)
+{
+  ifstream ifs(SegmentManifestFile(logfile));
+  if (!ifs)
+    return false;
+  segments.clear();
+  string kind;
+  while (ifs >> kind) {
+    if (kind == "segment") {
+      segment_info si;
+      if (!(ifs >> si.fname_ >> si.max_epoch_ >> si.seq_))
+        return false;
+      segments.push_back(si);
+    } else if (kind == "spare") {
+      string fname;
+      if (!(ifs >> fname))
+        return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+txn_logger::NotifyCheckpoint(uint64_t epoch)
+{
+  uint64_t cur = g_checkpoint_epoch.load(memory_order_acquire);
+  while (cur < epoch &&
+         !g_checkpoint_epoch.compare_exchange_weak(
+           cur, epoch, memory_order_acq_rel))
+    ;
+  // a checkpoint's epoch is that of its snapshot, which is behind the tick
+  // the snapshot was taken at: so one w/ an epoch past the tick of the load
+  // was taken after it
+  uint64_t e = g_recovered_load_epoch.load(memory_order_acquire);
+  while (e && epoch >= e &&
+         !g_recovered_load_epoch.compare_exchange_weak(
+           e, 0, memory_order_acq_rel))
+    ;
+}
+
+void
+txn_logger::NoteRecoveredLoad()
+{
+  g_recovered_load_epoch.store(
+      ticker::s_instance.global_current_tick() + 1, memory_order_release);
+}
+
+txn_logger::log_output::log_output(
+    const string &logfile, size_t segment_size, bool direct_io)
+  : logfile_(logfile), segment_size_(segment_size), direct_io_(direct_io),
+    next_segment_id_(0), next_seq_(1), nbytes_(0), fd_(-1)
+{
+  if (!segment_size_) {
+    fd_ = open(logfile_.c_str(),
+               O_CREAT|O_WRONLY|O_TRUNC|(direct_io_ ? O_DIRECT : 0), 0664);
+    if (fd_ == -1) {
+      perror("open");
+      ALWAYS_ASSERT(false);
+    }
+    return;
+  }
+  // like the unsegmented log, start over. the seqs carry on, so that
+  // nothing a previous run left behind passes for a new segment's
+  vector<segment_info> old;
+  if (ReadSegmentManifest(logfile_, old))
+    for (auto &si : old) {
+      unlink(si.fname_.c_str());
+      next_seq_ = max(next_seq_, si.seq_ + 1);
+    }
+  ifstream ifs(SegmentManifestFile(logfile_));
+  string line;
+  while (getline(ifs, line)) {
+    istringstream iss(line);
+    string kind, fname;
+    if (iss >> kind >> fname && kind == "spare")
+      unlink(fname.c_str());
+  }
+  open_segment();
+}
+
+void
+txn_logger::log_output::open_segment()
+{
+  if (fd_ != -1)
+    close(fd_);
+  segment_info si;
+  si.max_epoch_ = 0;
+  si.seq_ = next_seq_++;
+  if (!spares_.empty()) {
+    // reusing the file spares creating (and later removing) one, and
+    // keeping its contents spares allocating its blocks again: the old
+    // buffers left past the new ones have an older seq_
+    si.fname_ = spares_.back();
+    spares_.pop_back();
+    fd_ = open(si.fname_.c_str(), O_WRONLY|(direct_io_ ? O_DIRECT : 0));
+  } else {
+    si.fname_ = logfile_ + "." + to_string(next_segment_id_++);
+    fd_ = open(si.fname_.c_str(),
+               O_CREAT|O_WRONLY|O_TRUNC|(direct_io_ ? O_DIRECT : 0), 0664);
+    // so that appending to it does not need to grow the file
+    if (fd_ != -1 && posix_fallocate(fd_, 0, segment_size_)) {
+      perror("posix_fallocate");
+      ALWAYS_ASSERT(false);
+    }
+  }
+  if (fd_ == -1) {
+    perror("open");
+    ALWAYS_ASSERT(false);
+  }
+  segments_.push_back(si);
+  nbytes_ = 0;
+  // the segment must be listed before anything written to it counts
+  write_manifest();
+}
+
+void
+txn_logger::log_output::write_manifest()
+{
+  ostringstream oss;
+  for (auto &si : segments_)
+    oss << "segment " << si.fname_ << " " << si.max_epoch_
+        << " " << si.seq_ << "\n";
+  for (auto &fname : spares_)
+    oss << "spare " << fname << "\n";
+  const string contents = oss.str();
+  const string fname = SegmentManifestFile(logfile_);
+  const string tmpname = fname + ".tmp";
+  const int fd = open(tmpname.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664);
+  if (fd == -1) {
+    perror("open");
+    ALWAYS_ASSERT(false);
+  }
+  if (write(fd, contents.data(), contents.size()) != ssize_t(contents.size())) {
+    perror("write");
+    ALWAYS_ASSERT(false);
+  }
+  if (g_call_fsync && fdatasync(fd) == -1) {
+    perror("fdatasync");
+    ALWAYS_ASSERT(false);
+  }
+  close(fd);
+  if (rename(tmpname.c_str(), fname.c_str()) == -1) {
+    perror("rename");
+    ALWAYS_ASSERT(false);
+  }
+  if (g_call_fsync) {
+    const size_t slash = fname.rfind('/');
+    const string dir =
+      slash == string::npos ? string(".") : fname.substr(0, slash + 1);
+    const int dfd = open(dir.c_str(), O_RDONLY);
+    if (dfd == -1 || fsync(dfd) == -1) {
+      perror("fsync");
+      ALWAYS_ASSERT(false);
+    }
+    close(dfd);
+  }
+}
+
+void
+txn_logger::log_output::prepare_write(size_t nbytes)
+{
+  if (!segment_size_)
+    return;
+  if (segment_full(nbytes)) {
+    // the current segment is durable, since the writer waits for its
+    // writes before moving on (or durability is not asked for)
+    INVARIANT(segments_.back().max_epoch_);
+    open_segment();
+  }
+  nbytes_ += nbytes;
+}
+
+void
+txn_logger::log_output::finish_write(uint64_t max_epoch)
+{
+  if (!segment_size_)
+    return;
+  segment_info &si = segments_.back();
+  si.max_epoch_ = max(si.max_epoch_, max_epoch);
+}
+
+void
+txn_logger::log_output::truncate(uint64_t epoch)
+{
+  if (!segment_size_)
+    return;
+  size_t n = 0;
+  while (n + 1 < segments_.size() && segments_[n].max_epoch_ <= epoch)
+    n++;
+  if (!n)
+    return;
+  vector<string> dropped;
+  for (size_t i = 0; i < n; i++) {
+    if (spares_.size() < NMaxSpareSegments)
+      spares_.push_back(segments_[i].fname_);
+    else
+      dropped.push_back(segments_[i].fname_);
+  }
+  segments_.erase(segments_.begin(), segments_.begin() + n);
+  write_manifest();
+  for (auto &fname : dropped)
+    unlink(fname.c_str());
+}
+
 void
 txn_logger::persister(
     vector<vector<unsigned>> assignments)
@@ -132,7 +544,7 @@ txn_logger::persister(
   timer loop_timer;
   for (;;) {
     const uint64_t last_loop_usec = loop_timer.lap();
-    const uint64_t delay_time_usec = ticker::tick_us;
+    const uint64_t delay_time_usec = round_delay_us();
     if (last_loop_usec < delay_time_usec) {
       const uint64_t sleep_ns = (delay_time_usec - last_loop_usec) * 1000;
       struct timespec t;
@@ -165,25 +577,37 @@ txn_logger::advance_system_sync_epoch(
         // core->logger queue is empty, then that means we can advance its sync
         // epoch up to best_tick_inc, b/c it is guaranteed that the next time
         // it does any actions will be in epoch > best_tick_inc
+        //
+        // the ticker lock is only held to see that the thread is idle: any
+        // txn it starts after that is in an epoch > best_tick_inc, so the
+        // flush below (which may compress) need not keep it (or the ticker)
+        // waiting
         if (!ctx.persist_buffers_.peek()) {
           spinlock &l = ticker::s_instance.lock_for(k);
+          bool did_lock = false;
           if (!l.is_locked()) {
-            bool did_lock = false;
             for (size_t c = 0; c < 3; c++) {
               if (l.try_lock()) {
                 did_lock = true;
                 break;
               }
             }
-            if (did_lock) {
-              if (!ctx.persist_buffers_.peek()) {
-                min_so_far = min(min_so_far, best_tick_inc);
-                per_thread_sync_epochs_[i].epochs_[k].store(
-                    best_tick_inc, memory_order_release);
-                l.unlock();
-                continue;
-              }
+            if (did_lock)
               l.unlock();
+          }
+          // an idle thread may still hold txns it never pushed, since it
+          // only does so once a buffer fills up or the epoch changes. these
+          // must be written before its epoch can advance. if the thread is
+          // busy w/ its buffers again, it pushes them itself
+          if (did_lock && ctx.flush_lock_.try_lock()) {
+            if (transaction_proto2_static::flush_log_buffers(k))
+              ++g_evt_log_buffer_idle_flush;
+            ctx.flush_lock_.unlock();
+            if (!ctx.persist_buffers_.peek()) {
+              min_so_far = min(min_so_far, best_tick_inc);
+              per_thread_sync_epochs_[i].epochs_[k].store(
+                  best_tick_inc, memory_order_release);
+              continue;
             }
           }
         }
@@ -218,16 +642,44 @@ txn_logger::advance_system_sync_epoch(
   }
 
   system_sync_epoch_->store(min_so_far, memory_order_release);
+
+  // the loggers have already synced everything up to min_so_far, so it is
+  // safe to let recovery see it
+  if (g_pepoch_fd != -1 && min_so_far != syssync) {
+    if (unlikely(pwrite(g_pepoch_fd, &min_so_far,
+                        sizeof(min_so_far), 0) != sizeof(min_so_far))) {
+      perror("pwrite");
+      ALWAYS_ASSERT(false);
+    }
+    if (g_call_fsync && unlikely(fdatasync(g_pepoch_fd) == -1)) {
+      perror("fdatasync");
+      ALWAYS_ASSERT(false);
+    }
+  }
+}
+
+// stamps the headers of the first n buffers in iovs w/ the seq_ of the
+// segment they are about to be written to (see logbuf_header)
+static inline void
+stamp_seqs(vector<iovec> &iovs, size_t n, uint32_t seq)
+{
+  for (size_t i = 0; i < n; i++)
+    reinterpret_cast<txn_logger::logbuf_header *>(
+        iovs[i].iov_base)->seq_ = seq;
 }
 
 void
 txn_logger::writer(
-    unsigned id, int fd,
+    unsigned id, log_output *out,
     vector<unsigned> assignment)
 {
 
   if (g_pin_loggers_to_numa_nodes) {
-    ALWAYS_ASSERT(!numa_run_on_node(id % numa_num_configured_nodes()));
+    // run next to our workers (or the first one's, if they span nodes)
+    int node = AssignmentNumaNode(assignment);
+    if (node == -1)
+      node = WorkerNumaNode(assignment[0]);
+    ALWAYS_ASSERT(!numa_run_on_node(node));
     ALWAYS_ASSERT(!sched_yield());
   }
 
@@ -236,6 +688,56 @@ txn_logger::writer(
   vector<pbuffer *> pxs;
   timer loop_timer;
 
+  // w/ direct IO, the log buffers are copied into the aio_writer's aligned
+  // buffers, but a core's buffers are only returned (and its epoch prefix
+  // only published) once the write holding them completes. the buffers
+  // staying queued until then is also what keeps the persister from taking
+  // the core for idle (see advance_system_sync_epoch())
+  struct core_write {
+    unsigned core_;
+    unsigned nbufs_;
+    uint64_t epoch_prefix_;
+  };
+  struct direct_write {
+    uint64_t max_epoch_;
+    vector<core_write> cores_;
+  };
+  unique_ptr<aio_writer> aio;
+  deque<direct_write> inflight;
+  vector<uint64_t> completed;
+  uint64_t nsubmitted = 0;
+  if (g_direct_io) {
+    static_assert(g_direct_io_alignment == aio_writer::Alignment,
+                  "direct IO alignment mismatch");
+    aio.reset(new aio_writer(
+          g_direct_io_depth, g_direct_io_write_size, g_call_fsync));
+    aio->set_file(out->fd(), 0);
+  }
+
+  epoch_array &ea = per_thread_sync_epochs_[id];
+  auto finish_direct_writes = [&]() {
+    for (auto cookie : completed) {
+      INVARIANT(!inflight.empty());
+      direct_write &w = inflight.front();
+      INVARIANT(cookie == nsubmitted - inflight.size());
+      for (auto &cw : w.cores_) {
+        if (cw.epoch_prefix_ > ea.epochs_[cw.core_].load(memory_order_acquire))
+          ea.epochs_[cw.core_].store(cw.epoch_prefix_, memory_order_release);
+        persist_ctx &ctx = persist_ctx_for(cw.core_, INITMODE_NONE);
+        for (size_t i = 0; i < cw.nbufs_; i++) {
+          pbuffer * const px = ctx.persist_buffers_.deq();
+          INVARIANT(px->io_scheduled_);
+          INVARIANT(px->core_id_ == cw.core_);
+          px->reset();
+          ctx.all_buffers_.enq(px);
+        }
+      }
+      out->finish_write(w.max_epoch_);
+      inflight.pop_front();
+    }
+    completed.clear();
+  };
+
   // XXX: sense is not useful for now, unless we want to
   // fsync in the background...
   bool sense = false; // cur is at sense, prev is at !sense
@@ -247,18 +749,40 @@ txn_logger::writer(
   // NOTE: a core id in the persistence system really represets
   // all cores in the regular system modulo g_nworkers
   size_t nbufswritten = 0, nbyteswritten = 0;
+  uint64_t max_epoch_written = 0, last_truncate_epoch = 0;
+  bool batch_full = false;
   for (;;) {
 
     const uint64_t last_loop_usec = loop_timer.lap();
-    const uint64_t delay_time_usec = ticker::tick_us;
-    // don't allow this loop to proceed less than an epoch's worth of time,
-    // so we can batch IO
-    if (last_loop_usec < delay_time_usec && nbufswritten < iovs.size()) {
-      const uint64_t sleep_ns = (delay_time_usec - last_loop_usec) * 1000;
-      struct timespec t;
-      t.tv_sec  = sleep_ns / ONE_SECOND_NS;
-      t.tv_nsec = sleep_ns % ONE_SECOND_NS;
-      nanosleep(&t, nullptr);
+    const uint64_t delay_time_usec = round_delay_us();
+    // don't allow this loop to proceed less than an epoch's worth of time
+    // (a deadline's in low latency mode), so we can batch IO
+    if (last_loop_usec < delay_time_usec &&
+        nbufswritten < iovs.size() && !batch_full) {
+      uint64_t sleep_us = delay_time_usec - last_loop_usec;
+      if (aio) {
+        // spend the time waiting for the writes in flight instead, so
+        // they count as soon as they complete
+        timer wait_timer;
+        uint64_t waited_us = 0;
+        while (aio->ninflight() && waited_us < sleep_us) {
+          aio->reap(completed, sleep_us - waited_us);
+          finish_direct_writes();
+          waited_us += wait_timer.lap();
+        }
+        sleep_us -= min(sleep_us, waited_us);
+      }
+      if (sleep_us) {
+        const uint64_t sleep_ns = sleep_us * 1000;
+        struct timespec t;
+        t.tv_sec  = sleep_ns / ONE_SECOND_NS;
+        t.tv_nsec = sleep_ns % ONE_SECOND_NS;
+        nanosleep(&t, nullptr);
+      }
+    }
+    if (aio) {
+      aio->reap(completed);
+      finish_direct_writes();
     }
 
     // we need g_persist_stats[cur_sync_epoch_ex % g_nmax_loggers]
@@ -267,7 +791,9 @@ txn_logger::writer(
     // (cur_sync_epoch_ex + g_max_lag_epochs)
     const uint64_t cur_sync_epoch_ex =
       system_sync_epoch_->load(memory_order_acquire) + 1;
-    nbufswritten = nbyteswritten = 0;
+    nbufswritten = nbyteswritten = max_epoch_written = 0;
+    batch_full = false;
+    vector<core_write> cores_written;
     for (auto idx : assignment) {
       INVARIANT(idx >= 0 && idx < g_nworkers);
       for (size_t k = idx; k < NMAXCORES; k += g_nworkers) {
@@ -275,6 +801,9 @@ txn_logger::writer(
         ctx.persist_buffers_.peekall(pxs);
         for (auto px : pxs) {
           INVARIANT(px);
+          if (aio && px->io_scheduled_)
+            // still in flight
+            continue;
           INVARIANT(!px->io_scheduled_);
           INVARIANT(nbufswritten <= iovs.size());
           INVARIANT(px->header()->nentries_);
@@ -298,6 +827,14 @@ txn_logger::writer(
 
           const size_t pxlen = PXLEN(px);
 
+          // leave room for the padding (see logbuf_header)
+          if (aio && nbyteswritten + pxlen + sizeof(logbuf_header) >
+                     aio->buffer_size()) {
+            ++g_evt_logger_writev_limit_met;
+            batch_full = true;
+            goto process;
+          }
+
           iovs[nbufswritten].iov_len = pxlen;
           evt_avg_log_buffer_iov_len.offer(pxlen);
           px->io_scheduled_ = true;
@@ -323,6 +860,13 @@ txn_logger::writer(
           INVARIANT(epoch_prefixes[sense][k] <= px_epoch);
           INVARIANT(px_epoch > 0);
           epoch_prefixes[sense][k] = px_epoch - 1;
+          max_epoch_written = max(max_epoch_written, px_epoch);
+          if (aio) {
+            if (cores_written.empty() || cores_written.back().core_ != k)
+              cores_written.push_back({unsigned(k), 0, 0});
+            cores_written.back().nbufs_++;
+            cores_written.back().epoch_prefix_ = px_epoch - 1;
+          }
           auto &pes = g_persist_stats[k].d_[px_epoch % g_max_lag_epochs];
           if (!pes.ntxns_.load(memory_order_acquire))
             pes.earliest_start_us_.store(px->earliest_start_us_, memory_order_release);
@@ -341,23 +885,63 @@ txn_logger::writer(
 
     const bool dosense = sense;
 
+    if (aio) {
+      const size_t nbytespadded =
+        (nbyteswritten % g_direct_io_alignment) ?
+          slow_round_up(nbyteswritten + sizeof(logbuf_header),
+                        g_direct_io_alignment) :
+          nbyteswritten;
+      if (out->segment_full(nbytespadded)) {
+        aio->drain(completed);
+        finish_direct_writes();
+        out->prepare_write(nbytespadded);
+        aio->set_file(out->fd(), 0);
+      } else {
+        out->prepare_write(nbytespadded);
+      }
+      stamp_seqs(iovs, nbufswritten, out->seq());
+      if (aio->ninflight() == aio->depth()) {
+        aio->reap(completed, -1);
+        finish_direct_writes();
+      }
+      uint8_t *p = aio->next_buffer();
+      for (size_t i = 0; i < nbufswritten; i++) {
+        NDB_MEMCPY(p, iovs[i].iov_base, iovs[i].iov_len);
+        p += iovs[i].iov_len;
+      }
+      if (nbytespadded != nbyteswritten) {
+        const logbuf_header padding = {0, g_padding_tid, 0, 0, out->seq()};
+        NDB_MEMCPY(p, &padding, sizeof(padding));
+        p += sizeof(padding);
+        NDB_MEMSET(p, 0, nbytespadded - nbyteswritten - sizeof(padding));
+      }
+      aio->submit(nbytespadded, nsubmitted++);
+      inflight.push_back({max_epoch_written, move(cores_written)});
+      g_evt_avg_logger_bytes_per_writev.offer(nbyteswritten);
+      sense = !sense;
+      goto truncate;
+    }
+
     if (!g_fake_writes) {
 #ifdef ENABLE_EVENT_COUNTERS
       timer write_timer;
 #endif
-      const ssize_t ret = writev(fd, &iovs[0], nbufswritten);
+      out->prepare_write(nbyteswritten);
+      stamp_seqs(iovs, nbufswritten, out->seq());
+      const ssize_t ret = writev(out->fd(), &iovs[0], nbufswritten);
       if (unlikely(ret == -1)) {
         perror("writev");
         ALWAYS_ASSERT(false);
       }
 
       if (g_call_fsync) {
-        const int fret = fdatasync(fd);
+        const int fret = fdatasync(out->fd());
         if (unlikely(fret == -1)) {
           perror("fdatasync");
           ALWAYS_ASSERT(false);
         }
       }
+      out->finish_write(max_epoch_written);
 
 #ifdef ENABLE_EVENT_COUNTERS
       {
@@ -373,7 +957,6 @@ txn_logger::writer(
     //
     // return all buffers that have been io_scheduled_ - we can do this as
     // soon as write returns. we take care to return to the proper buffer
-    epoch_array &ea = per_thread_sync_epochs_[id];
     for (auto idx: assignment) {
       for (size_t k = idx; k < NMAXCORES; k += g_nworkers) {
         const uint64_t x0 = ea.epochs_[k].load(memory_order_acquire);
@@ -406,6 +989,17 @@ txn_logger::writer(
 
     // bump the sense
     sense = !sense;
+
+  truncate:
+    // segments which a checkpoint covers, and which are durable on all
+    // cores, are no longer needed
+    const uint64_t truncate_epoch =
+      min(g_checkpoint_epoch.load(memory_order_acquire),
+          system_sync_epoch_->load(memory_order_acquire));
+    if (truncate_epoch > last_truncate_epoch) {
+      last_truncate_epoch = truncate_epoch;
+      out->truncate(truncate_epoch);
+    }
   }
 }
 
@@ -514,7 +1108,7 @@ transaction_proto2_static::PurgeThreadOutstandingGCTasks()
       sleep_ro_epoch();
       continue;
     }
-    const uint64_t ro_tick_geq = ro_tick_ex - 1;
+    const uint64_t ro_tick_geq = min(ro_tick_ex - 1, PinnedSnapshotTick());
     if (ro_tick_geq < e) {
       sleep_ro_epoch();
       continue;
@@ -525,6 +1119,29 @@ transaction_proto2_static::PurgeThreadOutstandingGCTasks()
   INVARIANT(ctx.queue_.empty());
 }
 
+uint64_t
+transaction_proto2_static::PinSnapshot()
+{
+  INVARIANT(rcu::s_instance.in_rcu_region());
+  // computed the same way as for a read-only txn. while we are in the RCU
+  // region the global last tick can move ahead by at most one, so no GC has
+  // cleaned (nor will clean, see on_post_rcu_region_completion()) past the
+  // read only tick of this snapshot
+  const uint64_t last_tick_ex = ticker::s_instance.global_last_tick_exclusive();
+  const uint64_t ro_tick_ex = to_read_only_tick(last_tick_ex);
+  uint64_t exp = NoPinnedSnapshot;
+  ALWAYS_ASSERT(g_flags->g_pinned_ro_tick.compare_exchange_strong(
+        exp, ro_tick_ex ? ro_tick_ex - 1 : 0, memory_order_acq_rel));
+  return ComputeReadOnlyTid(last_tick_ex);
+}
+
+void
+transaction_proto2_static::UnpinSnapshot()
+{
+  INVARIANT(PinnedSnapshotTick() != NoPinnedSnapshot);
+  g_flags->g_pinned_ro_tick.store(NoPinnedSnapshot, memory_order_release);
+}
+
 //#ifdef CHECK_INVARIANTS
 //// make sure hidden is blocked by version e, when traversing from start
 //static bool
@@ -562,6 +1179,20 @@ transaction_proto2_static::clean_up_to_including(threadctx &ctx, uint64_t ro_tic
 #endif
   ctx.last_reaped_epoch_ = ro_tick_geq;
 
+  ctx.scratch_.empty_accept_from(ctx.queue_, ro_tick_geq);
+  ctx.scratch_.transfer_freelist(ctx.queue_);
+  px_queue &q = ctx.scratch_;
+  if (q.empty())
+    return;
+  reap_queue(ctx, q, ro_tick_geq, 128);
+}
+
+void
+transaction_proto2_static::reap_queue(
+    threadctx &ctx, px_queue &q, uint64_t ro_tick_geq,
+    size_t max_niters_with_rcu)
+{
+  INVARIANT(!rcu::s_instance.in_rcu_region());
 #ifdef CHECK_INVARIANTS
   const uint64_t last_tick_ex = ticker::s_instance.global_last_tick_exclusive();
   INVARIANT(last_tick_ex);
@@ -573,7 +1204,6 @@ transaction_proto2_static::clean_up_to_including(threadctx &ctx, uint64_t ro_tic
 
   // XXX: hacky
   char rcu_guard[sizeof(scoped_rcu_base<false>)] = {0};
-  const size_t max_niters_with_rcu = 128;
 #define ENTER_RCU() \
     do { \
       new (&rcu_guard[0]) scoped_rcu_base<false>(); \
@@ -584,11 +1214,6 @@ transaction_proto2_static::clean_up_to_including(threadctx &ctx, uint64_t ro_tic
       px->~scoped_rcu_base<false>(); \
     } while (0)
 
-  ctx.scratch_.empty_accept_from(ctx.queue_, ro_tick_geq);
-  ctx.scratch_.transfer_freelist(ctx.queue_);
-  px_queue &q = ctx.scratch_;
-  if (q.empty())
-    return;
   bool in_rcu = false;
   size_t niters_with_rcu = 0, n = 0;
   for (auto it = q.begin(); it != q.end(); ++it, ++n, ++niters_with_rcu) {
@@ -610,6 +1235,8 @@ transaction_proto2_static::clean_up_to_including(threadctx &ctx, uint64_t ro_tic
       INVARIANT(delent.trigger_tid_ <= last_consistent_tid);
       delent.tuple()->opaque.store(0, std::memory_order_release);
 #endif
+      ctx.nreclaimed_++;
+      ctx.nbytes_reclaimed_ += sizeof(dbtuple) + delent.tuple()->alloc_size;
       dbtuple::release_no_rcu(delent.tuple());
     } else {
       INVARIANT(!delent.tuple_ahead_);
@@ -642,6 +1269,7 @@ transaction_proto2_static::clean_up_to_including(threadctx &ctx, uint64_t ro_tic
               nullptr),
             my_ro_tick);
         ++g_evt_proto_gc_delete_requeue;
+        ctx.nrequeued_++;
         // reclaim string ptrs
         string *spx = delent.key_.get();
         if (unlikely(spx))
@@ -676,6 +1304,8 @@ transaction_proto2_static::clean_up_to_including(threadctx &ctx, uint64_t ro_tic
       ALWAYS_ASSERT(did_remove);
       INVARIANT(removed == (typename concurrent_btree::value_type) delent.tuple());
       delent.tuple()->clear_latest();
+      ctx.nreclaimed_++;
+      ctx.nbytes_reclaimed_ += sizeof(dbtuple) + delent.tuple()->alloc_size;
       dbtuple::release(delent.tuple()); // rcu free it
     }
 
@@ -693,12 +1323,218 @@ transaction_proto2_static::clean_up_to_including(threadctx &ctx, uint64_t ro_tic
   INVARIANT(!rcu::s_instance.in_rcu_region());
 }
 
+void
+transaction_proto2_static::hand_off_up_to_including(
+    threadctx &ctx, uint64_t ro_tick_geq)
+{
+  INVARIANT(!rcu::s_instance.in_rcu_region());
+  INVARIANT(ctx.last_reaped_epoch_ <= ro_tick_geq);
+  if (ctx.last_reaped_epoch_ == ro_tick_geq)
+    return;
+  if (ctx.queue_.empty()) {
+    ctx.last_reaped_epoch_ = ro_tick_geq;
+    return;
+  }
+  if (unlikely(!ctx.handoff_registered_)) {
+    g_gc_cores[coreid::core_id()].store(&ctx, memory_order_release);
+    ctx.handoff_registered_ = true;
+  }
+  {
+    ::lock_guard<spinlock> l(&ctx.handoff_lock_);
+    // StopGCThreads() can run between our caller's IsGCAsync() and here,
+    // after which nothing handed over gets reclaimed
+    if (likely(IsGCAsync())) {
+      ctx.last_reaped_epoch_ = ro_tick_geq;
+      ctx.handoff_depth_ += ctx.handoff_.accept_from(ctx.queue_, ro_tick_geq);
+      // take back the groups the GC thread is done with
+      ctx.handoff_.transfer_freelist(ctx.queue_);
+      return;
+    }
+  }
+  clean_up_to_including(ctx, ro_tick_geq);
+}
+
+void
+transaction_proto2_static::StartGCThreads()
+{
+  ALWAYS_ASSERT(!IsGCAsync());
+  INVARIANT(g_gc_threads.empty());
+  if (numa_available() == -1) {
+    g_gc_threads.push_back(new gc_thread(-1));
+  } else {
+    // the nodes w/ cpus
+    vector<bool> has_cpus(numa_max_node() + 1);
+    for (int cpu = 0; cpu < numa_num_configured_cpus(); cpu++) {
+      const int node = numa_node_of_cpu(cpu);
+      if (node >= 0)
+        has_cpus[node] = true;
+    }
+    for (size_t node = 0; node < has_cpus.size(); node++)
+      if (has_cpus[node])
+        g_gc_threads.push_back(new gc_thread(node));
+  }
+  for (size_t i = 0; i < g_gc_threads.size(); i++)
+    g_gc_threads[i]->thd_ =
+      thread(&transaction_proto2_static::gc_thread_loop, i);
+  g_flags->g_gc_async.store(true, memory_order_release);
+}
+
+void
+transaction_proto2_static::StopGCThreads()
+{
+  ALWAYS_ASSERT(IsGCAsync());
+  g_flags->g_gc_async.store(false, memory_order_release);
+  // wait out the hand-offs which saw the GC as async, so that nothing is
+  // handed over after the GC threads are told to stop
+  for (size_t i = 0; i < NMaxCores; i++) {
+    threadctx * const c = g_gc_cores[i].load(memory_order_acquire);
+    if (!c)
+      continue;
+    c->handoff_lock_.lock();
+    c->handoff_lock_.unlock();
+  }
+  for (auto g : g_gc_threads)
+    g->stop_.store(true, memory_order_release);
+  for (auto g : g_gc_threads) {
+    g->thd_.join();
+    delete g;
+  }
+  g_gc_threads.clear();
+}
+
+void
+transaction_proto2_static::gc_thread_loop(size_t idx)
+{
+  gc_thread &g = *g_gc_threads[idx];
+  if (g.node_ != -1) {
+    // run next to the memory we reclaim, and (if there is an allocator
+    // region for it) free it through the region of one of the node's cpus
+    int cpu = -1;
+    for (int c = 0; c < numa_num_configured_cpus() && cpu == -1; c++)
+      if (numa_node_of_cpu(c) == g.node_)
+        cpu = c;
+    if (cpu != -1 && size_t(cpu) < ::allocator::GetNumRegions()) {
+      rcu::s_instance.pin_current_thread(cpu);
+    } else {
+      ALWAYS_ASSERT(!numa_run_on_node(g.node_));
+      ALWAYS_ASSERT(!sched_yield());
+    }
+  }
+
+  threadctx &ctx = g_threadctxs.my();
+  g.ctx_.store(&ctx, memory_order_release);
+  vector<int> nodes(NMaxCores, -2); // core id => node, -2 if not known yet
+  for (;;) {
+    // read before the pass: once it is set, nothing more is handed over
+    const bool stopping = g.stop_.load(memory_order_acquire);
+    bool did_work = false, drained = false;
+    // computed like in on_post_rcu_region_completion(). the entries handed
+    // over were ready when the cores did so, so they still are
+    const uint64_t last_tick_ex = ticker::s_instance.global_last_tick_exclusive();
+    const uint64_t ro_tick_ex = to_read_only_tick(last_tick_ex - 1);
+    if (likely(ro_tick_ex)) {
+      const uint64_t ro_tick_geq = min(ro_tick_ex - 1, PinnedSnapshotTick());
+      timer t;
+      for (size_t i = 0; i < NMaxCores; i++) {
+        threadctx * const c = g_gc_cores[i].load(memory_order_acquire);
+        if (!c)
+          continue;
+        if (g.node_ != -1) {
+          if (nodes[i] == -2)
+            nodes[i] = txn_logger::WorkerNumaNode(i);
+          if (nodes[i] != g.node_)
+            continue;
+        }
+        size_t depth;
+        {
+          ::lock_guard<spinlock> l(&c->handoff_lock_);
+          depth = c->handoff_depth_;
+          if (depth) {
+            ctx.scratch_.empty_accept_from(
+                c->handoff_, numeric_limits<uint64_t>::max());
+            c->handoff_depth_ = 0;
+          }
+          // give back the groups of the batches reaped so far
+          ctx.scratch_.transfer_freelist(c->handoff_);
+        }
+        if (!depth)
+          continue;
+        reap_queue(ctx, ctx.scratch_, ro_tick_geq, GCBatchSize);
+        g.nbatches_++;
+        g.max_queue_depth_ = max(g.max_queue_depth_, uint64_t(depth));
+        did_work = true;
+      }
+      // the deletes reap_queue() put off
+      clean_up_to_including(ctx, ro_tick_geq);
+      g.gc_usec_ += t.lap();
+      drained = !did_work && ctx.queue_.empty();
+    }
+    // the cores' key strings (see on_logical_delete()) are not reused here
+    for (auto spx : ctx.pool_)
+      delete spx;
+    ctx.pool_.clear();
+    // reclaim what reap_queue() freed w/ RCU
+    rcu::s_instance.do_cleanup();
+    if (stopping && drained)
+      return;
+    if (!did_work) {
+      const uint64_t sleep_ns = ticker::tick_us * 1000;
+      struct timespec ts;
+      ts.tv_sec  = sleep_ns / ONE_SECOND_NS;
+      ts.tv_nsec = sleep_ns % ONE_SECOND_NS;
+      nanosleep(&ts, nullptr);
+    }
+  }
+}
+
+void
+transaction_proto2_static::GetGCStats(vector<gc_stats> &stats)
+{
+  stats.assign(g_gc_threads.size(), gc_stats());
+  for (size_t i = 0; i < g_gc_threads.size(); i++) {
+    const gc_thread &g = *g_gc_threads[i];
+    gc_stats &s = stats[i];
+    s.node_ = g.node_;
+    s.nbatches_ = g.nbatches_;
+    s.max_queue_depth_ = g.max_queue_depth_;
+    s.gc_usec_ = g.gc_usec_;
+    if (const threadctx *ctx = g.ctx_.load(memory_order_acquire)) {
+      s.nreclaimed_ = ctx->nreclaimed_;
+      s.nbytes_reclaimed_ = ctx->nbytes_reclaimed_;
+      s.nrequeued_ = ctx->nrequeued_;
+    }
+    for (size_t c = 0; c < NMaxCores; c++) {
+      const threadctx * const ctx = g_gc_cores[c].load(memory_order_acquire);
+      if (ctx && (g.node_ == -1 || txn_logger::WorkerNumaNode(c) == g.node_))
+        s.queue_depth_ += ctx->handoff_depth_;
+    }
+  }
+}
+
+ostream &
+operator<<(ostream &o, const transaction_proto2_static::gc_stats &s)
+{
+  o << "gc node " << s.node_
+    << " batches " << s.nbatches_
+    << " reclaimed " << s.nreclaimed_
+    << " bytes " << s.nbytes_reclaimed_
+    << " requeued " << s.nrequeued_
+    << " queue_depth " << s.queue_depth_
+    << " max_queue_depth " << s.max_queue_depth_
+    << " gc_us " << s.gc_usec_;
+  return o;
+}
+
 aligned_padded_elem<transaction_proto2_static::hackstruct>
   transaction_proto2_static::g_hack;
 aligned_padded_elem<transaction_proto2_static::flags>
   transaction_proto2_static::g_flags;
 percore_lazy<transaction_proto2_static::threadctx>
   transaction_proto2_static::g_threadctxs;
+vector<transaction_proto2_static::gc_thread *>
+  transaction_proto2_static::g_gc_threads;
+atomic<transaction_proto2_static::threadctx *>
+  transaction_proto2_static::g_gc_cores[NMaxCores];
 event_counter
   transaction_proto2_static::g_evt_worker_thread_wait_log_buffer(
       "worker_thread_wait_log_buffer");
@@ -711,6 +1547,9 @@ event_counter
 event_avg_counter
   transaction_proto2_static::g_evt_avg_log_entry_size(
       "avg_log_entry_size");
+event_counter
+  transaction_proto2_static::g_evt_op_log_patches(
+      "op_log_patches");
 event_avg_counter
   transaction_proto2_static::g_evt_avg_proto_gc_queue_len(
       "avg_proto_gc_queue_len");
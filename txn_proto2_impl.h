@@ -5,14 +5,15 @@
 #include <atomic>
 #include <vector>
 #include <set>
-
-#include <lz4.h>
+#include <limits>
+#include <thread>
 
 #include "txn.h"
 #include "txn_impl.h"
 #include "txn_btree.h"
 #include "macros.h"
 #include "circbuf.h"
+#include "log_codec.h"
 #include "spinbarrier.h"
 #include "record/serializer.h"
 
@@ -23,6 +24,7 @@ template <template <typename> class Transaction>
 
 // the system has a single logging subsystem (composed of multiple lgogers)
 // NOTE: currently, the persistence epoch is tied 1:1 with the ticker's epoch
+// (but see the flush_deadline_us arg to Init())
 class txn_logger {
   friend class transaction_proto2_static;
   template <typename T>
@@ -37,7 +39,9 @@ public:
   static const size_t g_buffer_size = (1<<20); // in bytes
   static const size_t g_horizon_buffer_size = 2 * (1<<16); // in bytes
   static const size_t g_max_lag_epochs = 128; // cannot lag more than 128 epochs
-  static const bool   g_pin_loggers_to_numa_nodes = false;
+  static const size_t g_direct_io_depth = 4; // writes in flight per logger
+  static const size_t g_direct_io_write_size = (1<<23); // in bytes, at most
+  static const size_t g_direct_io_alignment = 4096; // in bytes
 
   static inline bool
   IsPersistenceEnabled()
@@ -51,10 +55,53 @@ public:
     return g_use_compression;
   }
 
+  static inline bool
+  IsOpLoggingEnabled()
+  {
+    return g_op_logging;
+  }
+
   // init the logging subsystem.
   //
   // should only be called ONCE is not thread-safe.  if assignments_used is not
-  // null, then fills it with a copy of the assignment actually computed
+  // null, then fills it with a copy of the assignment actually computed.
+  //
+  // if segment_size is not 0, logger i writes a series of segment files
+  // instead of logfiles[i], moving on to the next one once a segment holds
+  // segment_size bytes (see SegmentManifestFile())
+  //
+  // if flush_deadline_us is not 0, the logging subsystem runs in low latency
+  // (group commit) mode: instead of batching IO an epoch at a time, a core
+  // hands its log buffer to its logger once the buffer's oldest txn is
+  // flush_deadline_us old, and the loggers and the persistent epoch (see
+  // PersistedEpoch()) advance every flush_deadline_us. a txn still cannot
+  // be durable before its epoch ends, but it then becomes durable within a
+  // couple of deadlines, instead of a couple of epochs
+  //
+  // if direct_io is set, the loggers bypass the page cache: the log files are
+  // opened w/ O_DIRECT, and each logger keeps up to g_direct_io_depth async
+  // writes (which are durable once they complete, if call_fsync) in flight,
+  // instead of doing a writev() and an fdatasync() per round. writes are
+  // padded to g_direct_io_alignment (see logbuf_header)
+  //
+  // if use_compression is set, logger i's cores compress their txns w/
+  // codecs[i] (codecs[0] for all loggers if there is only one, LZ4 if
+  // there is none)
+  //
+  // if numa_aware is set (and the machine has NUMA support), each logger
+  // runs on the node of its workers, assignments (if not given) are computed
+  // by NumaAssignments(), and each core allocates its log buffers on its own
+  // node. worker i is assumed to run on cpu i (see rcu::pin_current_thread())
+  //
+  // if op_logging is set, an overwrite is logged as a patch against the
+  // value it replaced (see EncodePatch()) when that is smaller than the new
+  // value, and writes a txn superseded itself are not logged. replaying a
+  // patch needs the version before it, so the log (or a checkpoint) must
+  // hold every key's writes since the key was loaded
+  //
+  // Init() truncates the log files, so it refuses to run (and aborts) while
+  // records loaded from them by txn_log_recovery are not yet in a
+  // checkpoint, see NoteRecoveredLoad()
   static void Init(
       size_t nworkers,
       const std::vector<std::string> &logfiles,
@@ -62,13 +109,120 @@ public:
       std::vector<std::vector<unsigned>> *assignments_used = nullptr,
       bool call_fsync = true,
       bool use_compression = false,
-      bool fake_writes = false);
+      bool fake_writes = false,
+      size_t segment_size = 0,
+      uint64_t flush_deadline_us = 0,
+      bool direct_io = false,
+      const std::vector<log_codec *> &codecs = {},
+      bool numa_aware = false,
+      bool op_logging = false);
+
+  // the logging subsystem keeps the system's persistent epoch (see
+  // system_sync_epoch_) in a small file next to the first log file, so
+  // recovery knows how far it may replay (see txn_log_recovery)
+  static inline std::string
+  PersistedEpochFile(const std::string &first_logfile)
+  {
+    return first_logfile + ".pepoch";
+  }
+
+  // a segment of a segmented log, see Init()
+  struct segment_info {
+    std::string fname_;
+    uint64_t max_epoch_; // of its log buffers, 0 for the one being written
+    uint32_t seq_; // stamped on its log buffers, see logbuf_header
+  };
 
+  // the live segments of logfile, oldest first, are listed in this file.
+  // segments are preallocated (so they can end w/ zeroes), and the files of
+  // the ones no longer needed are recycled as they are, keeping their
+  // blocks. so a segment can end w/ the buffers of the one its file held
+  // before, which recovery tells apart by their seq_
+  static inline std::string
+  SegmentManifestFile(const std::string &logfile)
+  {
+    return logfile + ".segments";
+  }
+
+  // returns false if logfile is not segmented
+  static bool
+  ReadSegmentManifest(const std::string &logfile,
+                      std::vector<segment_info> &segments);
+
+  // every txn in an epoch <= PersistedEpoch() is durable, so a txn can be
+  // acknowledged once IsDurable(its commit TID). there is deliberately no
+  // finer (per core TID) watermark: recovery only replays whole epochs, so
+  // a txn in a later epoch is not recoverable even once its buffer is on
+  // disk
+  static inline uint64_t
+  PersistedEpoch()
+  {
+    return system_sync_epoch_->load(std::memory_order_acquire);
+  }
+
+  static inline bool IsDurable(uint64_t commit_tid);
+
+  // lets the loggers drop the segments which only hold txns in epochs <=
+  // epoch, since a durable checkpoint covers them (see txn_checkpointer)
+  static void NotifyCheckpoint(uint64_t epoch);
+
+  // txn_log_recovery::load() calls this once it has loaded records from the
+  // log: they are only durable there, so Init() refuses to truncate the log
+  // until a checkpoint taken after the load (ie one NotifyCheckpoint() gets
+  // a later epoch for) holds them
+  static void NoteRecoveredLoad();
+
+  // each log buffer on disk is a logbuf_header followed by its txns. each
+  // txn is written as:
+  //   [commit tid (u64) | nwrites (varint)] and then per write
+  //   [table id (u32) | key len (varint) | key | value len (varint) | value]
+  // where the table id is the written tree's (see
+  // base_txn_btree::TableId()), and a 0 length value means the key was
+  // removed. if the header's ops_
+  // is set (see Init()'s op_logging), a write_kind (u8) precedes each value
+  // len, and the value of a WRITE_PATCH is a patch (see EncodePatch()) to
+  // apply to the key's previous version. with compression,
+  // the txns are instead grouped into [compressed len (u32) | block]
+  // chunks, each holding whole txns and compressed w/ the buffer's codec_.
+  // all txns in a buffer come from the same core and epoch
+  //
+  // w/ direct IO, a write which does not end on a g_direct_io_alignment
+  // boundary is padded w/ a header whose last_tid_ is g_padding_tid (and
+  // nentries_ is 0), followed by zeroes up to the next boundary (counting
+  // from the start of the file) after that header
+  //
+  // in a segmented log, the logger stamps each header (padding included)
+  // w/ the seq_ of the segment it is written to, right before the write
   struct logbuf_header {
     uint64_t nentries_; // > 0 for all valid log buffers
     uint64_t last_tid_; // TID of the last commit
+    uint8_t codec_;     // log_codec::id() of the chunks, 0 if not compressed
+    uint8_t ops_;       // 1 if the writes carry a write_kind
+    uint32_t seq_;      // segment_info::seq_, 0 if the log is not segmented
   } PACKED;
 
+  enum write_kind : uint8_t {
+    WRITE_FULL = 0,  // the new value (or a remove)
+    WRITE_PATCH = 1, // a patch against the previous value
+  };
+
+  // appends a patch which turns [base, base + base_len) into
+  // [v, v + vlen) to out, as a series of
+  //   [new len (varint)] [gap (varint) | run len (varint) | run]*
+  // where each run of changed bytes starts gap bytes after the end of the
+  // previous one (or the start of the value). bytes past the base are
+  // always in a run
+  static void EncodePatch(const uint8_t *base, size_t base_len,
+                          const uint8_t *v, size_t vlen,
+                          std::string &out);
+
+  // sets out to base w/ patch applied. returns false if patch is malformed
+  static bool ApplyPatch(const uint8_t *base, size_t base_len,
+                         const uint8_t *patch, size_t patch_len,
+                         std::string &out);
+
+  static const uint64_t g_padding_tid = std::numeric_limits<uint64_t>::max();
+
   struct pbuffer {
     uint64_t earliest_start_us_; // start time of the earliest txn
     bool io_scheduled_; // has the logger scheduled IO yet?
@@ -178,6 +332,18 @@ public:
     return seen.size() == nworkers;
   }
 
+  // the NUMA node worker runs on, see Init()
+  static int WorkerNumaNode(unsigned worker);
+
+  // the node all the workers in assignment run on, -1 if they span nodes
+  static int AssignmentNumaNode(const std::vector<unsigned> &assignment);
+
+  // a valid assignment (see AssignmentsValid()) which spreads the loggers
+  // over the nodes the workers run on, and does not give a logger workers
+  // from more than one node unless there are fewer loggers than nodes
+  static std::vector<std::vector<unsigned>>
+  NumaAssignments(unsigned nfds, unsigned nworkers);
+
   typedef circbuf<pbuffer, g_perthread_buffers> pbuffer_circbuf;
 
   static std::tuple<uint64_t, uint64_t, double>
@@ -212,13 +378,29 @@ private:
   struct persist_ctx {
     bool init_;
 
-    void *lz4ctx_;     // for compression
-    pbuffer *horizon_; // for compression
+    log_codec *codec_;   // for compression
+    void *codec_state_;  // for compression
+    pbuffer *horizon_;   // for compression
+
+    // for op logging: the values overwritten by the txn committing on this
+    // core, each as [len (u32) | value] (len ~0 if there was none), the
+    // txn's encoding, and scratch space for it
+    std::string op_bases_;
+    std::string op_txn_;
+    std::string op_value_;
+    std::string op_patch_;
 
     circbuf<pbuffer, g_perthread_buffers> all_buffers_;     // logger pushes to core
     circbuf<pbuffer, g_perthread_buffers> persist_buffers_; // core pushes to logger
 
-    persist_ctx() : init_(false), lz4ctx_(nullptr), horizon_(nullptr) {}
+    // guards the core's end of the queues (and horizon_), which the
+    // persister flushes when the core is idle (see
+    // transaction_proto2_static::flush_log_buffers())
+    spinlock flush_lock_;
+
+    persist_ctx()
+      : init_(false), codec_(nullptr), codec_state_(nullptr),
+        horizon_(nullptr) {}
   };
 
   // context per one epoch
@@ -255,17 +437,76 @@ private:
   advance_system_sync_epoch(
       const std::vector<std::vector<unsigned>> &assignments);
 
+  // the file(s) a logger writes to: logfiles[i] itself, or its segments
+  class log_output {
+  public:
+    log_output(const std::string &logfile, size_t segment_size,
+               bool direct_io);
+
+    inline int
+    fd() const
+    {
+      return fd_;
+    }
+
+    // the seq_ to stamp the buffers written to fd() w/ (see logbuf_header)
+    inline uint32_t
+    seq() const
+    {
+      return segment_size_ ? segments_.back().seq_ : 0;
+    }
+
+    // would writing nbytes more move on to a new segment? the writes
+    // before must be durable by then
+    inline bool
+    segment_full(size_t nbytes) const
+    {
+      return segment_size_ && nbytes_ && nbytes_ + nbytes > segment_size_;
+    }
+
+    // called before nbytes are written to fd(), may move on to a new
+    // segment (see segment_full())
+    void prepare_write(size_t nbytes);
+
+    // called once a write is durable (in the order they were prepared),
+    // max_epoch being the last epoch of the buffers in it
+    void finish_write(uint64_t max_epoch);
+
+    // drops the closed segments which only hold epochs <= epoch, keeping a
+    // few to recycle
+    void truncate(uint64_t epoch);
+
+  private:
+    void open_segment();
+    void write_manifest();
+
+    static const size_t NMaxSpareSegments = 2;
+
+    const std::string logfile_;
+    const size_t segment_size_; // 0 if not segmented
+    const bool direct_io_;
+    std::vector<segment_info> segments_; // back() is being written
+    std::vector<std::string> spares_;
+    uint64_t next_segment_id_;
+    uint32_t next_seq_;
+    size_t nbytes_; // written to the current segment
+    int fd_;
+  };
+
   // makes copy on purpose
   static void writer(
-      unsigned id, int fd,
+      unsigned id, log_output *out,
       std::vector<unsigned> assignment);
 
   static void persister(
       std::vector<std::vector<unsigned>> assignments);
 
+  // malloc(), but on the caller's NUMA node if g_pin_loggers_to_numa_nodes
+  static void *alloc_local(size_t sz);
+
   enum InitMode {
     INITMODE_NONE, // no initialization
-    INITMODE_REG,  // just use malloc() to init buffers
+    INITMODE_REG,  // just use malloc() (see alloc_local()) to init buffers
     INITMODE_RCU,  // try to use the RCU numa aware allocator
   };
 
@@ -277,15 +518,16 @@ private:
     if (unlikely(!ctx.init_ && imode != INITMODE_NONE)) {
       size_t needed = g_perthread_buffers * (sizeof(pbuffer) + g_buffer_size);
       if (IsCompressionEnabled())
-        needed += size_t(LZ4_create_size()) +
+        needed += ctx.codec_->state_size() +
           sizeof(pbuffer) + g_horizon_buffer_size;
       char *mem =
         (imode == INITMODE_REG) ?
-          (char *) malloc(needed) :
+          (char *) alloc_local(needed) :
           (char *) rcu::s_instance.alloc_static(needed);
       if (IsCompressionEnabled()) {
-        ctx.lz4ctx_ = mem;
-        mem += LZ4_create_size();
+        if (ctx.codec_->state_size())
+          ctx.codec_state_ = mem;
+        mem += ctx.codec_->state_size();
         ctx.horizon_ = new (mem) pbuffer(core_id, g_horizon_buffer_size);
         mem += sizeof(pbuffer) + g_horizon_buffer_size;
       }
@@ -310,6 +552,30 @@ private:
   static bool g_fake_writes; // whether or not to fake doing writes (to measure
                              // pure overhead of disk)
 
+  static int g_pepoch_fd; // PersistedEpochFile(), -1 if not written
+
+  static uint64_t g_flush_deadline_us; // 0 unless in low latency mode
+
+  static bool g_direct_io; // whether or not the loggers use O_DIRECT + aio
+
+  static bool g_pin_loggers_to_numa_nodes; // see Init()'s numa_aware
+
+  static bool g_op_logging; // see Init()'s op_logging
+
+  // how long the loggers and the persister wait between rounds
+  static inline uint64_t
+  round_delay_us()
+  {
+    return g_flush_deadline_us ? g_flush_deadline_us : ticker::tick_us;
+  }
+
+  // the epoch of the last durable checkpoint, see NotifyCheckpoint()
+  static std::atomic<uint64_t> g_checkpoint_epoch;
+
+  // 1 + the tick at the last NoteRecoveredLoad() not yet covered by a
+  // checkpoint, 0 if there is none
+  static std::atomic<uint64_t> g_recovered_load_epoch;
+
   static size_t g_nworkers; // assignments are computed based on g_nworkers
                             // but a logger responsible for core i is really
                             // responsible for cores i + k * g_nworkers, for k
@@ -336,6 +602,8 @@ private:
 
   static event_counter g_evt_log_buffer_epoch_boundary;
   static event_counter g_evt_log_buffer_out_of_space;
+  static event_counter g_evt_log_buffer_deadline;
+  static event_counter g_evt_log_buffer_idle_flush;
   static event_counter g_evt_log_buffer_bytes_before_compress;
   static event_counter g_evt_log_buffer_bytes_after_compress;
   static event_counter g_evt_logger_writev_limit_met;
@@ -355,6 +623,7 @@ operator<<(std::ostream &o, txn_logger::logbuf_header &hdr)
 }
 
 class transaction_proto2_static {
+  friend class txn_logger;
 public:
 
   // NOTE:
@@ -481,6 +750,67 @@ public:
 
   static void PurgeThreadOutstandingGCTasks();
 
+  /**
+   * Moves the GC (the reclaiming of spilled record versions and of logically
+   * deleted records) off the cores, to a pool of threads, one per NUMA node
+   * (one in all w/o NUMA support). Instead of reclaiming its GC queue, a
+   * core then hands the entries which are ready over to the GC thread of
+   * its node (see txn_logger::WorkerNumaNode()), once per read only epoch.
+   * The GC threads run next to the memory they reclaim, and take the queues
+   * over in batches, reclaiming up to GCBatchSize entries per RCU region.
+   *
+   * Cannot be called again before StopGCThreads()
+   */
+  static void StartGCThreads();
+
+  // moves the GC back onto the cores, once the GC threads have reclaimed
+  // everything handed over to them (waiting out a pinned snapshot, if
+  // need be), and joins them. their stats are gone after
+  static void StopGCThreads();
+
+  static const size_t GCBatchSize = 1024;
+
+  static inline bool
+  IsGCAsync()
+  {
+    return g_flags->g_gc_async.load(std::memory_order_acquire);
+  }
+
+  struct gc_stats {
+    int node_;                  // -1 w/o NUMA support
+    uint64_t nbatches_;         // core queues taken over
+    uint64_t nreclaimed_;       // versions and deleted records reclaimed
+    uint64_t nbytes_reclaimed_; // ... the bytes of their dbtuples
+    uint64_t nrequeued_;        // deletes put off to a later epoch
+    uint64_t queue_depth_;      // entries handed over, not reclaimed yet
+    uint64_t max_queue_depth_;  // the most entries taken over at once
+    uint64_t gc_usec_;          // time spent reclaiming
+
+    gc_stats() { NDB_MEMSET(this, 0, sizeof(*this)); }
+  };
+
+  // the stats of each GC thread (none before StartGCThreads()). read w/o
+  // synchronization
+  static void GetGCStats(std::vector<gc_stats> &stats);
+
+  // keeps the GC from reclaiming the record versions which a snapshot read
+  // at the returned TID sees, until UnpinSnapshot(), so that reads at that
+  // TID can span many RCU regions (see txn_checkpointer). only one snapshot
+  // can be pinned at a time. must be called from within an RCU region
+  static uint64_t PinSnapshot();
+
+  static void UnpinSnapshot();
+
+  // the read only tick of the pinned snapshot, NoPinnedSnapshot if none.
+  // the GC does not clean past it
+  static const uint64_t NoPinnedSnapshot = std::numeric_limits<uint64_t>::max();
+
+  static inline uint64_t
+  PinnedSnapshotTick()
+  {
+    return g_flags->g_pinned_ro_tick.load(std::memory_order_acquire);
+  }
+
 #ifdef PROTO2_CAN_DISABLE_GC
   static inline bool
   IsGCEnabled()
@@ -555,12 +885,30 @@ protected:
     px_queue queue_;
     px_queue scratch_;
     std::deque<std::string *> pool_;
+
+    // w/ IsGCAsync(), the entries ready to be reclaimed, handed over to the
+    // GC thread of the core's node
+    spinlock handoff_lock_;
+    px_queue handoff_;
+    size_t handoff_depth_; // # of entries in handoff_
+    bool handoff_registered_;
+
+    // what reap_queue() did w/ this ctx
+    uint64_t nreclaimed_;
+    uint64_t nbytes_reclaimed_;
+    uint64_t nrequeued_;
+
     threadctx() :
         last_commit_tid_(0)
       , last_reaped_epoch_(0)
 #ifdef ENABLE_EVENT_COUNTERS
       , last_reaped_timestamp_us_(0)
 #endif
+      , handoff_depth_(0)
+      , handoff_registered_(false)
+      , nreclaimed_(0)
+      , nbytes_reclaimed_(0)
+      , nrequeued_(0)
     {
       ALWAYS_ASSERT(((uintptr_t)this % CACHELINE_SIZE) == 0);
       queue_.alloc_freelist(rcu::NQueueGroups);
@@ -571,6 +919,19 @@ protected:
   static void
   clean_up_to_including(threadctx &ctx, uint64_t ro_tick_geq);
 
+  // reclaims the entries of q (all of which must be <= ro_tick_geq),
+  // putting the deletes which cannot be done yet back on ctx.queue_. leaves
+  // RCU regions every max_niters_with_rcu entries
+  static void
+  reap_queue(threadctx &ctx, px_queue &q, uint64_t ro_tick_geq,
+             size_t max_niters_with_rcu);
+
+  // the async version of clean_up_to_including(), see StartGCThreads()
+  static void
+  hand_off_up_to_including(threadctx &ctx, uint64_t ro_tick_geq);
+
+  static void gc_thread_loop(size_t idx);
+
   // helper methods
   static inline txn_logger::pbuffer *
   wait_for_head(txn_logger::pbuffer_circbuf &pull_buf)
@@ -594,7 +955,8 @@ protected:
   // (if doing so was necessary)
   static inline size_t
   push_horizon_to_buffer(txn_logger::pbuffer *horizon,
-                         void *lz4ctx,
+                         log_codec *codec,
+                         void *codec_state,
                          txn_logger::pbuffer_circbuf &pull_buf,
                          txn_logger::pbuffer_circbuf &push_buf)
   {
@@ -608,7 +970,7 @@ protected:
     // horizon out of space- try to push horizon to buffer
     txn_logger::pbuffer *px = wait_for_head(pull_buf);
     const uint64_t compressed_space_needed =
-      sizeof(uint32_t) + LZ4_compressBound(horizon->datasize());
+      sizeof(uint32_t) + codec->compress_bound(horizon->datasize());
 
     bool buffer_cond = false;
     if (px->space_remaining() < compressed_space_needed ||
@@ -631,31 +993,34 @@ protected:
       px->earliest_start_us_ = horizon->earliest_start_us_;
     px->header()->nentries_ += horizon->header()->nentries_;
     px->header()->last_tid_  = horizon->header()->last_tid_;
+    px->header()->codec_     = codec->id();
+    px->header()->ops_       = txn_logger::IsOpLoggingEnabled();
 
 #ifdef ENABLE_EVENT_COUNTERS
     util::timer tt;
 #endif
-    const int ret = LZ4_compress_heap_limitedOutput(
-        lz4ctx,
-        (const char *) horizon->datastart(),
-        (char *) px->pointer() + sizeof(uint32_t),
+    const size_t ret = codec->compress(
+        codec_state,
+        horizon->datastart(),
         horizon->datasize(),
+        px->pointer() + sizeof(uint32_t),
         px->space_remaining() - sizeof(uint32_t));
 #ifdef ENABLE_EVENT_COUNTERS
     txn_logger::g_evt_avg_log_buffer_compress_time_us.offer(tt.lap());
     txn_logger::g_evt_log_buffer_bytes_before_compress.inc(horizon->datasize());
     txn_logger::g_evt_log_buffer_bytes_after_compress.inc(ret);
+    codec->evt_bytes_before_compress_.inc(horizon->datasize());
+    codec->evt_bytes_after_compress_.inc(ret);
 #endif
     INVARIANT(ret > 0);
 #if defined(CHECK_INVARIANTS) && defined(PARANOID_CHECKING)
     {
       uint8_t decode_buf[txn_logger::g_horizon_buffer_size];
-      const int decode_ret =
-        LZ4_decompress_safe_partial(
-            (const char *) px->pointer() + sizeof(uint32_t),
-            (char *) &decode_buf[0],
+      const ssize_t decode_ret =
+        codec->decompress(
+            px->pointer() + sizeof(uint32_t),
             ret,
-            txn_logger::g_horizon_buffer_size,
+            &decode_buf[0],
             txn_logger::g_horizon_buffer_size);
       INVARIANT(decode_ret >= 0);
       INVARIANT(size_t(decode_ret) == horizon->datasize());
@@ -672,6 +1037,40 @@ protected:
     return ntxns_pushed_to_logger;
   }
 
+  // hands the txns core_id has logged so far (but not yet pushed) to its
+  // logger. returns false if there were none
+  //
+  // must be called w/ the core's persist_ctx::flush_lock_ held, since the
+  // core's end of its buffer queues is single threaded
+  static inline bool
+  flush_log_buffers(uint64_t core_id)
+  {
+    txn_logger::persist_ctx &ctx =
+      txn_logger::persist_ctx_for(core_id, txn_logger::INITMODE_NONE);
+    if (unlikely(!ctx.init_))
+      return false;
+    txn_logger::persist_stats &stats = txn_logger::g_persist_stats[core_id];
+    txn_logger::pbuffer_circbuf &pull_buf = ctx.all_buffers_;
+    txn_logger::pbuffer_circbuf &push_buf = ctx.persist_buffers_;
+    if (txn_logger::IsCompressionEnabled() &&
+        ctx.horizon_->header()->nentries_) {
+      INVARIANT(ctx.horizon_->datasize());
+      const uint64_t npushed =
+        push_horizon_to_buffer(
+            ctx.horizon_, ctx.codec_, ctx.codec_state_, pull_buf, push_buf);
+      if (npushed)
+        util::non_atomic_fetch_add(stats.ntxns_pushed_, npushed);
+    }
+    txn_logger::pbuffer *px = pull_buf.peek();
+    if (!px || !px->header()->nentries_)
+      return false;
+    txn_logger::pbuffer *px0 = pull_buf.deq();
+    util::non_atomic_fetch_add(stats.ntxns_pushed_, px0->header()->nentries_);
+    INVARIANT(px0 == px);
+    push_buf.enq(px0);
+    return true;
+  }
+
   struct hackstruct {
     std::atomic<bool> status_;
     std::atomic<uint64_t> global_tid_;
@@ -684,20 +1083,51 @@ protected:
 
   struct flags {
     std::atomic<bool> g_gc_init;
+    std::atomic<bool> g_gc_async;
     std::atomic<bool> g_disable_snapshots;
-    constexpr flags() : g_gc_init(false), g_disable_snapshots(false) {}
+    std::atomic<uint64_t> g_pinned_ro_tick;
+    constexpr flags()
+      : g_gc_init(false), g_gc_async(false), g_disable_snapshots(false),
+        g_pinned_ro_tick(NoPinnedSnapshot) {}
   };
   static util::aligned_padded_elem<flags> g_flags;
 
   static percore_lazy<threadctx> g_threadctxs;
 
+  // see StartGCThreads()
+  struct gc_thread {
+    int node_;
+    std::atomic<threadctx *> ctx_; // the thread's own, once it runs
+    std::atomic<bool> stop_; // see StopGCThreads()
+    std::thread thd_;
+    uint64_t nbatches_;
+    uint64_t max_queue_depth_;
+    uint64_t gc_usec_;
+    gc_thread(int node)
+      : node_(node), ctx_(nullptr), stop_(false),
+        nbatches_(0), max_queue_depth_(0), gc_usec_(0) {}
+  };
+  static std::vector<gc_thread *> g_gc_threads;
+  // the cores which have handed entries over, by core id
+  static std::atomic<threadctx *> g_gc_cores[NMaxCores];
+
   static event_counter g_evt_worker_thread_wait_log_buffer;
   static event_counter g_evt_dbtuple_no_space_for_delkey;
   static event_counter g_evt_proto_gc_delete_requeue;
   static event_avg_counter g_evt_avg_log_entry_size;
+  static event_counter g_evt_op_log_patches;
   static event_avg_counter g_evt_avg_proto_gc_queue_len;
 };
 
+std::ostream &operator<<(
+    std::ostream &o, const transaction_proto2_static::gc_stats &s);
+
+bool
+txn_logger::IsDurable(uint64_t commit_tid)
+{
+  return transaction_proto2_static::EpochId(commit_tid) <= PersistedEpoch();
+}
+
 bool
 txn_logger::pbuffer::can_hold_tid(uint64_t tid) const
 {
@@ -784,49 +1214,20 @@ public:
       return;
     // need to write into log buffer
 
-    serializer<uint32_t, true> vs_uint32_t;
-
-    // compute how much space is necessary
-    uint64_t space_needed = 0;
-
-    // 8 bytes to indicate TID
-    space_needed += sizeof(uint64_t);
-
-    // variable bytes to indicate # of records written
-#ifdef LOGGER_UNSAFE_FAKE_COMPRESSION
-    const unsigned nwrites = 0;
-#else
-    const unsigned nwrites = this->write_set.size();
-#endif
+    const unsigned long my_core_id = coreid::core_id();
 
-    space_needed += vs_uint32_t.nbytes(&nwrites);
+    txn_logger::persist_ctx &ctx =
+      txn_logger::persist_ctx_for(my_core_id, txn_logger::INITMODE_REG);
 
-    // each record needs to be recorded
+    // compute how much space is necessary
     write_set_u32_vec value_sizes;
-    for (unsigned idx = 0; idx < nwrites; idx++) {
-      const transaction_base::write_record_t &rec = this->write_set[idx];
-      const uint32_t k_nbytes = rec.get_key().size();
-      space_needed += vs_uint32_t.nbytes(&k_nbytes);
-      space_needed += k_nbytes;
-
-      const uint32_t v_nbytes = rec.get_value() ?
-          rec.get_writer()(
-              dbtuple::TUPLE_WRITER_COMPUTE_DELTA_NEEDED,
-              rec.get_value(), nullptr, 0) : 0;
-      space_needed += vs_uint32_t.nbytes(&v_nbytes);
-      space_needed += v_nbytes;
-
-      value_sizes.push_back(v_nbytes);
-    }
+    const uint64_t space_needed = txn_logger::IsOpLoggingEnabled() ?
+      encode_op_txn(ctx, commit_tid) : compute_space_needed(value_sizes);
 
     g_evt_avg_log_entry_size.offer(space_needed);
     INVARIANT(space_needed <= txn_logger::g_horizon_buffer_size);
     INVARIANT(space_needed <= txn_logger::g_buffer_size);
 
-    const unsigned long my_core_id = coreid::core_id();
-
-    txn_logger::persist_ctx &ctx =
-      txn_logger::persist_ctx_for(my_core_id, txn_logger::INITMODE_REG);
     txn_logger::persist_stats &stats =
       txn_logger::g_persist_stats[my_core_id];
     txn_logger::pbuffer_circbuf &pull_buf = ctx.all_buffers_;
@@ -834,6 +1235,9 @@ public:
 
     util::non_atomic_fetch_add(stats.ntxns_committed_, 1UL);
 
+    // only ever contended by the persister's idle flush
+    ::lock_guard<spinlock> l(ctx.flush_lock_);
+
     const bool do_compress = txn_logger::IsCompressionEnabled();
     if (do_compress) {
       // try placing in horizon
@@ -848,14 +1252,16 @@ public:
         INVARIANT(ctx.horizon_->datasize());
         // horizon out of space, so we push it
         const uint64_t npushed =
-          push_horizon_to_buffer(ctx.horizon_, ctx.lz4ctx_, pull_buf, push_buf);
+          push_horizon_to_buffer(
+            ctx.horizon_, ctx.codec_, ctx.codec_state_, pull_buf, push_buf);
         if (npushed)
           util::non_atomic_fetch_add(stats.ntxns_pushed_, npushed);
       }
 
       INVARIANT(ctx.horizon_->space_remaining() >= space_needed);
       const uint64_t written =
-        write_current_txn_into_buffer(ctx.horizon_, commit_tid, value_sizes);
+        write_current_txn_into_buffer(
+            ctx.horizon_, commit_tid, value_sizes, ctx.op_txn_);
       if (written != space_needed)
         INVARIANT(false);
 
@@ -881,20 +1287,186 @@ public:
       }
 
       const uint64_t written =
-        write_current_txn_into_buffer(px, commit_tid, value_sizes);
+        write_current_txn_into_buffer(px, commit_tid, value_sizes, ctx.op_txn_);
       if (written != space_needed)
         INVARIANT(false);
     }
+
+    // in low latency mode, don't let txns wait for the buffer to fill up
+    if (txn_logger::g_flush_deadline_us) {
+      const txn_logger::pbuffer *px =
+        do_compress ? ctx.horizon_ : pull_buf.peek();
+      if (util::timer::cur_usec() - px->earliest_start_us_ >=
+          txn_logger::g_flush_deadline_us) {
+        flush_log_buffers(my_core_id);
+        ++txn_logger::g_evt_log_buffer_deadline;
+      }
+    }
+  }
+
+  inline ALWAYS_INLINE void
+  on_dbtuple_overwrite(const dbtuple *tuple)
+  {
+    if (!txn_logger::IsPersistenceEnabled() ||
+        !txn_logger::IsOpLoggingEnabled())
+      return;
+    INVARIANT(tuple->is_locked());
+    INVARIANT(tuple->is_latest());
+    // save the value the write replaces, for encode_op_txn()
+    txn_logger::persist_ctx &ctx =
+      txn_logger::persist_ctx_for(coreid::core_id(), txn_logger::INITMODE_REG);
+    const uint32_t len = tuple->is_deleting() ? ~uint32_t(0) : tuple->size;
+    ctx.op_bases_.append((const char *) &len, sizeof(len));
+    if (!tuple->is_deleting())
+      ctx.op_bases_.append(
+          (const char *) tuple->get_value_start(), tuple->size);
   }
 
 private:
 
-  // assumes enough space in px to hold this txn
+  // the space needed to log the txn, w/ the size of each write's value
+  // going to value_sizes
+  inline uint64_t
+  compute_space_needed(write_set_u32_vec &value_sizes) const
+  {
+    serializer<uint32_t, true> vs_uint32_t;
+
+    uint64_t space_needed = 0;
+
+    // 8 bytes to indicate TID
+    space_needed += sizeof(uint64_t);
+
+    // variable bytes to indicate # of records written
+#ifdef LOGGER_UNSAFE_FAKE_COMPRESSION
+    const unsigned nwrites = 0;
+#else
+    const unsigned nwrites = this->write_set.size();
+#endif
+
+    space_needed += vs_uint32_t.nbytes(&nwrites);
+
+    // each record needs to be recorded
+    for (unsigned idx = 0; idx < nwrites; idx++) {
+      const transaction_base::write_record_t &rec = this->write_set[idx];
+      const uint32_t k_nbytes = rec.get_key().size();
+      space_needed += sizeof(uint32_t); // table id
+      space_needed += vs_uint32_t.nbytes(&k_nbytes);
+      space_needed += k_nbytes;
+
+      const uint32_t v_nbytes = rec.get_value() ?
+          rec.get_writer()(
+              dbtuple::TUPLE_WRITER_COMPUTE_DELTA_NEEDED,
+              rec.get_value(), nullptr, 0) : 0;
+      space_needed += vs_uint32_t.nbytes(&v_nbytes);
+      space_needed += v_nbytes;
+
+      value_sizes.push_back(v_nbytes);
+    }
+
+    return space_needed;
+  }
+
+  // op logging (see txn_logger::Init()): encodes the txn into ctx.op_txn_,
+  // logging each overwrite as a patch against the value on_dbtuple_overwrite()
+  // saved for it if that is smaller. the writes superseded by a later write
+  // in the txn (ie not do_write()) are left out, so that every patch
+  // applies to the version logged right before it. returns the size
+  uint64_t
+  encode_op_txn(txn_logger::persist_ctx &ctx, uint64_t commit_tid)
+  {
+    serializer<uint32_t, true> vs_uint32_t;
+    serializer<uint32_t, false> s_uint32_t;
+    serializer<uint64_t, false> s_uint64_t;
+    std::string &out = ctx.op_txn_;
+    std::string &nv = ctx.op_value_;
+    auto append_varint = [&out, &vs_uint32_t](uint32_t x) {
+      uint8_t buf[5];
+      out.append((const char *) buf, vs_uint32_t.write(buf, x) - buf);
+    };
+
+    unsigned nwrites = 0;
+    for (unsigned idx = 0; idx < this->write_set.size(); idx++)
+      nwrites += this->write_set[idx].do_write();
+
+    out.resize(sizeof(uint64_t));
+    s_uint64_t.write((uint8_t *) &out[0], commit_tid);
+    append_varint(nwrites);
+
+    const uint8_t * const bases = (const uint8_t *) ctx.op_bases_.data();
+    size_t base_off = 0;
+    for (unsigned idx = 0; idx < this->write_set.size(); idx++) {
+      const transaction_base::write_record_t &rec = this->write_set[idx];
+      if (!rec.do_write())
+        continue;
+      const uint8_t *base = nullptr;
+      uint32_t base_len = 0;
+      if (!rec.is_insert()) {
+        // on_dbtuple_overwrite() was called for it, in write set order
+        INVARIANT(base_off + sizeof(uint32_t) <= ctx.op_bases_.size());
+        s_uint32_t.read(bases + base_off, &base_len);
+        base_off += sizeof(uint32_t);
+        if (base_len == ~uint32_t(0)) {
+          base_len = 0;
+        } else {
+          base = bases + base_off;
+          base_off += base_len;
+        }
+      }
+
+      const uint32_t table_id = rec.get_btree()->table_id();
+      out.append((const char *) &table_id, sizeof(table_id));
+      append_varint(rec.get_key().size());
+      out.append(rec.get_key().data(), rec.get_key().size());
+
+      if (!rec.get_value()) {
+        out.push_back(txn_logger::WRITE_FULL);
+        append_varint(0);
+        continue;
+      }
+
+      // the new value, built the way the tuple built it
+      const size_t v_nbytes =
+        rec.get_writer()(
+            dbtuple::TUPLE_WRITER_COMPUTE_NEEDED,
+            rec.get_value(), const_cast<uint8_t *>(base), base_len);
+      nv.assign((const char *) base, base_len);
+      if (nv.size() < v_nbytes)
+        nv.resize(v_nbytes);
+      rec.get_writer()(
+          dbtuple::TUPLE_WRITER_DO_WRITE,
+          rec.get_value(), (uint8_t *) &nv[0], base_len);
+
+      if (base) {
+        std::string &patch = ctx.op_patch_;
+        patch.clear();
+        txn_logger::EncodePatch(
+            base, base_len, (const uint8_t *) nv.data(), v_nbytes, patch);
+        if (patch.size() < v_nbytes) {
+          out.push_back(txn_logger::WRITE_PATCH);
+          append_varint(patch.size());
+          out.append(patch);
+          ++g_evt_op_log_patches;
+          continue;
+        }
+      }
+
+      out.push_back(txn_logger::WRITE_FULL);
+      append_varint(v_nbytes);
+      out.append(nv.data(), v_nbytes);
+    }
+    INVARIANT(base_off == ctx.op_bases_.size());
+    ctx.op_bases_.clear();
+    return out.size();
+  }
+
+  // assumes enough space in px to hold this txn. in op logging mode, the
+  // txn is op_txn (see encode_op_txn())
   inline uint64_t
   write_current_txn_into_buffer(
       txn_logger::pbuffer *px,
       uint64_t commit_tid,
-      const write_set_u32_vec &value_sizes)
+      const write_set_u32_vec &value_sizes,
+      const std::string &op_txn)
   {
     INVARIANT(px->can_hold_tid(commit_tid));
 
@@ -904,7 +1476,17 @@ private:
     uint8_t *p = px->pointer();
     uint8_t *porig = p;
 
+    if (txn_logger::IsOpLoggingEnabled()) {
+      NDB_MEMCPY(p, op_txn.data(), op_txn.size());
+      px->curoff_ += op_txn.size();
+      px->header()->nentries_++;
+      px->header()->last_tid_ = commit_tid;
+      px->header()->ops_ = 1;
+      return op_txn.size();
+    }
+
     serializer<uint32_t, true> vs_uint32_t;
+    serializer<uint32_t, false> s_uint32_t;
     serializer<uint64_t, false> s_uint64_t;
 
 #ifdef LOGGER_UNSAFE_FAKE_COMPRESSION
@@ -922,6 +1504,7 @@ private:
     for (unsigned idx = 0; idx < nwrites; idx++) {
       const transaction_base::write_record_t &rec = this->write_set[idx];
       const uint32_t k_nbytes = rec.get_key().size();
+      p = s_uint32_t.write(p, rec.get_btree()->table_id());
       p = vs_uint32_t.write(p, k_nbytes);
       NDB_MEMCPY(p, rec.get_key().data(), k_nbytes);
       p += k_nbytes;
@@ -1155,10 +1738,14 @@ public:
     if (unlikely(!ro_tick_ex))
       // won't have anything to clean
       return;
-    // all reads happening at >= ro_tick_geq
-    const uint64_t ro_tick_geq = ro_tick_ex - 1;
+    // all reads happening at >= ro_tick_geq, except for a pinned snapshot
+    const uint64_t ro_tick_geq =
+      std::min(ro_tick_ex - 1, PinnedSnapshotTick());
     threadctx &ctx = g_threadctxs.my();
-    clean_up_to_including(ctx, ro_tick_geq);
+    if (IsGCAsync())
+      hand_off_up_to_including(ctx, ro_tick_geq);
+    else
+      clean_up_to_including(ctx, ro_tick_geq);
   }
 
 private:
@@ -1183,6 +1770,18 @@ struct base_txn_btree_handler<transaction_proto2> {
 #endif
   }
   static const bool has_background_task = true;
+  // bulk loaded records never make it into the log
+  static inline bool
+  can_bulk_load()
+  {
+    return !txn_logger::IsPersistenceEnabled();
+  }
+  // the log tells tables apart by their name's id only
+  static inline bool
+  unique_table_names()
+  {
+    return txn_logger::IsPersistenceEnabled();
+  }
 };
 
 template <>
@@ -1216,35 +1815,13 @@ struct txn_epoch_sync<transaction_proto2> : public transaction_proto2_static {
   {
     if (!txn_logger::IsPersistenceEnabled())
       return;
+    // the persister may be flushing this core's buffers too (see
+    // txn_logger::advance_system_sync_epoch())
     const unsigned long my_core_id = coreid::core_id();
-    txn_logger::persist_ctx &ctx =
-      txn_logger::persist_ctx_for(my_core_id, txn_logger::INITMODE_NONE);
-    if (unlikely(!ctx.init_))
-      return;
-    txn_logger::persist_stats &stats =
-      txn_logger::g_persist_stats[my_core_id];
-    txn_logger::pbuffer_circbuf &pull_buf = ctx.all_buffers_;
-    txn_logger::pbuffer_circbuf &push_buf = ctx.persist_buffers_;
-    if (txn_logger::IsCompressionEnabled() &&
-        ctx.horizon_->header()->nentries_) {
-      INVARIANT(ctx.horizon_->datasize());
-      const uint64_t npushed =
-        push_horizon_to_buffer(ctx.horizon_, ctx.lz4ctx_, pull_buf, push_buf);
-      if (npushed)
-        util::non_atomic_fetch_add(stats.ntxns_pushed_, npushed);
-    }
-    txn_logger::pbuffer *px = pull_buf.peek();
-    if (!px || !px->header()->nentries_) {
-      //std::cerr << "core " << my_core_id
-      //          << " nothing to push to logger" << std::endl;
-      return;
-    }
-    //std::cerr << "core " << my_core_id
-    //          << " pushing buffer to logger" << std::endl;
-    txn_logger::pbuffer *px0 = pull_buf.deq();
-    util::non_atomic_fetch_add(stats.ntxns_pushed_, px0->header()->nentries_);
-    INVARIANT(px0 == px);
-    push_buf.enq(px0);
+    ::lock_guard<spinlock> l(
+        txn_logger::persist_ctx_for(
+          my_core_id, txn_logger::INITMODE_NONE).flush_lock_);
+    flush_log_buffers(my_core_id);
   }
   static std::tuple<uint64_t, uint64_t, double>
   compute_ntxn_persisted()
@@ -399,6 +399,25 @@ public:
   }
 };
 
+class scoped_rate_timer {
+private:
+  timer t;
+  std::string region;
+  size_t n;
+
+public:
+  scoped_rate_timer(const std::string &region, size_t n) : region(region), n(n)
+  {}
+
+  ~scoped_rate_timer()
+  {
+    double x = t.lap() / 1000.0; // ms
+    double rate = double(n) / (x / 1000.0);
+    std::cerr << "timed region `" << region << "' took " << x
+              << " ms (" << rate << " events/sec)" << std::endl;
+  }
+};
+
 inline std::string
 next_key(const std::string &s)
 {